@@ -7,6 +7,58 @@
 #include <iostream>
 #include <random>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iterator>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <exception>
+#include <type_traits>
+#if (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#define BITMAP_PMR
+#include <memory_resource>
+#endif
+#endif
+#if !defined(__cplusplus_cli) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define BITMAP_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BITMAP_TARGET(isa)
+#else
+#include <cpuid.h>
+#define BITMAP_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 #pragma pack(push, 1)
@@ -98,1324 +150,7854 @@ pixel pixel::operator/(const int& scaler)
     return result;
 }
 
-class Bitmap_cpp
+template <typename T>
+class basic_pixel_span
 {
 public:
-    // Data
-    bmp_header header;
-    bmp_info_header info_header;
-    vector<vector<pixel>> data;
+    basic_pixel_span() : ptr(nullptr), count(0) {}
+    basic_pixel_span(T* ptr, int count) : ptr(ptr), count(count) {}
+
+    T* begin() const { return ptr; }
+    T* end() const { return ptr + count; }
+    T* data() const { return ptr; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](int y) const { return ptr[y]; }
+
+private:
+    T* ptr;
+    int count;
+};
+typedef basic_pixel_span<pixel> pixel_span;
+typedef basic_pixel_span<const pixel> const_pixel_span;
 
-    // Constructors
-    Bitmap_cpp() = default;
-    ~Bitmap_cpp();
-    Bitmap_cpp(string file_path);
-    Bitmap_cpp(const Bitmap_cpp& other) = default;
-    void LoadBmp(string file_path);
-    void SaveBmp(string file_path);
+// Row iterator, lets `for (auto& row : data)` walk the rows as spans
+template <typename T>
+class basic_pixel_row_iterator
+{
+public:
+    typedef forward_iterator_tag iterator_category;
+    typedef basic_pixel_span<T> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const value_type* pointer;
+    typedef const value_type& reference;
+
+    basic_pixel_row_iterator(T* row, int width, ptrdiff_t stride) : current(row, width), stride(stride) {}
+
+    reference operator*() const { return current; }
+    pointer operator->() const { return &current; }
+    basic_pixel_row_iterator& operator++() { current = value_type(current.data() + stride, current.size()); return *this; }
+    basic_pixel_row_iterator operator++(int) { basic_pixel_row_iterator old = *this; ++*this; return old; }
+    bool operator==(const basic_pixel_row_iterator& other) const { return current.data() == other.current.data(); }
+    bool operator!=(const basic_pixel_row_iterator& other) const { return current.data() != other.current.data(); }
+
+private:
+    value_type current;
+    ptrdiff_t stride;
+};
 
-    // Basic functions
-    bool empty() const { return data.empty(); }
-    void CheckValid() const;
-    void Resize(int width, int height, int start_x = 0, int start_y = 0);
-    void toGray();
-    void InvertColor();
-    void AddImpluseNoise(const int salt_ratio = 5, const int pepper_ratio = 5);
-    void AddGaussianNoise(const int mean = 0, const int variance = 10);
+// Source of pixel memory, Bitmap_cpp::SetMemoryResource routes every buffer of an image through one.
+// The resource must outlive the buffers allocated from it.
+class bitmap_memory_resource
+{
+public:
+    virtual ~bitmap_memory_resource() {}
+    virtual void* Allocate(size_t bytes, size_t alignment) = 0;
+    virtual void Deallocate(void* ptr, size_t bytes, size_t alignment) = 0;
+};
 
-    // Image processing
-    void mix_with(const Bitmap_cpp& other, const float ratio = 0.5f);
-    void ZoomIn_ZeroOrder(const int scale = 2);
-    void ZoomIn_FirstOrder(const int scale = 2);
-    void ZoomIn_Compare(const int scale = 2);
-    void ZoomIn_Bilinear(const int scale = 2);
-    void ZoomOut(const int scale = 2);
-    void HistogramEqualization_Global();
-    void HistogramEqualization_Local(const int block_size = 7);
+#ifdef BITMAP_PMR
+// Adapter for std::pmr resources, e.g. a monotonic_buffer_resource used as a per-frame arena.
+// The adapter has to outlive the buffers as well.
+class bitmap_pmr_resource : public bitmap_memory_resource
+{
+public:
+    explicit bitmap_pmr_resource(std::pmr::memory_resource* upstream) : upstream(upstream) {}
+    void* Allocate(size_t bytes, size_t alignment) override { return upstream->allocate(bytes, alignment); }
+    void Deallocate(void* ptr, size_t bytes, size_t alignment) override { upstream->deallocate(ptr, bytes, alignment); }
 
-    // Smoothing filters
-    void SpatialLowPassFilter(const int filter_size = 3);
-    void MedianFilter(const int filter_size = 3);
-    void AlphaTrimmedMeanFilter(const int filter_size = 3, const int removed_elements = 1);
+private:
+    std::pmr::memory_resource* upstream;
+};
+#endif
 
-    // Sharpening filters
-    void SpatialHighPassFilter(const int filter_size = 3);
-    void SpatialHighBoostFilter(const int filter_size = 3, const float boost_ratio = 1.5f);
+// Allocations made for the pixel buffers of one image
+struct bitmap_memory_stats
+{
+    size_t allocations;
+    size_t allocated_bytes;
+    size_t current_bytes;
+    size_t peak_bytes;
+};
 
-    // Edge detection
-    void PrewittOperator(bool Diagonal = false);
-    void SobelOperator(bool Diagonal = false);
-    void LaplacianOperator(bool Enhanced = false);
+// Allocation source shared by the buffers of one image, a null resource is the aligned heap.
+// Every buffer keeps its source alive, so storage always goes back to the resource it came from.
+struct pixel_memory
+{
+    pixel_memory() : resource(nullptr), allocations(0), allocated_bytes(0), current_bytes(0), peak_bytes(0) {}
 
-    vector<int> DCT_Transform(const vector<pixel> data, const float u, const float v, const int N);
-    pixel IDCT_Transform(const vector<vector<int>> data, const float x, const float y, const int N);
-    void DCT_Compress();
+    bitmap_memory_resource* resource;
+    atomic<size_t> allocations;
+    atomic<size_t> allocated_bytes;
+    atomic<size_t> current_bytes;
+    atomic<size_t> peak_bytes;
+};
 
-    // Operators
-    Bitmap_cpp operator+(const Bitmap_cpp& other);
-    Bitmap_cpp operator-(const Bitmap_cpp& other);
-    Bitmap_cpp operator*(const int& scaler);
-    Bitmap_cpp operator/(const int& scaler);
+namespace bitmap_detail
+{
+    // Aligned bytes from memory's resource (the aligned heap when there is none), counted in its statistics
+    void* allocate_bytes(pixel_memory* memory, const size_t bytes, const size_t alignment)
+    {
+        void* ptr = nullptr;
+        if (memory != nullptr && memory->resource != nullptr)
+            ptr = memory->resource->Allocate(bytes, alignment);
+        else
+        {
+            #ifdef _WIN32
+            ptr = _aligned_malloc(bytes, alignment);
+            #else
+            if (posix_memalign(&ptr, alignment, bytes) != 0)
+                ptr = nullptr;
+            #endif
+        }
+        if (ptr == nullptr)
+            throw bad_alloc();
 
-    // Bitwise operators
-    void and_with(const Bitmap_cpp& other);
-    void or_with(const Bitmap_cpp& other);
-    void xor_with(const Bitmap_cpp& other);
+        if (memory != nullptr)
+        {
+            memory->allocations++;
+            memory->allocated_bytes += bytes;
+            const size_t current = memory->current_bytes += bytes;
+            size_t peak = memory->peak_bytes;
+            while (current > peak && !memory->peak_bytes.compare_exchange_weak(peak, current))
+                ;
+        }
+        return ptr;
+    }
 
-    #ifdef __cplusplus_cli
-    Bitmap_cpp(System::String^ file_path);
-    void LoadBmp(System::String^ file_path);
-    operator System::Drawing::Bitmap^();
-    System::Drawing::Bitmap^ toBitmap();
-    #endif
+    bitmap_memory_stats memory_stats(const pixel_memory* memory)
+    {
+        bitmap_memory_stats stats = {0, 0, 0, 0};
+        if (memory != nullptr)
+        {
+            stats.allocations = memory->allocations;
+            stats.allocated_bytes = memory->allocated_bytes;
+            stats.current_bytes = memory->current_bytes;
+            stats.peak_bytes = memory->peak_bytes;
+        }
+        return stats;
+    }
+
+    void deallocate_bytes(pixel_memory* memory, void* ptr, const size_t bytes, const size_t alignment)
+    {
+        if (ptr == nullptr)
+            return;
+        if (memory != nullptr)
+            memory->current_bytes -= bytes;
+
+        if (memory != nullptr && memory->resource != nullptr)
+            memory->resource->Deallocate(ptr, bytes, alignment);
+        else
+        {
+            #ifdef _WIN32
+            _aligned_free(ptr);
+            #else
+            free(ptr);
+            #endif
+        }
+    }
+}
+
+// Contiguous image storage, rows are padded to a multiple of `alignment` bytes.
+// A buffer can also be a view over external memory (e.g. a mapped file), in which
+// case the stride may be negative and `owner` keeps that memory alive.
+class pixel_buffer
+{
+public:
+    static const int alignment = 64;
+    static const int row_align = alignment / sizeof(pixel);
+
+    typedef basic_pixel_row_iterator<pixel> iterator;
+    typedef basic_pixel_row_iterator<const pixel> const_iterator;
+
+    pixel_buffer() : storage(nullptr), capacity(0), origin(nullptr), rows(0), cols(0), row_stride(0), read_only(false) {}
+    pixel_buffer(int height, int width);
+    pixel_buffer(const pixel_buffer& other);
+    pixel_buffer(pixel_buffer&& other) noexcept;
+    ~pixel_buffer();
+    pixel_buffer& operator=(const pixel_buffer& other);
+    pixel_buffer& operator=(pixel_buffer&& other) noexcept;
+
+    void resize(int height, int width);
+    void resize_for_overwrite(int height, int width);
+    void assign(int height, int width, const pixel& value);
+    void clear();
+    void swap(pixel_buffer& other) noexcept;
+    void attach(pixel* first_row, int height, int width, ptrdiff_t stride, shared_ptr<void> owner, bool writable);
+    // View of the rectangle starting at parent[x][y]. It keeps a mapped parent alive but not owned storage,
+    // so it is only valid until the parent's buffer is reallocated or freed.
+    void attach(const pixel_buffer& parent, int x, int y, int height, int width, bool writable);
+    void make_writable();
+
+    // Allocation source of this buffer, the pixels move over when it changes
+    void use_memory(shared_ptr<pixel_memory> source);
+    const shared_ptr<pixel_memory>& memory_source() const { return memory; }
+
+    bool empty() const { return rows == 0 || cols == 0; }
+    int height() const { return rows; }
+    int width() const { return cols; }
+    ptrdiff_t stride() const { return row_stride; }
+    ptrdiff_t stride_bytes() const { return row_stride * static_cast<ptrdiff_t>(sizeof(pixel)); }
+    bool is_view() const { return owner != nullptr; }
+    bool writable() const { return !read_only; }
+
+    pixel* row(int x) { return origin + x * row_stride; }
+    const pixel* row(int x) const { return origin + x * row_stride; }
+    pixel_span row_span(int x) { return pixel_span(row(x), cols); }
+    const_pixel_span row_span(int x) const { return const_pixel_span(row(x), cols); }
+
+    // Compatibility accessor, keeps `data[x][y]` working
+    pixel* operator[](int x) { return row(x); }
+    const pixel* operator[](int x) const { return row(x); }
+
+    iterator begin() { return iterator(origin, cols, row_stride); }
+    iterator end() { return iterator(origin + rows * row_stride, cols, row_stride); }
+    const_iterator begin() const { return const_iterator(origin, cols, row_stride); }
+    const_iterator end() const { return const_iterator(origin + rows * row_stride, cols, row_stride); }
+
+private:
+    pixel* Allocate(size_t count);
+    void Deallocate(pixel* ptr, size_t count);
+    void Reserve(int height, int width);
+
+    pixel* storage;
+    size_t capacity;
+    pixel* origin;
+    int rows;
+    int cols;
+    ptrdiff_t row_stride;
+    shared_ptr<void> owner;
+    bool read_only;
+    shared_ptr<pixel_memory> memory;
 };
 
-Bitmap_cpp::Bitmap_cpp(string file_path)
+pixel_buffer::pixel_buffer(int height, int width) : pixel_buffer()
 {
-    LoadBmp(file_path);
+    resize(height, width);
 }
 
-Bitmap_cpp::~Bitmap_cpp()
+pixel_buffer::pixel_buffer(const pixel_buffer& other) : pixel_buffer()
 {
-    data.clear();
+    *this = other;
 }
 
-void Bitmap_cpp::LoadBmp(string file_path)
+pixel_buffer::pixel_buffer(pixel_buffer&& other) noexcept : pixel_buffer()
 {
-    ifstream file(file_path, ios::binary);
-    if (!file.is_open())
-        throw runtime_error("Error: file not found");
+    swap(other);
+}
 
-    file.read(reinterpret_cast<char*>(&header), sizeof(bmp_header));
-    if (header.signature[0] != 'B' || header.signature[1] != 'M')
-        throw runtime_error("Error: file is not a Bitmap file");
+pixel_buffer::~pixel_buffer()
+{
+    Deallocate(storage, capacity);
+}
 
-    file.read(reinterpret_cast<char*>(&info_header), sizeof(bmp_info_header));
-    if (info_header.bit_count != 24 && info_header.bit_count != 32)
-        throw runtime_error("Error: unsupported bit count");
-    if (info_header.height <= 0 || info_header.width <= 0)
-        throw runtime_error("Error: invalid image size");
+pixel_buffer& pixel_buffer::operator=(const pixel_buffer& other)
+{
+    if (this == &other)
+        return *this;
+
+    Reserve(other.rows, other.cols);
+    for (int x = 0; x < rows; x++)
+        memcpy(row(x), other.row(x), cols * sizeof(pixel));
+    return *this;
+}
 
-    switch(info_header.bit_count)
+pixel_buffer& pixel_buffer::operator=(pixel_buffer&& other) noexcept
+{
+    if (this != &other)
     {
-        case 24:
-        {
-            #ifndef __cplusplus_cli
-            string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
-            cout << file_name << " is a 24-bit Bitmap file" << endl;
-            #endif
+        pixel_buffer empty_buffer;
+        swap(empty_buffer);
+        swap(other);
+    }
+    return *this;
+}
 
-            int padding = (4 - (info_header.width * 3) % 4) % 4;
-            data.resize(info_header.height);
-            vector<unsigned char> row_data(info_header.width * 3);
-            
-            for (int x = 0; x < info_header.height; x++)
-            {
-                data[x].resize(info_header.width);
-                file.read(reinterpret_cast<char*>(row_data.data()), info_header.width * 3);
-                for (int y = 0; y < info_header.width; y++)
-                {
-                    data[x][y].b = row_data[y * 3];
-                    data[x][y].g = row_data[y * 3 + 1];
-                    data[x][y].r = row_data[y * 3 + 2];
-                }
+pixel* pixel_buffer::Allocate(size_t count)
+{
+    if (count == 0)
+        return nullptr;
+    return static_cast<pixel*>(bitmap_detail::allocate_bytes(memory.get(), count * sizeof(pixel), alignment));
+}
 
-                if (padding > 0)
-                    file.seekg(padding, ios::cur);
-            }
-            break;
-        }
-        case 32:
-        {
-            #ifndef __cplusplus_cli
-            string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
-            cout << file_name << " is a 32-bit Bitmap file" << endl;
-            #endif
+void pixel_buffer::Deallocate(pixel* ptr, size_t count)
+{
+    bitmap_detail::deallocate_bytes(memory.get(), ptr, count * sizeof(pixel), alignment);
+}
 
-            data.resize(info_header.height);
-            for (auto& row : data)
-            {
-                row.resize(info_header.width);
-                file.read(reinterpret_cast<char*>(row.data()), info_header.width * 4);
-            }
-            break;
-        }
-        default:
-        {
-            throw runtime_error("Error: unsupported bit count");
-        }
+void pixel_buffer::Reserve(int height, int width)
+{
+    if (height < 0 || width < 0)
+        throw invalid_argument("Error: invalid buffer size");
+
+    owner.reset();
+    read_only = false;
+
+    const ptrdiff_t new_stride = (width + row_align - 1) / row_align * row_align;
+    const size_t required = static_cast<size_t>(new_stride) * height;
+    if (required > capacity)
+    {
+        pixel* new_storage = Allocate(required);
+        Deallocate(storage, capacity);
+        storage = new_storage;
+        capacity = required;
     }
-    file.close();
+    origin = storage;
+    rows = height;
+    cols = width;
+    row_stride = new_stride;
 }
 
-void Bitmap_cpp::SaveBmp(string file_path)
+void pixel_buffer::resize(int height, int width)
 {
-    CheckValid();
-    if (file_path.find(".bmp") == string::npos)
-        file_path += ".bmp";
+    assign(height, width, pixel());
+}
 
-    ofstream file(file_path, ios::binary);
-    if (!file.is_open())
-        throw runtime_error("Error: Cannot create file");
-    
-    file.write(reinterpret_cast<char*>(&header), sizeof(bmp_header));
-    file.write(reinterpret_cast<char*>(&info_header), sizeof(bmp_info_header));
+// Same as resize but leaves the pixels uninitialized, for buffers that are about to be overwritten
+void pixel_buffer::resize_for_overwrite(int height, int width)
+{
+    Reserve(height, width);
+}
 
-    switch(info_header.bit_count)
-    {
-        case 24:
-        {
-            int padding = (4 - (info_header.width * 3) % 4) % 4;
-            vector<unsigned char> row_data(info_header.width * 3);
-            vector<unsigned char> padding_buffer(padding, 0);
-            for (int x = 0; x < info_header.height; x++)
-            {
-                for (int y = 0; y < info_header.width; y++)
-                {
-                    row_data[y * 3] = data[x][y].b;
-                    row_data[y * 3 + 1] = data[x][y].g;
-                    row_data[y * 3 + 2] = data[x][y].r;
-                }
-                file.write(reinterpret_cast<char*>(row_data.data()), info_header.width * 3);
+void pixel_buffer::assign(int height, int width, const pixel& value)
+{
+    Reserve(height, width);
+    for (int x = 0; x < rows; x++)
+        fill(row(x), row(x) + row_stride, value);
+}
 
-                if (padding > 0)
-                    file.write(reinterpret_cast<char*>(padding_buffer.data()), padding);
-            }
-            if (!file.good())
-                throw runtime_error("Error: failed to write 24-bit Bitmap file");
-            else
-                cout << file_path.substr(file_path.find_last_of("/\\") + 1) << " is saved" << endl;
-            break;
-        }
-        case 32:
-        {
-            for (auto& row : data)
-                file.write(reinterpret_cast<char*>(row.data()), info_header.width * 4);
-            if (!file.good())
-                throw runtime_error("Error: failed to write 32-bit Bitmap file");
-            else
-                cout << file_path.substr(file_path.find_last_of("/\\") + 1) << " is saved" << endl;
-            break;
-        }
-        default:
-        {
-            throw runtime_error("Error: unsupported bit count");
-        }
-    }
-    file.close();
-    if (!file.good())
-        throw runtime_error("Error: file write error");
+void pixel_buffer::clear()
+{
+    owner.reset();
+    read_only = false;
+    origin = storage;
+    rows = cols = 0;
+    row_stride = 0;
 }
 
-void Bitmap_cpp::CheckValid() const
+void pixel_buffer::swap(pixel_buffer& other) noexcept
 {
-    if (data.empty())
-        throw runtime_error("Error: image data is empty");
-    if (info_header.width <= 0 || info_header.height <= 0)
-        throw runtime_error("Error: invalid image size");
+    std::swap(storage, other.storage);
+    std::swap(capacity, other.capacity);
+    std::swap(origin, other.origin);
+    std::swap(rows, other.rows);
+    std::swap(cols, other.cols);
+    std::swap(row_stride, other.row_stride);
+    owner.swap(other.owner);
+    std::swap(read_only, other.read_only);
+    memory.swap(other.memory);
 }
 
-void Bitmap_cpp::Resize(int width, int height, int start_y, int start_x)
+void pixel_buffer::attach(pixel* first_row, int height, int width, ptrdiff_t stride, shared_ptr<void> owner, bool writable)
 {
-    CheckValid();
-    width = min(width, info_header.width);
-    height = min(height, info_header.height);
+    if (height < 0 || width < 0)
+        throw invalid_argument("Error: invalid buffer size");
+
+    this->owner = owner;
+    read_only = !writable;
+    origin = first_row;
+    rows = height;
+    cols = width;
+    row_stride = stride;
+}
 
-    start_x = info_header.height - start_x;
-    if (start_x + height > info_header.height)
-        start_x = max(0, info_header.height - height);
-    if (start_y + width > info_header.width)
-        start_y = max(0, info_header.width - width);
-    vector<vector<pixel>> new_data(height, vector<pixel>(width));
-    for (int x = 0; x < height; x++)
-        for (int y = 0; y < width; y++)
-            new_data[x][y] = data[start_x + x][start_y + y];
+void pixel_buffer::attach(const pixel_buffer& parent, int x, int y, int height, int width, bool writable)
+{
+    if (x < 0 || y < 0 || height <= 0 || width <= 0 || x + height > parent.rows || y + width > parent.cols)
+        throw invalid_argument("Error: region is out of range");
 
-    data = new_data;
-    info_header.width = width;
-    info_header.height = height;
+    pixel* first_row = const_cast<pixel*>(parent.row(x)) + y;
+    // The aliasing constructor gives a non-null owner (is_view) without a reference to owned storage
+    shared_ptr<void> region_owner(parent.owner, first_row);
+    attach(first_row, height, width, parent.row_stride, region_owner, writable && !parent.read_only);
 }
 
-void Bitmap_cpp::toGray()
+void pixel_buffer::make_writable()
 {
-    CheckValid();
-    for (auto& row : data)
-    {
-        for (auto& p : row)
-        {
-            unsigned char gray = (p.r + p.g + p.b) / 3;
-            p.r = p.g = p.b = gray;
-        }
-    }
+    if (!read_only)
+        return;
+
+    pixel_buffer copy;
+    copy.memory = memory;
+    copy = *this;
+    swap(copy);
 }
 
-void Bitmap_cpp::InvertColor()
+void pixel_buffer::use_memory(shared_ptr<pixel_memory> source)
 {
-    CheckValid();
-    for (auto& row : data)
-    {
-        for (auto& p : row)
-        {
-            p.r = 255 - p.r;
-            p.g = 255 - p.g;
-            p.b = 255 - p.b;
-        }
-    }
+    if (source == memory)
+        return;
+
+    // The old storage leaves with `moved` and goes back to the source it came from
+    pixel_buffer moved;
+    moved.memory = source;
+    if (is_view())
+        moved.attach(origin, rows, cols, row_stride, owner, !read_only);
+    else
+        moved = *this;
+    swap(moved);
 }
 
-void Bitmap_cpp::AddImpluseNoise(const int salt_ratio, const int pepper_ratio)
+// One 8-bit channel of an image, rows are padded to a multiple of `alignment` bytes. Storage comes
+// from the same memory sources as pixel_buffer storage.
+class channel_plane
 {
-    CheckValid();
-    if (salt_ratio < 0 || pepper_ratio < 0 || salt_ratio + pepper_ratio > 100)
-        throw invalid_argument("Error: salt and pepper ratio must be greater than 0 and less than 100");
-    
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_real_distribution<float> dis(0, 1);
+public:
+    static const int alignment = 64;
+
+    channel_plane() : storage(nullptr), capacity(0), rows(0), cols(0), row_stride(0) {}
+    channel_plane(const channel_plane& other);
+    channel_plane(channel_plane&& other) noexcept;
+    ~channel_plane();
+    channel_plane& operator=(const channel_plane& other);
+    channel_plane& operator=(channel_plane&& other) noexcept;
+
+    // Keeps the storage when it is large enough, the samples are left uninitialized
+    void resize_for_overwrite(int height, int width);
+    void swap(channel_plane& other) noexcept;
+
+    // Allocation source of this plane, the samples move over when it changes
+    void use_memory(shared_ptr<pixel_memory> source);
+    const shared_ptr<pixel_memory>& memory_source() const { return memory; }
+
+    bool empty() const { return rows == 0 || cols == 0; }
+    int height() const { return rows; }
+    int width() const { return cols; }
+    ptrdiff_t stride() const { return row_stride; }
+
+    unsigned char* row(int x) { return storage + x * row_stride; }
+    const unsigned char* row(int x) const { return storage + x * row_stride; }
+
+private:
+    unsigned char* storage;
+    size_t capacity;
+    int rows;
+    int cols;
+    ptrdiff_t row_stride;
+    shared_ptr<pixel_memory> memory;
+};
 
-    const float noise_ratio_f = (salt_ratio + pepper_ratio) / 100.0;
-    const float salt_ratio_f = static_cast<float>(salt_ratio) / (salt_ratio + pepper_ratio);
-    for (auto& row : data)
-        for (auto& p : row)
-            if (dis(gen) < noise_ratio_f)
-                p.r = p.g = p.b = dis(gen) > salt_ratio_f ? 0 : 255;
+channel_plane::channel_plane(const channel_plane& other) : channel_plane()
+{
+    *this = other;
 }
 
-void Bitmap_cpp::AddGaussianNoise(const int mean, const int variance)
+channel_plane::channel_plane(channel_plane&& other) noexcept : channel_plane()
 {
-    CheckValid();
-    if (variance < 0)
-        throw invalid_argument("Error: standard deviation must be greater than 0");
-    
-    random_device rd;
-    mt19937 gen(rd());
-    normal_distribution<float> dis(mean, sqrt(variance));
-    
-    for (auto& row : data)
-    {
-        for (auto& p : row)
-        {
-            float noise = dis(gen);
-            p.r = min(255, max(0, static_cast<int>(p.r + noise)));
-            p.g = min(255, max(0, static_cast<int>(p.g + noise)));
-            p.b = min(255, max(0, static_cast<int>(p.b + noise)));
-        }
-    }
+    swap(other);
 }
 
-void Bitmap_cpp::mix_with(const Bitmap_cpp& other, const float ratio)
+channel_plane::~channel_plane()
 {
-    CheckValid();
-    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
-        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+    bitmap_detail::deallocate_bytes(memory.get(), storage, capacity, alignment);
+}
 
-    for (int x = 0; x < info_header.height; x++)
+channel_plane& channel_plane::operator=(const channel_plane& other)
+{
+    if (this == &other)
+        return *this;
+
+    resize_for_overwrite(other.rows, other.cols);
+    for (int x = 0; x < rows; x++)
+        memcpy(row(x), other.row(x), cols);
+    return *this;
+}
+
+channel_plane& channel_plane::operator=(channel_plane&& other) noexcept
+{
+    if (this != &other)
     {
-        for (int y = 0; y < info_header.width; y++)
-        {
-            data[x][y].r = data[x][y].r * (1 - ratio) + other.data[x][y].r * ratio;
-            data[x][y].g = data[x][y].g * (1 - ratio) + other.data[x][y].g * ratio;
-            data[x][y].b = data[x][y].b * (1 - ratio) + other.data[x][y].b * ratio;
-        }
+        channel_plane empty_plane;
+        swap(empty_plane);
+        swap(other);
     }
+    return *this;
 }
 
-void Bitmap_cpp::ZoomIn_ZeroOrder(const int scale)
+void channel_plane::resize_for_overwrite(int height, int width)
 {
-    CheckValid();
-    vector<vector<pixel>> new_data(info_header.height * scale, vector<pixel>(info_header.width * scale));
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            new_data[x * scale][y * scale] = data[x][y];
+    if (height < 0 || width < 0)
+        throw invalid_argument("Error: invalid buffer size");
 
-    for (int x = 0; x < (info_header.height * scale); x++)
+    const ptrdiff_t new_stride = (width + alignment - 1) / alignment * alignment;
+    const size_t required = static_cast<size_t>(new_stride) * height;
+    if (required > capacity)
     {
-        for (int y = 0; y < (info_header.width * scale); y++)
+        unsigned char* new_storage = static_cast<unsigned char*>(bitmap_detail::allocate_bytes(memory.get(), required, alignment));
+        bitmap_detail::deallocate_bytes(memory.get(), storage, capacity, alignment);
+        storage = new_storage;
+        capacity = required;
+    }
+    rows = height;
+    cols = width;
+    row_stride = new_stride;
+}
+
+void channel_plane::swap(channel_plane& other) noexcept
+{
+    std::swap(storage, other.storage);
+    std::swap(capacity, other.capacity);
+    std::swap(rows, other.rows);
+    std::swap(cols, other.cols);
+    std::swap(row_stride, other.row_stride);
+    memory.swap(other.memory);
+}
+
+void channel_plane::use_memory(shared_ptr<pixel_memory> source)
+{
+    if (source == memory)
+        return;
+
+    // The old storage leaves with `moved` and goes back to the source it came from
+    channel_plane moved;
+    moved.memory = source;
+    moved = *this;
+    swap(moved);
+}
+
+// Work-stealing pool behind every parallel operation. Each worker owns a task deque, takes work from the
+// back of its own deque and steals from the front of the others; the calling thread helps with its own
+// job while it waits, so nested calls from inside a task cannot deadlock.
+class bitmap_thread_pool
+{
+public:
+    // thread_count counts the calling thread as well, 0 uses every hardware thread
+    explicit bitmap_thread_pool(int thread_count = 0);
+    ~bitmap_thread_pool();
+    bitmap_thread_pool(const bitmap_thread_pool&) = delete;
+    bitmap_thread_pool& operator=(const bitmap_thread_pool&) = delete;
+
+    int ThreadCount() const { return static_cast<int>(workers.size()) + 1; }
+
+    // Runs body over [begin, end) split into contiguous chunks, with at most max_threads chunks running at once.
+    // The first exception thrown by a chunk is rethrown here after every chunk has finished.
+    void ParallelFor(const int begin, const int end, const int max_threads, const function<void(int, int)>& body);
+
+private:
+    struct job
+    {
+        const function<void(int, int)>* body;
+        int max_threads;
+        atomic<int> running;
+        atomic<int> pending;
+        mutex error_lock;
+        exception_ptr error;
+    };
+
+    struct task
+    {
+        job* owner;
+        int begin;
+        int end;
+    };
+
+    struct task_queue
+    {
+        mutex lock;
+        deque<task> tasks;
+    };
+
+    static bool Acquire(job& owner);
+    bool TakeTask(const int home, const job* only, task& result);
+    void RunTask(const task& current);
+    void WorkerLoop(const int index);
+
+    vector<unique_ptr<task_queue>> queues;
+    vector<thread> workers;
+    mutex sleep_lock;
+    condition_variable wake;
+    uint64_t signals;
+    atomic<int> next_queue;
+    bool stopping;
+};
+
+bitmap_thread_pool::bitmap_thread_pool(int thread_count) : signals(0), next_queue(0), stopping(false)
+{
+    if (thread_count <= 0)
+        thread_count = max(1, static_cast<int>(thread::hardware_concurrency()));
+
+    // One queue per worker plus one for callers that are not workers of this pool
+    for (int i = 0; i < thread_count; i++)
+        queues.emplace_back(new task_queue());
+    for (int i = 1; i < thread_count; i++)
+        workers.emplace_back(&bitmap_thread_pool::WorkerLoop, this, i - 1);
+}
+
+bitmap_thread_pool::~bitmap_thread_pool()
+{
+    {
+        lock_guard<mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void bitmap_thread_pool::ParallelFor(const int begin, const int end, const int max_threads, const function<void(int, int)>& body)
+{
+    const int count = end - begin;
+    if (count <= 0)
+        return;
+    const int threads = min(count, min(max_threads, ThreadCount()));
+    if (threads <= 1)
+    {
+        body(begin, end);
+        return;
+    }
+
+    // A few chunks per thread so that stealing can even out uneven rows
+    const int chunks = min(count, threads * 4);
+    job current;
+    current.body = &body;
+    current.max_threads = threads;
+    current.running = 0;
+    current.pending = chunks;
+
+    const int first_queue = next_queue++;
+    for (int i = 0; i < chunks; i++)
+    {
+        task_queue& queue = *queues[static_cast<size_t>(first_queue + i) % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        queue.tasks.push_back(task{&current, begin + static_cast<int>(static_cast<int64_t>(count) * i / chunks), begin + static_cast<int>(static_cast<int64_t>(count) * (i + 1) / chunks)});
+    }
+    {
+        lock_guard<mutex> guard(sleep_lock);
+        signals++;
+    }
+    wake.notify_all();
+
+    while (current.pending > 0)
+    {
+        uint64_t seen;
         {
-            if (x % scale == 0 && y % scale == 0)
-                continue;
-            
-            new_data[x][y] = data[x / scale][y / scale];
+            lock_guard<mutex> guard(sleep_lock);
+            seen = signals;
         }
+        task next;
+        if (TakeTask(static_cast<int>(queues.size()) - 1, &current, next))
+        {
+            RunTask(next);
+            continue;
+        }
+        unique_lock<mutex> guard(sleep_lock);
+        wake.wait(guard, [&] { return current.pending == 0 || signals != seen; });
     }
-    data = new_data;
-    info_header.width *= scale;
-    info_header.height *= scale;
+
+    if (current.error)
+        rethrow_exception(current.error);
 }
 
-void Bitmap_cpp::ZoomIn_FirstOrder(const int scale)
+bool bitmap_thread_pool::Acquire(job& owner)
 {
-    CheckValid();
-    vector<vector<pixel>> new_data(info_header.height * scale, vector<pixel>(info_header.width * scale));
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            new_data[x * scale][y * scale] = data[x][y];
+    int running = owner.running;
+    while (running < owner.max_threads)
+        if (owner.running.compare_exchange_weak(running, running + 1))
+            return true;
+    return false;
+}
 
-    for (int x = 0; x < (info_header.height * scale) - (scale - 1); x += scale)
+bool bitmap_thread_pool::TakeTask(const int home, const job* only, task& result)
+{
+    // Own queue from the back, then the other queues from the front
+    for (size_t n = 0; n < queues.size(); n++)
     {
-        for (int y = 0; y < (info_header.width * scale); y++)
+        task_queue& queue = *queues[(home + n) % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        for (size_t i = 0; i < queue.tasks.size(); i++)
         {
-            if (x % scale == 0 && y % scale == 0)
-                continue;
-            if (y >= (info_header.width * scale) - (scale - 1))
-            {
-                new_data[x][y] = new_data[x][y - 1];
+            const size_t index = n == 0 ? queue.tasks.size() - 1 - i : i;
+            task& candidate = queue.tasks[index];
+            if ((only != nullptr && candidate.owner != only) || !Acquire(*candidate.owner))
                 continue;
-            }
-            
-            int y0 = (y / scale) * scale;
-            int y1 = min(y0 + scale, info_header.width * scale - 1);
-            int w0 = y - y0;
-            int w1 = y1 - y;
-            int w = w0 + w1;
-
-            new_data[x][y] = pixel(
-                (w1 * new_data[x][y0].r + w0 * new_data[x][y1].r) / w, 
-                (w1 * new_data[x][y0].g + w0 * new_data[x][y1].g) / w, 
-                (w1 * new_data[x][y0].b + w0 * new_data[x][y1].b) / w);
+            result = candidate;
+            queue.tasks.erase(queue.tasks.begin() + index);
+            return true;
         }
     }
+    return false;
+}
 
-    for (int x = 0; x < (info_header.height * scale); x++)
+void bitmap_thread_pool::RunTask(const task& current)
+{
+    job& owner = *current.owner;
+    try
     {
-        for (int y = 0; y < (info_header.width * scale); y++)
+        (*owner.body)(current.begin, current.end);
+    }
+    catch (...)
+    {
+        lock_guard<mutex> guard(owner.error_lock);
+        if (!owner.error)
+            owner.error = current_exception();
+    }
+
+    // The owner may return as soon as pending reaches zero, so the job is not touched after that
+    owner.running--;
+    lock_guard<mutex> guard(sleep_lock);
+    owner.pending--;
+    signals++;
+    wake.notify_all();
+}
+
+void bitmap_thread_pool::WorkerLoop(const int index)
+{
+    while (true)
+    {
+        uint64_t seen;
         {
-            if (x % scale == 0)
-                continue;
-            if (x >= (info_header.height * scale) - (scale - 1))
-            {
-                new_data[x][y] = new_data[x - 1][y];
-                continue;
-            }
+            lock_guard<mutex> guard(sleep_lock);
+            if (stopping)
+                return;
+            seen = signals;
+        }
+        task next;
+        if (TakeTask(index, nullptr, next))
+        {
+            RunTask(next);
+            continue;
+        }
+        unique_lock<mutex> guard(sleep_lock);
+        wake.wait(guard, [&] { return stopping || signals != seen; });
+    }
+}
 
-            int x0 = (x / scale) * scale;
-            int x1 = min(x0 + scale, info_header.height * scale - 1);
-            int w0 = x - x0;
-            int w1 = x1 - x;
-            int w = w0 + w1;
+// Threads for blocking file work, kept apart from bitmap_thread_pool so a thread waiting on the disk
+// never holds up a filter. Tasks start in submission order; the destructor runs the queued ones first.
+class bitmap_io_pool
+{
+public:
+    // 0 uses every hardware thread
+    explicit bitmap_io_pool(int thread_count = 2);
+    ~bitmap_io_pool();
+    bitmap_io_pool(const bitmap_io_pool&) = delete;
+    bitmap_io_pool& operator=(const bitmap_io_pool&) = delete;
+
+    int ThreadCount() const { return static_cast<int>(workers.size()); }
+
+    // Runs task on a pool thread, an exception it throws is rethrown by the future's get()
+    template <typename Task>
+    future<decltype(declval<Task&>()())> Submit(Task task);
+
+private:
+    void WorkerLoop();
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    deque<function<void()>> tasks;
+    bool stopping;
+};
 
-            new_data[x][y] = pixel(
-                (w1 * new_data[x0][y].r + w0 * new_data[x1][y].r) / w, 
-                (w1 * new_data[x0][y].g + w0 * new_data[x1][y].g) / w, 
-                (w1 * new_data[x0][y].b + w0 * new_data[x1][y].b) / w);
+bitmap_io_pool::bitmap_io_pool(int thread_count) : stopping(false)
+{
+    if (thread_count < 0)
+        throw invalid_argument("Error: thread count must not be negative");
+    if (thread_count == 0)
+        thread_count = max(1, static_cast<int>(thread::hardware_concurrency()));
+
+    for (int i = 0; i < thread_count; i++)
+        workers.emplace_back(&bitmap_io_pool::WorkerLoop, this);
+}
+
+bitmap_io_pool::~bitmap_io_pool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+template <typename Task>
+future<decltype(declval<Task&>()())> bitmap_io_pool::Submit(Task task)
+{
+    typedef decltype(declval<Task&>()()) result_type;
+    // function<> needs a copyable target, so the packaged task is shared
+    auto work = make_shared<packaged_task<result_type()>>(move(task));
+    future<result_type> result = work->get_future();
+    {
+        lock_guard<mutex> guard(lock);
+        if (stopping)
+            throw runtime_error("Error: I/O pool is shutting down");
+        tasks.push_back([work]() { (*work)(); });
+    }
+    wake.notify_one();
+    return result;
+}
+
+void bitmap_io_pool::WorkerLoop()
+{
+    while (true)
+    {
+        function<void()> next;
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            next = move(tasks.front());
+            tasks.pop_front();
         }
+        next();
     }
-    data = new_data;
-    info_header.width *= scale;
-    info_header.height *= scale;
 }
 
-void Bitmap_cpp::ZoomIn_Compare(const int scale)
+// Instruction sets of the point-wise kernels, picked at start-up from CPUID
+enum class simd_level
 {
-    CheckValid();
-    vector<vector<pixel>> new_data(info_header.height * scale, vector<pixel>(info_header.width * scale));
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            new_data[x * scale][y * scale] = data[x][y];
-    
-    for (int x = 0; x < (info_header.height * scale) - (scale - 1); x += scale)
+    scalar,
+    sse2,
+    avx2,
+    avx512
+};
+
+namespace bitmap_detail
+{
+    // Pool and thread count used by parallel_for, a null pool / zero count means "not set"
+    struct thread_settings
     {
-        for (int y = 0; y < (info_header.width * scale); y++)
+        shared_ptr<bitmap_thread_pool> pool;
+        int thread_count;
+    };
+
+    inline mutex& global_thread_lock()
+    {
+        static mutex lock;
+        return lock;
+    }
+
+    inline thread_settings& global_thread_settings()
+    {
+        static thread_settings settings = {nullptr, 0};
+        return settings;
+    }
+
+    inline shared_ptr<bitmap_io_pool>& global_io_pool()
+    {
+        static shared_ptr<bitmap_io_pool> pool;
+        return pool;
+    }
+
+    // Pool of the asynchronous file functions, created on first use unless one was set
+    shared_ptr<bitmap_io_pool> current_io_pool()
+    {
+        lock_guard<mutex> guard(global_thread_lock());
+        shared_ptr<bitmap_io_pool>& pool = global_io_pool();
+        if (!pool)
+            pool = make_shared<bitmap_io_pool>();
+        return pool;
+    }
+
+    // Innermost bitmap_thread_scope of the calling thread
+    inline const thread_settings*& scoped_thread_settings()
+    {
+        #ifdef __cplusplus_cli
+        static const thread_settings* current = nullptr;
+        #else
+        static thread_local const thread_settings* current = nullptr;
+        #endif
+        return current;
+    }
+
+    // Splits [begin, end) into contiguous chunks and runs them on the current thread pool.
+    // Chunks must only depend on their own range, so the result is the same for any split.
+    void parallel_for(const int begin, const int end, const function<void(int, int)>& body)
+    {
+        if (end - begin <= 1)
         {
-            if (x % scale == 0 && y % scale == 0)
-                continue;
-            if (y >= (info_header.width * scale) - (scale - 1))
+            if (end > begin)
+                body(begin, end);
+            return;
+        }
+
+        shared_ptr<bitmap_thread_pool> pool;
+        int thread_count = 0;
+        const thread_settings* scoped = scoped_thread_settings();
+        if (scoped != nullptr)
+        {
+            pool = scoped->pool;
+            thread_count = scoped->thread_count;
+        }
+        {
+            lock_guard<mutex> guard(global_thread_lock());
+            thread_settings& global = global_thread_settings();
+            if (!pool)
+                pool = global.pool;
+            if (thread_count <= 0)
+                thread_count = global.thread_count;
+            if (!pool && thread_count != 1)
+                pool = global.pool = make_shared<bitmap_thread_pool>();
+        }
+
+        if (!pool || thread_count == 1)
+            body(begin, end);
+        else
+            pool->ParallelFor(begin, end, thread_count > 0 ? thread_count : pool->ThreadCount(), body);
+    }
+
+    // Point-wise kernels over `count` pixels. Every instruction set computes exactly the same values,
+    // the vector versions leave the last few pixels of a row to the scalar one.
+    struct pointwise_kernels
+    {
+        void (*gray)(pixel* dst, int count);
+        void (*invert)(pixel* dst, int count);
+        void (*blend)(pixel* dst, const pixel* src, int count, int weight);
+        void (*add)(pixel* dst, const pixel* src, int count);
+        void (*subtract)(pixel* dst, const pixel* src, int count);
+        void (*multiply)(pixel* dst, int count, int scaler);
+        void (*divide)(pixel* dst, int count, int scaler);
+        void (*bitwise_and)(pixel* dst, const pixel* src, int count);
+        void (*bitwise_or)(pixel* dst, const pixel* src, int count);
+        void (*bitwise_xor)(pixel* dst, const pixel* src, int count);
+        void (*deinterleave)(const pixel* src, unsigned char* b, unsigned char* g, unsigned char* r, unsigned char* a, int count);
+        void (*interleave)(pixel* dst, const unsigned char* b, const unsigned char* g, const unsigned char* r, const unsigned char* a, int count);
+        void (*extract_gray)(const pixel* src, unsigned char* dst, int count);
+    };
+
+    namespace scalar
+    {
+        inline void gray(pixel* dst, int count)
+        {
+            for (int i = 0; i < count; i++)
+                dst[i].r = dst[i].g = dst[i].b = static_cast<unsigned char>((dst[i].r + dst[i].g + dst[i].b) / 3);
+        }
+
+        inline void invert(pixel* dst, int count)
+        {
+            for (int i = 0; i < count; i++)
             {
-                new_data[x][y] = new_data[x][y - 1];
-                continue;
+                dst[i].r = 255 - dst[i].r;
+                dst[i].g = 255 - dst[i].g;
+                dst[i].b = 255 - dst[i].b;
             }
-            
-            int y0 = (y / scale) * scale;
-            int y1 = min(y0 + scale, info_header.width * scale - 1);
-            int w0 = y - y0;
-            int w1 = y1 - y;
-            int w = w0 + w1;
+        }
 
-            new_data[x][y] = pixel(
-                (w1 * new_data[x][y0].r + w0 * new_data[x][y1].r) / w, 
-                (w1 * new_data[x][y0].g + w0 * new_data[x][y1].g) / w, 
-                (w1 * new_data[x][y0].b + w0 * new_data[x][y1].b) / w);
+        // dst * (256 - weight) + src * weight, weight in [0, 256]
+        inline void blend(pixel* dst, const pixel* src, int count, int weight)
+        {
+            const int keep = 256 - weight;
+            for (int i = 0; i < count; i++)
+            {
+                dst[i].r = static_cast<unsigned char>((dst[i].r * keep + src[i].r * weight + 128) >> 8);
+                dst[i].g = static_cast<unsigned char>((dst[i].g * keep + src[i].g * weight + 128) >> 8);
+                dst[i].b = static_cast<unsigned char>((dst[i].b * keep + src[i].b * weight + 128) >> 8);
+            }
+        }
+
+        // The arithmetic operators produce opaque pixels, like the pixel operators they replace
+        inline void add(pixel* dst, const pixel* src, int count)
+        {
+            for (int i = 0; i < count; i++)
+                dst[i] = dst[i] + src[i];
+        }
+
+        inline void subtract(pixel* dst, const pixel* src, int count)
+        {
+            for (int i = 0; i < count; i++)
+                dst[i] = dst[i] - src[i];
+        }
+
+        inline void multiply(pixel* dst, int count, int scaler)
+        {
+            for (int i = 0; i < count; i++)
+                dst[i] = dst[i] * scaler;
+        }
+
+        inline void divide(pixel* dst, int count, int scaler)
+        {
+            for (int i = 0; i < count; i++)
+                dst[i] = dst[i] / scaler;
+        }
+
+        inline void bitwise_and(pixel* dst, const pixel* src, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                dst[i].r &= src[i].r;
+                dst[i].g &= src[i].g;
+                dst[i].b &= src[i].b;
+            }
+        }
+
+        inline void bitwise_or(pixel* dst, const pixel* src, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                dst[i].r |= src[i].r;
+                dst[i].g |= src[i].g;
+                dst[i].b |= src[i].b;
+            }
+        }
+
+        inline void bitwise_xor(pixel* dst, const pixel* src, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                dst[i].r ^= src[i].r;
+                dst[i].g ^= src[i].g;
+                dst[i].b ^= src[i].b;
+            }
+        }
+
+        // Pixels to channel planes and back, a null alpha plane is skipped when splitting and reads as 255 when merging
+        inline void deinterleave(const pixel* src, unsigned char* b, unsigned char* g, unsigned char* r, unsigned char* a, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                b[i] = src[i].b;
+                g[i] = src[i].g;
+                r[i] = src[i].r;
+            }
+            if (a != nullptr)
+                for (int i = 0; i < count; i++)
+                    a[i] = src[i].a;
+        }
+
+        inline void interleave(pixel* dst, const unsigned char* b, const unsigned char* g, const unsigned char* r, const unsigned char* a, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                dst[i].b = b[i];
+                dst[i].g = g[i];
+                dst[i].r = r[i];
+                dst[i].a = a != nullptr ? a[i] : 255;
+            }
+        }
+
+        // The gray value of toGray, one byte per pixel
+        inline void extract_gray(const pixel* src, unsigned char* dst, int count)
+        {
+            for (int i = 0; i < count; i++)
+                dst[i] = static_cast<unsigned char>((src[i].r + src[i].g + src[i].b) / 3);
         }
     }
-    
-    for (int x = 0; x < (info_header.height * scale); x++)
+
+    #ifdef BITMAP_X86
+    // One copy of the kernels per instruction set, built from the same primitives. A pixel is one
+    // 32-bit lane with alpha in the top byte. Products run on 16-bit lanes: scalers up to 128 keep them
+    // below 32768 so the signed pack saturates correctly, c / d == c * (65536 / d + 1) >> 16 for c, d < 256
+    // and (r + g + b) / 3 == (r + g + b) * 21846 >> 16 for every sum up to 765.
+    #define BITMAP_POINTWISE_KERNELS(TARGET, VEC, WIDTH)                                                                                                \
+        TARGET inline void gray(pixel* dst, int count)                                                                                                  \
+        {                                                                                                                                               \
+            const VEC byte = set1(0xFF), third = set1(21846);                                                                                           \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC p = load(dst + i);                                                                                                            \
+                const VEC sum = add_16(add_16(and_(p, byte), and_(srli_32<8>(p), byte)), and_(srli_32<16>(p), byte));                                   \
+                const VEC g = mulhi_u16(sum, third);                                                                                                    \
+                store(dst + i, keep_alpha(or_(g, or_(slli_32<8>(g), slli_32<16>(g))), p));                                                              \
+            }                                                                                                                                           \
+            scalar::gray(dst + i, count - i);                                                                                                           \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void invert(pixel* dst, int count)                                                                                                \
+        {                                                                                                                                               \
+            const VEC color = set1(0x00FFFFFF);                                                                                                         \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+                store(dst + i, xor_(load(dst + i), color));                                                                                             \
+            scalar::invert(dst + i, count - i);                                                                                                         \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void blend(pixel* dst, const pixel* src, int count, int weight)                                                                   \
+        {                                                                                                                                               \
+            const VEC zero = set1(0), keep = set1((256 - weight) * 0x10001), take = set1(weight * 0x10001), half = set1(128 * 0x10001);                 \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC d = load(dst + i), s = load(src + i);                                                                                         \
+                const VEC low = srli_16<8>(add_16(add_16(mullo_16(unpacklo_8(d, zero), keep), mullo_16(unpacklo_8(s, zero), take)), half));             \
+                const VEC high = srli_16<8>(add_16(add_16(mullo_16(unpackhi_8(d, zero), keep), mullo_16(unpackhi_8(s, zero), take)), half));            \
+                store(dst + i, keep_alpha(packus_16(low, high), d));                                                                                    \
+            }                                                                                                                                           \
+            scalar::blend(dst + i, src + i, count - i, weight);                                                                                         \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void add(pixel* dst, const pixel* src, int count)                                                                                 \
+        {                                                                                                                                               \
+            const VEC alpha = set1(static_cast<int>(0xFF000000u));                                                                                      \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+                store(dst + i, or_(adds_u8(load(dst + i), load(src + i)), alpha));                                                                      \
+            scalar::add(dst + i, src + i, count - i);                                                                                                   \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void subtract(pixel* dst, const pixel* src, int count)                                                                            \
+        {                                                                                                                                               \
+            const VEC alpha = set1(static_cast<int>(0xFF000000u));                                                                                      \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+                store(dst + i, or_(subs_u8(load(dst + i), load(src + i)), alpha));                                                                      \
+            scalar::subtract(dst + i, src + i, count - i);                                                                                              \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void multiply(pixel* dst, int count, int scaler)                                                                                  \
+        {                                                                                                                                               \
+            if (scaler <= 0 || scaler > 128)                                                                                                            \
+                return scalar::multiply(dst, count, scaler);                                                                                            \
+            const VEC zero = set1(0), factor = set1(scaler * 0x10001), alpha = set1(static_cast<int>(0xFF000000u));                                     \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC p = load(dst + i);                                                                                                            \
+                store(dst + i, or_(packus_16(mullo_16(unpacklo_8(p, zero), factor), mullo_16(unpackhi_8(p, zero), factor)), alpha));                    \
+            }                                                                                                                                           \
+            scalar::multiply(dst + i, count - i, scaler);                                                                                               \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void divide(pixel* dst, int count, int scaler)                                                                                    \
+        {                                                                                                                                               \
+            if (scaler < 2 || scaler > 255)                                                                                                             \
+                return scalar::divide(dst, count, scaler);                                                                                              \
+            const VEC zero = set1(0), magic = set1(static_cast<int>((65536u / scaler + 1) * 0x10001u)), alpha = set1(static_cast<int>(0xFF000000u));    \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC p = load(dst + i);                                                                                                            \
+                store(dst + i, or_(packus_16(mulhi_u16(unpacklo_8(p, zero), magic), mulhi_u16(unpackhi_8(p, zero), magic)), alpha));                    \
+            }                                                                                                                                           \
+            scalar::divide(dst + i, count - i, scaler);                                                                                                 \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void bitwise_and(pixel* dst, const pixel* src, int count)                                                                         \
+        {                                                                                                                                               \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC d = load(dst + i);                                                                                                            \
+                store(dst + i, keep_alpha(and_(d, load(src + i)), d));                                                                                  \
+            }                                                                                                                                           \
+            scalar::bitwise_and(dst + i, src + i, count - i);                                                                                           \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void bitwise_or(pixel* dst, const pixel* src, int count)                                                                          \
+        {                                                                                                                                               \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC d = load(dst + i);                                                                                                            \
+                store(dst + i, keep_alpha(or_(d, load(src + i)), d));                                                                                   \
+            }                                                                                                                                           \
+            scalar::bitwise_or(dst + i, src + i, count - i);                                                                                            \
+        }                                                                                                                                               \
+                                                                                                                                                        \
+        TARGET inline void bitwise_xor(pixel* dst, const pixel* src, int count)                                                                         \
+        {                                                                                                                                               \
+            int i = 0;                                                                                                                                  \
+            for (; i + WIDTH <= count; i += WIDTH)                                                                                                      \
+            {                                                                                                                                           \
+                const VEC d = load(dst + i);                                                                                                            \
+                store(dst + i, keep_alpha(xor_(d, load(src + i)), d));                                                                                  \
+            }                                                                                                                                           \
+            scalar::bitwise_xor(dst + i, src + i, count - i);                                                                                           \
+        }
+
+    namespace sse2
+    {
+        #define BITMAP_SSE2 BITMAP_TARGET("sse2")
+        BITMAP_SSE2 inline __m128i load(const pixel* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+        BITMAP_SSE2 inline void store(pixel* p, const __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+        BITMAP_SSE2 inline __m128i set1(const int v) { return _mm_set1_epi32(v); }
+        BITMAP_SSE2 inline __m128i and_(const __m128i a, const __m128i b) { return _mm_and_si128(a, b); }
+        BITMAP_SSE2 inline __m128i or_(const __m128i a, const __m128i b) { return _mm_or_si128(a, b); }
+        BITMAP_SSE2 inline __m128i xor_(const __m128i a, const __m128i b) { return _mm_xor_si128(a, b); }
+        BITMAP_SSE2 inline __m128i adds_u8(const __m128i a, const __m128i b) { return _mm_adds_epu8(a, b); }
+        BITMAP_SSE2 inline __m128i subs_u8(const __m128i a, const __m128i b) { return _mm_subs_epu8(a, b); }
+        BITMAP_SSE2 inline __m128i add_16(const __m128i a, const __m128i b) { return _mm_add_epi16(a, b); }
+        BITMAP_SSE2 inline __m128i mullo_16(const __m128i a, const __m128i b) { return _mm_mullo_epi16(a, b); }
+        BITMAP_SSE2 inline __m128i mulhi_u16(const __m128i a, const __m128i b) { return _mm_mulhi_epu16(a, b); }
+        template <int N> BITMAP_SSE2 inline __m128i srli_16(const __m128i a) { return _mm_srli_epi16(a, N); }
+        template <int N> BITMAP_SSE2 inline __m128i srli_32(const __m128i a) { return _mm_srli_epi32(a, N); }
+        template <int N> BITMAP_SSE2 inline __m128i slli_32(const __m128i a) { return _mm_slli_epi32(a, N); }
+        BITMAP_SSE2 inline __m128i unpacklo_8(const __m128i a, const __m128i b) { return _mm_unpacklo_epi8(a, b); }
+        BITMAP_SSE2 inline __m128i unpackhi_8(const __m128i a, const __m128i b) { return _mm_unpackhi_epi8(a, b); }
+        BITMAP_SSE2 inline __m128i packus_16(const __m128i a, const __m128i b) { return _mm_packus_epi16(a, b); }
+        BITMAP_SSE2 inline __m128i keep_alpha(const __m128i result, const __m128i original)
+        {
+            const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+            return _mm_or_si128(_mm_andnot_si128(alpha, result), _mm_and_si128(alpha, original));
+        }
+
+        BITMAP_POINTWISE_KERNELS(BITMAP_SSE2, __m128i, 4)
+
+        // 16 pixels per step, a channel is shifted down and masked in every 32-bit pixel, then packed to bytes
+        template <int Shift> BITMAP_SSE2 inline __m128i pack_channel(const __m128i* p)
+        {
+            const __m128i byte = _mm_set1_epi32(0xFF);
+            const __m128i low = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p[0], Shift), byte), _mm_and_si128(_mm_srli_epi32(p[1], Shift), byte));
+            const __m128i high = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p[2], Shift), byte), _mm_and_si128(_mm_srli_epi32(p[3], Shift), byte));
+            return _mm_packus_epi16(low, high);
+        }
+
+        BITMAP_SSE2 inline void deinterleave(const pixel* src, unsigned char* b, unsigned char* g, unsigned char* r, unsigned char* a, int count)
+        {
+            int i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                const __m128i p[4] = {load(src + i), load(src + i + 4), load(src + i + 8), load(src + i + 12)};
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(b + i), pack_channel<0>(p));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(g + i), pack_channel<8>(p));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), pack_channel<16>(p));
+                if (a != nullptr)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(a + i), pack_channel<24>(p));
+            }
+            scalar::deinterleave(src + i, b + i, g + i, r + i, a != nullptr ? a + i : nullptr, count - i);
+        }
+
+        // b, g and r, a are zipped to 16-bit pairs, the pairs to 32-bit pixels
+        BITMAP_SSE2 inline void interleave(pixel* dst, const unsigned char* b, const unsigned char* g, const unsigned char* r, const unsigned char* a, int count)
+        {
+            const __m128i opaque = _mm_set1_epi8(-1);
+            int i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)), vg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + i));
+                const __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + i));
+                const __m128i va = a != nullptr ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)) : opaque;
+                const __m128i bg_low = _mm_unpacklo_epi8(vb, vg), bg_high = _mm_unpackhi_epi8(vb, vg);
+                const __m128i ra_low = _mm_unpacklo_epi8(vr, va), ra_high = _mm_unpackhi_epi8(vr, va);
+                store(dst + i, _mm_unpacklo_epi16(bg_low, ra_low));
+                store(dst + i + 4, _mm_unpackhi_epi16(bg_low, ra_low));
+                store(dst + i + 8, _mm_unpacklo_epi16(bg_high, ra_high));
+                store(dst + i + 12, _mm_unpackhi_epi16(bg_high, ra_high));
+            }
+            scalar::interleave(dst + i, b + i, g + i, r + i, a != nullptr ? a + i : nullptr, count - i);
+        }
+
+        // Channel sums per 32-bit pixel divided as in gray, then packed to bytes
+        BITMAP_SSE2 inline __m128i pixel_gray(const __m128i p)
+        {
+            const __m128i byte = _mm_set1_epi32(0xFF), third = _mm_set1_epi32(21846);
+            const __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(p, byte), _mm_and_si128(_mm_srli_epi32(p, 8), byte)), _mm_and_si128(_mm_srli_epi32(p, 16), byte));
+            return _mm_mulhi_epu16(sum, third);
+        }
+
+        BITMAP_SSE2 inline void extract_gray(const pixel* src, unsigned char* dst, int count)
+        {
+            int i = 0;
+            for (; i + 16 <= count; i += 16)
+            {
+                const __m128i low = _mm_packs_epi32(pixel_gray(load(src + i)), pixel_gray(load(src + i + 4)));
+                const __m128i high = _mm_packs_epi32(pixel_gray(load(src + i + 8)), pixel_gray(load(src + i + 12)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+            }
+            scalar::extract_gray(src + i, dst + i, count - i);
+        }
+        #undef BITMAP_SSE2
+    }
+
+    namespace avx2
+    {
+        #define BITMAP_AVX2 BITMAP_TARGET("avx2")
+        BITMAP_AVX2 inline __m256i load(const pixel* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+        BITMAP_AVX2 inline void store(pixel* p, const __m256i v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+        BITMAP_AVX2 inline __m256i set1(const int v) { return _mm256_set1_epi32(v); }
+        BITMAP_AVX2 inline __m256i and_(const __m256i a, const __m256i b) { return _mm256_and_si256(a, b); }
+        BITMAP_AVX2 inline __m256i or_(const __m256i a, const __m256i b) { return _mm256_or_si256(a, b); }
+        BITMAP_AVX2 inline __m256i xor_(const __m256i a, const __m256i b) { return _mm256_xor_si256(a, b); }
+        BITMAP_AVX2 inline __m256i adds_u8(const __m256i a, const __m256i b) { return _mm256_adds_epu8(a, b); }
+        BITMAP_AVX2 inline __m256i subs_u8(const __m256i a, const __m256i b) { return _mm256_subs_epu8(a, b); }
+        BITMAP_AVX2 inline __m256i add_16(const __m256i a, const __m256i b) { return _mm256_add_epi16(a, b); }
+        BITMAP_AVX2 inline __m256i mullo_16(const __m256i a, const __m256i b) { return _mm256_mullo_epi16(a, b); }
+        BITMAP_AVX2 inline __m256i mulhi_u16(const __m256i a, const __m256i b) { return _mm256_mulhi_epu16(a, b); }
+        template <int N> BITMAP_AVX2 inline __m256i srli_16(const __m256i a) { return _mm256_srli_epi16(a, N); }
+        template <int N> BITMAP_AVX2 inline __m256i srli_32(const __m256i a) { return _mm256_srli_epi32(a, N); }
+        template <int N> BITMAP_AVX2 inline __m256i slli_32(const __m256i a) { return _mm256_slli_epi32(a, N); }
+        BITMAP_AVX2 inline __m256i unpacklo_8(const __m256i a, const __m256i b) { return _mm256_unpacklo_epi8(a, b); }
+        BITMAP_AVX2 inline __m256i unpackhi_8(const __m256i a, const __m256i b) { return _mm256_unpackhi_epi8(a, b); }
+        BITMAP_AVX2 inline __m256i packus_16(const __m256i a, const __m256i b) { return _mm256_packus_epi16(a, b); }
+        BITMAP_AVX2 inline __m256i keep_alpha(const __m256i result, const __m256i original)
+        {
+            return _mm256_blendv_epi8(result, original, _mm256_set1_epi32(static_cast<int>(0xFF000000u)));
+        }
+
+        BITMAP_POINTWISE_KERNELS(BITMAP_AVX2, __m256i, 8)
+
+        // Same as SSE2 with 32 pixels per step, the packs work per 128-bit lane so the 4-byte groups are put back in order
+        template <int Shift> BITMAP_AVX2 inline __m256i pack_channel(const __m256i* p)
+        {
+            const __m256i byte = _mm256_set1_epi32(0xFF);
+            const __m256i low = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p[0], Shift), byte), _mm256_and_si256(_mm256_srli_epi32(p[1], Shift), byte));
+            const __m256i high = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p[2], Shift), byte), _mm256_and_si256(_mm256_srli_epi32(p[3], Shift), byte));
+            return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, high), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        }
+
+        BITMAP_AVX2 inline void deinterleave(const pixel* src, unsigned char* b, unsigned char* g, unsigned char* r, unsigned char* a, int count)
+        {
+            int i = 0;
+            for (; i + 32 <= count; i += 32)
+            {
+                const __m256i p[4] = {load(src + i), load(src + i + 8), load(src + i + 16), load(src + i + 24)};
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(b + i), pack_channel<0>(p));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(g + i), pack_channel<8>(p));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), pack_channel<16>(p));
+                if (a != nullptr)
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), pack_channel<24>(p));
+            }
+            sse2::deinterleave(src + i, b + i, g + i, r + i, a != nullptr ? a + i : nullptr, count - i);
+        }
+
+        BITMAP_AVX2 inline void interleave(pixel* dst, const unsigned char* b, const unsigned char* g, const unsigned char* r, const unsigned char* a, int count)
+        {
+            const __m256i opaque = _mm256_set1_epi8(-1);
+            int i = 0;
+            for (; i + 32 <= count; i += 32)
+            {
+                const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)), vg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g + i));
+                const __m256i vr = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + i));
+                const __m256i va = a != nullptr ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)) : opaque;
+                const __m256i bg_low = _mm256_unpacklo_epi8(vb, vg), bg_high = _mm256_unpackhi_epi8(vb, vg);
+                const __m256i ra_low = _mm256_unpacklo_epi8(vr, va), ra_high = _mm256_unpackhi_epi8(vr, va);
+                // Pixels 0-3 | 16-19, 4-7 | 20-23, 8-11 | 24-27 and 12-15 | 28-31
+                const __m256i p0 = _mm256_unpacklo_epi16(bg_low, ra_low), p1 = _mm256_unpackhi_epi16(bg_low, ra_low);
+                const __m256i p2 = _mm256_unpacklo_epi16(bg_high, ra_high), p3 = _mm256_unpackhi_epi16(bg_high, ra_high);
+                store(dst + i, _mm256_permute2x128_si256(p0, p1, 0x20));
+                store(dst + i + 8, _mm256_permute2x128_si256(p2, p3, 0x20));
+                store(dst + i + 16, _mm256_permute2x128_si256(p0, p1, 0x31));
+                store(dst + i + 24, _mm256_permute2x128_si256(p2, p3, 0x31));
+            }
+            sse2::interleave(dst + i, b + i, g + i, r + i, a != nullptr ? a + i : nullptr, count - i);
+        }
+
+        BITMAP_AVX2 inline __m256i pixel_gray(const __m256i p)
+        {
+            const __m256i byte = _mm256_set1_epi32(0xFF), third = _mm256_set1_epi32(21846);
+            const __m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(p, byte), _mm256_and_si256(_mm256_srli_epi32(p, 8), byte)), _mm256_and_si256(_mm256_srli_epi32(p, 16), byte));
+            return _mm256_mulhi_epu16(sum, third);
+        }
+
+        BITMAP_AVX2 inline void extract_gray(const pixel* src, unsigned char* dst, int count)
+        {
+            int i = 0;
+            for (; i + 32 <= count; i += 32)
+            {
+                const __m256i low = _mm256_packs_epi32(pixel_gray(load(src + i)), pixel_gray(load(src + i + 8)));
+                const __m256i high = _mm256_packs_epi32(pixel_gray(load(src + i + 16)), pixel_gray(load(src + i + 24)));
+                const __m256i packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, high), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+            }
+            sse2::extract_gray(src + i, dst + i, count - i);
+        }
+        #undef BITMAP_AVX2
+    }
+
+    namespace avx512
+    {
+        #define BITMAP_AVX512 BITMAP_TARGET("avx512f,avx512bw")
+        BITMAP_AVX512 inline __m512i load(const pixel* p) { return _mm512_loadu_si512(p); }
+        BITMAP_AVX512 inline void store(pixel* p, const __m512i v) { _mm512_storeu_si512(p, v); }
+        BITMAP_AVX512 inline __m512i set1(const int v) { return _mm512_set1_epi32(v); }
+        BITMAP_AVX512 inline __m512i and_(const __m512i a, const __m512i b) { return _mm512_and_si512(a, b); }
+        BITMAP_AVX512 inline __m512i or_(const __m512i a, const __m512i b) { return _mm512_or_si512(a, b); }
+        BITMAP_AVX512 inline __m512i xor_(const __m512i a, const __m512i b) { return _mm512_xor_si512(a, b); }
+        BITMAP_AVX512 inline __m512i adds_u8(const __m512i a, const __m512i b) { return _mm512_adds_epu8(a, b); }
+        BITMAP_AVX512 inline __m512i subs_u8(const __m512i a, const __m512i b) { return _mm512_subs_epu8(a, b); }
+        BITMAP_AVX512 inline __m512i add_16(const __m512i a, const __m512i b) { return _mm512_add_epi16(a, b); }
+        BITMAP_AVX512 inline __m512i mullo_16(const __m512i a, const __m512i b) { return _mm512_mullo_epi16(a, b); }
+        BITMAP_AVX512 inline __m512i mulhi_u16(const __m512i a, const __m512i b) { return _mm512_mulhi_epu16(a, b); }
+        template <int N> BITMAP_AVX512 inline __m512i srli_16(const __m512i a) { return _mm512_srli_epi16(a, N); }
+        // Zero-masked forms, the unmasked ones trip -Wmaybe-uninitialized inside GCC's own header
+        template <int N> BITMAP_AVX512 inline __m512i srli_32(const __m512i a) { return _mm512_maskz_srli_epi32(static_cast<__mmask16>(0xFFFF), a, N); }
+        template <int N> BITMAP_AVX512 inline __m512i slli_32(const __m512i a) { return _mm512_maskz_slli_epi32(static_cast<__mmask16>(0xFFFF), a, N); }
+        BITMAP_AVX512 inline __m512i unpacklo_8(const __m512i a, const __m512i b) { return _mm512_unpacklo_epi8(a, b); }
+        BITMAP_AVX512 inline __m512i unpackhi_8(const __m512i a, const __m512i b) { return _mm512_unpackhi_epi8(a, b); }
+        BITMAP_AVX512 inline __m512i packus_16(const __m512i a, const __m512i b) { return _mm512_packus_epi16(a, b); }
+        // Byte mask with the b, g, r bytes of every pixel set
+        BITMAP_AVX512 inline __m512i keep_alpha(const __m512i result, const __m512i original)
+        {
+            return _mm512_mask_mov_epi8(original, static_cast<__mmask64>(0x7777777777777777ull), result);
+        }
+
+        BITMAP_POINTWISE_KERNELS(BITMAP_AVX512, __m512i, 16)
+        #undef BITMAP_AVX512
+    }
+    #undef BITMAP_POINTWISE_KERNELS
+
+    inline void cpuid(const int leaf, const int subleaf, unsigned int* regs)
+    {
+        #ifdef _MSC_VER
+        int info[4];
+        __cpuidex(info, leaf, subleaf);
+        for (int i = 0; i < 4; i++)
+            regs[i] = static_cast<unsigned int>(info[i]);
+        #else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+        #endif
+    }
+
+    // Register state the OS saves on a context switch (XCR0)
+    inline uint64_t enabled_cpu_state()
+    {
+        #ifdef _MSC_VER
+        return _xgetbv(0);
+        #else
+        unsigned int eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+        #endif
+    }
+    #endif
+
+    inline simd_level detect_simd_level()
+    {
+        simd_level level = simd_level::scalar;
+        #ifdef BITMAP_X86
+        unsigned int regs[4];
+        cpuid(0, 0, regs);
+        const unsigned int max_leaf = regs[0];
+        cpuid(1, 0, regs);
+        if (regs[3] & (1u << 26))
+            level = simd_level::sse2;
+
+        // AVX state needs OSXSAVE and XMM / YMM enabled, AVX-512 additionally opmask and ZMM
+        const bool os_saves_state = (regs[2] & (1u << 27)) != 0;
+        const uint64_t state = os_saves_state ? enabled_cpu_state() : 0;
+        if (max_leaf >= 7 && (state & 0x6) == 0x6)
+        {
+            cpuid(7, 0, regs);
+            if (regs[1] & (1u << 5))
+                level = simd_level::avx2;
+            if ((regs[1] & (1u << 16)) && (regs[1] & (1u << 30)) && (state & 0xE6) == 0xE6)
+                level = simd_level::avx512;
+        }
+        #endif
+        return level;
+    }
+
+    inline atomic<int>& active_simd_level()
+    {
+        static atomic<int> level(static_cast<int>(detect_simd_level()));
+        return level;
+    }
+
+    inline const pointwise_kernels& pointwise()
+    {
+        static const pointwise_kernels tables[] = {
+            {scalar::gray, scalar::invert, scalar::blend, scalar::add, scalar::subtract, scalar::multiply, scalar::divide, scalar::bitwise_and, scalar::bitwise_or, scalar::bitwise_xor, scalar::deinterleave, scalar::interleave, scalar::extract_gray},
+            #ifdef BITMAP_X86
+            {sse2::gray, sse2::invert, sse2::blend, sse2::add, sse2::subtract, sse2::multiply, sse2::divide, sse2::bitwise_and, sse2::bitwise_or, sse2::bitwise_xor, sse2::deinterleave, sse2::interleave, sse2::extract_gray},
+            {avx2::gray, avx2::invert, avx2::blend, avx2::add, avx2::subtract, avx2::multiply, avx2::divide, avx2::bitwise_and, avx2::bitwise_or, avx2::bitwise_xor, avx2::deinterleave, avx2::interleave, avx2::extract_gray},
+            // AVX-512 reuses the AVX2 channel shuffles and gray extraction
+            {avx512::gray, avx512::invert, avx512::blend, avx512::add, avx512::subtract, avx512::multiply, avx512::divide, avx512::bitwise_and, avx512::bitwise_or, avx512::bitwise_xor, avx2::deinterleave, avx2::interleave, avx2::extract_gray},
+            #endif
+        };
+        return tables[active_simd_level().load()];
+    }
+
+    // Division by a fixed divisor through a multiply and a shift, exact for dividends up to 255 * divisor
+    struct exact_divider
+    {
+        explicit exact_divider(const uint32_t divisor) : divisor(divisor)
+        {
+            const uint64_t limit = uint64_t(1) << shift;
+            exact = divisor > 0 && uint64_t(255) * divisor * divisor < limit;
+            magic = exact ? (limit - 1) / divisor + 1 : 0;
+        }
+
+        uint32_t operator()(const uint32_t value) const
+        {
+            return exact ? static_cast<uint32_t>((value * magic) >> shift) : value / divisor;
+        }
+
+        static const int shift = 40;
+        uint32_t divisor;
+        uint64_t magic;
+        bool exact;
+    };
+
+    // Argument checks shared by the filters of every image class
+    inline void check_filter_size(const int filter_size)
+    {
+        if (filter_size <= 0)
+            throw invalid_argument("Error: filter size must be greater than 0");
+        if (filter_size % 2 == 0)
+            throw invalid_argument("Error: filter size must be an odd number");
+    }
+
+    inline void check_removed_elements(const int filter_size, const int removed_elements)
+    {
+        if (filter_size * filter_size <= removed_elements * 2)
+            throw invalid_argument("Error: removed_elements must be less than half of the filter size");
+        if (removed_elements < 0)
+            throw invalid_argument("Error: removed_elements must not be negative");
+    }
+
+    inline void check_percentile(const float percentile)
+    {
+        if (percentile < 0.0f || percentile > 100.0f)
+            throw invalid_argument("Error: percentile must be between 0 and 100");
+    }
+
+    // Output stage of the row filters, called with the index of every row right after it is written
+    struct no_row_callback
+    {
+        void operator()(int) const {}
+    };
+
+    // Gray samples of pixel images (r == g == b) and of gray planes, for code shared by both
+    inline int gray_value(const pixel& p) { return p.r; }
+    inline int gray_value(const unsigned char value) { return value; }
+    inline void set_gray(pixel& p, const int value) { p.r = p.g = p.b = static_cast<unsigned char>(value); }
+    inline void set_gray(unsigned char& sample, const int value) { sample = static_cast<unsigned char>(value); }
+
+    inline void assign_black(pixel_buffer& image, const int height, const int width)
+    {
+        image.assign(height, width, pixel());
+    }
+
+    inline void assign_black(channel_plane& image, const int height, const int width)
+    {
+        image.resize_for_overwrite(height, width);
+        for (int x = 0; x < height; x++)
+            fill(image.row(x), image.row(x) + width, 0);
+    }
+
+    // Box filter over the first `Channels` bytes of every sample, `step` is the byte distance between samples.
+    // Rows [first_row, last_row) are written, pixels closer than filter_size / 2 to the border are left as they are.
+    template <int Channels, typename RowDone>
+    void box_filter_rows(const unsigned char* src, const ptrdiff_t src_stride, const int step,
+        unsigned char* dst, const ptrdiff_t dst_stride, const int width, const int height,
+        const int filter_size, int first_row, int last_row, RowDone row_done)
+    {
+        const int padding = filter_size / 2;
+        first_row = max(first_row, padding);
+        last_row = min(last_row, height - padding);
+        if (first_row >= last_row || width < filter_size)
+            return;
+
+        // Vertical running sums per column, then a horizontal running sum over them
+        const exact_divider divide(filter_size * filter_size);
+        vector<uint32_t> column_sum(static_cast<size_t>(width) * Channels, 0);
+        for (int i = first_row - padding; i <= first_row + padding; i++)
+        {
+            const unsigned char* row = src + i * src_stride;
+            for (int y = 0; y < width; y++)
+                for (int c = 0; c < Channels; c++)
+                    column_sum[y * Channels + c] += row[y * step + c];
+        }
+
+        for (int x = first_row; x < last_row; x++)
+        {
+            unsigned char* out = dst + x * dst_stride;
+            uint32_t sum[Channels] = {0};
+            for (int y = 0; y < filter_size; y++)
+                for (int c = 0; c < Channels; c++)
+                    sum[c] += column_sum[y * Channels + c];
+
+            for (int y = padding; ; y++)
+            {
+                for (int c = 0; c < Channels; c++)
+                    out[y * step + c] = static_cast<unsigned char>(divide(sum[c]));
+                if (y + padding + 1 >= width)
+                    break;
+                for (int c = 0; c < Channels; c++)
+                    sum[c] += column_sum[(y + padding + 1) * Channels + c] - column_sum[(y - padding) * Channels + c];
+            }
+            row_done(x);
+
+            if (x + 1 < last_row)
+            {
+                const unsigned char* leaving = src + (x - padding) * src_stride;
+                const unsigned char* entering = src + (x + padding + 1) * src_stride;
+                for (int y = 0; y < width; y++)
+                    for (int c = 0; c < Channels; c++)
+                        column_sum[y * Channels + c] += entering[y * step + c] - leaving[y * step + c];
+            }
+        }
+    }
+
+    // Column histograms of a rank_window for rows up to `width` pixels wide, in one block of an image's memory
+    class rank_histograms
+    {
+    public:
+        explicit rank_histograms(shared_ptr<pixel_memory> memory)
+            : column_fine(nullptr), column_coarse(nullptr), column_coarse_sum(nullptr), memory(move(memory)), block(nullptr), bytes(0) {}
+        ~rank_histograms() { deallocate_bytes(memory.get(), block, bytes, alignment); }
+        rank_histograms(const rank_histograms&) = delete;
+        rank_histograms& operator=(const rank_histograms&) = delete;
+
+        void Reserve(const int width)
+        {
+            const size_t columns = static_cast<size_t>(width);
+            const size_t needed = columns * (16 * sizeof(uint32_t) + 16 * sizeof(uint16_t) + 256 * sizeof(uint16_t));
+            if (needed > bytes)
+            {
+                void* grown = allocate_bytes(memory.get(), needed, alignment);
+                deallocate_bytes(memory.get(), block, bytes, alignment);
+                block = grown;
+                bytes = needed;
+            }
+            column_coarse_sum = static_cast<uint32_t*>(block);
+            column_coarse = reinterpret_cast<uint16_t*>(column_coarse_sum + columns * 16);
+            column_fine = column_coarse + columns * 16;
+        }
+
+        uint16_t* column_fine;
+        uint16_t* column_coarse;
+        uint32_t* column_coarse_sum;
+
+    private:
+        static const size_t alignment = 64;
+        shared_ptr<pixel_memory> memory;
+        void* block;
+        size_t bytes;
+    };
+
+    // Histograms kept by an image for its rank filters, one set per band running at the same time. Copies
+    // and assignments take the other memory with an empty pool, as moved pixel buffers take its memory.
+    class rank_storage
+    {
+    public:
+        explicit rank_storage(shared_ptr<pixel_memory> memory = nullptr) : memory(move(memory)), created(0) {}
+        rank_storage(const rank_storage& other) noexcept : memory(other.memory), created(0) {}
+        rank_storage& operator=(const rank_storage& other)
+        {
+            if (this != &other)
+                Reset(other.memory);
+            return *this;
+        }
+
+        // Drops the pool, later histograms come from `memory`
+        void Reset(shared_ptr<pixel_memory> new_memory)
+        {
+            lock_guard<mutex> guard(lock);
+            memory = move(new_memory);
+            idle.clear();
+            created = 0;
+        }
+
+        // One set of histograms for the lifetime of a band, returned to the pool afterwards
+        class lease
+        {
+        public:
+            lease(rank_storage& storage, const int width) : storage(storage), histograms(storage.Acquire()) { histograms->Reserve(width); }
+            ~lease() { storage.Release(move(histograms)); }
+            lease(const lease&) = delete;
+            lease& operator=(const lease&) = delete;
+            rank_histograms& operator*() const { return *histograms; }
+
+        private:
+            rank_storage& storage;
+            unique_ptr<rank_histograms> histograms;
+        };
+
+    private:
+        unique_ptr<rank_histograms> Acquire()
+        {
+            lock_guard<mutex> guard(lock);
+            if (!idle.empty())
+            {
+                unique_ptr<rank_histograms> histograms = move(idle.back());
+                idle.pop_back();
+                return histograms;
+            }
+            // Room to take every set back without allocating
+            idle.reserve(++created);
+            return unique_ptr<rank_histograms>(new rank_histograms(memory));
+        }
+
+        void Release(unique_ptr<rank_histograms> histograms)
+        {
+            lock_guard<mutex> guard(lock);
+            idle.push_back(move(histograms));
+        }
+
+        shared_ptr<pixel_memory> memory;
+        mutex lock;
+        vector<unique_ptr<rank_histograms>> idle;
+        size_t created;
+    };
+
+    // Sliding-histogram rank queries over a filter_size x filter_size window of one 8-bit channel
+    // (Perreault & Hebert, "Median Filtering in Constant Time"). Every column keeps a histogram of the
+    // rows under the window, the window histogram is kept as 16 coarse bins and 256 fine bins, and a
+    // fine bucket is only brought up to date when a query actually looks inside it.
+    class rank_window
+    {
+    public:
+        // `histograms` must be reserved for `width` columns
+        rank_window(const unsigned char* src, const ptrdiff_t src_stride, const int step, const int width, const int filter_size, rank_histograms& histograms)
+            : src(src), src_stride(src_stride), step(step), width(width), filter_size(filter_size),
+              padding(filter_size / 2), window_pixels(filter_size * filter_size), center(0),
+              column_fine(histograms.column_fine), column_coarse(histograms.column_coarse),
+              column_coarse_sum(histograms.column_coarse_sum) {}
+
+        // Writes query(*this) for every pixel of rows [first_row, last_row) that has a full window
+        template <typename Query, typename RowDone>
+        void FilterRows(unsigned char* dst, const ptrdiff_t dst_stride, const int dst_step, const int height,
+            int first_row, int last_row, Query query, RowDone row_done)
+        {
+            first_row = max(first_row, padding);
+            last_row = min(last_row, height - padding);
+            if (first_row >= last_row || width < filter_size)
+                return;
+
+            // Columns start with rows [first_row - padding, first_row + padding), each column adds its
+            // bottom row (and drops the top one) right before it enters the window
+            fill(column_fine, column_fine + static_cast<size_t>(width) * 256, 0);
+            fill(column_coarse, column_coarse + static_cast<size_t>(width) * 16, 0);
+            fill(column_coarse_sum, column_coarse_sum + static_cast<size_t>(width) * 16, 0);
+            for (int i = first_row - padding; i < first_row + padding; i++)
+                for (int y = 0; y < width; y++)
+                    AddSample(y, src[i * src_stride + y * step]);
+
+            for (int x = first_row; x < last_row; x++)
+            {
+                const bool drop_top = x > first_row;
+                fill(coarse, coarse + 16, 0);
+                fill(coarse_sum, coarse_sum + 16, 0);
+                fill(fine_center, fine_center + 16, INT32_MIN);
+                for (int y = 0; y < filter_size; y++)
+                {
+                    UpdateColumn(y, x, drop_top);
+                    AddColumn(y);
+                }
+
+                unsigned char* out = dst + x * dst_stride;
+                for (center = padding; ; center++)
+                {
+                    out[center * dst_step] = static_cast<unsigned char>(query(*this));
+                    if (center + padding + 1 >= width)
+                        break;
+                    UpdateColumn(center + padding + 1, x, drop_top);
+                    AddColumn(center + padding + 1);
+                    RemoveColumn(center - padding);
+                }
+                row_done(x);
+            }
+        }
+
+        int Size() const { return window_pixels; }
+
+        // Value at 0-based position `rank` of the sorted window
+        int Kth(const int rank)
+        {
+            uint32_t seen = 0;
+            int bucket = 0;
+            while (seen + coarse[bucket] <= static_cast<uint32_t>(rank))
+                seen += coarse[bucket++];
+
+            const uint32_t* bins = SyncBucket(bucket);
+            int bin = 0;
+            while (seen + bins[bin] <= static_cast<uint32_t>(rank))
+                seen += bins[bin++];
+            return bucket * 16 + bin;
+        }
+
+        uint32_t TotalSum() const
+        {
+            uint32_t sum = 0;
+            for (int bucket = 0; bucket < 16; bucket++)
+                sum += coarse_sum[bucket];
+            return sum;
+        }
+
+        // Sum of the `n` smallest values of the window
+        uint32_t LowestSum(const int n)
+        {
+            uint32_t seen = 0, sum = 0;
+            int bucket = 0;
+            while (bucket < 16 && seen + coarse[bucket] <= static_cast<uint32_t>(n))
+            {
+                seen += coarse[bucket];
+                sum += coarse_sum[bucket++];
+            }
+            if (seen < static_cast<uint32_t>(n))
+            {
+                const uint32_t* bins = SyncBucket(bucket);
+                for (int bin = 0; seen < static_cast<uint32_t>(n); bin++)
+                {
+                    const uint32_t take = min(bins[bin], n - seen);
+                    sum += take * (bucket * 16 + bin);
+                    seen += take;
+                }
+            }
+            return sum;
+        }
+
+        // Sum of the `n` largest values of the window
+        uint32_t HighestSum(const int n)
+        {
+            uint32_t seen = 0, sum = 0;
+            int bucket = 15;
+            while (bucket >= 0 && seen + coarse[bucket] <= static_cast<uint32_t>(n))
+            {
+                seen += coarse[bucket];
+                sum += coarse_sum[bucket--];
+            }
+            if (seen < static_cast<uint32_t>(n))
+            {
+                const uint32_t* bins = SyncBucket(bucket);
+                for (int bin = 15; seen < static_cast<uint32_t>(n); bin--)
+                {
+                    const uint32_t take = min(bins[bin], n - seen);
+                    sum += take * (bucket * 16 + bin);
+                    seen += take;
+                }
+            }
+            return sum;
+        }
+
+    private:
+        void AddSample(const int y, const unsigned char value)
+        {
+            column_fine[y * 256 + value]++;
+            column_coarse[y * 16 + (value >> 4)]++;
+            column_coarse_sum[y * 16 + (value >> 4)] += value;
+        }
+
+        void RemoveSample(const int y, const unsigned char value)
+        {
+            column_fine[y * 256 + value]--;
+            column_coarse[y * 16 + (value >> 4)]--;
+            column_coarse_sum[y * 16 + (value >> 4)] -= value;
+        }
+
+        void UpdateColumn(const int y, const int x, const bool drop_top)
+        {
+            AddSample(y, src[(x + padding) * src_stride + y * step]);
+            if (drop_top)
+                RemoveSample(y, src[(x - padding - 1) * src_stride + y * step]);
+        }
+
+        void AddColumn(const int y)
+        {
+            for (int bucket = 0; bucket < 16; bucket++)
+            {
+                coarse[bucket] += column_coarse[y * 16 + bucket];
+                coarse_sum[bucket] += column_coarse_sum[y * 16 + bucket];
+            }
+        }
+
+        void RemoveColumn(const int y)
+        {
+            for (int bucket = 0; bucket < 16; bucket++)
+            {
+                coarse[bucket] -= column_coarse[y * 16 + bucket];
+                coarse_sum[bucket] -= column_coarse_sum[y * 16 + bucket];
+            }
+        }
+
+        // Brings the fine bins of one coarse bucket up to the current window position
+        const uint32_t* SyncBucket(const int bucket)
+        {
+            uint32_t* bins = fine + bucket * 16;
+            const int last = fine_center[bucket];
+            if (last == INT32_MIN || (center - last) * 2 >= filter_size)
+            {
+                fill(bins, bins + 16, 0);
+                for (int y = center - padding; y <= center + padding; y++)
+                {
+                    const uint16_t* column = &column_fine[y * 256 + bucket * 16];
+                    for (int bin = 0; bin < 16; bin++)
+                        bins[bin] += column[bin];
+                }
+            }
+            else
+            {
+                for (int c = last + 1; c <= center; c++)
+                {
+                    const uint16_t* entering = &column_fine[(c + padding) * 256 + bucket * 16];
+                    const uint16_t* leaving = &column_fine[(c - padding - 1) * 256 + bucket * 16];
+                    for (int bin = 0; bin < 16; bin++)
+                        bins[bin] += entering[bin] - leaving[bin];
+                }
+            }
+            fine_center[bucket] = center;
+            return bins;
+        }
+
+        const unsigned char* src;
+        ptrdiff_t src_stride;
+        int step;
+        int width;
+        int filter_size;
+        int padding;
+        int window_pixels;
+        int center;
+
+        uint16_t* column_fine;
+        uint16_t* column_coarse;
+        uint32_t* column_coarse_sum;
+
+        uint32_t coarse[16];
+        uint32_t coarse_sum[16];
+        uint32_t fine[256];
+        int32_t fine_center[16];
+    };
+
+    // Square integer convolution kernels, taps[i * size + j] weighs the pixel i - size / 2 rows below and
+    // j - size / 2 columns right of the center. A kernel that is the outer product of an integer column and
+    // an integer row is separable and runs as a vertical and a horizontal 1-D pass. The row factor is the
+    // first nonzero row divided by the gcd of its taps, every other row then has to be an integer multiple
+    // of it. These constexpr versions factor static_kernel at compile time, runtime_kernel does it in loops.
+    constexpr int tap_gcd(const int a, const int b) { return b == 0 ? (a < 0 ? -a : a) : tap_gcd(b, a % b); }
+
+    constexpr int pivot_row(const int* taps, const int size, const int n = 0)
+    {
+        return n == size * size ? size : taps[n] != 0 ? n / size : pivot_row(taps, size, n + 1);
+    }
+
+    constexpr int row_divisor(const int* taps, const int size, const int p, const int j = 0)
+    {
+        return j == size ? 0 : tap_gcd(taps[p * size + j], row_divisor(taps, size, p, j + 1));
+    }
+
+    constexpr int row_factor(const int* taps, const int size, const int j)
+    {
+        return pivot_row(taps, size) == size ? 0 : taps[pivot_row(taps, size) * size + j] / row_divisor(taps, size, pivot_row(taps, size));
+    }
+
+    constexpr int pivot_column(const int* taps, const int size, const int j = 0)
+    {
+        return j == size || row_factor(taps, size, j) != 0 ? j : pivot_column(taps, size, j + 1);
+    }
+
+    constexpr int column_factor(const int* taps, const int size, const int i)
+    {
+        return pivot_row(taps, size) == size ? 0 : taps[i * size + pivot_column(taps, size)] / row_factor(taps, size, pivot_column(taps, size));
+    }
+
+    constexpr bool factors_match(const int* taps, const int size, const int n = 0)
+    {
+        return n == size * size || (taps[n] == column_factor(taps, size, n / size) * row_factor(taps, size, n % size) && factors_match(taps, size, n + 1));
+    }
+
+    template <int Size, int... Taps>
+    struct static_kernel
+    {
+        static_assert(Size % 2 == 1 && sizeof...(Taps) == Size * Size, "Error: kernel must be square with an odd size");
+        static const int size = Size;
+        static constexpr int taps[Size * Size] = {Taps...};
+        static const bool separable = pivot_row(taps, Size) != Size && factors_match(taps, Size);
+    };
+
+    template <int Size, int... Taps>
+    constexpr int static_kernel<Size, Taps...>::taps[Size * Size];
+
+    struct runtime_kernel
+    {
+        runtime_kernel(const int size, const vector<int>& taps) : size(size), taps(taps), separable(false)
+        {
+            if (size <= 0 || size % 2 == 0 || taps.size() != static_cast<size_t>(size) * size)
+                throw invalid_argument("Error: kernel must be square with an odd size");
+
+            int p = 0;
+            while (p < size * size && taps[p] == 0)
+                p++;
+            if (p == size * size)
+                return;
+            p /= size;
+
+            int divisor = 0;
+            for (int j = 0; j < size; j++)
+                divisor = tap_gcd(taps[p * size + j], divisor);
+            row.resize(size);
+            for (int j = 0; j < size; j++)
+                row[j] = taps[p * size + j] / divisor;
+            int q = 0;
+            while (row[q] == 0)
+                q++;
+            column.resize(size);
+            for (int i = 0; i < size; i++)
+                column[i] = taps[i * size + q] / row[q];
+
+            separable = true;
+            for (int n = 0; n < size * size; n++)
+                separable = separable && taps[n] == column[n / size] * row[n % size];
+        }
+
+        int size;
+        vector<int> taps;
+        bool separable;
+        vector<int> column;
+        vector<int> row;
+    };
+
+    // Fully unrolled tap sums of a static_kernel, `rows` points at the sample of the top-left tap in each kernel row
+    template <typename Kernel, int N, int Count>
+    struct unrolled_taps
+    {
+        static int32_t Full(const unsigned char* const* rows, const int offset, const int step)
+        {
+            const int coefficient = Kernel::taps[N];
+            return (coefficient == 0 ? 0 : coefficient * rows[N / Kernel::size][offset + N % Kernel::size * step]) +
+                unrolled_taps<Kernel, N + 1, Count>::Full(rows, offset, step);
+        }
+
+        static int32_t Column(const unsigned char* const* rows, const int offset)
+        {
+            const int coefficient = integral_constant<int, column_factor(Kernel::taps, Kernel::size, N)>::value;
+            return (coefficient == 0 ? 0 : coefficient * rows[N][offset]) + unrolled_taps<Kernel, N + 1, Count>::Column(rows, offset);
+        }
+
+        template <int Channels>
+        static int32_t Row(const int32_t* values)
+        {
+            const int coefficient = integral_constant<int, row_factor(Kernel::taps, Kernel::size, N)>::value;
+            return (coefficient == 0 ? 0 : coefficient * values[N * Channels]) + unrolled_taps<Kernel, N + 1, Count>::template Row<Channels>(values);
+        }
+    };
+
+    template <typename Kernel, int Count>
+    struct unrolled_taps<Kernel, Count, Count>
+    {
+        static int32_t Full(const unsigned char* const*, const int, const int) { return 0; }
+        static int32_t Column(const unsigned char* const*, const int) { return 0; }
+        template <int Channels>
+        static int32_t Row(const int32_t*) { return 0; }
+    };
+
+    // One output row of `kernel`, sums[y * Channels + c] is written for the columns with a full window.
+    // `rows` holds the source rows under the kernel, `vertical` is `size` rows of scratch.
+    template <int Channels, int Size, int... Taps>
+    void convolve_row(const static_kernel<Size, Taps...>&, const unsigned char* const* rows, const int step, const int width,
+        int32_t* vertical, int32_t* sums)
+    {
+        typedef static_kernel<Size, Taps...> kernel;
+        const int padding = Size / 2;
+        if (kernel::separable)
+        {
+            for (int y = 0; y < width; y++)
+                for (int c = 0; c < Channels; c++)
+                    vertical[y * Channels + c] = unrolled_taps<kernel, 0, Size>::Column(rows, y * step + c);
+            for (int y = padding; y < width - padding; y++)
+                for (int c = 0; c < Channels; c++)
+                    sums[y * Channels + c] = unrolled_taps<kernel, 0, Size>::template Row<Channels>(vertical + (y - padding) * Channels + c);
+        }
+        else
+        {
+            for (int y = padding; y < width - padding; y++)
+                for (int c = 0; c < Channels; c++)
+                    sums[y * Channels + c] = unrolled_taps<kernel, 0, Size * Size>::Full(rows, (y - padding) * step + c, step);
+        }
+    }
+
+    template <int Channels>
+    void convolve_row(const runtime_kernel& kernel, const unsigned char* const* rows, const int step, const int width,
+        int32_t* vertical, int32_t* sums)
+    {
+        const int size = kernel.size, padding = size / 2;
+        fill(sums + padding * Channels, sums + (width - padding) * Channels, 0);
+        if (kernel.separable)
+        {
+            fill(vertical, vertical + width * Channels, 0);
+            for (int i = 0; i < size; i++)
+            {
+                const int coefficient = kernel.column[i];
+                if (coefficient != 0)
+                    for (int y = 0; y < width; y++)
+                        for (int c = 0; c < Channels; c++)
+                            vertical[y * Channels + c] += coefficient * rows[i][y * step + c];
+            }
+            for (int j = 0; j < size; j++)
+            {
+                const int coefficient = kernel.row[j];
+                if (coefficient != 0)
+                    for (int y = padding; y < width - padding; y++)
+                        for (int c = 0; c < Channels; c++)
+                            sums[y * Channels + c] += coefficient * vertical[(y - padding + j) * Channels + c];
+            }
+            return;
+        }
+
+        // The rows under the kernel are widened into `vertical` one channel at a time first, so every output
+        // is a dot product of each kernel row with contiguous values
+        for (int c = 0; c < Channels; c++)
+            for (int i = 0; i < size; i++)
+            {
+                int32_t* plane = vertical + (c * size + i) * width;
+                for (int y = 0; y < width; y++)
+                    plane[y] = rows[i][y * step + c];
+            }
+
+        // Four neighbouring outputs share every tap load
+        const int* taps = kernel.taps.data();
+        for (int c = 0; c < Channels; c++)
+        {
+            const int32_t* planes = vertical + c * size * width;
+            int y = padding;
+            for (; y + 4 <= width - padding; y += 4)
+            {
+                int32_t sum[4] = {0, 0, 0, 0};
+                for (int i = 0; i < size; i++)
+                {
+                    const int* tap = taps + i * size;
+                    const int32_t* in = planes + i * width + y - padding;
+                    for (int j = 0; j < size; j++)
+                    {
+                        sum[0] += tap[j] * in[j];
+                        sum[1] += tap[j] * in[j + 1];
+                        sum[2] += tap[j] * in[j + 2];
+                        sum[3] += tap[j] * in[j + 3];
+                    }
+                }
+                for (int k = 0; k < 4; k++)
+                    sums[(y + k) * Channels + c] = sum[k];
+            }
+            for (; y < width - padding; y++)
+            {
+                int32_t sum = 0;
+                for (int i = 0; i < size; i++)
+                {
+                    const int* tap = taps + i * size;
+                    const int32_t* in = planes + i * width + y - padding;
+                    for (int j = 0; j < size; j++)
+                        sum += tap[j] * in[j];
+                }
+                sums[y * Channels + c] = sum;
+            }
+        }
+    }
+
+    template <typename Kernel, typename... Rest>
+    int kernel_size(const Kernel& kernel, const Rest&...)
+    {
+        return kernel.size;
+    }
+
+    template <int Channels>
+    void convolve_each(const unsigned char* const*, const int, const int, int32_t*, const size_t) {}
+
+    template <int Channels, typename Kernel, typename... Rest>
+    void convolve_each(const unsigned char* const* rows, const int step, const int width, int32_t* buffer, const size_t row_values,
+        const Kernel& kernel, const Rest&... rest)
+    {
+        convolve_row<Channels>(kernel, rows, step, width, buffer, buffer + row_values * kernel.size);
+        convolve_each<Channels>(rows, step, width, buffer + row_values * (kernel.size + 1), row_values, rest...);
+    }
+
+    // Convolves the first `Channels` bytes of every sample with each of `kernels` (all of the same size) over rows
+    // [first_row, last_row) that have a full window, and calls output(x, sums) per row where sums[k] is the
+    // response of the k-th kernel, laid out as in convolve_row.
+    template <int Channels, typename Output, typename Kernel, typename... Rest>
+    void convolve_rows(const unsigned char* src, const ptrdiff_t src_stride, const int step, const int width, const int height,
+        int first_row, int last_row, Output output, const Kernel& kernel, const Rest&... rest)
+    {
+        const int size = kernel.size, padding = size / 2;
+        first_row = max(first_row, padding);
+        last_row = min(last_row, height - padding);
+        if (first_row >= last_row || width < size)
+            return;
+
+        const int kernel_count = 1 + sizeof...(Rest);
+        const size_t row_values = static_cast<size_t>(width) * Channels;
+        // Every kernel gets `size` rows of scratch followed by its output row
+        vector<int32_t> buffer(row_values * (size + 1) * kernel_count);
+        const int32_t* sums[kernel_count];
+        for (int k = 0; k < kernel_count; k++)
+            sums[k] = &buffer[row_values * ((size + 1) * k + size)];
+
+        vector<const unsigned char*> rows(size);
+        for (int x = first_row; x < last_row; x++)
+        {
+            for (int i = 0; i < size; i++)
+                rows[i] = src + (x - padding + i) * src_stride;
+            convolve_each<Channels>(rows.data(), step, width, buffer.data(), row_values, kernel, rest...);
+            output(x, sums);
+        }
+    }
+
+    // Orthonormal 8x8 DCT-II basis, c[u][x] = alpha(u) * cos((2x + 1) * u * pi / 16), plus a 2^13 fixed-point copy
+    struct dct_table
+    {
+        static const int fixed_bits = 13;
+
+        dct_table()
+        {
+            const double PI = 3.14159265358979323846;
+            for (int u = 0; u < 8; u++)
+            {
+                const double alpha = u == 0 ? sqrt(1.0 / 8) : sqrt(2.0 / 8);
+                for (int x = 0; x < 8; x++)
+                {
+                    c[u][x] = static_cast<float>(alpha * cos((2 * x + 1) * u * PI / 16));
+                    q[u][x] = static_cast<int32_t>(floor(alpha * cos((2 * x + 1) * u * PI / 16) * (1 << fixed_bits) + 0.5));
+                }
+            }
+        }
+
+        static const dct_table& get()
+        {
+            static const dct_table table;
+            return table;
+        }
+
+        float c[8][8];
+        int32_t q[8][8];
+    };
+
+    // Separable transforms, rows first then columns, in place on a row-major 8x8 block
+    void forward_dct_8x8(float* block)
+    {
+        const dct_table& table = dct_table::get();
+        float temp[64];
+        for (int x = 0; x < 8; x++)
+            for (int v = 0; v < 8; v++)
+            {
+                float sum = 0;
+                for (int y = 0; y < 8; y++)
+                    sum += table.c[v][y] * block[x * 8 + y];
+                temp[x * 8 + v] = sum;
+            }
+        for (int u = 0; u < 8; u++)
+            for (int v = 0; v < 8; v++)
+            {
+                float sum = 0;
+                for (int x = 0; x < 8; x++)
+                    sum += table.c[u][x] * temp[x * 8 + v];
+                block[u * 8 + v] = sum;
+            }
+    }
+
+    void inverse_dct_8x8(float* block)
+    {
+        const dct_table& table = dct_table::get();
+        float temp[64];
+        for (int u = 0; u < 8; u++)
+            for (int y = 0; y < 8; y++)
+            {
+                float sum = 0;
+                for (int v = 0; v < 8; v++)
+                    sum += table.c[v][y] * block[u * 8 + v];
+                temp[u * 8 + y] = sum;
+            }
+        for (int x = 0; x < 8; x++)
+            for (int y = 0; y < 8; y++)
+            {
+                float sum = 0;
+                for (int u = 0; u < 8; u++)
+                    sum += table.c[u][x] * temp[u * 8 + y];
+                block[x * 8 + y] = sum;
+            }
+    }
+
+    // Fixed-point versions, samples and coefficients are plain integers, intermediate
+    // results keep a few extra fraction bits between the two passes
+    void forward_dct_8x8(int32_t* block)
+    {
+        const dct_table& table = dct_table::get();
+        const int first_shift = dct_table::fixed_bits - 2, second_shift = dct_table::fixed_bits + 2;
+        int32_t temp[64];
+        for (int x = 0; x < 8; x++)
+            for (int v = 0; v < 8; v++)
+            {
+                int32_t sum = 0;
+                for (int y = 0; y < 8; y++)
+                    sum += table.q[v][y] * block[x * 8 + y];
+                temp[x * 8 + v] = (sum + (1 << (first_shift - 1))) >> first_shift;
+            }
+        for (int u = 0; u < 8; u++)
+            for (int v = 0; v < 8; v++)
+            {
+                int32_t sum = 0;
+                for (int x = 0; x < 8; x++)
+                    sum += table.q[u][x] * temp[x * 8 + v];
+                block[u * 8 + v] = (sum + (1 << (second_shift - 1))) >> second_shift;
+            }
+    }
+
+    void inverse_dct_8x8(int32_t* block)
+    {
+        const dct_table& table = dct_table::get();
+        const int first_shift = dct_table::fixed_bits - 3, second_shift = dct_table::fixed_bits + 3;
+        int32_t temp[64];
+        for (int u = 0; u < 8; u++)
+            for (int y = 0; y < 8; y++)
+            {
+                int32_t sum = 0;
+                for (int v = 0; v < 8; v++)
+                    sum += table.q[v][y] * block[u * 8 + v];
+                temp[u * 8 + y] = (sum + (1 << (first_shift - 1))) >> first_shift;
+            }
+        for (int x = 0; x < 8; x++)
+            for (int y = 0; y < 8; y++)
+            {
+                int32_t sum = 0;
+                for (int u = 0; u < 8; u++)
+                    sum += table.q[u][x] * temp[u * 8 + y];
+                block[x * 8 + y] = (sum + (1 << (second_shift - 1))) >> second_shift;
+            }
+    }
+
+    inline unsigned char round_sample(const float value) { return static_cast<unsigned char>(min(255.0f, max(0.0f, floor(value + 0.5f)))); }
+    inline unsigned char round_sample(const int32_t value) { return static_cast<unsigned char>(min(255, max(0, static_cast<int>(value)))); }
+
+    // Red, green and blue samples of an image, `step` bytes apart along a row, so the DCT code runs on
+    // interleaved pixels and on channel planes (step 1) alike. A gray plane is all three channels at once.
+    template <typename Byte>
+    struct rgb_view
+    {
+        Byte* r;
+        Byte* g;
+        Byte* b;
+        ptrdiff_t stride;
+        int step;
+        int width;
+        int height;
+
+        ptrdiff_t offset(const int x, const int y) const { return x * stride + y * step; }
+    };
+
+    // Whether two buffers share pixel memory, as regions of one image can
+    inline bool overlaps(const pixel_buffer& a, const pixel_buffer& b)
+    {
+        if (a.empty() || b.empty())
+            return false;
+        const auto bounds = [](const pixel_buffer& buffer)
+        {
+            const pixel* first = buffer.row(0);
+            const pixel* last = buffer.row(buffer.height() - 1);
+            return make_pair(min(first, last, less<const pixel*>()), max(first, last, less<const pixel*>()) + buffer.width());
+        };
+        const pair<const pixel*, const pixel*> first = bounds(a), second = bounds(b);
+        return less<const pixel*>()(first.first, second.second) && less<const pixel*>()(second.first, first.second);
+    }
+
+    inline rgb_view<unsigned char> rgb_of(pixel_buffer& data)
+    {
+        pixel* origin = data.row(0);
+        const rgb_view<unsigned char> view = {&origin->r, &origin->g, &origin->b, data.stride_bytes(), static_cast<int>(sizeof(pixel)), data.width(), data.height()};
+        return view;
+    }
+
+    inline rgb_view<const unsigned char> rgb_of(const pixel_buffer& data)
+    {
+        const pixel* origin = data.row(0);
+        const rgb_view<const unsigned char> view = {&origin->r, &origin->g, &origin->b, data.stride_bytes(), static_cast<int>(sizeof(pixel)), data.width(), data.height()};
+        return view;
+    }
+
+    // Low-pass DCT compression of the 8x8 block at (x, y), edge blocks replicate the last row / column.
+    // Channels are independent, so a gray view is transformed once.
+    template <typename T>
+    void dct_compress_block(const rgb_view<unsigned char>& image, const int x, const int y, const int keep_diagonals)
+    {
+        const int height = image.height, width = image.width;
+        unsigned char* const channels[3] = {image.r, image.g, image.b};
+        const int channel_count = image.r == image.g && image.r == image.b ? 1 : 3;
+        T block[3][64];
+        for (int i = 0; i < 8; i++)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                const ptrdiff_t offset = image.offset(min(x + i, height - 1), min(y + j, width - 1));
+                for (int c = 0; c < channel_count; c++)
+                    block[c][i * 8 + j] = static_cast<T>(channels[c][offset] - 128);
+            }
+        }
+
+        for (int c = 0; c < channel_count; c++)
+        {
+            forward_dct_8x8(block[c]);
+            for (int u = 0; u < 8; u++)
+                for (int v = max(0, keep_diagonals - u); v < 8; v++)
+                    block[c][u * 8 + v] = 0;
+            inverse_dct_8x8(block[c]);
+        }
+
+        for (int i = 0; i < 8 && x + i < height; i++)
+        {
+            for (int j = 0; j < 8 && y + j < width; j++)
+            {
+                const ptrdiff_t offset = image.offset(x + i, y + j);
+                for (int c = 0; c < channel_count; c++)
+                    channels[c][offset] = round_sample(block[c][i * 8 + j] + 128);
+            }
+        }
+    }
+
+    // Entropy coding for the DCT container, the same scheme as baseline JPEG: zig-zag order,
+    // DC differences and (run, size) AC symbols, Huffman codes of at most 16 bits
+    const int zigzag_order[64] = {
+         0,  1,  8, 16,  9,  2,  3, 10,
+        17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63
+    };
+
+    const unsigned char luma_quantization[64] = {
+        16, 11, 10, 16,  24,  40,  51,  61,
+        12, 12, 14, 19,  26,  58,  60,  55,
+        14, 13, 16, 24,  40,  57,  69,  56,
+        14, 17, 22, 29,  51,  87,  80,  62,
+        18, 22, 37, 56,  68, 109, 103,  77,
+        24, 35, 55, 64,  81, 104, 113,  92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103,  99
+    };
+
+    const unsigned char chroma_quantization[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99
+    };
+
+    // Number of bits needed for |value|, the JPEG "category"
+    inline int bit_length(int value)
+    {
+        value = abs(value);
+        int bits = 0;
+        while (value > 0)
+        {
+            bits++;
+            value >>= 1;
+        }
+        return bits;
+    }
+
+    struct huffman_table
+    {
+        unsigned char bits[17];        // bits[n] = number of codes of length n
+        vector<unsigned char> symbols; // symbols ordered by code length
+        uint16_t code[256];
+        unsigned char size[256];
+        int32_t max_code[18];
+        int32_t value_offset[17];
+
+        huffman_table()
+        {
+            fill(bits, bits + 17, 0);
+            fill(size, size + 256, 0);
+        }
+
+        // Length-limited code lengths from symbol frequencies (JPEG Annex K.2 / K.3)
+        void Build(const uint32_t* frequencies)
+        {
+            uint32_t freq[257];
+            int code_size[257], others[257];
+            copy(frequencies, frequencies + 256, freq);
+            freq[256] = 1; // reserved, keeps any real code from being all ones
+            fill(code_size, code_size + 257, 0);
+            fill(others, others + 257, -1);
+
+            while (true)
+            {
+                int v1 = -1, v2 = -1;
+                for (int i = 0; i < 257; i++)
+                    if (freq[i] > 0 && (v1 < 0 || freq[i] <= freq[v1]))
+                        v1 = i;
+                for (int i = 0; i < 257; i++)
+                    if (freq[i] > 0 && i != v1 && (v2 < 0 || freq[i] <= freq[v2]))
+                        v2 = i;
+                if (v2 < 0)
+                    break;
+
+                freq[v1] += freq[v2];
+                freq[v2] = 0;
+                code_size[v1]++;
+                while (others[v1] >= 0)
+                {
+                    v1 = others[v1];
+                    code_size[v1]++;
+                }
+                others[v1] = v2;
+                code_size[v2]++;
+                while (others[v2] >= 0)
+                {
+                    v2 = others[v2];
+                    code_size[v2]++;
+                }
+            }
+
+            int counts[258] = {0};
+            for (int i = 0; i < 257; i++)
+                if (code_size[i] > 0)
+                    counts[code_size[i]]++;
+            for (int i = 257; i > 16; i--)
+            {
+                while (counts[i] > 0)
+                {
+                    int j = i - 2;
+                    while (counts[j] == 0)
+                        j--;
+                    counts[i] -= 2;
+                    counts[i - 1]++;
+                    counts[j + 1] += 2;
+                    counts[j]--;
+                }
+            }
+            int longest = 16;
+            while (counts[longest] == 0)
+                longest--;
+            counts[longest]--; // drop the reserved symbol
+
+            fill(bits, bits + 17, 0);
+            for (int i = 1; i <= 16; i++)
+                bits[i] = static_cast<unsigned char>(counts[i]);
+            symbols.clear();
+            for (int length = 1; length <= 257; length++)
+                for (int i = 0; i < 256; i++)
+                    if (code_size[i] == length)
+                        symbols.push_back(static_cast<unsigned char>(i));
+            Finish();
+        }
+
+        // Canonical codes for encoding and the per-length limits for decoding
+        void Finish()
+        {
+            fill(size, size + 256, 0);
+            int k = 0;
+            int32_t next_code = 0;
+            for (int length = 1; length <= 16; length++)
+            {
+                value_offset[length] = k - next_code;
+                for (int i = 0; i < bits[length]; i++, k++)
+                {
+                    if (k >= static_cast<int>(symbols.size()))
+                        throw runtime_error("Error: invalid Huffman table");
+                    code[symbols[k]] = static_cast<uint16_t>(next_code++);
+                    size[symbols[k]] = static_cast<unsigned char>(length);
+                }
+                max_code[length] = bits[length] > 0 ? next_code - 1 : -1;
+                next_code <<= 1;
+            }
+            max_code[17] = INT32_MAX;
+        }
+    };
+
+    class bit_writer
+    {
+    public:
+        bit_writer(vector<unsigned char>& out) : out(out), buffer(0), count(0) {}
+
+        void Write(const uint32_t bits, const int length)
+        {
+            for (int i = length - 1; i >= 0; i--)
+            {
+                buffer = (buffer << 1) | ((bits >> i) & 1);
+                if (++count == 8)
+                    Emit();
+            }
+        }
+
+        // Pads the last byte with ones, as JPEG does before a marker
+        void Flush()
+        {
+            while (count != 0)
+                Write(1, 1);
+        }
+
+    private:
+        void Emit()
+        {
+            out.push_back(static_cast<unsigned char>(buffer));
+            if (buffer == 0xFF)
+                out.push_back(0x00);
+            buffer = 0;
+            count = 0;
+        }
+
+        vector<unsigned char>& out;
+        uint32_t buffer;
+        int count;
+    };
+
+    class bit_reader
+    {
+    public:
+        bit_reader(const unsigned char* begin, const unsigned char* end) : current(begin), end(end), buffer(0), count(0) {}
+
+        int Read()
+        {
+            if (count == 0)
+            {
+                buffer = 0xFF;
+                if (current < end && !(current[0] == 0xFF && current + 1 < end && current[1] != 0x00))
+                {
+                    buffer = *current++;
+                    if (buffer == 0xFF)
+                        current++;
+                }
+                count = 8;
+            }
+            return (buffer >> --count) & 1;
+        }
+
+        int Read(const int length)
+        {
+            int value = 0;
+            for (int i = 0; i < length; i++)
+                value = (value << 1) | Read();
+            return value;
+        }
+
+        int Decode(const huffman_table& table)
+        {
+            int32_t code = Read();
+            int length = 1;
+            while (code > table.max_code[length])
+            {
+                code = (code << 1) | Read();
+                if (++length > 16)
+                    throw runtime_error("Error: corrupt DCT data");
+            }
+            return table.symbols[table.value_offset[length] + code];
+        }
+
+    private:
+        const unsigned char* current;
+        const unsigned char* end;
+        uint32_t buffer;
+        int count;
+    };
+
+    inline uint32_t extra_bits(const int value, const int length)
+    {
+        return static_cast<uint32_t>(value >= 0 ? value : value + (1 << length) - 1);
+    }
+
+    inline int extend_bits(const int bits, const int length)
+    {
+        return length == 0 ? 0 : (bits < (1 << (length - 1)) ? bits - (1 << length) + 1 : bits);
+    }
+
+    // Level shift, transform and quantize one channel of an 8x8 block, the result is in zig-zag order
+    inline void quantize_block(float* samples, const unsigned char* quantization, int16_t* coefficients)
+    {
+        forward_dct_8x8(samples);
+        for (int i = 0; i < 64; i++)
+        {
+            const int index = zigzag_order[i];
+            coefficients[i] = static_cast<int16_t>(floor(samples[index] / quantization[index] + 0.5f));
+        }
+    }
+
+    inline void count_block(const int16_t* coefficients, int& dc_prediction, uint32_t* dc_frequencies, uint32_t* ac_frequencies)
+    {
+        dc_frequencies[bit_length(coefficients[0] - dc_prediction)]++;
+        dc_prediction = coefficients[0];
+        int run = 0;
+        for (int i = 1; i < 64; i++)
+        {
+            if (coefficients[i] == 0)
+            {
+                run++;
+                continue;
+            }
+            while (run > 15)
+            {
+                ac_frequencies[0xF0]++;
+                run -= 16;
+            }
+            ac_frequencies[(run << 4) | bit_length(coefficients[i])]++;
+            run = 0;
+        }
+        if (run > 0)
+            ac_frequencies[0x00]++;
+    }
+
+    inline void encode_block(const int16_t* coefficients, int& dc_prediction, const huffman_table& dc, const huffman_table& ac, bit_writer& writer)
+    {
+        const int difference = coefficients[0] - dc_prediction;
+        const int dc_length = bit_length(difference);
+        writer.Write(dc.code[dc_length], dc.size[dc_length]);
+        writer.Write(extra_bits(difference, dc_length), dc_length);
+        dc_prediction = coefficients[0];
+
+        int run = 0;
+        for (int i = 1; i < 64; i++)
+        {
+            if (coefficients[i] == 0)
+            {
+                run++;
+                continue;
+            }
+            while (run > 15)
+            {
+                writer.Write(ac.code[0xF0], ac.size[0xF0]);
+                run -= 16;
+            }
+            const int length = bit_length(coefficients[i]);
+            const int symbol = (run << 4) | length;
+            writer.Write(ac.code[symbol], ac.size[symbol]);
+            writer.Write(extra_bits(coefficients[i], length), length);
+            run = 0;
+        }
+        if (run > 0)
+            writer.Write(ac.code[0x00], ac.size[0x00]);
+    }
+
+    inline void decode_block(bit_reader& reader, int& dc_prediction, const huffman_table& dc, const huffman_table& ac, const unsigned char* quantization, float* samples)
+    {
+        fill(samples, samples + 64, 0.0f);
+        const int dc_length = reader.Decode(dc);
+        if (dc_length > 15)
+            throw runtime_error("Error: corrupt DCT data");
+        dc_prediction += extend_bits(reader.Read(dc_length), dc_length);
+        samples[0] = static_cast<float>(dc_prediction * quantization[0]);
+
+        for (int i = 1; i < 64; i++)
+        {
+            const int symbol = reader.Decode(ac);
+            const int run = symbol >> 4, length = symbol & 15;
+            if (length == 0)
+            {
+                if (run != 15)
+                    break;
+                i += 15;
+                continue;
+            }
+            i += run;
+            if (i > 63)
+                throw runtime_error("Error: corrupt DCT data");
+            const int index = zigzag_order[i];
+            samples[index] = static_cast<float>(extend_bits(reader.Read(length), length) * quantization[index]);
+        }
+        inverse_dct_8x8(samples);
+    }
+
+    // IJG quality scaling, 50 keeps the reference tables, 100 is nearly lossless
+    inline void scale_quantization(const unsigned char* base, const int quality, unsigned char* table)
+    {
+        const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+        for (int i = 0; i < 64; i++)
+            table[i] = static_cast<unsigned char>(min(255, max(1, (base[i] * scale + 50) / 100)));
+    }
+
+    struct dct_tables
+    {
+        unsigned char quantization[2][64]; // luma, chroma
+        huffman_table huffman[4];          // luma DC, luma AC, chroma DC, chroma AC
+
+        void Write(vector<unsigned char>& out) const
+        {
+            out.insert(out.end(), quantization[0], quantization[0] + 64);
+            out.insert(out.end(), quantization[1], quantization[1] + 64);
+            for (int i = 0; i < 4; i++)
+            {
+                out.insert(out.end(), huffman[i].bits + 1, huffman[i].bits + 17);
+                out.insert(out.end(), huffman[i].symbols.begin(), huffman[i].symbols.end());
+            }
+        }
+
+        const unsigned char* Read(const unsigned char* current, const unsigned char* end)
+        {
+            if (end - current < 128)
+                throw runtime_error("Error: corrupt DCT header");
+            memcpy(quantization, current, 128);
+            current += 128;
+            for (int t = 0; t < 2; t++)
+                for (int i = 0; i < 64; i++)
+                    if (quantization[t][i] == 0)
+                        throw runtime_error("Error: corrupt DCT header");
+
+            for (int i = 0; i < 4; i++)
+            {
+                if (end - current < 16)
+                    throw runtime_error("Error: corrupt DCT header");
+                int count = 0;
+                for (int length = 1; length <= 16; length++)
+                    count += huffman[i].bits[length] = *current++;
+                if (count == 0 || count > 256 || end - current < count)
+                    throw runtime_error("Error: corrupt DCT header");
+                huffman[i].symbols.assign(current, current + count);
+                current += count;
+                huffman[i].Finish();
+            }
+            return current;
+        }
+    };
+
+    // YCbCr transform and quantization of one row of 8x8 blocks, edge blocks replicate the last row / column
+    inline void quantize_block_row(const rgb_view<const unsigned char>& image, const int block_row, const dct_tables& tables, vector<int16_t>& coefficients)
+    {
+        const int height = image.height, width = image.width;
+        const int block_cols = (width + 7) / 8;
+        coefficients.resize(static_cast<size_t>(block_cols) * 3 * 64);
+        float block[3][64];
+        for (int by = 0; by < block_cols; by++)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                for (int j = 0; j < 8; j++)
+                {
+                    const ptrdiff_t offset = image.offset(min(block_row * 8 + i, height - 1), min(by * 8 + j, width - 1));
+                    const float r = image.r[offset], g = image.g[offset], b = image.b[offset];
+                    block[0][i * 8 + j] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+                    block[1][i * 8 + j] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    block[2][i * 8 + j] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+            for (int c = 0; c < 3; c++)
+                quantize_block(block[c], tables.quantization[c == 0 ? 0 : 1], &coefficients[(by * 3 + c) * 64]);
+        }
+    }
+
+    // Decodes one restart segment into rows [block_row * 8, block_row * 8 + 8) of the image, only
+    // rows inside [first_row, first_row + dst.height) are stored. Alpha is left to the caller.
+    // Largest image a .bdct header may declare, 16384 x 16384, so a short file cannot make the decoder allocate more
+    const uint64_t max_dct_pixels = uint64_t(1) << 28;
+
+    inline void decode_block_row(const unsigned char* begin, const unsigned char* end, const int block_row, const dct_tables& tables, const rgb_view<unsigned char>& dst, const int first_row, const int image_height)
+    {
+        const int width = dst.width, block_cols = (width + 7) / 8;
+        bit_reader reader(begin, end);
+        int dc_prediction[3] = {0, 0, 0};
+        float block[3][64];
+        for (int by = 0; by < block_cols; by++)
+        {
+            for (int c = 0; c < 3; c++)
+                decode_block(reader, dc_prediction[c], tables.huffman[c == 0 ? 0 : 2], tables.huffman[c == 0 ? 1 : 3], tables.quantization[c == 0 ? 0 : 1], block[c]);
+
+            for (int i = 0; i < 8; i++)
+            {
+                const int x = block_row * 8 + i;
+                if (x < first_row || x >= first_row + dst.height || x >= image_height)
+                    continue;
+                for (int j = 0; j < 8 && by * 8 + j < width; j++)
+                {
+                    const float luma = block[0][i * 8 + j] + 128, cb = block[1][i * 8 + j], cr = block[2][i * 8 + j];
+                    const ptrdiff_t offset = dst.offset(x - first_row, by * 8 + j);
+                    dst.r[offset] = round_sample(luma + 1.402f * cr);
+                    dst.g[offset] = round_sample(luma - 0.344136f * cb - 0.714136f * cr);
+                    dst.b[offset] = round_sample(luma + 1.772f * cb);
+                }
+            }
+        }
+    }
+
+}
+
+/* DCT container (.bdct), little-endian like the Bitmap headers:
+   dct_file_header
+   unsigned char quantization[2][64]   luma / chroma tables in natural order
+   4 Huffman tables                    luma DC, luma AC, chroma DC, chroma AC, each is 16 code-length counts followed by the symbols
+   uint32_t row_offsets[block_rows]    start of every block-row segment, relative to data_offset
+   entropy data                        one segment per row of 8x8 blocks starting at data[0], Y Cb Cr per block (4:4:4).
+                                       DC prediction restarts in every segment and each one ends with the
+                                       restart marker 0xFF 0xD0 + (block_row % 8), so segments decode independently
+*/
+#pragma pack(push, 1)
+struct dct_file_header
+{
+    char signature[4]; // "BDCT"
+    uint16_t version;
+    uint16_t quality;
+    int32_t width;
+    int32_t height;
+    uint32_t data_offset;
+    uint32_t data_size;
+};
+#pragma pack(pop)
+
+// Overrides the thread count and / or pool for every operation started by this thread while it is alive.
+// thread_count 0 keeps the global setting, 1 runs serially; pool nullptr keeps the global pool.
+class bitmap_thread_scope
+{
+public:
+    explicit bitmap_thread_scope(const int thread_count, shared_ptr<bitmap_thread_pool> pool = nullptr);
+    ~bitmap_thread_scope();
+    bitmap_thread_scope(const bitmap_thread_scope&) = delete;
+    bitmap_thread_scope& operator=(const bitmap_thread_scope&) = delete;
+
+private:
+    bitmap_detail::thread_settings settings;
+    const bitmap_detail::thread_settings* previous;
+};
+
+bitmap_thread_scope::bitmap_thread_scope(const int thread_count, shared_ptr<bitmap_thread_pool> pool)
+{
+    if (thread_count < 0)
+        throw invalid_argument("Error: thread count must not be negative");
+
+    // Unset fields fall back to the enclosing scope first
+    previous = bitmap_detail::scoped_thread_settings();
+    settings.pool = pool ? pool : (previous != nullptr ? previous->pool : nullptr);
+    settings.thread_count = thread_count > 0 ? thread_count : (previous != nullptr ? previous->thread_count : 0);
+    bitmap_detail::scoped_thread_settings() = &settings;
+}
+
+bitmap_thread_scope::~bitmap_thread_scope()
+{
+    bitmap_detail::scoped_thread_settings() = previous;
+}
+
+// Messages of the file functions ("input.bmp is a 24-bit Bitmap file", "output.bmp is saved").
+// Nothing is written until a logger is set, it may be called from several threads at once.
+typedef function<void(const string& message)> bitmap_logger;
+
+// One finished operation: size of its result (or source), pixel bytes read plus written and the elapsed time
+struct bitmap_trace_span
+{
+    const char* operation;
+    int width;
+    int height;
+    uint64_t bytes;
+    uint64_t nanoseconds;
+};
+// Spans are only recorded when BITMAP_TRACE is defined before this header, otherwise they are not compiled
+// in at all. The tracer runs on the thread that finished the operation and must not throw.
+typedef function<void(const bitmap_trace_span& span)> bitmap_tracer;
+
+namespace bitmap_detail
+{
+    struct hook_settings
+    {
+        hook_settings() : has_logger(false), has_tracer(false) {}
+        mutex lock;
+        shared_ptr<const bitmap_logger> logger;
+        shared_ptr<const bitmap_tracer> tracer;
+        // Checked without the lock so the silent default costs one load
+        atomic<bool> has_logger;
+        atomic<bool> has_tracer;
+    };
+
+    inline hook_settings& global_hooks()
+    {
+        static hook_settings hooks;
+        return hooks;
+    }
+
+    inline bool logging_enabled()
+    {
+        return global_hooks().has_logger.load(memory_order_relaxed);
+    }
+
+    void log_message(const string& message)
+    {
+        shared_ptr<const bitmap_logger> logger;
+        {
+            lock_guard<mutex> guard(global_hooks().lock);
+            logger = global_hooks().logger;
+        }
+        if (logger)
+            (*logger)(message);
+    }
+
+    inline string file_name_of(const string& file_path)
+    {
+        return file_path.substr(file_path.find_last_of("/\\") + 1);
+    }
+
+    void log_saved(const string& file_path)
+    {
+        if (logging_enabled())
+            log_message(file_name_of(file_path) + " is saved");
+    }
+
+    #ifdef BITMAP_TRACE
+    // Reports the enclosing operation to the tracer when it goes out of scope. `source` is read and
+    // `result` written by the operation, either may be null; both are looked at again at the end.
+    class trace_scope
+    {
+    public:
+        trace_scope(const char* operation, const bmp_info_header* source, const bmp_info_header* result)
+            : operation(operation), result(result), source(source), source_bytes(0),
+              active(global_hooks().has_tracer.load(memory_order_relaxed))
+        {
+            if (!active)
+                return;
+            // An in-place operation may resize its image, so the source is measured up front
+            if (source != nullptr)
+                source_bytes = PixelBytes(*source);
+            start = chrono::steady_clock::now();
+        }
+
+        ~trace_scope()
+        {
+            if (!active)
+                return;
+            const uint64_t elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            shared_ptr<const bitmap_tracer> tracer;
+            {
+                lock_guard<mutex> guard(global_hooks().lock);
+                tracer = global_hooks().tracer;
+            }
+            if (!tracer)
+                return;
+            const bmp_info_header& shape = result != nullptr ? *result : *source;
+            bitmap_trace_span span = {operation, shape.width, abs(shape.height), source_bytes + (result != nullptr ? PixelBytes(*result) : 0), elapsed};
+            (*tracer)(span);
+        }
+
+        trace_scope(const trace_scope&) = delete;
+        trace_scope& operator=(const trace_scope&) = delete;
+
+    private:
+        static uint64_t PixelBytes(const bmp_info_header& info_header)
+        {
+            return static_cast<uint64_t>(max(info_header.width, 0)) * static_cast<uint64_t>(abs(info_header.height)) * sizeof(pixel);
+        }
+
+        const char* operation;
+        const bmp_info_header* result;
+        const bmp_info_header* source;
+        uint64_t source_bytes;
+        bool active;
+        chrono::steady_clock::time_point start;
+    };
+    #define BITMAP_TRACE_SPAN(operation, source, result) bitmap_detail::trace_scope bitmap_trace_scope_(operation, source, result)
+    #else
+    #define BITMAP_TRACE_SPAN(operation, source, result)
+    #endif
+}
+
+namespace bitmap_detail
+{
+    // Writes the chunks in order with a single writev (or one write per chunk on Windows) instead of one
+    // call per row. With atomic_replace the data goes to "<file_path>.tmp" first and is renamed over
+    // file_path, so other readers see either the previous file or the complete new one.
+    void write_file(const string& file_path, const vector<pair<const void*, size_t>>& chunks, const bool atomic_replace)
+    {
+        const string target = atomic_replace ? file_path + ".tmp" : file_path;
+        #ifdef _WIN32
+        {
+            ofstream file(target, ios::binary);
+            if (!file.is_open())
+                throw runtime_error("Error: Cannot create file");
+            for (auto& chunk : chunks)
+                file.write(static_cast<const char*>(chunk.first), chunk.second);
+            file.close();
+            if (!file.good())
+            {
+                remove(target.c_str());
+                throw runtime_error("Error: file write error");
+            }
+        }
+        if (atomic_replace && !MoveFileExA(target.c_str(), file_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+        {
+            remove(target.c_str());
+            throw runtime_error("Error: cannot replace " + file_path);
+        }
+        #else
+        const int descriptor = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (descriptor < 0)
+            throw runtime_error("Error: Cannot create file");
+
+        vector<iovec> pending;
+        for (auto& chunk : chunks)
+        {
+            if (chunk.second == 0)
+                continue;
+            iovec entry;
+            entry.iov_base = const_cast<void*>(chunk.first);
+            entry.iov_len = chunk.second;
+            pending.push_back(entry);
+        }
+        bool written_all = true;
+        size_t next = 0;
+        while (next < pending.size())
+        {
+            ssize_t written = ::writev(descriptor, &pending[next], static_cast<int>(min<size_t>(pending.size() - next, 64)));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                written_all = false;
+                break;
+            }
+            // A short write resumes inside the first unfinished chunk
+            while (next < pending.size() && static_cast<size_t>(written) >= pending[next].iov_len)
+                written -= pending[next++].iov_len;
+            if (next < pending.size())
+            {
+                pending[next].iov_base = static_cast<char*>(pending[next].iov_base) + written;
+                pending[next].iov_len -= written;
+            }
+        }
+        if (::close(descriptor) != 0)
+            written_all = false;
+        if (!written_all)
+        {
+            ::unlink(target.c_str());
+            throw runtime_error("Error: file write error");
+        }
+        if (atomic_replace && ::rename(target.c_str(), file_path.c_str()) != 0)
+        {
+            ::unlink(target.c_str());
+            throw runtime_error("Error: cannot replace " + file_path);
+        }
+        #endif
+    }
+
+    // Writes an encoded .bdct file, adding the extension when file_path has none
+    void write_dct_file(string file_path, const vector<unsigned char>& bytes, const bool atomic_replace)
+    {
+        if (file_path.find(".bdct") == string::npos)
+            file_path += ".bdct";
+        write_file(file_path, {{bytes.data(), bytes.size()}}, atomic_replace);
+        log_saved(file_path);
+    }
+}
+
+enum class bmp_map_mode
+{
+    read_only,
+    copy_on_write
+};
+
+enum class equalization_mode
+{
+    exact,
+    clahe
+};
+
+enum class dct_precision
+{
+    floating_point,
+    fixed_point
+};
+
+// Interpolation kernel of Resample
+enum class resample_filter
+{
+    bilinear,
+    bicubic,
+    lanczos
+};
+
+// Compression field of the Bitmap info header
+enum class bmp_compression : uint32_t
+{
+    rgb = 0,
+    rle8 = 1,
+    rle4 = 2,
+    bitfields = 3
+};
+
+namespace bitmap_detail
+{
+    // Weights of one resampling pass. Output coordinate i reads `taps` consecutive source samples from
+    // first[i], weights[i * taps + k] are fixed point with resample_bits fraction bits and sum to one.
+    const int resample_bits = 14;
+    struct resample_table
+    {
+        int taps;
+        vector<int> first;
+        vector<int16_t> weights;
+    };
+
+    inline double resample_support(const resample_filter filter)
+    {
+        return filter == resample_filter::bilinear ? 1.0 : filter == resample_filter::bicubic ? 2.0 : 3.0;
+    }
+
+    inline double resample_kernel(const resample_filter filter, double x)
+    {
+        x = fabs(x);
+        if (filter == resample_filter::bilinear)
+            return x < 1.0 ? 1.0 - x : 0.0;
+        if (filter == resample_filter::bicubic)
+        {
+            // Keys' cubic convolution with a = -0.5
+            if (x < 1.0)
+                return (1.5 * x - 2.5) * x * x + 1.0;
+            return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+        }
+        if (x < 1e-8)
+            return 1.0;
+        if (x >= 3.0)
+            return 0.0;
+        const double pi_x = acos(-1.0) * x;
+        return 3.0 * sin(pi_x) * sin(pi_x / 3.0) / (pi_x * pi_x);
+    }
+
+    resample_table make_resample_table(const int source_size, const int target_size, const resample_filter filter)
+    {
+        // Shrinking stretches the kernel by the scale factor, so every source sample is weighted in
+        const double scale = static_cast<double>(source_size) / target_size;
+        const double kernel_scale = max(scale, 1.0);
+        const double support = resample_support(filter) * kernel_scale;
+        resample_table table;
+        table.taps = min(static_cast<int>(ceil(2.0 * support)) + 1, source_size);
+        table.first.resize(target_size);
+        table.weights.assign(static_cast<size_t>(target_size) * table.taps, 0);
+        vector<double> weights(table.taps);
+        for (int i = 0; i < target_size; i++)
+        {
+            const double center = (i + 0.5) * scale;
+            const int begin = max(static_cast<int>(floor(center - support + 0.5)), 0);
+            const int end = min(min(static_cast<int>(floor(center + support + 0.5)), source_size), begin + table.taps);
+            double sum = 0.0;
+            for (int j = begin; j < end; j++)
+            {
+                weights[j - begin] = resample_kernel(filter, (j + 0.5 - center) / kernel_scale);
+                sum += weights[j - begin];
+            }
+
+            // Windows are moved inside the image so every output reads exactly `taps` samples
+            const int first = min(begin, source_size - table.taps);
+            int16_t* out = &table.weights[static_cast<size_t>(i) * table.taps];
+            int total = 0, largest = begin - first;
+            for (int j = begin; j < end; j++)
+            {
+                const double weight = sum != 0.0 ? weights[j - begin] / sum : (j == begin ? 1.0 : 0.0);
+                out[j - first] = static_cast<int16_t>(floor(weight * (1 << resample_bits) + 0.5));
+                total += out[j - first];
+                if (out[j - first] > out[largest])
+                    largest = j - first;
+            }
+            // The rounding error goes to the largest weight, so flat areas stay exactly flat
+            out[largest] = static_cast<int16_t>(out[largest] + (1 << resample_bits) - total);
+            table.first[i] = first;
+        }
+        return table;
+    }
+
+    #ifdef BITMAP_X86
+    namespace sse2
+    {
+        #define BITMAP_SSE2 BITMAP_TARGET("sse2")
+        // Two taps per _mm_madd_epi16: the samples of neighbouring taps are interleaved into 16-bit pairs and
+        // multiplied by the weight pair (first, second). A missing second tap is a zero sample.
+        BITMAP_SSE2 inline __m128i weight_pair(const int16_t first, const int16_t second)
+        {
+            return _mm_set1_epi32(static_cast<int>((static_cast<uint32_t>(static_cast<uint16_t>(second)) << 16) | static_cast<uint16_t>(first)));
+        }
+
+        BITMAP_SSE2 inline __m128i load_pixel(const unsigned char* p)
+        {
+            int32_t value;
+            memcpy(&value, p, sizeof(value));
+            return _mm_cvtsi32_si128(value);
+        }
+
+        BITMAP_SSE2 inline void resample_columns(const unsigned char* in, unsigned char* out, const int width, const resample_table& columns)
+        {
+            const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi32(1 << (resample_bits - 1));
+            const int taps = columns.taps;
+            for (int y = 0; y < width; y++)
+            {
+                const unsigned char* samples = in + columns.first[y] * 4;
+                const int16_t* weights = &columns.weights[static_cast<size_t>(y) * taps];
+                __m128i sum = half;
+                int k = 0;
+                for (; k + 2 <= taps; k += 2)
+                {
+                    const __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(load_pixel(samples + k * 4), load_pixel(samples + k * 4 + 4)), zero);
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, weight_pair(weights[k], weights[k + 1])));
+                }
+                if (k < taps)
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(_mm_unpacklo_epi8(load_pixel(samples + k * 4), zero), zero), weight_pair(weights[k], 0)));
+                sum = _mm_srai_epi32(sum, resample_bits);
+                sum = _mm_packus_epi16(_mm_packs_epi32(sum, sum), zero);
+                const int32_t value = _mm_cvtsi128_si32(sum);
+                memcpy(out + y * 4, &value, sizeof(value));
+            }
+        }
+
+        // 16 samples of one output row at a time, returns how many samples were written
+        BITMAP_SSE2 inline int resample_rows(const unsigned char* const* in, const int16_t* weights, const int taps, unsigned char* out, const int samples)
+        {
+            const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi32(1 << (resample_bits - 1));
+            int i = 0;
+            for (; i + 16 <= samples; i += 16)
+            {
+                __m128i sum0 = half, sum1 = half, sum2 = half, sum3 = half;
+                for (int k = 0; k < taps; k += 2)
+                {
+                    const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[k] + i));
+                    const __m128i second = k + 1 < taps ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[k + 1] + i)) : zero;
+                    const __m128i weight = weight_pair(weights[k], k + 1 < taps ? weights[k + 1] : 0);
+                    const __m128i low = _mm_unpacklo_epi8(first, second), high = _mm_unpackhi_epi8(first, second);
+                    sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), weight));
+                    sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), weight));
+                    sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), weight));
+                    sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), weight));
+                }
+                const __m128i low = _mm_packs_epi32(_mm_srai_epi32(sum0, resample_bits), _mm_srai_epi32(sum1, resample_bits));
+                const __m128i high = _mm_packs_epi32(_mm_srai_epi32(sum2, resample_bits), _mm_srai_epi32(sum3, resample_bits));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(low, high));
+            }
+            return i;
+        }
+        #undef BITMAP_SSE2
+    }
+    #endif
+
+    // Horizontal pass of rows [first_row, last_row), every channel including alpha
+    void ResampleColumns(const pixel_buffer& src, pixel_buffer& dst, const resample_table& columns, const int first_row, const int last_row)
+    {
+        const int taps = columns.taps;
+        #ifdef BITMAP_X86
+        const bool use_sse2 = active_simd_level().load() >= static_cast<int>(simd_level::sse2);
+        #endif
+        for (int x = first_row; x < last_row; x++)
+        {
+            const unsigned char* in = reinterpret_cast<const unsigned char*>(src.row(x));
+            unsigned char* out = reinterpret_cast<unsigned char*>(dst.row(x));
+            #ifdef BITMAP_X86
+            if (use_sse2)
+            {
+                sse2::resample_columns(in, out, dst.width(), columns);
+                continue;
+            }
+            #endif
+            for (int y = 0; y < dst.width(); y++)
+            {
+                const unsigned char* samples = in + columns.first[y] * 4;
+                const int16_t* weights = &columns.weights[static_cast<size_t>(y) * taps];
+                int32_t sum[4] = {1 << (resample_bits - 1), 1 << (resample_bits - 1), 1 << (resample_bits - 1), 1 << (resample_bits - 1)};
+                for (int k = 0; k < taps; k++)
+                    for (int c = 0; c < 4; c++)
+                        sum[c] += weights[k] * samples[k * 4 + c];
+                for (int c = 0; c < 4; c++)
+                    out[y * 4 + c] = round_sample(sum[c] >> resample_bits);
+            }
+        }
+    }
+
+    // Vertical pass of output rows [first_row, last_row). Every output sample is a weighted sum of the
+    // same column in `taps` consecutive source rows, so the samples of a row are independent.
+    void ResampleRows(const pixel_buffer& src, pixel_buffer& dst, const resample_table& rows, const int first_row, const int last_row)
+    {
+        const int samples = dst.width() * 4;
+        vector<const unsigned char*> in(rows.taps);
+        #ifdef BITMAP_X86
+        const bool use_sse2 = active_simd_level().load() >= static_cast<int>(simd_level::sse2);
+        #endif
+        for (int x = first_row; x < last_row; x++)
+        {
+            const int16_t* weights = &rows.weights[static_cast<size_t>(x) * rows.taps];
+            for (int k = 0; k < rows.taps; k++)
+                in[k] = reinterpret_cast<const unsigned char*>(src.row(rows.first[x] + k));
+            unsigned char* out = reinterpret_cast<unsigned char*>(dst.row(x));
+            int i = 0;
+            #ifdef BITMAP_X86
+            if (use_sse2)
+                i = sse2::resample_rows(in.data(), weights, rows.taps, out, samples);
+            #endif
+            for (; i < samples; i++)
+            {
+                int32_t sum = 1 << (resample_bits - 1);
+                for (int k = 0; k < rows.taps; k++)
+                    sum += weights[k] * in[k][i];
+                out[i] = round_sample(sum >> resample_bits);
+            }
+        }
+    }
+
+    // One channel of a 16 / 32-bit bit-field pixel, `table` widens the masked value to 8 bits
+    struct bmp_channel
+    {
+        uint32_t mask;
+        int shift;
+        unsigned char table[256];
+
+        void Set(const uint32_t channel_mask, const unsigned char missing)
+        {
+            mask = channel_mask;
+            shift = 0;
+            if (mask == 0)
+            {
+                table[0] = missing;
+                return;
+            }
+            while (((mask >> shift) & 1) == 0)
+                shift++;
+            int bits = 0;
+            while (shift + bits < 32 && ((mask >> (shift + bits)) & 1))
+                bits++;
+            if (shift + bits < 32 && (mask >> (shift + bits)) != 0)
+                throw runtime_error("Error: invalid bit mask");
+
+            // Channels wider than 8 bits keep their top 8 bits
+            const int kept = min(bits, 8);
+            shift += bits - kept;
+            mask = ((1u << kept) - 1) << shift;
+            const int max_value = (1 << kept) - 1;
+            for (int value = 0; value <= max_value; value++)
+                table[value] = static_cast<unsigned char>((value * 255 + max_value / 2) / max_value);
+        }
+
+        unsigned char operator()(const uint32_t word) const { return table[(word & mask) >> shift]; }
+    };
+
+    // Pixel layout of a Bitmap file, filled in from its headers by Bitmap_cpp::ReadBmpFormat
+    struct bmp_format
+    {
+        int width;
+        int height;
+        int bit_count;
+        bmp_compression compression;
+        bool top_down;
+        bool raw;                // 32-bit rows that already have the pixel layout
+        pixel palette[256];
+        bmp_channel channels[4]; // b, g, r, a
+
+        size_t RowBytes() const { return (static_cast<size_t>(width) * bit_count + 31) / 32 * 4; }
+    };
+
+    // One uncompressed file row to pixels, palettized depths go through the palette and 16 / 32-bit
+    // bit fields through the channel tables
+    inline void decode_bmp_row(const bmp_format& format, const unsigned char* src, pixel* dst)
+    {
+        const int width = format.width;
+        switch (format.bit_count)
+        {
+            case 1:
+            {
+                for (int y = 0; y < width; y++)
+                    dst[y] = format.palette[(src[y >> 3] >> (7 - (y & 7))) & 1];
+                break;
+            }
+            case 4:
+            {
+                for (int y = 0; y < width; y++)
+                    dst[y] = format.palette[(src[y >> 1] >> (y & 1 ? 0 : 4)) & 15];
+                break;
+            }
+            case 8:
+            {
+                for (int y = 0; y < width; y++)
+                    dst[y] = format.palette[src[y]];
+                break;
+            }
+            case 16:
+            {
+                for (int y = 0; y < width; y++)
+                {
+                    const uint32_t word = src[y * 2] | src[y * 2 + 1] << 8;
+                    dst[y].b = format.channels[0](word);
+                    dst[y].g = format.channels[1](word);
+                    dst[y].r = format.channels[2](word);
+                    dst[y].a = format.channels[3](word);
+                }
+                break;
+            }
+            case 24:
+            {
+                for (int y = 0; y < width; y++)
+                {
+                    dst[y].b = src[y * 3];
+                    dst[y].g = src[y * 3 + 1];
+                    dst[y].r = src[y * 3 + 2];
+                    dst[y].a = 255;
+                }
+                break;
+            }
+            case 32:
+            {
+                if (format.raw)
+                {
+                    memcpy(dst, src, static_cast<size_t>(width) * 4);
+                    break;
+                }
+                for (int y = 0; y < width; y++)
+                {
+                    uint32_t word;
+                    memcpy(&word, src + y * 4, 4);
+                    dst[y].b = format.channels[0](word);
+                    dst[y].g = format.channels[1](word);
+                    dst[y].r = format.channels[2](word);
+                    dst[y].a = format.channels[3](word);
+                }
+                break;
+            }
+        }
+    }
+
+    // Expands an RLE8 / RLE4 stream, rows come bottom-up like pixel_buffer rows. Pixels the stream
+    // skips with a delta or an early end of line keep palette entry 0.
+    inline void decode_bmp_rle(const bmp_format& format, const unsigned char* current, const unsigned char* end, pixel_buffer& dst)
+    {
+        const bool rle4 = format.compression == bmp_compression::rle4;
+        const int height = format.height, width = format.width;
+        for (int x = 0; x < height; x++)
+            fill(dst.row(x), dst.row(x) + width, format.palette[0]);
+
+        int x = 0, y = 0;
+        while (end - current >= 2 && x < height)
+        {
+            const int count = current[0], value = current[1];
+            current += 2;
+            if (count > 0)
+            {
+                // Encoded run, RLE4 alternates the two indices of the value byte
+                pixel* row = dst.row(x);
+                for (int i = 0; i < count && y < width; i++, y++)
+                    row[y] = format.palette[rle4 ? (i & 1 ? value & 15 : value >> 4) : value];
+            }
+            else if (value == 0)
+            {
+                x++;
+                y = 0;
+            }
+            else if (value == 1)
+            {
+                break;
+            }
+            else if (value == 2)
+            {
+                if (end - current < 2)
+                    break;
+                y += current[0];
+                x += current[1];
+                current += 2;
+            }
+            else
+            {
+                // Absolute run of `value` indices, padded to a 16-bit boundary
+                const int bytes = rle4 ? (value + 1) / 2 : value;
+                if (end - current < bytes)
+                    throw runtime_error("Error: corrupt RLE data");
+                pixel* row = dst.row(x);
+                for (int i = 0; i < value && y < width; i++, y++)
+                    row[y] = format.palette[rle4 ? (i & 1 ? current[i >> 1] & 15 : current[i >> 1] >> 4) : current[i]];
+                current += min<ptrdiff_t>((bytes + 1) & ~1, end - current);
+            }
+        }
+    }
+
+    // RLE8 / RLE4 of one row of palette indices. Repeats of two or more become runs, longer stretches
+    // without repeats go out in absolute mode and shorter ones as runs of one.
+    inline void encode_bmp_rle(const unsigned char* indices, const int width, const bool rle4, vector<unsigned char>& out)
+    {
+        int y = 0;
+        while (y < width)
+        {
+            int run = 1;
+            while (y + run < width && run < 255 && indices[y + run] == indices[y])
+                run++;
+            if (run >= 2)
+            {
+                out.push_back(static_cast<unsigned char>(run));
+                out.push_back(static_cast<unsigned char>(rle4 ? indices[y] << 4 | indices[y] : indices[y]));
+                y += run;
+                continue;
+            }
+
+            int literal = 1;
+            while (y + literal < width && literal < 255 && !(y + literal + 1 < width && indices[y + literal] == indices[y + literal + 1]))
+                literal++;
+            if (literal < 3)
+            {
+                for (int i = 0; i < literal; i++)
+                {
+                    out.push_back(1);
+                    out.push_back(static_cast<unsigned char>(rle4 ? indices[y + i] << 4 : indices[y + i]));
+                }
+            }
+            else
+            {
+                out.push_back(0);
+                out.push_back(static_cast<unsigned char>(literal));
+                const size_t start = out.size();
+                if (rle4)
+                {
+                    for (int i = 0; i < literal; i += 2)
+                        out.push_back(static_cast<unsigned char>(indices[y + i] << 4 | (i + 1 < literal ? indices[y + i + 1] : 0)));
+                }
+                else
+                {
+                    out.insert(out.end(), indices + y, indices + y + literal);
+                }
+                if ((out.size() - start) & 1)
+                    out.push_back(0);
+            }
+            y += literal;
+        }
+    }
+
+    // Packs one row of palette indices into 1, 4 or 8-bit file samples, `dst` must be zeroed
+    inline void pack_bmp_indices(const unsigned char* indices, const int width, const int bit_count, unsigned char* dst)
+    {
+        switch (bit_count)
+        {
+            case 1:
+            {
+                for (int y = 0; y < width; y++)
+                    dst[y >> 3] |= static_cast<unsigned char>(indices[y] << (7 - (y & 7)));
+                break;
+            }
+            case 4:
+            {
+                for (int y = 0; y < width; y++)
+                    dst[y >> 1] |= static_cast<unsigned char>(indices[y] << (y & 1 ? 0 : 4));
+                break;
+            }
+            default:
+            {
+                memcpy(dst, indices, width);
+                break;
+            }
+        }
+    }
+
+    // Palette of every color in the image (alpha is not stored) and the index of each pixel, rows in
+    // pixel_buffer order. Colors are sorted, so gray images get an ascending gray palette. Returns false
+    // as soon as there are more than max_colors colors.
+    inline bool index_colors(const pixel_buffer& image, const size_t max_colors, vector<pixel>& palette, vector<unsigned char>& indices)
+    {
+        const int height = image.height(), width = image.width();
+        unordered_map<uint32_t, int> colors;
+        for (int x = 0; x < height; x++)
+        {
+            const pixel* row = image.row(x);
+            uint32_t last = 0xFFFFFFFF;
+            for (int y = 0; y < width; y++)
+            {
+                const uint32_t key = row[y].b | row[y].g << 8 | row[y].r << 16;
+                if (key == last)
+                    continue;
+                last = key;
+                colors.insert(make_pair(key, 0));
+                if (colors.size() > max_colors)
+                    return false;
+            }
+        }
+
+        vector<uint32_t> keys;
+        keys.reserve(colors.size());
+        for (auto& color : colors)
+            keys.push_back(color.first);
+        sort(keys.begin(), keys.end());
+        palette.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            colors[keys[i]] = static_cast<int>(i);
+            palette[i].b = static_cast<unsigned char>(keys[i]);
+            palette[i].g = static_cast<unsigned char>(keys[i] >> 8);
+            palette[i].r = static_cast<unsigned char>(keys[i] >> 16);
+            palette[i].a = 0;
+        }
+
+        indices.resize(static_cast<size_t>(height) * width);
+        parallel_for(0, height, [&](int first_row, int last_row)
+        {
+            for (int x = first_row; x < last_row; x++)
+            {
+                const pixel* row = image.row(x);
+                unsigned char* out = &indices[static_cast<size_t>(x) * width];
+                uint32_t last = 0xFFFFFFFF;
+                unsigned char index = 0;
+                for (int y = 0; y < width; y++)
+                {
+                    const uint32_t key = row[y].b | row[y].g << 8 | row[y].r << 16;
+                    if (key != last)
+                    {
+                        last = key;
+                        index = static_cast<unsigned char>(colors.find(key)->second);
+                    }
+                    out[y] = index;
+                }
+            }
+        });
+        return true;
+    }
+}
+
+class Bitmap_pipeline;
+
+namespace bitmap_detail
+{
+    // Nodes of an image expression, see image_leaf
+    struct image_expr_base {};
+    struct image_leaf;
+
+    template <typename T>
+    struct is_image_expr : is_base_of<image_expr_base, T> {};
+}
+
+class Bitmap_cpp
+{
+public:
+    // Data
+    bmp_header header;
+    bmp_info_header info_header;
+    pixel_buffer data;
+
+    // Constructors, copies allocate from the same memory resource as the original
+    Bitmap_cpp();
+    ~Bitmap_cpp();
+    Bitmap_cpp(string file_path);
+    Bitmap_cpp(const Bitmap_cpp& other);
+    Bitmap_cpp(Bitmap_cpp&& other) = default;
+    Bitmap_cpp& operator=(const Bitmap_cpp& other);
+    Bitmap_cpp& operator=(Bitmap_cpp&& other) = default;
+    template <typename Node, typename = typename enable_if<bitmap_detail::is_image_expr<Node>::value>::type>
+    Bitmap_cpp(const Node& expression);
+    template <typename Node, typename = typename enable_if<bitmap_detail::is_image_expr<Node>::value>::type>
+    Bitmap_cpp& operator=(const Node& expression);
+    void LoadBmp(string file_path);
+    // The contents of a Bitmap file already in memory, e.g. a payload received over the network
+    void LoadBmpFromMemory(const uint8_t* bytes, const size_t size);
+    void MapBmp(string file_path, bmp_map_mode mode = bmp_map_mode::read_only);
+    // Headers are regenerated from the image, atomic_replace writes a temporary file and renames it over file_path
+    void SaveBmp(string file_path, const bool atomic_replace = false);
+    // Depth and compression SaveBmp writes, set from the file by LoadBmp. 1, 4 and 8 bits are palettized
+    // (rle4 / rle8 allowed) with the image's colors, 16 bits is 555 (rgb) or 565 (bitfields). A palette
+    // depth set here makes SaveBmp throw when the colors do not fit, one inherited from the loaded file
+    // gives way to 24 bits (32 when alpha is used).
+    void SetBmpFormat(const int bit_count, const bmp_compression compression = bmp_compression::rgb);
+    // The file SaveBmp would write. The second form writes into `buffer` only when the file fits in
+    // `capacity` and returns its size either way; 24 and 32-bit files are encoded without allocating.
+    vector<unsigned char> EncodeBmp();
+    size_t EncodeBmp(uint8_t* buffer, const size_t capacity);
+    // LoadBmp and SaveBmp on the I/O pool. SaveBmpAsync saves the image as it is now: a copy, or the
+    // image itself when called on an rvalue (`move(image).SaveBmpAsync(path)`).
+    static future<Bitmap_cpp> LoadBmpAsync(string file_path);
+    future<void> SaveBmpAsync(string file_path, const bool atomic_replace = false) const &;
+    future<void> SaveBmpAsync(string file_path, const bool atomic_replace = false) &&;
+
+    // A view of the width x height rectangle whose first pixel is data[start_x][start_y]. It shares this
+    // image's pixels: every operation that keeps its size (filters, point-wise operations, operators,
+    // `region = expression`) writes into this image, operations that change the size detach it. A region of
+    // a const image is copied on its first write. Valid until this image's buffer is reallocated.
+    Bitmap_cpp Region(const int width, const int height, const int start_x = 0, const int start_y = 0);
+    Bitmap_cpp Region(const int width, const int height, const int start_x = 0, const int start_y = 0) const;
+
+    // Basic functions
+    bool empty() const { return data.empty(); }
+    void CheckValid() const;
+    void Resize(int width, int height, int start_x = 0, int start_y = 0);
+    void toGray();
+    void InvertColor();
+    void AddImpluseNoise(const int salt_ratio = 5, const int pepper_ratio = 5);
+    void AddGaussianNoise(const int mean = 0, const int variance = 10);
+
+    // Image processing
+    void mix_with(const Bitmap_cpp& other, const float ratio = 0.5f);
+    void ZoomIn_ZeroOrder(const int scale = 2);
+    void ZoomIn_FirstOrder(const int scale = 2);
+    void ZoomIn_Compare(const int scale = 2);
+    void ZoomIn_Bilinear(const int scale = 2);
+    void ZoomOut(const int scale = 2);
+    // Any output size, the weight tables are built once and the two separable passes run in fixed point
+    void Resample(const int width, const int height, const resample_filter filter = resample_filter::bilinear);
+    void HistogramEqualization_Global();
+    void HistogramEqualization_Local(const int block_size = 7, const equalization_mode mode = equalization_mode::exact, const float clip_limit = 4.0f);
+
+    // Smoothing filters
+    void SpatialLowPassFilter(const int filter_size = 3);
+    void MedianFilter(const int filter_size = 3);
+    void AlphaTrimmedMeanFilter(const int filter_size = 3, const int removed_elements = 1);
+    void PercentileFilter(const int filter_size = 3, const float percentile = 50.0f);
+    void MinFilter(const int filter_size = 3);
+    void MaxFilter(const int filter_size = 3);
+
+    // Sharpening filters
+    void SpatialHighPassFilter(const int filter_size = 3);
+    void SpatialHighBoostFilter(const int filter_size = 3, const float boost_ratio = 1.5f);
+
+    // Edge detection
+    void PrewittOperator(bool Diagonal = false);
+    void SobelOperator(bool Diagonal = false);
+    void LaplacianOperator(bool Enhanced = false);
+
+    // Filters that write into dst (which may be this image) and leave this image as it is
+    void SpatialLowPassFilterInto(Bitmap_cpp& dst, const int filter_size = 3) const;
+    void MedianFilterInto(Bitmap_cpp& dst, const int filter_size = 3) const;
+    void AlphaTrimmedMeanFilterInto(Bitmap_cpp& dst, const int filter_size = 3, const int removed_elements = 1) const;
+    void PercentileFilterInto(Bitmap_cpp& dst, const int filter_size = 3, const float percentile = 50.0f) const;
+    void MinFilterInto(Bitmap_cpp& dst, const int filter_size = 3) const;
+    void MaxFilterInto(Bitmap_cpp& dst, const int filter_size = 3) const;
+    void SpatialHighPassFilterInto(Bitmap_cpp& dst, const int filter_size = 3) const;
+    void SpatialHighBoostFilterInto(Bitmap_cpp& dst, const int filter_size = 3, const float boost_ratio = 1.5f) const;
+    void PrewittOperatorInto(Bitmap_cpp& dst, bool Diagonal = false) const;
+    void SobelOperatorInto(Bitmap_cpp& dst, bool Diagonal = false) const;
+    void LaplacianOperatorInto(Bitmap_cpp& dst, bool Enhanced = false) const;
+
+    vector<int> DCT_Transform(const vector<pixel> data, const float u, const float v, const int N);
+    pixel IDCT_Transform(const vector<vector<int>> data, const float x, const float y, const int N);
+    void DCT_Compress(const dct_precision precision = dct_precision::floating_point);
+    vector<unsigned char> DCT_Encode(const int quality = 75) const;
+    void DCT_Decode(const vector<unsigned char>& bytes, const int first_row = 0, const int row_count = -1);
+    void SaveDCT(string file_path, const int quality = 75, const bool atomic_replace = false);
+    void LoadDCT(string file_path, const int first_row = 0, const int row_count = -1);
+
+    // Operators, the rvalue overloads reuse the buffer of the expiring image
+    Bitmap_cpp operator+(const Bitmap_cpp& other) const &;
+    Bitmap_cpp operator-(const Bitmap_cpp& other) const &;
+    Bitmap_cpp operator*(const int& scaler) const &;
+    Bitmap_cpp operator/(const int& scaler) const &;
+    Bitmap_cpp operator+(const Bitmap_cpp& other) &&;
+    Bitmap_cpp operator-(const Bitmap_cpp& other) &&;
+    Bitmap_cpp operator*(const int& scaler) &&;
+    Bitmap_cpp operator/(const int& scaler) &&;
+    Bitmap_cpp& operator+=(const Bitmap_cpp& other);
+    Bitmap_cpp& operator-=(const Bitmap_cpp& other);
+    Bitmap_cpp& operator*=(const int& scaler);
+    Bitmap_cpp& operator/=(const int& scaler);
+
+    // Fused expressions, `Bitmap_cpp r = (a.Expr() + b - c) * 2;` evaluates in one pass
+    bitmap_detail::image_leaf Expr() const;
+
+    // Bitwise operators
+    void and_with(const Bitmap_cpp& other);
+    void or_with(const Bitmap_cpp& other);
+    void xor_with(const Bitmap_cpp& other);
+
+    // Threading, 0 threads uses the whole pool and a null pool the library-owned one
+    static void SetThreadCount(const int thread_count);
+    static void SetThreadPool(shared_ptr<bitmap_thread_pool> pool);
+    // Pool of the asynchronous file functions, nullptr creates a library-owned one with 2 threads
+    static void SetIoPool(shared_ptr<bitmap_io_pool> pool);
+
+    // Logging and tracing, an empty function turns them off (the default)
+    static void SetLogger(bitmap_logger logger);
+    static void SetTracer(bitmap_tracer tracer);
+
+    // Instruction set of the point-wise operations, capped at what the CPU supports
+    static simd_level GetSimdLevel();
+    static void SetSimdLevel(const simd_level level);
+
+    // Deferred execution, the returned pipeline reads this image when its result is requested
+    Bitmap_pipeline Lazy() const;
+
+    // Memory of the pixel buffers, nullptr is the aligned heap. The counters belong to this image and
+    // start over when the resource changes; ReleaseScratch frees the buffers the filters write into.
+    void SetMemoryResource(bitmap_memory_resource* resource);
+    bitmap_memory_resource* GetMemoryResource() const;
+    bitmap_memory_stats MemoryStats() const;
+    void ReleaseScratch();
+
+    #ifdef __cplusplus_cli
+    Bitmap_cpp(System::String^ file_path);
+    void LoadBmp(System::String^ file_path);
+    operator System::Drawing::Bitmap^();
+    System::Drawing::Bitmap^ toBitmap();
+    #endif
+
+private:
+    friend class Bitmap_stream;
+    friend class Bitmap_pipeline;
+    friend class Bitmap_planar;
+    friend class Bitmap_gray;
+    static shared_ptr<void> MapFile(const string& file_path, bool copy_on_write, size_t& file_size);
+    // Bodies of the public functions without their trace span, for callers that already opened one
+    void ReadBmp(const string& file_path);
+    vector<unsigned char> EncodeFile();
+    void PercentileInto(Bitmap_cpp& dst, const int filter_size, const float percentile) const;
+    template <typename Node>
+    void EvaluateExpr(const Node& expression);
+    // Point-wise operators with the kernel picked by the caller, `kernel` comes from bitmap_detail::pointwise()
+    void CombineWith(const Bitmap_cpp& other, void (*kernel)(pixel* dst, const pixel* src, int count));
+    void ScaleBy(const int scaler, void (*kernel)(pixel* dst, int count, int scaler));
+    void DecodeBmp(const unsigned char* bytes, const size_t size, bitmap_detail::bmp_format& format);
+    // `tables` holds the bytes after the two headers: bit masks and palette
+    static void ReadBmpFormat(const bmp_info_header& info_header, const unsigned char* tables, const size_t size, bitmap_detail::bmp_format& format);
+    static void ReadBmpFormat(istream& file, const bmp_info_header& info_header, bitmap_detail::bmp_format& format);
+    static void ReadPixelRows(istream& file, const bitmap_detail::bmp_format& format, pixel_buffer& dst, const int first_row, const int count);
+    // SetBmpFormat without marking the format as requested, also refreshes the sizes in the headers
+    void ApplyBmpFormat(const int bit_count, const bmp_compression compression);
+    // Palette depth SaveBmp falls back from when the colors no longer fit: 24 bits, or 32 when alpha is used
+    void FallBackToTrueColor();
+    // 1, 4, 8 and 16-bit files, whose size depends on the palette and the compressed data. Returns false
+    // when the colors do not fit an inherited palette depth, a requested one throws instead.
+    bool EncodePackedBmp(vector<unsigned char>& bytes) const;
+    // 24 or 32-bit rows of the file, `out` holds count rows of the padded file row size
+    static void EncodePixelRows(unsigned char* out, const int bit_count, const pixel_buffer& src, const int first_row, const int count);
+    // The format came from SetBmpFormat rather than from the loaded file
+    bool format_requested;
+    // Filters write into `scratch` and trade it with `data`, so same-sized images reuse both buffers
+    pixel_buffer scratch;
+    // Intermediate image between the two passes of Resample
+    pixel_buffer pass_scratch;
+    // Column histograms of the rank filters writing into this image
+    bitmap_detail::rank_storage rank_scratch;
+    // Makes result the pixels of this image, a region of the same size gets a copy and stays in place
+    void Commit(pixel_buffer& result);
+    template <typename Rows>
+    void FilterInto(Bitmap_cpp& dst, Rows rows) const;
+    template <typename Query>
+    void RankFilter(Bitmap_cpp& dst, const int filter_size, Query query) const;
+    // Row filters over interleaved pixels or over one channel plane, the kernels themselves are shared
+    template <typename Response, typename RowDone, typename... Kernels>
+    static void ConvolutionRows(const pixel_buffer& src, pixel_buffer& dst, const int first_row, const int last_row, Response response, RowDone row_done, const Kernels&... kernels);
+    template <typename Response, typename RowDone, typename... Kernels>
+    static void ConvolutionRows(const channel_plane& src, channel_plane& dst, const int first_row, const int last_row, Response response, RowDone row_done, const Kernels&... kernels);
+    template <typename Image, typename RowDone>
+    static void HighPassRows(const Image& src, Image& dst, const int filter_size, const int first_row, const int last_row, RowDone row_done);
+    template <typename Image, typename RowDone>
+    static void PrewittRows(const Image& src, Image& dst, const bool diagonal, const int first_row, const int last_row, RowDone row_done);
+    template <typename Image, typename RowDone>
+    static void SobelRows(const Image& src, Image& dst, const bool diagonal, const int first_row, const int last_row, RowDone row_done);
+    template <typename Image, typename RowDone>
+    static void LaplacianRows(const Image& src, Image& dst, const bool enhanced, const int first_row, const int last_row, RowDone row_done);
+    template <typename RowDone>
+    static void LowPassRows(const pixel_buffer& src, pixel_buffer& dst, const int filter_size, const int first_row, const int last_row, RowDone row_done);
+    template <typename RowDone>
+    static void LowPassRows(const channel_plane& src, channel_plane& dst, const int filter_size, const int first_row, const int last_row, RowDone row_done);
+    template <typename Query, typename RowDone>
+    static void RankRows(const pixel_buffer& src, pixel_buffer& dst, const int filter_size, const int first_row, const int last_row, Query query, RowDone row_done, bitmap_detail::rank_storage& storage);
+    template <typename Query, typename RowDone>
+    static void RankRows(const channel_plane& src, channel_plane& dst, const int filter_size, const int first_row, const int last_row, Query query, RowDone row_done, bitmap_detail::rank_storage& storage);
+    template <typename Image>
+    static void EqualizeGlobal(Image& data);
+    template <typename Image>
+    static void EqualizeLocal(const Image& data, Image& new_data, const int block_size);
+    template <typename Image>
+    static void EqualizeCLAHE(Image& data, const int tile_size, const float clip_limit);
+    static void CompressDCTBlocks(const bitmap_detail::rgb_view<unsigned char>& image, const dct_precision precision);
+    static vector<unsigned char> EncodeDCT(const bitmap_detail::rgb_view<const unsigned char>& image, const int quality);
+    static void ReadDCTHeader(const unsigned char* bytes, const size_t size, dct_file_header& file_header, bitmap_detail::dct_tables& tables, vector<uint32_t>& row_offsets);
+    void DecodeDCT(const dct_file_header& file_header, const bitmap_detail::dct_tables& tables, const vector<uint32_t>& row_offsets, const unsigned char* segments, const uint32_t segments_offset, const int first_row, const int row_count);
+    static void DecodeDCTRows(const dct_file_header& file_header, const bitmap_detail::dct_tables& tables, const vector<uint32_t>& row_offsets, const unsigned char* segments, const uint32_t segments_offset, const int first_row, const bitmap_detail::rgb_view<unsigned char>& dst);
+    static void MakeHeaders(const int width, const int height, bmp_header& header, bmp_info_header& info_header);
+};
+
+// Lazily evaluated image arithmetic, `(a.Expr() + b - c) * 2` builds a tree of nodes that is evaluated row
+// by row when it is converted to a Bitmap_cpp. Every node writes one row into a caller buffer with the same
+// saturating kernels the operators use, operands that are not plain images get a scratch row of their own,
+// so an expression of any depth is one pass over the images without intermediate images. Nodes refer to
+// their images, so an expression must not outlive them.
+namespace bitmap_detail
+{
+    typedef void (*binary_kernel)(pixel* dst, const pixel* src, int count);
+    typedef void (*scalar_kernel)(pixel* dst, int count, int scaler);
+
+    struct image_leaf : image_expr_base
+    {
+        static const int scratch_rows = 0;
+        static const int operand_rows = 0;
+
+        explicit image_leaf(const Bitmap_cpp& image) : image(&image) {}
+        const Bitmap_cpp& Front() const { return *image; }
+
+        void Evaluate(const pointwise_kernels&, const int x, const int width, pixel* out, pixel*) const
+        {
+            copy(image->data.row(x), image->data.row(x) + width, out);
+        }
+
+        const pixel* Operand(const pointwise_kernels&, const int x, const int, pixel*, pixel*) const
+        {
+            return image->data.row(x);
+        }
+
+        const Bitmap_cpp* image;
+    };
+
+    template <typename Left, typename Right, binary_kernel pointwise_kernels::*Kernel>
+    struct image_binary : image_expr_base
+    {
+        static const int scratch_rows = Left::scratch_rows > Right::operand_rows ? Left::scratch_rows : Right::operand_rows;
+        static const int operand_rows = scratch_rows + 1;
+
+        image_binary(const Left& left, const Right& right) : left(left), right(right)
+        {
+            const bmp_info_header& origin = left.Front().info_header;
+            const bmp_info_header& other = right.Front().info_header;
+            if (origin.width != other.width || origin.height != other.height)
+                throw runtime_error("Error: image size error, " + to_string(origin.width) + "x" + to_string(origin.height) + "(origin) vs " + to_string(other.width) + "x" + to_string(other.height) + "(other)");
+        }
+
+        const Bitmap_cpp& Front() const { return left.Front(); }
+
+        // The left operand is evaluated straight into `out`, the right one into the first scratch row
+        void Evaluate(const pointwise_kernels& kernels, const int x, const int width, pixel* out, pixel* scratch) const
+        {
+            left.Evaluate(kernels, x, width, out, scratch);
+            const pixel* operand = right.Operand(kernels, x, width, scratch, scratch + width);
+            (kernels.*Kernel)(out, operand, width);
+        }
+
+        const pixel* Operand(const pointwise_kernels& kernels, const int x, const int width, pixel* out, pixel* scratch) const
+        {
+            Evaluate(kernels, x, width, out, scratch);
+            return out;
+        }
+
+        Left left;
+        Right right;
+    };
+
+    template <typename Inner, scalar_kernel pointwise_kernels::*Kernel>
+    struct image_scalar : image_expr_base
+    {
+        static const int scratch_rows = Inner::scratch_rows;
+        static const int operand_rows = scratch_rows + 1;
+
+        image_scalar(const Inner& inner, const int scaler) : inner(inner), scaler(scaler) {}
+        const Bitmap_cpp& Front() const { return inner.Front(); }
+
+        void Evaluate(const pointwise_kernels& kernels, const int x, const int width, pixel* out, pixel* scratch) const
+        {
+            inner.Evaluate(kernels, x, width, out, scratch);
+            (kernels.*Kernel)(out, width, scaler);
+        }
+
+        const pixel* Operand(const pointwise_kernels& kernels, const int x, const int width, pixel* out, pixel* scratch) const
+        {
+            Evaluate(kernels, x, width, out, scratch);
+            return out;
+        }
+
+        Inner inner;
+        int scaler;
+    };
+
+    // Plain images take part in an expression as leaves
+    template <typename T>
+    struct expr_operand
+    {
+        typedef T type;
+        static const T& Wrap(const T& node) { return node; }
+    };
+
+    template <>
+    struct expr_operand<Bitmap_cpp>
+    {
+        typedef image_leaf type;
+        static image_leaf Wrap(const Bitmap_cpp& image) { return image_leaf(image); }
+    };
+
+    // Binary operators take two nodes or a node and an image, two images keep using Bitmap_cpp's own operators
+    template <typename Left, typename Right, binary_kernel pointwise_kernels::*Kernel>
+    struct expr_binary_result : enable_if<
+        (is_image_expr<Left>::value || is_image_expr<Right>::value) &&
+        (is_image_expr<Left>::value || is_same<Left, Bitmap_cpp>::value) &&
+        (is_image_expr<Right>::value || is_same<Right, Bitmap_cpp>::value),
+        image_binary<typename expr_operand<Left>::type, typename expr_operand<Right>::type, Kernel>> {};
+
+    template <typename Left, typename Right>
+    typename expr_binary_result<Left, Right, &pointwise_kernels::add>::type operator+(const Left& left, const Right& right)
+    {
+        return typename expr_binary_result<Left, Right, &pointwise_kernels::add>::type(expr_operand<Left>::Wrap(left), expr_operand<Right>::Wrap(right));
+    }
+
+    template <typename Left, typename Right>
+    typename expr_binary_result<Left, Right, &pointwise_kernels::subtract>::type operator-(const Left& left, const Right& right)
+    {
+        return typename expr_binary_result<Left, Right, &pointwise_kernels::subtract>::type(expr_operand<Left>::Wrap(left), expr_operand<Right>::Wrap(right));
+    }
+
+    template <typename Left, typename Right>
+    typename expr_binary_result<Left, Right, &pointwise_kernels::bitwise_and>::type operator&(const Left& left, const Right& right)
+    {
+        return typename expr_binary_result<Left, Right, &pointwise_kernels::bitwise_and>::type(expr_operand<Left>::Wrap(left), expr_operand<Right>::Wrap(right));
+    }
+
+    template <typename Left, typename Right>
+    typename expr_binary_result<Left, Right, &pointwise_kernels::bitwise_or>::type operator|(const Left& left, const Right& right)
+    {
+        return typename expr_binary_result<Left, Right, &pointwise_kernels::bitwise_or>::type(expr_operand<Left>::Wrap(left), expr_operand<Right>::Wrap(right));
+    }
+
+    template <typename Left, typename Right>
+    typename expr_binary_result<Left, Right, &pointwise_kernels::bitwise_xor>::type operator^(const Left& left, const Right& right)
+    {
+        return typename expr_binary_result<Left, Right, &pointwise_kernels::bitwise_xor>::type(expr_operand<Left>::Wrap(left), expr_operand<Right>::Wrap(right));
+    }
+
+    template <typename Node>
+    typename enable_if<is_image_expr<Node>::value, image_scalar<Node, &pointwise_kernels::multiply>>::type operator*(const Node& node, const int& scaler)
+    {
+        if (scaler <= 0)
+            throw invalid_argument("Error: scaler must be greater than 0");
+        return image_scalar<Node, &pointwise_kernels::multiply>(node, scaler);
+    }
+
+    template <typename Node>
+    typename enable_if<is_image_expr<Node>::value, image_scalar<Node, &pointwise_kernels::divide>>::type operator/(const Node& node, const int& scaler)
+    {
+        if (scaler == 0)
+            throw invalid_argument("Error: division by zero");
+        return image_scalar<Node, &pointwise_kernels::divide>(node, scaler);
+    }
+
+    // Writes every row of `expression` into dst, through a scratch row when dst may be one of its operands
+    template <typename Node>
+    void evaluate_expr(const Node& expression, pixel_buffer& dst, const bool aliased)
+    {
+        const int width = expression.Front().info_header.width, height = expression.Front().info_header.height;
+        const pointwise_kernels& kernels = pointwise();
+        parallel_for(0, height, [&](int first_row, int last_row)
+        {
+            vector<pixel> scratch(static_cast<size_t>(width) * (Node::scratch_rows + (aliased ? 1 : 0)));
+            pixel* row = scratch.data() + static_cast<size_t>(width) * Node::scratch_rows;
+            for (int x = first_row; x < last_row; x++)
+            {
+                expression.Evaluate(kernels, x, width, aliased ? row : dst.row(x), scratch.data());
+                if (aliased)
+                    copy(row, row + width, dst.row(x));
+            }
+        });
+    }
+}
+
+template <typename Node, typename>
+Bitmap_cpp::Bitmap_cpp(const Node& expression) : Bitmap_cpp()
+{
+    BITMAP_TRACE_SPAN("Expr", nullptr, &info_header);
+    EvaluateExpr(expression);
+}
+
+template <typename Node, typename>
+Bitmap_cpp& Bitmap_cpp::operator=(const Node& expression)
+{
+    BITMAP_TRACE_SPAN("Expr", nullptr, &info_header);
+    EvaluateExpr(expression);
+    return *this;
+}
+
+template <typename Node>
+void Bitmap_cpp::EvaluateExpr(const Node& expression)
+{
+    const Bitmap_cpp& front = expression.Front();
+    header = front.header;
+    info_header = front.info_header;
+    format_requested = front.format_requested;
+    // Only a buffer of the right size can be one of the operands
+    const bool resized = data.height() != info_header.height || data.width() != info_header.width;
+    if (resized)
+        data.resize_for_overwrite(info_header.height, info_header.width);
+    else
+        data.make_writable();
+    bitmap_detail::evaluate_expr(expression, data, !resized);
+}
+
+bitmap_detail::image_leaf Bitmap_cpp::Expr() const
+{
+    CheckValid();
+    return bitmap_detail::image_leaf(*this);
+}
+
+Bitmap_cpp::Bitmap_cpp() : format_requested(false)
+{
+    SetMemoryResource(nullptr);
+}
+
+Bitmap_cpp::Bitmap_cpp(string file_path) : Bitmap_cpp()
+{
+    LoadBmp(file_path);
+}
+
+Bitmap_cpp::Bitmap_cpp(const Bitmap_cpp& other) : header(other.header), info_header(other.info_header), format_requested(other.format_requested)
+{
+    SetMemoryResource(other.GetMemoryResource());
+    data = other.data;
+}
+
+Bitmap_cpp& Bitmap_cpp::operator=(const Bitmap_cpp& other)
+{
+    // Copies into the existing buffer, same-sized images do not allocate
+    header = other.header;
+    info_header = other.info_header;
+    format_requested = other.format_requested;
+    data = other.data;
+    return *this;
+}
+
+Bitmap_cpp::~Bitmap_cpp()
+{
+    data.clear();
+}
+
+void Bitmap_cpp::LoadBmp(string file_path)
+{
+    BITMAP_TRACE_SPAN("LoadBmp", nullptr, &info_header);
+    ReadBmp(file_path);
+}
+
+void Bitmap_cpp::ReadBmp(const string& file_path)
+{
+    ifstream file(file_path, ios::binary | ios::ate);
+    if (!file.is_open())
+        throw runtime_error("Error: file not found");
+
+    // The whole file is read with one call and decoded from memory
+    const streamoff file_size = file.tellg();
+    if (file_size < 0)
+        throw runtime_error("Error: file read error");
+    vector<unsigned char> bytes(static_cast<size_t>(file_size));
+    file.seekg(0, ios::beg);
+    if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size()))
+        throw runtime_error("Error: file read error");
+    file.close();
+
+    bitmap_detail::bmp_format format;
+    DecodeBmp(bytes.data(), bytes.size(), format);
+    if (bitmap_detail::logging_enabled())
+    {
+        const bool rle = format.compression == bmp_compression::rle8 || format.compression == bmp_compression::rle4;
+        bitmap_detail::log_message(bitmap_detail::file_name_of(file_path) + (format.bit_count == 8 ? " is an " : " is a ") + to_string(format.bit_count) + "-bit Bitmap file" + (rle ? " (RLE)" : ""));
+    }
+}
+
+void Bitmap_cpp::LoadBmpFromMemory(const uint8_t* bytes, const size_t size)
+{
+    BITMAP_TRACE_SPAN("LoadBmpFromMemory", nullptr, &info_header);
+    bitmap_detail::bmp_format format;
+    DecodeBmp(bytes, size, format);
+}
+
+void Bitmap_cpp::DecodeBmp(const unsigned char* bytes, const size_t size, bitmap_detail::bmp_format& format)
+{
+    if (size < sizeof(bmp_header) || bytes[0] != 'B' || bytes[1] != 'M')
+        throw runtime_error("Error: file is not a Bitmap file");
+    if (size < sizeof(bmp_header) + sizeof(bmp_info_header))
+        throw runtime_error("Error: unsupported Bitmap header");
+    memcpy(&header, bytes, sizeof(bmp_header));
+    memcpy(&info_header, bytes + sizeof(bmp_header), sizeof(bmp_info_header));
+    const size_t headers_size = sizeof(bmp_header) + sizeof(bmp_info_header);
+    ReadBmpFormat(info_header, bytes + headers_size, size - headers_size, format);
+    if (header.data_offset > size)
+        throw runtime_error("Error: unexpected end of Bitmap file");
+
+    const unsigned char* pixels = bytes + header.data_offset;
+    const size_t available = size - header.data_offset;
+    if (format.compression == bmp_compression::rle8 || format.compression == bmp_compression::rle4)
+    {
+        // size_image may be 0, the end of the buffer bounds the compressed stream then
+        const size_t stream_size = info_header.size_image == 0 ? available : min(available, static_cast<size_t>(info_header.size_image));
+        // A run carries at most 255 pixels in two bytes. Headers declaring more pixels than the stream could
+        // encode that way are refused before the image is allocated, so a few bytes cannot ask for gigabytes;
+        // this also refuses the rare file that leaves most of a huge image to deltas or an early end of bitmap.
+        if (static_cast<uint64_t>(format.width) * static_cast<uint64_t>(format.height) > static_cast<uint64_t>(stream_size / 2) * 255)
+            throw runtime_error("Error: RLE data is too short for the image size");
+        data.resize(format.height, format.width);
+        bitmap_detail::decode_bmp_rle(format, pixels, pixels + stream_size, data);
+    }
+    else
+    {
+        // File rows in file order, top-down files list the last pixel_buffer row first
+        const size_t row_bytes = format.RowBytes();
+        if (available / row_bytes < static_cast<size_t>(format.height))
+            throw runtime_error("Error: unexpected end of Bitmap file");
+        data.resize_for_overwrite(format.height, format.width);
+        bitmap_detail::parallel_for(0, format.height, [&](int first_row, int last_row)
+        {
+            for (int x = first_row; x < last_row; x++)
+            {
+                pixel* row = data.row(format.top_down ? format.height - 1 - x : x);
+                if (format.raw)
+                    memcpy(row, pixels + row_bytes * x, row_bytes);
+                else
+                    bitmap_detail::decode_bmp_row(format, pixels + row_bytes * x, row);
+            }
+        });
+    }
+
+    // Bit fields that SaveBmp cannot write again are kept at 32 bits
+    int bit_count = format.bit_count;
+    bmp_compression compression = format.compression;
+    if (bit_count == 16)
+    {
+        const uint32_t blue = format.channels[0].mask, green = format.channels[1].mask, red = format.channels[2].mask, alpha = format.channels[3].mask;
+        if (red == 0xF800 && green == 0x7E0 && blue == 0x1F && alpha == 0)
+            compression = bmp_compression::bitfields;
+        else if (red == 0x7C00 && green == 0x3E0 && blue == 0x1F && alpha == 0)
+            compression = bmp_compression::rgb;
+        else
+            bit_count = 32;
+    }
+    if (bit_count == 32)
+        compression = bmp_compression::rgb;
+    ApplyBmpFormat(bit_count, compression);
+    format_requested = false;
+}
+
+// Checks the info header and reads what follows it: the rest of a V4 / V5 header, bit masks and the
+// palette. The pixel data starts at data_offset.
+void Bitmap_cpp::ReadBmpFormat(istream& file, const bmp_info_header& info_header, bitmap_detail::bmp_format& format)
+{
+    if (!file)
+        throw runtime_error("Error: unsupported Bitmap header");
+
+    // At most the rest of a 4096-byte header, 16 bytes of masks and 256 palette entries follow
+    unsigned char tables[4096 + 16 + 1024];
+    file.read(reinterpret_cast<char*>(tables), sizeof(tables));
+    const size_t size = static_cast<size_t>(file.gcount());
+    file.clear();
+    ReadBmpFormat(info_header, tables, size, format);
+}
+
+void Bitmap_cpp::ReadBmpFormat(const bmp_info_header& info_header, const unsigned char* tables, const size_t size, bitmap_detail::bmp_format& format)
+{
+    if (info_header.size < sizeof(bmp_info_header) || info_header.size > 4096)
+        throw runtime_error("Error: unsupported Bitmap header");
+    if (info_header.width <= 0 || info_header.height == 0 || info_header.height == INT32_MIN)
+        throw runtime_error("Error: invalid image size");
+
+    const int bit_count = info_header.bit_count;
+    const uint32_t compression = info_header.compression;
+    const bool bitfields = compression == 3 || compression == 6; // BI_BITFIELDS, BI_ALPHABITFIELDS
+    if (bit_count != 1 && bit_count != 4 && bit_count != 8 && bit_count != 16 && bit_count != 24 && bit_count != 32)
+        throw runtime_error("Error: unsupported bit count");
+    if (compression != 0 && !(compression == 1 && bit_count == 8) && !(compression == 2 && bit_count == 4) && !(bitfields && (bit_count == 16 || bit_count == 32)))
+        throw runtime_error("Error: unsupported compression");
+    if (info_header.height < 0 && (compression == 1 || compression == 2))
+        throw runtime_error("Error: compressed Bitmap files must be bottom-up");
+
+    format.width = info_header.width;
+    format.height = abs(info_header.height);
+    format.top_down = info_header.height < 0;
+    format.bit_count = bit_count;
+    format.compression = bitfields ? bmp_compression::bitfields : static_cast<bmp_compression>(compression);
+    format.raw = bit_count == 32 && !bitfields;
+
+    // Red, green, blue (and alpha) masks are part of V2+ headers, after a 40-byte header they follow it
+    size_t extension = info_header.size - sizeof(bmp_info_header);
+    if (bitfields && extension < 12)
+        extension = compression == 6 ? 16 : 12;
+    if (extension > size)
+        throw runtime_error("Error: unexpected end of Bitmap file");
+    if (bitfields)
+    {
+        uint32_t masks[4] = {0, 0, 0, 0};
+        memcpy(masks, tables, min<size_t>(extension, sizeof(masks)));
+        format.channels[0].Set(masks[2], 0);
+        format.channels[1].Set(masks[1], 0);
+        format.channels[2].Set(masks[0], 0);
+        format.channels[3].Set(masks[3], 255);
+        format.raw = bit_count == 32 && masks[0] == 0xFF0000 && masks[1] == 0xFF00 && masks[2] == 0xFF && (masks[3] == 0xFF000000 || masks[3] == 0);
+    }
+    else if (bit_count == 16)
+    {
+        format.channels[0].Set(0x1F, 0);
+        format.channels[1].Set(0x3E0, 0);
+        format.channels[2].Set(0x7C00, 0);
+        format.channels[3].Set(0, 255);
+    }
+
+    // Palette entries are b, g, r, reserved; indices past the palette read as black
+    if (bit_count <= 8)
+    {
+        const uint32_t colors = info_header.colors_used == 0 ? 1u << bit_count : info_header.colors_used;
+        if (colors > 256)
+            throw runtime_error("Error: invalid palette size");
+        if (colors * 4 > size - extension)
+            throw runtime_error("Error: unexpected end of Bitmap file");
+        const unsigned char (*entries)[4] = reinterpret_cast<const unsigned char (*)[4]>(tables + extension);
+        fill(format.palette, format.palette + 256, pixel());
+        for (uint32_t i = 0; i < colors; i++)
+            format.palette[i] = pixel(entries[i][2], entries[i][1], entries[i][0]);
+    }
+}
+
+shared_ptr<void> Bitmap_cpp::MapFile(const string& file_path, bool copy_on_write, size_t& file_size)
+{
+    #ifdef _WIN32
+    HANDLE file = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw runtime_error("Error: file not found");
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        throw runtime_error("Error: cannot read file size");
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr)
+        throw runtime_error("Error: cannot map file");
+
+    void* view = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == nullptr)
+        throw runtime_error("Error: cannot map file");
+
+    file_size = static_cast<size_t>(size.QuadPart);
+    return shared_ptr<void>(view, [](void* ptr) { UnmapViewOfFile(ptr); });
+    #else
+    int file = open(file_path.c_str(), O_RDONLY);
+    if (file < 0)
+        throw runtime_error("Error: file not found");
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        close(file);
+        throw runtime_error("Error: cannot read file size");
+    }
+    const size_t length = static_cast<size_t>(file_stat.st_size);
+    void* view = mmap(nullptr, length, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, copy_on_write ? MAP_PRIVATE : MAP_SHARED, file, 0);
+    close(file);
+    if (view == MAP_FAILED)
+        throw runtime_error("Error: cannot map file");
+
+    file_size = length;
+    return shared_ptr<void>(view, [length](void* ptr) { munmap(ptr, length); });
+    #endif
+}
+
+void Bitmap_cpp::MapBmp(string file_path, bmp_map_mode mode)
+{
+    BITMAP_TRACE_SPAN("MapBmp", nullptr, &info_header);
+    size_t file_size = 0;
+    shared_ptr<void> mapping = MapFile(file_path, mode == bmp_map_mode::copy_on_write, file_size);
+    unsigned char* bytes = static_cast<unsigned char*>(mapping.get());
+    if (file_size < sizeof(bmp_header) + sizeof(bmp_info_header))
+        throw runtime_error("Error: file is not a Bitmap file");
+
+    bmp_header file_header;
+    bmp_info_header file_info_header;
+    memcpy(&file_header, bytes, sizeof(bmp_header));
+    memcpy(&file_info_header, bytes + sizeof(bmp_header), sizeof(bmp_info_header));
+    if (file_header.signature[0] != 'B' || file_header.signature[1] != 'M')
+        throw runtime_error("Error: file is not a Bitmap file");
+
+    // Only uncompressed 32-bit rows share the in-memory pixel layout, anything else is read normally
+    if (file_info_header.bit_count != 32 || file_info_header.compression != 0)
+    {
+        mapping.reset();
+        ReadBmp(file_path);
+        return;
+    }
+    if (file_info_header.width <= 0 || file_info_header.height == 0 || file_info_header.height == INT32_MIN)
+        throw runtime_error("Error: invalid image size");
+
+    const int width = file_info_header.width;
+    const int height = abs(file_info_header.height);
+    if (file_header.data_offset + static_cast<size_t>(width) * 4 * height > file_size)
+        throw runtime_error("Error: pixel data exceeds file size");
+
+    if (bitmap_detail::logging_enabled())
+        bitmap_detail::log_message(bitmap_detail::file_name_of(file_path) + " is a 32-bit Bitmap file (mapped)");
+
+    // data[0] is always the bottom row, so top-down files are walked with a negative stride
+    pixel* first_row = reinterpret_cast<pixel*>(bytes + file_header.data_offset);
+    ptrdiff_t stride = width;
+    if (file_info_header.height < 0)
+    {
+        first_row += static_cast<ptrdiff_t>(height - 1) * width;
+        stride = -stride;
+    }
+
+    header = file_header;
+    info_header = file_info_header;
+    header.data_offset = sizeof(bmp_header) + sizeof(bmp_info_header);
+    info_header.size = sizeof(bmp_info_header);
+    info_header.height = height;
+    format_requested = false;
+    data.attach(first_row, height, width, stride, mapping, mode == bmp_map_mode::copy_on_write);
+}
+
+void Bitmap_cpp::ReadPixelRows(istream& file, const bitmap_detail::bmp_format& format, pixel_buffer& dst, const int first_row, const int count)
+{
+    // File rows first_row.. in file order, top-down files list the last pixel_buffer row first
+    const size_t row_bytes = format.RowBytes();
+    if (format.raw)
+    {
+        for (int x = first_row; x < first_row + count; x++)
+            file.read(reinterpret_cast<char*>(dst.row(format.top_down ? dst.height() - 1 - x : x)), row_bytes);
+        return;
+    }
+
+    vector<unsigned char> row_data(row_bytes);
+    for (int x = first_row; x < first_row + count; x++)
+    {
+        file.read(reinterpret_cast<char*>(row_data.data()), row_data.size());
+        bitmap_detail::decode_bmp_row(format, row_data.data(), dst.row(format.top_down ? dst.height() - 1 - x : x));
+    }
+}
+
+void Bitmap_cpp::EncodePixelRows(unsigned char* out, const int bit_count, const pixel_buffer& src, const int first_row, const int count)
+{
+    const int width = src.width();
+    if (bit_count != 24 && bit_count != 32)
+        throw runtime_error("Error: unsupported bit count");
+
+    const size_t row_bytes = (static_cast<size_t>(width) * bit_count + 31) / 32 * 4;
+    bitmap_detail::parallel_for(0, count, [&](int first, int last)
+    {
+        for (int x = first; x < last; x++)
+        {
+            const pixel* row = src.row(first_row + x);
+            unsigned char* row_data = out + row_bytes * x;
+            if (bit_count == 32)
+            {
+                memcpy(row_data, row, static_cast<size_t>(width) * 4);
+                continue;
+            }
+            for (int y = 0; y < width; y++)
+            {
+                row_data[y * 3] = row[y].b;
+                row_data[y * 3 + 1] = row[y].g;
+                row_data[y * 3 + 2] = row[y].r;
+            }
+            memset(row_data + width * 3, 0, row_bytes - width * 3);
+        }
+    });
+}
+
+void Bitmap_cpp::SaveBmp(string file_path, const bool atomic_replace)
+{
+    BITMAP_TRACE_SPAN("SaveBmp", &info_header, nullptr);
+    if (file_path.find(".bmp") == string::npos)
+        file_path += ".bmp";
+    const vector<unsigned char> bytes = EncodeFile();
+    bitmap_detail::write_file(file_path, {{bytes.data(), bytes.size()}}, atomic_replace);
+    bitmap_detail::log_saved(file_path);
+}
+
+vector<unsigned char> Bitmap_cpp::EncodeBmp()
+{
+    BITMAP_TRACE_SPAN("EncodeBmp", &info_header, nullptr);
+    return EncodeFile();
+}
+
+vector<unsigned char> Bitmap_cpp::EncodeFile()
+{
+    CheckValid();
+    // Sizes and offsets are stale after Resize, the zooms or anything else that changed the image
+    ApplyBmpFormat(info_header.bit_count, static_cast<bmp_compression>(info_header.compression));
+    if (info_header.bit_count != 24 && info_header.bit_count != 32)
+    {
+        vector<unsigned char> bytes;
+        if (EncodePackedBmp(bytes))
+            return bytes;
+        FallBackToTrueColor();
+    }
+
+    vector<unsigned char> bytes(header.file_size);
+    memcpy(bytes.data(), &header, sizeof(bmp_header));
+    memcpy(bytes.data() + sizeof(bmp_header), &info_header, sizeof(bmp_info_header));
+    EncodePixelRows(bytes.data() + header.data_offset, info_header.bit_count, data, 0, data.height());
+    return bytes;
+}
+
+size_t Bitmap_cpp::EncodeBmp(uint8_t* buffer, const size_t capacity)
+{
+    BITMAP_TRACE_SPAN("EncodeBmp", &info_header, nullptr);
+    CheckValid();
+    ApplyBmpFormat(info_header.bit_count, static_cast<bmp_compression>(info_header.compression));
+    if (info_header.bit_count != 24 && info_header.bit_count != 32)
+    {
+        vector<unsigned char> bytes;
+        if (EncodePackedBmp(bytes))
+        {
+            if (bytes.size() <= capacity)
+                memcpy(buffer, bytes.data(), bytes.size());
+            return bytes.size();
+        }
+        FallBackToTrueColor();
+    }
+
+    if (header.file_size <= capacity)
+    {
+        memcpy(buffer, &header, sizeof(bmp_header));
+        memcpy(buffer + sizeof(bmp_header), &info_header, sizeof(bmp_info_header));
+        EncodePixelRows(buffer + header.data_offset, info_header.bit_count, data, 0, data.height());
+    }
+    return header.file_size;
+}
+
+void Bitmap_cpp::SetBmpFormat(const int bit_count, const bmp_compression compression)
+{
+    ApplyBmpFormat(bit_count, compression);
+    format_requested = true;
+}
+
+void Bitmap_cpp::ApplyBmpFormat(const int bit_count, const bmp_compression compression)
+{
+    bool supported = false;
+    switch (compression)
+    {
+        case bmp_compression::rgb: supported = bit_count == 1 || bit_count == 4 || bit_count == 8 || bit_count == 16 || bit_count == 24 || bit_count == 32; break;
+        case bmp_compression::rle8: supported = bit_count == 8; break;
+        case bmp_compression::rle4: supported = bit_count == 4; break;
+        case bmp_compression::bitfields: supported = bit_count == 16; break;
+    }
+    if (!supported)
+        throw invalid_argument("Error: unsupported bit count and compression");
+
+    // Sizes of an uncompressed file without palette, SaveBmp fills in the real ones for the other formats
+    const int width = data.width(), height = data.height();
+    const uint32_t row_bytes = (static_cast<uint32_t>(width) * bit_count + 31) / 32 * 4;
+    memcpy(header.signature, "BM", 2);
+    header.reserved = 0;
+    header.data_offset = sizeof(bmp_header) + sizeof(bmp_info_header);
+    info_header.size = sizeof(bmp_info_header);
+    info_header.width = width;
+    info_header.height = height;
+    info_header.planes = 1;
+    info_header.bit_count = static_cast<uint16_t>(bit_count);
+    info_header.compression = static_cast<uint32_t>(compression);
+    info_header.size_image = row_bytes * height;
+    info_header.colors_used = 0;
+    info_header.colors_important = 0;
+    header.file_size = header.data_offset + info_header.size_image;
+}
+
+// 1, 4, 8 and 16-bit files. The headers depend on the palette and on the compressed size, so the
+// pixels are encoded before anything is written.
+void Bitmap_cpp::FallBackToTrueColor()
+{
+    atomic<bool> alpha_used(false);
+    bitmap_detail::parallel_for(0, data.height(), [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row && !alpha_used; x++)
+        {
+            const pixel* row = data.row(x);
+            for (int y = 0; y < data.width(); y++)
+            {
+                if (row[y].a != 255)
+                {
+                    alpha_used = true;
+                    break;
+                }
+            }
+        }
+    });
+    ApplyBmpFormat(alpha_used ? 32 : 24, bmp_compression::rgb);
+}
+
+bool Bitmap_cpp::EncodePackedBmp(vector<unsigned char>& bytes) const
+{
+    const int width = data.width(), height = data.height(), bit_count = info_header.bit_count;
+    const bmp_compression compression = static_cast<bmp_compression>(info_header.compression);
+    const size_t row_bytes = (static_cast<size_t>(width) * bit_count + 31) / 32 * 4;
+    vector<unsigned char> table; // bit masks or palette
+    vector<unsigned char> pixels;
+    uint32_t colors_used = 0;
+    if (bit_count == 16)
+    {
+        const bool rgb565 = compression == bmp_compression::bitfields;
+        if (rgb565)
+        {
+            const uint32_t masks[3] = {0xF800, 0x7E0, 0x1F};
+            table.resize(sizeof(masks));
+            memcpy(table.data(), masks, sizeof(masks));
+        }
+        unsigned char to5[256], to6[256];
+        for (int value = 0; value < 256; value++)
+        {
+            to5[value] = static_cast<unsigned char>((value * 31 + 127) / 255);
+            to6[value] = static_cast<unsigned char>((value * 63 + 127) / 255);
+        }
+
+        pixels.assign(row_bytes * height, 0);
+        bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+        {
+            for (int x = first_row; x < last_row; x++)
+            {
+                const pixel* row = data.row(x);
+                unsigned char* out = &pixels[row_bytes * x];
+                for (int y = 0; y < width; y++)
+                {
+                    const int word = rgb565 ? to5[row[y].r] << 11 | to6[row[y].g] << 5 | to5[row[y].b] : to5[row[y].r] << 10 | to5[row[y].g] << 5 | to5[row[y].b];
+                    out[y * 2] = static_cast<unsigned char>(word);
+                    out[y * 2 + 1] = static_cast<unsigned char>(word >> 8);
+                }
+            }
+        });
+    }
+    else
+    {
+        vector<pixel> palette;
+        vector<unsigned char> indices;
+        if (!bitmap_detail::index_colors(data, size_t(1) << bit_count, palette, indices))
+        {
+            if (format_requested)
+                throw runtime_error("Error: image has more colors than the palette holds");
+            return false;
+        }
+        colors_used = static_cast<uint32_t>(palette.size());
+        table.resize(palette.size() * sizeof(pixel));
+        memcpy(table.data(), palette.data(), table.size());
+
+        if (compression == bmp_compression::rgb)
+        {
+            pixels.assign(row_bytes * height, 0);
+            bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+            {
+                for (int x = first_row; x < last_row; x++)
+                    bitmap_detail::pack_bmp_indices(&indices[static_cast<size_t>(x) * width], width, bit_count, &pixels[row_bytes * x]);
+            });
+        }
+        else
+        {
+            // Every row ends with an end of line, the last one with the end of bitmap
+            for (int x = 0; x < height; x++)
+            {
+                bitmap_detail::encode_bmp_rle(&indices[static_cast<size_t>(x) * width], width, compression == bmp_compression::rle4, pixels);
+                pixels.push_back(0);
+                pixels.push_back(x + 1 < height ? 0 : 1);
+            }
+        }
+    }
+
+    bmp_header file_header = header;
+    bmp_info_header file_info_header = info_header;
+    file_header.data_offset = static_cast<uint32_t>(sizeof(bmp_header) + sizeof(bmp_info_header) + table.size());
+    file_info_header.size_image = static_cast<uint32_t>(pixels.size());
+    file_info_header.colors_used = colors_used;
+    file_header.file_size = file_header.data_offset + file_info_header.size_image;
+
+    bytes.resize(file_header.file_size);
+    memcpy(bytes.data(), &file_header, sizeof(bmp_header));
+    memcpy(bytes.data() + sizeof(bmp_header), &file_info_header, sizeof(bmp_info_header));
+    if (!table.empty())
+        memcpy(bytes.data() + sizeof(bmp_header) + sizeof(bmp_info_header), table.data(), table.size());
+    if (!pixels.empty())
+        memcpy(bytes.data() + file_header.data_offset, pixels.data(), pixels.size());
+    return true;
+}
+
+future<Bitmap_cpp> Bitmap_cpp::LoadBmpAsync(string file_path)
+{
+    return bitmap_detail::current_io_pool()->Submit([file_path]() { return Bitmap_cpp(file_path); });
+}
+
+future<void> Bitmap_cpp::SaveBmpAsync(string file_path, const bool atomic_replace) const &
+{
+    return Bitmap_cpp(*this).SaveBmpAsync(file_path, atomic_replace);
+}
+
+future<void> Bitmap_cpp::SaveBmpAsync(string file_path, const bool atomic_replace) &&
+{
+    shared_ptr<Bitmap_cpp> image = make_shared<Bitmap_cpp>(move(*this));
+    return bitmap_detail::current_io_pool()->Submit([image, file_path, atomic_replace]() { image->SaveBmp(file_path, atomic_replace); });
+}
+
+// Loads the files a consumer announced ahead of time on the I/O pool, so they are usually decoded by the
+// time they are asked for. At most `depth` images are loading or waiting at once, the other announced
+// paths start as earlier images are taken. One queue serves one consumer thread.
+class bitmap_prefetch_queue
+{
+public:
+    explicit bitmap_prefetch_queue(const size_t depth = 4, shared_ptr<bitmap_io_pool> pool = nullptr);
+
+    // Announces files that will be asked for, in that order
+    void Prefetch(const string& file_path);
+    void Prefetch(const vector<string>& file_paths);
+
+    // The next announced image; a load error is rethrown here
+    Bitmap_cpp Next();
+    // The image of file_path, loaded right away if it was never announced
+    Bitmap_cpp Take(const string& file_path);
+
+    size_t Pending() const { return loading.size() + waiting.size(); }
+    bool empty() const { return Pending() == 0; }
+
+private:
+    struct entry
+    {
+        string file_path;
+        future<Bitmap_cpp> image;
+    };
+
+    void Fill();
+
+    size_t depth;
+    shared_ptr<bitmap_io_pool> pool;
+    deque<entry> loading;
+    deque<string> waiting;
+};
+
+bitmap_prefetch_queue::bitmap_prefetch_queue(const size_t depth, shared_ptr<bitmap_io_pool> pool) : depth(depth), pool(pool ? pool : bitmap_detail::current_io_pool())
+{
+    if (depth == 0)
+        throw invalid_argument("Error: prefetch depth must be greater than 0");
+}
+
+void bitmap_prefetch_queue::Prefetch(const string& file_path)
+{
+    waiting.push_back(file_path);
+    Fill();
+}
+
+void bitmap_prefetch_queue::Prefetch(const vector<string>& file_paths)
+{
+    waiting.insert(waiting.end(), file_paths.begin(), file_paths.end());
+    Fill();
+}
+
+Bitmap_cpp bitmap_prefetch_queue::Next()
+{
+    if (loading.empty())
+        throw runtime_error("Error: no announced image left");
+
+    future<Bitmap_cpp> image = move(loading.front().image);
+    loading.pop_front();
+    Fill();
+    return image.get();
+}
+
+Bitmap_cpp bitmap_prefetch_queue::Take(const string& file_path)
+{
+    for (auto it = loading.begin(); it != loading.end(); ++it)
+    {
+        if (it->file_path != file_path)
+            continue;
+        future<Bitmap_cpp> image = move(it->image);
+        loading.erase(it);
+        Fill();
+        return image.get();
+    }
+    auto it = find(waiting.begin(), waiting.end(), file_path);
+    if (it != waiting.end())
+        waiting.erase(it);
+    return Bitmap_cpp(file_path);
+}
+
+void bitmap_prefetch_queue::Fill()
+{
+    while (loading.size() < depth && !waiting.empty())
+    {
+        entry next;
+        next.file_path = move(waiting.front());
+        waiting.pop_front();
+        const string file_path = next.file_path;
+        next.image = pool->Submit([file_path]() { return Bitmap_cpp(file_path); });
+        loading.push_back(move(next));
+    }
+}
+
+void Bitmap_cpp::CheckValid() const
+{
+    if (data.empty())
+        throw runtime_error("Error: image data is empty");
+    if (info_header.width <= 0 || info_header.height <= 0)
+        throw runtime_error("Error: invalid image size");
+}
+
+Bitmap_cpp Bitmap_cpp::Region(const int width, const int height, const int start_x, const int start_y)
+{
+    CheckValid();
+    Bitmap_cpp region;
+    region.SetMemoryResource(GetMemoryResource());
+    region.header = header;
+    region.info_header = info_header;
+    region.data.attach(data, start_x, start_y, height, width, true);
+    region.ApplyBmpFormat(info_header.bit_count, static_cast<bmp_compression>(info_header.compression));
+    region.format_requested = format_requested;
+    return region;
+}
+
+Bitmap_cpp Bitmap_cpp::Region(const int width, const int height, const int start_x, const int start_y) const
+{
+    CheckValid();
+    Bitmap_cpp region;
+    region.SetMemoryResource(GetMemoryResource());
+    region.header = header;
+    region.info_header = info_header;
+    region.data.attach(data, start_x, start_y, height, width, false);
+    region.ApplyBmpFormat(info_header.bit_count, static_cast<bmp_compression>(info_header.compression));
+    region.format_requested = format_requested;
+    return region;
+}
+
+void Bitmap_cpp::Resize(int width, int height, int start_y, int start_x)
+{
+    BITMAP_TRACE_SPAN("Resize", &info_header, &info_header);
+    CheckValid();
+    width = min(width, info_header.width);
+    height = min(height, info_header.height);
+
+    start_x = info_header.height - start_x;
+    if (start_x + height > info_header.height)
+        start_x = max(0, info_header.height - height);
+    if (start_y + width > info_header.width)
+        start_y = max(0, info_header.width - width);
+    pixel_buffer& new_data = scratch;
+    new_data.assign(height, width, pixel());
+    for (int x = 0; x < height; x++)
+        copy(data.row(start_x + x) + start_y, data.row(start_x + x) + start_y + width, new_data.row(x));
+
+    Commit(new_data);
+    info_header.width = width;
+    info_header.height = height;
+}
+
+void Bitmap_cpp::toGray()
+{
+    BITMAP_TRACE_SPAN("toGray", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            kernels.gray(data.row(x), info_header.width);
+    });
+}
+
+void Bitmap_cpp::InvertColor()
+{
+    BITMAP_TRACE_SPAN("InvertColor", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            kernels.invert(data.row(x), info_header.width);
+    });
+}
+
+void Bitmap_cpp::AddImpluseNoise(const int salt_ratio, const int pepper_ratio)
+{
+    BITMAP_TRACE_SPAN("AddImpluseNoise", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    if (salt_ratio < 0 || pepper_ratio < 0 || salt_ratio + pepper_ratio > 100)
+        throw invalid_argument("Error: salt and pepper ratio must be greater than 0 and less than 100");
+    
+    random_device rd;
+    mt19937 gen(rd());
+    uniform_real_distribution<float> dis(0, 1);
+
+    const float noise_ratio_f = (salt_ratio + pepper_ratio) / 100.0;
+    const float salt_ratio_f = static_cast<float>(salt_ratio) / (salt_ratio + pepper_ratio);
+    for (auto& row : data)
+        for (auto& p : row)
+            if (dis(gen) < noise_ratio_f)
+                p.r = p.g = p.b = dis(gen) > salt_ratio_f ? 0 : 255;
+}
+
+void Bitmap_cpp::AddGaussianNoise(const int mean, const int variance)
+{
+    BITMAP_TRACE_SPAN("AddGaussianNoise", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    if (variance < 0)
+        throw invalid_argument("Error: standard deviation must be greater than 0");
+    
+    random_device rd;
+    mt19937 gen(rd());
+    normal_distribution<float> dis(mean, sqrt(variance));
+    
+    for (auto& row : data)
+    {
+        for (auto& p : row)
+        {
+            float noise = dis(gen);
+            p.r = min(255, max(0, static_cast<int>(p.r + noise)));
+            p.g = min(255, max(0, static_cast<int>(p.g + noise)));
+            p.b = min(255, max(0, static_cast<int>(p.b + noise)));
+        }
+    }
+}
+
+void Bitmap_cpp::mix_with(const Bitmap_cpp& other, const float ratio)
+{
+    BITMAP_TRACE_SPAN("mix_with", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
+        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+    if (ratio < 0.0f || ratio > 1.0f)
+        throw invalid_argument("Error: ratio must be between 0 and 1");
+
+    // 8-bit fixed-point weights, rounded to nearest
+    const int weight = static_cast<int>(ratio * 256 + 0.5f);
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            kernels.blend(data.row(x), other.data.row(x), info_header.width, weight);
+    });
+}
+
+void Bitmap_cpp::ZoomIn_ZeroOrder(const int scale)
+{
+    BITMAP_TRACE_SPAN("ZoomIn_ZeroOrder", &info_header, &info_header);
+    CheckValid();
+    pixel_buffer& new_data = scratch;
+    new_data.assign(info_header.height * scale, info_header.width * scale, pixel());
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            for (int y = 0; y < info_header.width; y++)
+                new_data[x * scale][y * scale] = data[x][y];
+    });
+
+    bitmap_detail::parallel_for(0, info_header.height * scale, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+        {
+            for (int y = 0; y < (info_header.width * scale); y++)
+            {
+                if (x % scale == 0 && y % scale == 0)
+                    continue;
+                
+                new_data[x][y] = data[x / scale][y / scale];
+            }
+        }
+    });
+    Commit(new_data);
+    info_header.width *= scale;
+    info_header.height *= scale;
+}
+
+void Bitmap_cpp::ZoomIn_FirstOrder(const int scale)
+{
+    BITMAP_TRACE_SPAN("ZoomIn_FirstOrder", &info_header, &info_header);
+    CheckValid();
+    pixel_buffer& new_data = scratch;
+    new_data.assign(info_header.height * scale, info_header.width * scale, pixel());
+    for (int x = 0; x < info_header.height; x++)
+        for (int y = 0; y < info_header.width; y++)
+            new_data[x * scale][y * scale] = data[x][y];
+
+    for (int x = 0; x < (info_header.height * scale) - (scale - 1); x += scale)
+    {
+        for (int y = 0; y < (info_header.width * scale); y++)
+        {
+            if (x % scale == 0 && y % scale == 0)
+                continue;
+            if (y >= (info_header.width * scale) - (scale - 1))
+            {
+                new_data[x][y] = new_data[x][y - 1];
+                continue;
+            }
+            
+            int y0 = (y / scale) * scale;
+            int y1 = min(y0 + scale, info_header.width * scale - 1);
+            int w0 = y - y0;
+            int w1 = y1 - y;
+            int w = w0 + w1;
+
+            new_data[x][y] = pixel(
+                (w1 * new_data[x][y0].r + w0 * new_data[x][y1].r) / w, 
+                (w1 * new_data[x][y0].g + w0 * new_data[x][y1].g) / w, 
+                (w1 * new_data[x][y0].b + w0 * new_data[x][y1].b) / w);
+        }
+    }
+
+    for (int x = 0; x < (info_header.height * scale); x++)
+    {
+        for (int y = 0; y < (info_header.width * scale); y++)
+        {
+            if (x % scale == 0)
+                continue;
+            if (x >= (info_header.height * scale) - (scale - 1))
+            {
+                new_data[x][y] = new_data[x - 1][y];
+                continue;
+            }
+
+            int x0 = (x / scale) * scale;
+            int x1 = min(x0 + scale, info_header.height * scale - 1);
+            int w0 = x - x0;
+            int w1 = x1 - x;
+            int w = w0 + w1;
+
+            new_data[x][y] = pixel(
+                (w1 * new_data[x0][y].r + w0 * new_data[x1][y].r) / w, 
+                (w1 * new_data[x0][y].g + w0 * new_data[x1][y].g) / w, 
+                (w1 * new_data[x0][y].b + w0 * new_data[x1][y].b) / w);
+        }
+    }
+    Commit(new_data);
+    info_header.width *= scale;
+    info_header.height *= scale;
+}
+
+void Bitmap_cpp::ZoomIn_Compare(const int scale)
+{
+    BITMAP_TRACE_SPAN("ZoomIn_Compare", &info_header, &info_header);
+    CheckValid();
+    pixel_buffer& new_data = scratch;
+    new_data.assign(info_header.height * scale, info_header.width * scale, pixel());
+    for (int x = 0; x < info_header.height; x++)
+        for (int y = 0; y < info_header.width; y++)
+            new_data[x * scale][y * scale] = data[x][y];
+    
+    for (int x = 0; x < (info_header.height * scale) - (scale - 1); x += scale)
+    {
+        for (int y = 0; y < (info_header.width * scale); y++)
+        {
+            if (x % scale == 0 && y % scale == 0)
+                continue;
+            if (y >= (info_header.width * scale) - (scale - 1))
+            {
+                new_data[x][y] = new_data[x][y - 1];
+                continue;
+            }
+            
+            int y0 = (y / scale) * scale;
+            int y1 = min(y0 + scale, info_header.width * scale - 1);
+            int w0 = y - y0;
+            int w1 = y1 - y;
+            int w = w0 + w1;
+
+            new_data[x][y] = pixel(
+                (w1 * new_data[x][y0].r + w0 * new_data[x][y1].r) / w, 
+                (w1 * new_data[x][y0].g + w0 * new_data[x][y1].g) / w, 
+                (w1 * new_data[x][y0].b + w0 * new_data[x][y1].b) / w);
+        }
+    }
+    
+    for (int x = 0; x < (info_header.height * scale); x++)
+    {
+        if (x % scale == 0)
+            continue;
+        for (int y = 0; y < (info_header.width * scale); y++)
+            new_data[x][y] = new_data[x - 1][y];
+    }
+    Commit(new_data);
+    info_header.width *= scale;
+    info_header.height *= scale;
+}
+
+void Bitmap_cpp::ZoomIn_Bilinear(const int scale)
+{
+    BITMAP_TRACE_SPAN("ZoomIn_Bilinear", &info_header, &info_header);
+    CheckValid();
+    const int new_height = info_header.height * scale, new_width = info_header.width * scale;
+    pixel_buffer& new_data = scratch;
+    new_data.assign(new_height, new_width, pixel());
+
+    // Every output row only reads the source image, the interpolation corners are the source pixels
+    // at multiples of scale. The last scale - 1 rows repeat the row above them and are copied afterwards.
+    const int last_row = new_height - (scale - 1);
+    bitmap_detail::parallel_for(0, last_row, [&](int first_row, int end_row)
+    {
+        for (int x = first_row; x < end_row; x++)
+        {
+            for (int y = 0; y < new_width; y++)
+            {
+                if (x % scale == 0 && y % scale == 0)
+                {
+                    new_data[x][y] = data[x / scale][y / scale];
+                    continue;
+                }
+                if (y >= new_width - (scale - 1))
+                {
+                    new_data[x][y] = new_data[x][y - 1];
+                    continue;
+                }
+
+                int x0 = (x / scale) * scale;
+                int x1 = min(x0 + scale, new_height - 1);
+                int x_ratio0 = x - x0;
+                int x_ratio1 = x1 - x;
+                int x_ratio = x_ratio0 + x_ratio1;
+
+                int y0 = (y / scale) * scale;
+                int y1 = min(y0 + scale, new_width - 1);
+                int y_ratio0 = y - y0;
+                int y_ratio1 = y1 - y;
+                int y_ratio = y_ratio0 + y_ratio1;
+
+                // x1 / y1 are only off the grid at the border, where their weight is zero
+                const pixel& p00 = data[x0 / scale][y0 / scale];
+                const pixel& p01 = data[x0 / scale][y1 / scale];
+                const pixel& p10 = data[x1 / scale][y0 / scale];
+                const pixel& p11 = data[x1 / scale][y1 / scale];
+
+                float r0 = (y_ratio1 * p00.r + y_ratio0 * p01.r) / y_ratio;
+                float r1 = (y_ratio1 * p10.r + y_ratio0 * p11.r) / y_ratio;
+
+                float g0 = (y_ratio1 * p00.g + y_ratio0 * p01.g) / y_ratio;
+                float g1 = (y_ratio1 * p10.g + y_ratio0 * p11.g) / y_ratio;
+
+                float b0 = (y_ratio1 * p00.b + y_ratio0 * p01.b) / y_ratio;
+                float b1 = (y_ratio1 * p10.b + y_ratio0 * p11.b) / y_ratio;
+
+                new_data[x][y] = pixel(
+                    (x_ratio1 * r0 + x_ratio0 * r1) / x_ratio,
+                    (x_ratio1 * g0 + x_ratio0 * g1) / x_ratio,
+                    (x_ratio1 * b0 + x_ratio0 * b1) / x_ratio);
+            }
+        }
+    });
+    for (int x = last_row; x < new_height; x++)
+        copy(new_data.row(x - 1), new_data.row(x - 1) + new_width, new_data.row(x));
+
+    Commit(new_data);
+    info_header.width *= scale;
+    info_header.height *= scale;
+}
+
+void Bitmap_cpp::ZoomOut(const int scale)
+{
+    BITMAP_TRACE_SPAN("ZoomOut", &info_header, &info_header);
+    CheckValid();
+    pixel_buffer& new_data = scratch;
+    new_data.assign(info_header.height / scale, info_header.width / scale, pixel());
+    bitmap_detail::parallel_for(0, info_header.height / scale, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+        {
+            for (int y = 0; y < info_header.width / scale; y++)
+            {
+                int sum_r = 0, sum_g = 0, sum_b = 0;
+                for (int i = 0; i < scale; i++)
+                {
+                    for (int j = 0; j < scale; j++)
+                    {
+                        int pos_x = x * scale + i;
+                        int pos_y = y * scale + j;
+                        sum_r += data[pos_x][pos_y].r;
+                        sum_g += data[pos_x][pos_y].g;
+                        sum_b += data[pos_x][pos_y].b;
+                    }
+                }
+                int scale_2 = scale * scale;
+                new_data[x][y].r = sum_r / scale_2;
+                new_data[x][y].g = sum_g / scale_2;
+                new_data[x][y].b = sum_b / scale_2;
+            }
+        }
+    });
+    Commit(new_data);
+    info_header.width /= scale;
+    info_header.height /= scale;
+}
+
+void Bitmap_cpp::Resample(const int width, const int height, const resample_filter filter)
+{
+    BITMAP_TRACE_SPAN("Resample", &info_header, &info_header);
+    CheckValid();
+    if (width <= 0 || height <= 0)
+        throw invalid_argument("Error: invalid image size");
+
+    // The horizontal pass runs first on every source row, a pass whose size does not change is skipped
+    const pixel_buffer* columns_done = &data;
+    pixel_buffer& horizontal = pass_scratch;
+    if (width != info_header.width)
+    {
+        const bitmap_detail::resample_table columns = bitmap_detail::make_resample_table(info_header.width, width, filter);
+        horizontal.resize_for_overwrite(info_header.height, width);
+        bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+        {
+            bitmap_detail::ResampleColumns(data, horizontal, columns, first_row, last_row);
+        });
+        columns_done = &horizontal;
+    }
+
+    if (height != info_header.height)
+    {
+        const bitmap_detail::resample_table rows = bitmap_detail::make_resample_table(info_header.height, height, filter);
+        pixel_buffer& new_data = scratch;
+        new_data.resize_for_overwrite(height, width);
+        bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+        {
+            bitmap_detail::ResampleRows(*columns_done, new_data, rows, first_row, last_row);
+        });
+        Commit(new_data);
+    }
+    else if (columns_done != &data)
+        Commit(horizontal);
+    info_header.width = width;
+    info_header.height = height;
+}
+
+void Bitmap_cpp::HistogramEqualization_Global()
+{
+    BITMAP_TRACE_SPAN("HistogramEqualization_Global", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    if (data[0][0].r != data[0][0].g || data[0][0].r != data[0][0].b)
+        throw runtime_error("Error: image is not a gray image");
+    EqualizeGlobal(data);
+}
+
+template <typename Image>
+void Bitmap_cpp::EqualizeGlobal(Image& data)
+{
+    const int height = data.height(), width = data.width();
+    int histogram[256] = {0};
+    for (int x = 0; x < height; x++)
+        for (int y = 0; y < width; y++)
+            histogram[bitmap_detail::gray_value(data.row(x)[y])]++;
+
+    int cdf[256] = {0};
+    cdf[0] = histogram[0];
+    for (int i = 1; i < 256; i++)
+        cdf[i] = cdf[i - 1] + histogram[i];
+    
+    int min_cdf = cdf[0];
+    for (int i = 0; i < 256; i++)
+    {
+        if (histogram[i] > 0)
+        {
+            min_cdf = cdf[i];
+            break;
+        }
+    }
+
+    int totel_pixel = width * height;
+    if (totel_pixel == min_cdf)
+        return;
+
+    for (int x = 0; x < height; x++)
+    {
+        for (int y = 0; y < width; y++)
+        {
+            auto& p = data.row(x)[y];
+            int new_value = (cdf[bitmap_detail::gray_value(p)] - min_cdf) * 255 / (totel_pixel - min_cdf);
+            bitmap_detail::set_gray(p, new_value);
+        }
+    }
+}
+
+void Bitmap_cpp::HistogramEqualization_Local(const int block_size, const equalization_mode mode, const float clip_limit)
+{
+    BITMAP_TRACE_SPAN("HistogramEqualization_Local", &info_header, &info_header);
+    CheckValid();
+    if (data[0][0].r != data[0][0].g || data[0][0].r != data[0][0].b)
+        throw runtime_error("Error: image is not a gray image");
+    if (block_size <= 0)
+        throw invalid_argument("Error: block size must be greater than 0");
+    if (mode == equalization_mode::clahe)
+    {
+        if (clip_limit <= 0.0f)
+            throw invalid_argument("Error: clip limit must be greater than 0");
+        data.make_writable();
+        EqualizeCLAHE(data, block_size, clip_limit);
+        return;
+    }
+
+    EqualizeLocal(data, scratch, block_size);
+    Commit(scratch);
+}
+
+template <typename Image>
+void Bitmap_cpp::EqualizeLocal(const Image& data, Image& new_data, const int block_size)
+{
+    const int height = data.height(), width = data.width();
+    int padding = block_size / 2 + block_size % 2 - 1;
+    int block_adjustment = 1 - block_size % 2;
+    bitmap_detail::assign_black(new_data, height, width);
+    for (int x = padding; x < height - padding - block_adjustment; x++)
+    {
+        int histogram[256] = {0};
+        for (int i = -padding; i <= padding + block_adjustment; i++)
+            for (int j = -padding; j <= padding + block_adjustment; j++)
+                histogram[bitmap_detail::gray_value(data.row(x + i)[padding + j])]++;
+
+        for (int y = padding; y < width - padding - block_adjustment; y++)
+        {
+            if (y > padding)
+            {
+                for (int i = -padding; i <= padding + block_adjustment; i++)
+                {
+                    histogram[bitmap_detail::gray_value(data.row(x + i)[y - padding - 1])]--;
+                    histogram[bitmap_detail::gray_value(data.row(x + i)[y + padding + block_adjustment])]++;
+                }
+            }
+
+            // Only cdf[value] and the first non-empty bin are needed, both come out of one partial scan
+            const int value = bitmap_detail::gray_value(data.row(x)[y]);
+            int cdf = 0, min_cdf = -1;
+            for (int i = 0; i <= value; i++)
+            {
+                cdf += histogram[i];
+                if (min_cdf < 0 && histogram[i] > 0)
+                    min_cdf = histogram[i];
+            }
+
+            int totel_pixel = (block_size + block_adjustment) * (block_size + block_adjustment);
+            if (totel_pixel == min_cdf)
+                continue;
+
+            int new_value = (cdf - min_cdf) * 255 / (totel_pixel - min_cdf);
+            bitmap_detail::set_gray(new_data.row(x)[y], new_value);
+        }
+    }
+}
+
+template <typename Image>
+void Bitmap_cpp::EqualizeCLAHE(Image& data, const int tile_size, const float clip_limit)
+{
+    const int height = data.height(), width = data.width();
+    const int tiles_x = (height + tile_size - 1) / tile_size;
+    const int tiles_y = (width + tile_size - 1) / tile_size;
+    vector<unsigned char> luts(static_cast<size_t>(tiles_x) * tiles_y * 256);
+
+    // One clipped histogram and mapping per tile
+    bitmap_detail::parallel_for(0, tiles_x * tiles_y, [&](int first_tile, int last_tile)
+    {
+        for (int tile = first_tile; tile < last_tile; tile++)
+        {
+            const int x0 = tile / tiles_y * tile_size, x1 = min(height, x0 + tile_size);
+            const int y0 = tile % tiles_y * tile_size, y1 = min(width, y0 + tile_size);
+            const int tile_pixels = (x1 - x0) * (y1 - y0);
+
+            int histogram[256] = {0};
+            for (int x = x0; x < x1; x++)
+                for (int y = y0; y < y1; y++)
+                    histogram[bitmap_detail::gray_value(data.row(x)[y])]++;
+
+            const int limit = max(1, static_cast<int>(clip_limit * tile_pixels / 256));
+            int excess = 0;
+            for (int i = 0; i < 256; i++)
+            {
+                if (histogram[i] > limit)
+                {
+                    excess += histogram[i] - limit;
+                    histogram[i] = limit;
+                }
+            }
+            const int share = excess / 256, remainder = excess % 256;
+            for (int i = 0; i < 256; i++)
+                histogram[i] += share + (i < remainder ? 1 : 0);
+
+            unsigned char* lut = &luts[static_cast<size_t>(tile) * 256];
+            int cdf = 0;
+            for (int i = 0; i < 256; i++)
+            {
+                cdf += histogram[i];
+                lut[i] = static_cast<unsigned char>(min(255, (cdf * 255 + tile_pixels / 2) / tile_pixels));
+            }
+        }
+    });
+
+    // Neighbouring tile centres and bilinear weights, shared by every row / column
+    auto Neighbours = [tile_size](const int position, const int tiles, int& first, int& second, float& weight)
+    {
+        const float offset = (position + 0.5f) / tile_size - 0.5f;
+        first = static_cast<int>(floor(offset));
+        weight = offset - first;
+        second = min(tiles - 1, first + 1);
+        first = max(0, first);
+        if (offset < 0.0f || first == second)
+            weight = 0.0f;
+    };
+    vector<int> column_first(width), column_second(width);
+    vector<float> column_weight(width);
+    for (int y = 0; y < width; y++)
+        Neighbours(y, tiles_y, column_first[y], column_second[y], column_weight[y]);
+
+    bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+        {
+            int top, bottom;
+            float row_weight;
+            Neighbours(x, tiles_x, top, bottom, row_weight);
+            const unsigned char* top_luts = &luts[static_cast<size_t>(top) * tiles_y * 256];
+            const unsigned char* bottom_luts = &luts[static_cast<size_t>(bottom) * tiles_y * 256];
+
+            auto* row = data.row(x);
+            for (int y = 0; y < width; y++)
+            {
+                const int value = bitmap_detail::gray_value(row[y]);
+                const int left = column_first[y] * 256 + value, right = column_second[y] * 256 + value;
+                const float w = column_weight[y];
+                const float upper = top_luts[left] + (top_luts[right] - top_luts[left]) * w;
+                const float lower = bottom_luts[left] + (bottom_luts[right] - bottom_luts[left]) * w;
+                bitmap_detail::set_gray(row[y], static_cast<int>(upper + (lower - upper) * row_weight + 0.5f));
+            }
+        }
+    });
+}
+
+template <typename Rows>
+void Bitmap_cpp::FilterInto(Bitmap_cpp& dst, Rows rows) const
+{
+    // rows(src, out, first_row, last_row) writes every pixel of its band. In place, or into a region that
+    // overlaps this image, the result goes to the scratch buffer first and is committed afterwards.
+    const bool region = dst.data.is_view() && dst.data.writable() && dst.data.height() == info_header.height && dst.data.width() == info_header.width;
+    const bool staged = &dst == this || (region && bitmap_detail::overlaps(data, dst.data));
+    pixel_buffer& out = staged ? dst.scratch : dst.data;
+    if (staged || !region)
+        out.resize_for_overwrite(info_header.height, info_header.width);
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        rows(data, out, first_row, last_row);
+    });
+    if (staged)
+        dst.Commit(dst.scratch);
+    if (&dst != this)
+    {
+        dst.header = header;
+        dst.info_header = info_header;
+        dst.format_requested = format_requested;
+    }
+}
+
+void Bitmap_cpp::Commit(pixel_buffer& result)
+{
+    if (!data.is_view() || !data.writable() || data.height() != result.height() || data.width() != result.width())
+    {
+        data.swap(result);
+        return;
+    }
+    const size_t row_bytes = static_cast<size_t>(result.width()) * sizeof(pixel);
+    bitmap_detail::parallel_for(0, result.height(), [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            memcpy(data.row(x), result.row(x), row_bytes);
+    });
+}
+
+void Bitmap_cpp::SpatialLowPassFilter(const int filter_size)
+{
+    SpatialLowPassFilterInto(*this, filter_size);
+}
+
+void Bitmap_cpp::SpatialLowPassFilterInto(Bitmap_cpp& dst, const int filter_size) const
+{
+    BITMAP_TRACE_SPAN("SpatialLowPassFilter", &info_header, &dst.info_header);
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        LowPassRows(src, out, filter_size, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
+
+template <typename RowDone>
+void Bitmap_cpp::LowPassRows(const pixel_buffer& src, pixel_buffer& dst, const int filter_size, const int first_row, const int last_row, RowDone row_done)
+{
+    // The box filter only writes the color of pixels with a full window, everything else is copied
+    const int height = src.height(), width = src.width(), padding = filter_size / 2;
+    bitmap_detail::box_filter_rows<3>(
+        reinterpret_cast<const unsigned char*>(src.row(0)), src.stride_bytes(), sizeof(pixel),
+        reinterpret_cast<unsigned char*>(dst.row(0)), dst.stride_bytes(),
+        width, height, filter_size, first_row, last_row, [&](int x)
+    {
+        const pixel* in = src.row(x);
+        pixel* out = dst.row(x);
+        copy(in, in + padding, out);
+        copy(in + width - padding, in + width, out + width - padding);
+        for (int y = padding; y < width - padding; y++)
+            out[y].a = in[y].a;
+        row_done(x);
+    });
+
+    for (int x = first_row; x < last_row; x++)
+    {
+        if (width >= filter_size && x >= padding && x < height - padding)
+            continue;
+        copy(src.row(x), src.row(x) + width, dst.row(x));
+        row_done(x);
+    }
+}
+
+template <typename Query>
+void Bitmap_cpp::RankFilter(Bitmap_cpp& dst, const int filter_size, Query query) const
+{
+    bitmap_detail::rank_storage* storage = &dst.rank_scratch;
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        RankRows(src, out, filter_size, first_row, last_row, query, bitmap_detail::no_row_callback(), *storage);
+    });
+}
+
+template <typename RowDone>
+void Bitmap_cpp::LowPassRows(const channel_plane& src, channel_plane& dst, const int filter_size, const int first_row, const int last_row, RowDone row_done)
+{
+    const int height = src.height(), width = src.width(), padding = filter_size / 2;
+    bitmap_detail::box_filter_rows<1>(src.row(0), src.stride(), 1, dst.row(0), dst.stride(), width, height, filter_size, first_row, last_row, [&](int x)
+    {
+        copy(src.row(x), src.row(x) + padding, dst.row(x));
+        copy(src.row(x) + width - padding, src.row(x) + width, dst.row(x) + width - padding);
+        row_done(x);
+    });
+
+    for (int x = first_row; x < last_row; x++)
+    {
+        if (width >= filter_size && x >= padding && x < height - padding)
+            continue;
+        copy(src.row(x), src.row(x) + width, dst.row(x));
+        row_done(x);
+    }
+}
+
+template <typename Query, typename RowDone>
+void Bitmap_cpp::RankRows(const pixel_buffer& src, pixel_buffer& dst, const int filter_size, const int first_row, const int last_row, Query query, RowDone row_done, bitmap_detail::rank_storage& storage)
+{
+    // Every band starts its own window, the histograms only depend on the rows under it.
+    // A row is complete after the last channel, pixels without a full window are black.
+    const int height = src.height(), width = src.width(), padding = filter_size / 2;
+    const bitmap_detail::rank_storage::lease histograms(storage, width);
+    for (int c = 0; c < 3; c++)
+    {
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(src.row(0)) + c;
+        unsigned char* out = reinterpret_cast<unsigned char*>(dst.row(0)) + c;
+        bitmap_detail::rank_window window(in, src.stride_bytes(), sizeof(pixel), width, filter_size, *histograms);
+        if (c < 2)
+        {
+            window.FilterRows(out, dst.stride_bytes(), sizeof(pixel), height, first_row, last_row, query, bitmap_detail::no_row_callback());
+            continue;
+        }
+        window.FilterRows(out, dst.stride_bytes(), sizeof(pixel), height, first_row, last_row, query, [&](int x)
+        {
+            pixel* row = dst.row(x);
+            fill(row, row + padding, pixel());
+            fill(row + width - padding, row + width, pixel());
+            for (int y = padding; y < width - padding; y++)
+                row[y].a = 255;
+            row_done(x);
+        });
+    }
+
+    for (int x = first_row; x < last_row; x++)
+    {
+        if (width >= filter_size && x >= padding && x < height - padding)
+            continue;
+        fill(dst.row(x), dst.row(x) + width, pixel());
+        row_done(x);
+    }
+}
+
+template <typename Query, typename RowDone>
+void Bitmap_cpp::RankRows(const channel_plane& src, channel_plane& dst, const int filter_size, const int first_row, const int last_row, Query query, RowDone row_done, bitmap_detail::rank_storage& storage)
+{
+    const int height = src.height(), width = src.width(), padding = filter_size / 2;
+    const bitmap_detail::rank_storage::lease histograms(storage, width);
+    bitmap_detail::rank_window window(src.row(0), src.stride(), 1, width, filter_size, *histograms);
+    window.FilterRows(dst.row(0), dst.stride(), 1, height, first_row, last_row, query, [&](int x)
+    {
+        fill(dst.row(x), dst.row(x) + padding, 0);
+        fill(dst.row(x) + width - padding, dst.row(x) + width, 0);
+        row_done(x);
+    });
+
+    for (int x = first_row; x < last_row; x++)
+    {
+        if (width >= filter_size && x >= padding && x < height - padding)
+            continue;
+        fill(dst.row(x), dst.row(x) + width, 0);
+        row_done(x);
+    }
+}
+
+void Bitmap_cpp::MedianFilter(const int filter_size)
+{
+    MedianFilterInto(*this, filter_size);
+}
+
+void Bitmap_cpp::MedianFilterInto(Bitmap_cpp& dst, const int filter_size) const
+{
+    BITMAP_TRACE_SPAN("MedianFilter", &info_header, &dst.info_header);
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+
+    RankFilter(dst, filter_size, [](bitmap_detail::rank_window& window) { return window.Kth(window.Size() / 2); });
+}
+
+void Bitmap_cpp::AlphaTrimmedMeanFilter(const int filter_size, const int removed_elements)
+{
+    AlphaTrimmedMeanFilterInto(*this, filter_size, removed_elements);
+}
+
+void Bitmap_cpp::AlphaTrimmedMeanFilterInto(Bitmap_cpp& dst, const int filter_size, const int removed_elements) const
+{
+    BITMAP_TRACE_SPAN("AlphaTrimmedMeanFilter", &info_header, &dst.info_header);
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_removed_elements(filter_size, removed_elements);
+    const int filter_pixels = filter_size * filter_size;
+
+    const bitmap_detail::exact_divider divide(filter_pixels - removed_elements * 2);
+    RankFilter(dst, filter_size, [=](bitmap_detail::rank_window& window)
+    {
+        return divide(window.TotalSum() - window.LowestSum(removed_elements) - window.HighestSum(removed_elements));
+    });
+}
+
+void Bitmap_cpp::PercentileFilter(const int filter_size, const float percentile)
+{
+    PercentileFilterInto(*this, filter_size, percentile);
+}
+
+void Bitmap_cpp::PercentileFilterInto(Bitmap_cpp& dst, const int filter_size, const float percentile) const
+{
+    BITMAP_TRACE_SPAN("PercentileFilter", &info_header, &dst.info_header);
+    PercentileInto(dst, filter_size, percentile);
+}
+
+void Bitmap_cpp::PercentileInto(Bitmap_cpp& dst, const int filter_size, const float percentile) const
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_percentile(percentile);
+
+    const int rank = static_cast<int>(percentile / 100.0f * (filter_size * filter_size - 1) + 0.5f);
+    RankFilter(dst, filter_size, [=](bitmap_detail::rank_window& window) { return window.Kth(rank); });
+}
+
+void Bitmap_cpp::MinFilter(const int filter_size)
+{
+    MinFilterInto(*this, filter_size);
+}
+
+void Bitmap_cpp::MinFilterInto(Bitmap_cpp& dst, const int filter_size) const
+{
+    BITMAP_TRACE_SPAN("MinFilter", &info_header, &dst.info_header);
+    PercentileInto(dst, filter_size, 0.0f);
+}
+
+void Bitmap_cpp::MaxFilter(const int filter_size)
+{
+    MaxFilterInto(*this, filter_size);
+}
+
+void Bitmap_cpp::MaxFilterInto(Bitmap_cpp& dst, const int filter_size) const
+{
+    BITMAP_TRACE_SPAN("MaxFilter", &info_header, &dst.info_header);
+    PercentileInto(dst, filter_size, 100.0f);
+}
+
+void Bitmap_cpp::SpatialHighPassFilter(const int filter_size)
+{
+    SpatialHighPassFilterInto(*this, filter_size);
+}
+
+void Bitmap_cpp::SpatialHighPassFilterInto(Bitmap_cpp& dst, const int filter_size) const
+{
+    BITMAP_TRACE_SPAN("SpatialHighPassFilter", &info_header, &dst.info_header);
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        HighPassRows(src, out, filter_size, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
+
+template <typename Image, typename RowDone>
+void Bitmap_cpp::HighPassRows(const Image& src, Image& dst, const int filter_size, const int first_row, const int last_row, RowDone row_done)
+{
+    /* kernel example, filter_size = 3
+    -1 -1 -1
+    -1  8 -1
+    -1 -1 -1
+    */
+    const int filter_pixels = filter_size * filter_size;
+    auto response = [=](const int32_t* const* sums, int i) { return max(0, min(255, sums[0][i] / filter_pixels)); };
+    if (filter_size == 3)
+    {
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done, bitmap_detail::static_kernel<3,
+            -1, -1, -1,
+            -1,  8, -1,
+            -1, -1, -1>());
+        return;
+    }
+
+    vector<int> kernel(filter_pixels, -1);
+    kernel[filter_pixels / 2] = filter_pixels - 1;
+    ConvolutionRows(src, dst, first_row, last_row, response, row_done, bitmap_detail::runtime_kernel(filter_size, kernel));
+}
+
+void Bitmap_cpp::SpatialHighBoostFilter(const int filter_size, const float boost_ratio)
+{
+    SpatialHighBoostFilterInto(*this, filter_size, boost_ratio);
+}
+
+void Bitmap_cpp::SpatialHighBoostFilterInto(Bitmap_cpp& dst, const int filter_size, const float boost_ratio) const
+{
+    BITMAP_TRACE_SPAN("SpatialHighBoostFilter", &info_header, &dst.info_header);
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    if (boost_ratio < 1.0f)
+        throw invalid_argument("Error: boost ratio must be greater than 1.0");
+
+    // The original is still the source, so every high-pass row is boosted as soon as it is finished
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        HighPassRows(src, out, filter_size, first_row, last_row, [&](int x)
+        {
+            const pixel* original = src.row(x);
+            pixel* highpass = out.row(x);
+            for (int y = 0; y < src.width(); y++)
+            {
+                highpass[y].r = min(255, max(0, static_cast<int>((boost_ratio - 1) * original[y].r + highpass[y].r)));
+                highpass[y].g = min(255, max(0, static_cast<int>((boost_ratio - 1) * original[y].g + highpass[y].g)));
+                highpass[y].b = min(255, max(0, static_cast<int>((boost_ratio - 1) * original[y].b + highpass[y].b)));
+            }
+        });
+    });
+}
+
+void Bitmap_cpp::PrewittOperator(bool Diagonal)
+{
+    PrewittOperatorInto(*this, Diagonal);
+}
+
+void Bitmap_cpp::PrewittOperatorInto(Bitmap_cpp& dst, bool Diagonal) const
+{
+    BITMAP_TRACE_SPAN("PrewittOperator", &info_header, &dst.info_header);
+    CheckValid();
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        PrewittRows(src, out, Diagonal, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
+
+template <typename Image, typename RowDone>
+void Bitmap_cpp::PrewittRows(const Image& src, Image& dst, const bool diagonal, const int first_row, const int last_row, RowDone row_done)
+{
+    auto response = [](const int32_t* const* sums, int i) { return min(255, abs(sums[0][i]) + abs(sums[1][i])); };
+    if (!diagonal)
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done,
+            bitmap_detail::static_kernel<3,
+                -1, 0, 1,
+                -1, 0, 1,
+                -1, 0, 1>(),
+            bitmap_detail::static_kernel<3,
+                -1, -1, -1,
+                 0,  0,  0,
+                 1,  1,  1>());
+    else
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done,
+            bitmap_detail::static_kernel<3,
+                -1, -1, 0,
+                -1,  0, 1,
+                 0,  1, 1>(),
+            bitmap_detail::static_kernel<3,
+                 0,  1, 1,
+                -1,  0, 1,
+                -1, -1, 0>());
+}
+
+void Bitmap_cpp::SobelOperator(bool Diagonal)
+{
+    SobelOperatorInto(*this, Diagonal);
+}
+
+void Bitmap_cpp::SobelOperatorInto(Bitmap_cpp& dst, bool Diagonal) const
+{
+    BITMAP_TRACE_SPAN("SobelOperator", &info_header, &dst.info_header);
+    CheckValid();
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        SobelRows(src, out, Diagonal, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
+
+template <typename Image, typename RowDone>
+void Bitmap_cpp::SobelRows(const Image& src, Image& dst, const bool diagonal, const int first_row, const int last_row, RowDone row_done)
+{
+    auto response = [](const int32_t* const* sums, int i) { return min(255, abs(sums[0][i]) + abs(sums[1][i])); };
+    if (!diagonal)
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done,
+            bitmap_detail::static_kernel<3,
+                -1, 0, 1,
+                -2, 0, 2,
+                -1, 0, 1>(),
+            bitmap_detail::static_kernel<3,
+                -1, -2, -1,
+                 0,  0,  0,
+                 1,  2,  1>());
+    else
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done,
+            bitmap_detail::static_kernel<3,
+                -2, -1, 0,
+                -1,  0, 1,
+                 0,  1, 2>(),
+            bitmap_detail::static_kernel<3,
+                 0,  1, 2,
+                -1,  0, 1,
+                -2, -1, 0>());
+}
+
+void Bitmap_cpp::LaplacianOperator(bool Enhanced)
+{
+    LaplacianOperatorInto(*this, Enhanced);
+}
+
+void Bitmap_cpp::LaplacianOperatorInto(Bitmap_cpp& dst, bool Enhanced) const
+{
+    BITMAP_TRACE_SPAN("LaplacianOperator", &info_header, &dst.info_header);
+    CheckValid();
+    FilterInto(dst, [=](const pixel_buffer& src, pixel_buffer& out, int first_row, int last_row)
+    {
+        LaplacianRows(src, out, Enhanced, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
+
+template <typename Image, typename RowDone>
+void Bitmap_cpp::LaplacianRows(const Image& src, Image& dst, const bool enhanced, const int first_row, const int last_row, RowDone row_done)
+{
+    auto response = [](const int32_t* const* sums, int i) { return max(0, min(255, sums[0][i])); };
+    if (!enhanced)
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done,
+            bitmap_detail::static_kernel<3,
+                0,  1, 0,
+                1, -4, 1,
+                0,  1, 0>());
+    else
+        ConvolutionRows(src, dst, first_row, last_row, response, row_done,
+            bitmap_detail::static_kernel<3,
+                1,  1, 1,
+                1, -8, 1,
+                1,  1, 1>());
+}
+
+template <typename Response, typename RowDone, typename... Kernels>
+void Bitmap_cpp::ConvolutionRows(const pixel_buffer& src, pixel_buffer& dst, const int first_row, const int last_row, Response response, RowDone row_done, const Kernels&... kernels)
+{
+    // Rows and columns without a full window are black, response(sums, i) gives one channel of the others
+    const int height = src.height(), width = src.width();
+    const int size = bitmap_detail::kernel_size(kernels...), padding = size / 2;
+    bitmap_detail::convolve_rows<3>(
+        reinterpret_cast<const unsigned char*>(src.row(0)), src.stride_bytes(), sizeof(pixel), width, height,
+        first_row, last_row, [&](int x, const int32_t* const* sums)
+    {
+        pixel* row = dst.row(x);
+        unsigned char* out = reinterpret_cast<unsigned char*>(row);
+        fill(row, row + padding, pixel());
+        fill(row + width - padding, row + width, pixel());
+        for (int y = padding; y < width - padding; y++)
+        {
+            for (int c = 0; c < 3; c++)
+                out[y * sizeof(pixel) + c] = static_cast<unsigned char>(response(sums, y * 3 + c));
+            row[y].a = 255;
+        }
+        row_done(x);
+    }, kernels...);
+
+    for (int x = first_row; x < last_row; x++)
+    {
+        if (width >= size && x >= padding && x < height - padding)
+            continue;
+        fill(dst.row(x), dst.row(x) + width, pixel());
+        row_done(x);
+    }
+}
+
+template <typename Response, typename RowDone, typename... Kernels>
+void Bitmap_cpp::ConvolutionRows(const channel_plane& src, channel_plane& dst, const int first_row, const int last_row, Response response, RowDone row_done, const Kernels&... kernels)
+{
+    const int height = src.height(), width = src.width();
+    const int size = bitmap_detail::kernel_size(kernels...), padding = size / 2;
+    bitmap_detail::convolve_rows<1>(src.row(0), src.stride(), 1, width, height, first_row, last_row, [&](int x, const int32_t* const* sums)
+    {
+        unsigned char* out = dst.row(x);
+        fill(out, out + padding, 0);
+        fill(out + width - padding, out + width, 0);
+        for (int y = padding; y < width - padding; y++)
+            out[y] = static_cast<unsigned char>(response(sums, y));
+        row_done(x);
+    }, kernels...);
+
+    for (int x = first_row; x < last_row; x++)
+    {
+        if (width >= size && x >= padding && x < height - padding)
+            continue;
+        fill(dst.row(x), dst.row(x) + width, 0);
+        row_done(x);
+    }
+}
+
+vector<int> Bitmap_cpp::DCT_Transform(const vector<pixel> data, const float u, const float v, const int N)
+{
+    const float PI = 3.1415926;
+    const float alpha_u = u == 0 ? 1 / sqrt(N) : sqrt(2.0 / N), alpha_v = v == 0 ? 1 / sqrt(N) : sqrt(2.0 / N);
+    const float alpha_coefficient = alpha_u * alpha_v;
+
+    float sum_r = 0, sum_g = 0, sum_b = 0;
+    for (int x = 0; x < N; x++)
+    {
+        const float cos_u = cos((2 * x + 1) * u * PI / (2.0 * N));
+        for (int y = 0; y < N; y++)
+        {
+            const float cos_v = cos((2 * y + 1) * v * PI / (2.0 * N));
+            const float coefficient = cos_u * cos_v;
+            sum_r += (data[x * N + y].r - 128) * coefficient;
+            sum_g += (data[x * N + y].g - 128) * coefficient;
+            sum_b += (data[x * N + y].b - 128) * coefficient;
+        }
+    }
+    return vector<int>{
+        static_cast<int>(alpha_coefficient * sum_r),
+        static_cast<int>(alpha_coefficient * sum_g),
+        static_cast<int>(alpha_coefficient * sum_b)
+    };
+}
+
+pixel Bitmap_cpp::IDCT_Transform(const vector<vector<int>> data, const float x, const float y, const int N)
+{
+    const float PI = 3.1415926;
+
+    float sum_r = 0, sum_g = 0, sum_b = 0;
+    for (int u = 0; u < N; u++)
+    {
+        const float alpha_u = u == 0 ? 1 / sqrt(N) : sqrt(2.0 / N);
+        const float cos_u = cos((2 * x + 1) * u * PI / (2.0 * N));
+        for (int v = 0; v < N; v++)
+        {
+            const float alpha_v = v == 0 ? 1 / sqrt(N) : sqrt(2.0 / N);
+            const float cos_v = cos((2 * y + 1) * v * PI / (2.0 * N));
+            const float coefficient = alpha_u * alpha_v * cos_u * cos_v;
+            sum_r += data[0][u * N + v] * coefficient;
+            sum_g += data[1][u * N + v] * coefficient;
+            sum_b += data[2][u * N + v] * coefficient;
+        }
+    }
+    return pixel{
+        static_cast<unsigned char>(sum_r + 128),
+        static_cast<unsigned char>(sum_g + 128),
+        static_cast<unsigned char>(sum_b + 128)
+    };
+}
+
+void Bitmap_cpp::DCT_Compress(const dct_precision precision)
+{
+    BITMAP_TRACE_SPAN("DCT_Compress", &info_header, &info_header);
+    CheckValid();
+    data.make_writable();
+    CompressDCTBlocks(bitmap_detail::rgb_of(data), precision);
+}
+
+void Bitmap_cpp::CompressDCTBlocks(const bitmap_detail::rgb_view<unsigned char>& image, const dct_precision precision)
+{
+    // Keeps the coefficients with u + v < 4, blocks run in parallel and are transformed in place
+    const int N = 8, keep_diagonals = 4;
+    const int block_rows = (image.height + N - 1) / N, block_cols = (image.width + N - 1) / N;
+    bitmap_detail::parallel_for(0, block_rows, [&](int first_block, int last_block)
+    {
+        for (int bx = first_block; bx < last_block; bx++)
+        {
+            for (int by = 0; by < block_cols; by++)
+            {
+                if (precision == dct_precision::fixed_point)
+                    bitmap_detail::dct_compress_block<int32_t>(image, bx * N, by * N, keep_diagonals);
+                else
+                    bitmap_detail::dct_compress_block<float>(image, bx * N, by * N, keep_diagonals);
+            }
+        }
+    });
+}
+
+vector<unsigned char> Bitmap_cpp::DCT_Encode(const int quality) const
+{
+    BITMAP_TRACE_SPAN("DCT_Encode", &info_header, nullptr);
+    CheckValid();
+    return EncodeDCT(bitmap_detail::rgb_of(data), quality);
+}
+
+vector<unsigned char> Bitmap_cpp::EncodeDCT(const bitmap_detail::rgb_view<const unsigned char>& image, const int quality)
+{
+    if (quality < 1 || quality > 100)
+        throw invalid_argument("Error: quality must be between 1 and 100");
+
+    const int height = image.height, width = image.width;
+    const int block_rows = (height + 7) / 8;
+    bitmap_detail::dct_tables tables;
+    bitmap_detail::scale_quantization(bitmap_detail::luma_quantization, quality, tables.quantization[0]);
+    bitmap_detail::scale_quantization(bitmap_detail::chroma_quantization, quality, tables.quantization[1]);
+
+    // First pass collects the symbol statistics for per-image optimal Huffman tables
+    uint32_t frequencies[4][256] = {};
+    mutex frequencies_lock;
+    bitmap_detail::parallel_for(0, block_rows, [&](int first_block, int last_block)
+    {
+        uint32_t local[4][256] = {};
+        vector<int16_t> coefficients;
+        for (int bx = first_block; bx < last_block; bx++)
+        {
+            bitmap_detail::quantize_block_row(image, bx, tables, coefficients);
+            int dc_prediction[3] = {0, 0, 0};
+            for (size_t block = 0; block < coefficients.size() / 64; block++)
+            {
+                const int c = static_cast<int>(block % 3);
+                bitmap_detail::count_block(&coefficients[block * 64], dc_prediction[c], local[c == 0 ? 0 : 2], local[c == 0 ? 1 : 3]);
+            }
+        }
+        lock_guard<mutex> guard(frequencies_lock);
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 256; j++)
+                frequencies[i][j] += local[i][j];
+    });
+    for (int i = 0; i < 4; i++)
+        tables.huffman[i].Build(frequencies[i]);
+
+    // Second pass transforms again instead of keeping every coefficient, each block row is its own segment
+    vector<vector<unsigned char>> segments(block_rows);
+    bitmap_detail::parallel_for(0, block_rows, [&](int first_block, int last_block)
+    {
+        vector<int16_t> coefficients;
+        for (int bx = first_block; bx < last_block; bx++)
+        {
+            bitmap_detail::quantize_block_row(image, bx, tables, coefficients);
+            bitmap_detail::bit_writer writer(segments[bx]);
+            int dc_prediction[3] = {0, 0, 0};
+            for (size_t block = 0; block < coefficients.size() / 64; block++)
+            {
+                const int c = static_cast<int>(block % 3);
+                bitmap_detail::encode_block(&coefficients[block * 64], dc_prediction[c], tables.huffman[c == 0 ? 0 : 2], tables.huffman[c == 0 ? 1 : 3], writer);
+            }
+            writer.Flush();
+            segments[bx].push_back(0xFF);
+            segments[bx].push_back(static_cast<unsigned char>(0xD0 + (bx & 7)));
+        }
+    });
+
+    vector<unsigned char> bytes(sizeof(dct_file_header));
+    tables.Write(bytes);
+    vector<uint32_t> row_offsets(block_rows);
+    size_t data_size = 0;
+    for (int bx = 0; bx < block_rows; bx++)
+    {
+        row_offsets[bx] = static_cast<uint32_t>(data_size);
+        data_size += segments[bx].size();
+    }
+    if (data_size > UINT32_MAX)
+        throw runtime_error("Error: compressed data is too large");
+    const unsigned char* offset_bytes = reinterpret_cast<const unsigned char*>(row_offsets.data());
+    bytes.insert(bytes.end(), offset_bytes, offset_bytes + row_offsets.size() * sizeof(uint32_t));
+
+    dct_file_header file_header;
+    memcpy(file_header.signature, "BDCT", 4);
+    file_header.version = 1;
+    file_header.quality = static_cast<uint16_t>(quality);
+    file_header.width = width;
+    file_header.height = height;
+    file_header.data_offset = static_cast<uint32_t>(bytes.size());
+    file_header.data_size = static_cast<uint32_t>(data_size);
+    memcpy(bytes.data(), &file_header, sizeof(dct_file_header));
+
+    bytes.reserve(bytes.size() + data_size);
+    for (auto& segment : segments)
+        bytes.insert(bytes.end(), segment.begin(), segment.end());
+    return bytes;
+}
+
+void Bitmap_cpp::DCT_Decode(const vector<unsigned char>& bytes, const int first_row, const int row_count)
+{
+    BITMAP_TRACE_SPAN("DCT_Decode", nullptr, &info_header);
+    dct_file_header file_header;
+    bitmap_detail::dct_tables tables;
+    vector<uint32_t> row_offsets;
+    ReadDCTHeader(bytes.data(), bytes.size(), file_header, tables, row_offsets);
+    if (static_cast<size_t>(file_header.data_offset) + file_header.data_size > bytes.size())
+        throw runtime_error("Error: DCT data exceeds buffer size");
+    DecodeDCT(file_header, tables, row_offsets, bytes.data() + file_header.data_offset, 0, first_row, row_count);
+}
+
+void Bitmap_cpp::SaveDCT(string file_path, const int quality, const bool atomic_replace)
+{
+    BITMAP_TRACE_SPAN("SaveDCT", &info_header, nullptr);
+    CheckValid();
+    const pixel_buffer& pixels = data;
+    bitmap_detail::write_dct_file(file_path, EncodeDCT(bitmap_detail::rgb_of(pixels), quality), atomic_replace);
+}
+
+void Bitmap_cpp::LoadDCT(string file_path, const int first_row, const int row_count)
+{
+    BITMAP_TRACE_SPAN("LoadDCT", nullptr, &info_header);
+    ifstream file(file_path, ios::binary);
+    if (!file.is_open())
+        throw runtime_error("Error: file not found");
+
+    dct_file_header file_header;
+    if (!file.read(reinterpret_cast<char*>(&file_header), sizeof(dct_file_header)) || memcmp(file_header.signature, "BDCT", 4) != 0)
+        throw runtime_error("Error: file is not a DCT file");
+    // The header and the entropy data have to be in the file before any buffer is sized from them
+    file.seekg(0, ios::end);
+    const uint64_t file_size = static_cast<uint64_t>(file.tellg());
+    file.seekg(sizeof(dct_file_header), ios::beg);
+    if (file_header.data_offset < sizeof(dct_file_header) || file_header.data_offset > file_size)
+        throw runtime_error("Error: corrupt DCT header");
+    if (static_cast<uint64_t>(file_header.data_offset) + file_header.data_size > file_size)
+        throw runtime_error("Error: DCT data exceeds file size");
+
+    vector<unsigned char> prefix(file_header.data_offset);
+    memcpy(prefix.data(), &file_header, sizeof(dct_file_header));
+    if (!file.read(reinterpret_cast<char*>(prefix.data() + sizeof(dct_file_header)), prefix.size() - sizeof(dct_file_header)))
+        throw runtime_error("Error: corrupt DCT header");
+
+    bitmap_detail::dct_tables tables;
+    vector<uint32_t> row_offsets;
+    ReadDCTHeader(prefix.data(), prefix.size(), file_header, tables, row_offsets);
+
+    // Only the segments covering the requested rows are read
+    const int last_row = row_count < 0 ? file_header.height : first_row + row_count;
+    if (first_row < 0 || last_row > file_header.height || first_row >= last_row)
+        throw invalid_argument("Error: row band is out of range");
+    const int first_block = first_row / 8, last_block = (last_row + 7) / 8;
+    const uint32_t begin = row_offsets[first_block];
+    const uint32_t end = last_block < static_cast<int>(row_offsets.size()) ? row_offsets[last_block] : file_header.data_size;
+
+    vector<unsigned char> segments(end - begin);
+    file.seekg(static_cast<streamoff>(file_header.data_offset) + begin, ios::beg);
+    if (!file.read(reinterpret_cast<char*>(segments.data()), segments.size()))
+        throw runtime_error("Error: DCT data exceeds file size");
+
+    if (bitmap_detail::logging_enabled())
+        bitmap_detail::log_message(bitmap_detail::file_name_of(file_path) + " is a DCT file (quality " + to_string(file_header.quality) + ")");
+
+    DecodeDCT(file_header, tables, row_offsets, segments.data(), begin, first_row, row_count);
+}
+
+void Bitmap_cpp::ReadDCTHeader(const unsigned char* bytes, const size_t size, dct_file_header& file_header, bitmap_detail::dct_tables& tables, vector<uint32_t>& row_offsets)
+{
+    if (size < sizeof(dct_file_header))
+        throw runtime_error("Error: file is not a DCT file");
+    memcpy(&file_header, bytes, sizeof(dct_file_header));
+    if (memcmp(file_header.signature, "BDCT", 4) != 0)
+        throw runtime_error("Error: file is not a DCT file");
+    if (file_header.version != 1)
+        throw runtime_error("Error: unsupported DCT version");
+    if (file_header.width <= 0 || file_header.height <= 0)
+        throw runtime_error("Error: invalid image size");
+    if (static_cast<uint64_t>(file_header.width) * static_cast<uint64_t>(file_header.height) > bitmap_detail::max_dct_pixels)
+        throw runtime_error("Error: image is too large");
+    // Every block codes a DC difference and at least one AC symbol (end of block when the rest is zero) per
+    // component, a bit each at the least, and every segment ends in a 2-byte restart marker. Data shorter
+    // than that cannot hold the declared size.
+    const size_t block_rows = (static_cast<size_t>(file_header.height) + 7) / 8;
+    const uint64_t block_cols = (static_cast<uint64_t>(file_header.width) + 7) / 8;
+    if (block_rows * ((block_cols * 6 + 7) / 8 + 2) > file_header.data_size)
+        throw runtime_error("Error: DCT data is too short for the image size");
+    if (file_header.data_offset > size)
+        throw runtime_error("Error: corrupt DCT header");
+
+    const unsigned char* end = bytes + file_header.data_offset;
+    const unsigned char* current = tables.Read(bytes + sizeof(dct_file_header), end);
+    if (static_cast<size_t>(end - current) != block_rows * sizeof(uint32_t))
+        throw runtime_error("Error: corrupt DCT header");
+    row_offsets.resize(block_rows);
+    memcpy(row_offsets.data(), current, block_rows * sizeof(uint32_t));
+    for (size_t i = 0; i < block_rows; i++)
+        if (row_offsets[i] > file_header.data_size || (i > 0 && row_offsets[i] < row_offsets[i - 1]))
+            throw runtime_error("Error: corrupt DCT header");
+}
+
+void Bitmap_cpp::DecodeDCT(const dct_file_header& file_header, const bitmap_detail::dct_tables& tables, const vector<uint32_t>& row_offsets, const unsigned char* segments, const uint32_t segments_offset, const int first_row, const int row_count)
+{
+    const int height = file_header.height, width = file_header.width;
+    const int last_row = row_count < 0 ? height : first_row + row_count;
+    if (first_row < 0 || last_row > height || first_row >= last_row)
+        throw invalid_argument("Error: row band is out of range");
+
+    pixel_buffer& new_data = scratch;
+    new_data.assign(last_row - first_row, width, pixel());
+    DecodeDCTRows(file_header, tables, row_offsets, segments, segments_offset, first_row, bitmap_detail::rgb_of(new_data));
+    MakeHeaders(width, last_row - first_row, header, info_header);
+    Commit(new_data);
+}
+
+void Bitmap_cpp::DecodeDCTRows(const dct_file_header& file_header, const bitmap_detail::dct_tables& tables, const vector<uint32_t>& row_offsets, const unsigned char* segments, const uint32_t segments_offset, const int first_row, const bitmap_detail::rgb_view<unsigned char>& dst)
+{
+    // Restart segments are independent, so block rows decode in parallel
+    const int first_block = first_row / 8, last_block = (first_row + dst.height + 7) / 8;
+    bitmap_detail::parallel_for(first_block, last_block, [&](int begin, int end)
+    {
+        for (int bx = begin; bx < end; bx++)
+        {
+            const uint32_t segment_end = bx + 1 < static_cast<int>(row_offsets.size()) ? row_offsets[bx + 1] : file_header.data_size;
+            bitmap_detail::decode_block_row(segments + (row_offsets[bx] - segments_offset), segments + (segment_end - segments_offset), bx, tables, dst, first_row, file_header.height);
+        }
+    });
+}
+
+// Headers of a new 24-bit image
+void Bitmap_cpp::MakeHeaders(const int width, const int height, bmp_header& header, bmp_info_header& info_header)
+{
+    const int row_bytes = (width * 3 + 3) / 4 * 4;
+    memcpy(header.signature, "BM", 2);
+    header.reserved = 0;
+    header.data_offset = sizeof(bmp_header) + sizeof(bmp_info_header);
+    info_header = bmp_info_header();
+    info_header.size = sizeof(bmp_info_header);
+    info_header.width = width;
+    info_header.height = height;
+    info_header.planes = 1;
+    info_header.bit_count = 24;
+    info_header.size_image = row_bytes * height;
+    header.file_size = header.data_offset + info_header.size_image;
+}
+
+Bitmap_cpp Bitmap_cpp::operator+(const Bitmap_cpp& other) const &
+{
+    Bitmap_cpp result;
+    BITMAP_TRACE_SPAN("operator+", &info_header, &result.info_header);
+    result.EvaluateExpr(Expr() + other);
+    return result;
+}
+
+Bitmap_cpp Bitmap_cpp::operator+(const Bitmap_cpp& other) &&
+{
+    BITMAP_TRACE_SPAN("operator+", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().add);
+    return move(*this);
+}
+
+Bitmap_cpp Bitmap_cpp::operator-(const Bitmap_cpp& other) const &
+{
+    Bitmap_cpp result;
+    BITMAP_TRACE_SPAN("operator-", &info_header, &result.info_header);
+    result.EvaluateExpr(Expr() - other);
+    return result;
+}
+
+Bitmap_cpp Bitmap_cpp::operator-(const Bitmap_cpp& other) &&
+{
+    BITMAP_TRACE_SPAN("operator-", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().subtract);
+    return move(*this);
+}
+
+Bitmap_cpp Bitmap_cpp::operator*(const int& scaler) const &
+{
+    Bitmap_cpp result;
+    BITMAP_TRACE_SPAN("operator*", &info_header, &result.info_header);
+    result.EvaluateExpr(Expr() * scaler);
+    return result;
+}
+
+Bitmap_cpp Bitmap_cpp::operator*(const int& scaler) &&
+{
+    BITMAP_TRACE_SPAN("operator*", &info_header, &info_header);
+    if (scaler <= 0)
+        throw invalid_argument("Error: scaler must be greater than 0");
+    ScaleBy(scaler, bitmap_detail::pointwise().multiply);
+    return move(*this);
+}
+
+Bitmap_cpp Bitmap_cpp::operator/(const int& scaler) const &
+{
+    Bitmap_cpp result;
+    BITMAP_TRACE_SPAN("operator/", &info_header, &result.info_header);
+    result.EvaluateExpr(Expr() / scaler);
+    return result;
+}
+
+Bitmap_cpp Bitmap_cpp::operator/(const int& scaler) &&
+{
+    BITMAP_TRACE_SPAN("operator/", &info_header, &info_header);
+    if (scaler == 0)
+        throw invalid_argument("Error: division by zero");
+    ScaleBy(scaler, bitmap_detail::pointwise().divide);
+    return move(*this);
+}
+
+Bitmap_cpp& Bitmap_cpp::operator+=(const Bitmap_cpp& other)
+{
+    BITMAP_TRACE_SPAN("operator+=", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().add);
+    return *this;
+}
+
+Bitmap_cpp& Bitmap_cpp::operator-=(const Bitmap_cpp& other)
+{
+    BITMAP_TRACE_SPAN("operator-=", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().subtract);
+    return *this;
+}
+
+Bitmap_cpp& Bitmap_cpp::operator*=(const int& scaler)
+{
+    BITMAP_TRACE_SPAN("operator*=", &info_header, &info_header);
+    if (scaler <= 0)
+        throw invalid_argument("Error: scaler must be greater than 0");
+    ScaleBy(scaler, bitmap_detail::pointwise().multiply);
+    return *this;
+}
+
+Bitmap_cpp& Bitmap_cpp::operator/=(const int& scaler)
+{
+    BITMAP_TRACE_SPAN("operator/=", &info_header, &info_header);
+    if (scaler == 0)
+        throw invalid_argument("Error: division by zero");
+    ScaleBy(scaler, bitmap_detail::pointwise().divide);
+    return *this;
+}
+
+void Bitmap_cpp::and_with(const Bitmap_cpp& other)
+{
+    BITMAP_TRACE_SPAN("and_with", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().bitwise_and);
+}
+
+void Bitmap_cpp::or_with(const Bitmap_cpp& other)
+{
+    BITMAP_TRACE_SPAN("or_with", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().bitwise_or);
+}
+
+void Bitmap_cpp::xor_with(const Bitmap_cpp& other)
+{
+    BITMAP_TRACE_SPAN("xor_with", &info_header, &info_header);
+    CombineWith(other, bitmap_detail::pointwise().bitwise_xor);
+}
+
+void Bitmap_cpp::CombineWith(const Bitmap_cpp& other, void (*kernel)(pixel* dst, const pixel* src, int count))
+{
+    CheckValid();
+    data.make_writable();
+    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
+        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            kernel(data.row(x), other.data.row(x), info_header.width);
+    });
+}
+
+void Bitmap_cpp::ScaleBy(const int scaler, void (*kernel)(pixel* dst, int count, int scaler))
+{
+    CheckValid();
+    data.make_writable();
+    bitmap_detail::parallel_for(0, info_header.height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            kernel(data.row(x), info_header.width, scaler);
+    });
+}
+
+void Bitmap_cpp::SetThreadCount(const int thread_count)
+{
+    if (thread_count < 0)
+        throw invalid_argument("Error: thread count must not be negative");
+
+    lock_guard<mutex> guard(bitmap_detail::global_thread_lock());
+    bitmap_detail::global_thread_settings().thread_count = thread_count;
+}
+
+void Bitmap_cpp::SetThreadPool(shared_ptr<bitmap_thread_pool> pool)
+{
+    lock_guard<mutex> guard(bitmap_detail::global_thread_lock());
+    bitmap_detail::global_thread_settings().pool = pool;
+}
+
+void Bitmap_cpp::SetLogger(bitmap_logger logger)
+{
+    bitmap_detail::hook_settings& hooks = bitmap_detail::global_hooks();
+    lock_guard<mutex> guard(hooks.lock);
+    hooks.logger = logger ? make_shared<const bitmap_logger>(move(logger)) : nullptr;
+    hooks.has_logger = hooks.logger != nullptr;
+}
+
+void Bitmap_cpp::SetTracer(bitmap_tracer tracer)
+{
+    bitmap_detail::hook_settings& hooks = bitmap_detail::global_hooks();
+    lock_guard<mutex> guard(hooks.lock);
+    hooks.tracer = tracer ? make_shared<const bitmap_tracer>(move(tracer)) : nullptr;
+    hooks.has_tracer = hooks.tracer != nullptr;
+}
+
+void Bitmap_cpp::SetIoPool(shared_ptr<bitmap_io_pool> pool)
+{
+    lock_guard<mutex> guard(bitmap_detail::global_thread_lock());
+    bitmap_detail::global_io_pool() = pool;
+}
+
+simd_level Bitmap_cpp::GetSimdLevel()
+{
+    return static_cast<simd_level>(bitmap_detail::active_simd_level().load());
+}
+
+void Bitmap_cpp::SetSimdLevel(const simd_level level)
+{
+    bitmap_detail::active_simd_level() = static_cast<int>(min(level, bitmap_detail::detect_simd_level()));
+}
+
+// Runs a chain of operations over a Bitmap file in horizontal bands. Only `band_rows`
+// rows plus the halo the operations need are kept in memory, the result is written
+// band by band in the same format SaveBmp produces.
+class Bitmap_stream
+{
+public:
+    Bitmap_stream(string file_path, const int band_rows = 256);
+
+    // Queued operations, `halo` is the number of neighbouring rows one output row depends on
+    Bitmap_stream& Apply(function<void(Bitmap_cpp&)> operation, const int halo = 0);
+    Bitmap_stream& toGray();
+    Bitmap_stream& InvertColor();
+    Bitmap_stream& SpatialLowPassFilter(const int filter_size = 3);
+    Bitmap_stream& MedianFilter(const int filter_size = 3);
+    Bitmap_stream& AlphaTrimmedMeanFilter(const int filter_size = 3, const int removed_elements = 1);
+    Bitmap_stream& SpatialHighPassFilter(const int filter_size = 3);
+    Bitmap_stream& SpatialHighBoostFilter(const int filter_size = 3, const float boost_ratio = 1.5f);
+    Bitmap_stream& PrewittOperator(bool Diagonal = false);
+    Bitmap_stream& SobelOperator(bool Diagonal = false);
+    Bitmap_stream& LaplacianOperator(bool Enhanced = false);
+
+    void SaveBmp(string file_path);
+
+private:
+    struct operation
+    {
+        function<void(Bitmap_cpp&)> apply;
+        int halo;
+    };
+
+    string input_path;
+    int band_rows;
+    vector<operation> operations;
+};
+
+Bitmap_stream::Bitmap_stream(string file_path, const int band_rows) : input_path(file_path), band_rows(band_rows)
+{
+    if (band_rows <= 0)
+        throw invalid_argument("Error: band rows must be greater than 0");
+}
+
+Bitmap_stream& Bitmap_stream::Apply(function<void(Bitmap_cpp&)> operation, const int halo)
+{
+    if (halo < 0)
+        throw invalid_argument("Error: halo must not be negative");
+    operations.push_back({operation, halo});
+    return *this;
+}
+
+Bitmap_stream& Bitmap_stream::toGray()
+{
+    return Apply([](Bitmap_cpp& band) { band.toGray(); });
+}
+
+Bitmap_stream& Bitmap_stream::InvertColor()
+{
+    return Apply([](Bitmap_cpp& band) { band.InvertColor(); });
+}
+
+Bitmap_stream& Bitmap_stream::SpatialLowPassFilter(const int filter_size)
+{
+    return Apply([=](Bitmap_cpp& band) { band.SpatialLowPassFilter(filter_size); }, filter_size / 2);
+}
+
+Bitmap_stream& Bitmap_stream::MedianFilter(const int filter_size)
+{
+    return Apply([=](Bitmap_cpp& band) { band.MedianFilter(filter_size); }, filter_size / 2);
+}
+
+Bitmap_stream& Bitmap_stream::AlphaTrimmedMeanFilter(const int filter_size, const int removed_elements)
+{
+    return Apply([=](Bitmap_cpp& band) { band.AlphaTrimmedMeanFilter(filter_size, removed_elements); }, filter_size / 2);
+}
+
+Bitmap_stream& Bitmap_stream::SpatialHighPassFilter(const int filter_size)
+{
+    return Apply([=](Bitmap_cpp& band) { band.SpatialHighPassFilter(filter_size); }, filter_size / 2);
+}
+
+Bitmap_stream& Bitmap_stream::SpatialHighBoostFilter(const int filter_size, const float boost_ratio)
+{
+    return Apply([=](Bitmap_cpp& band) { band.SpatialHighBoostFilter(filter_size, boost_ratio); }, filter_size / 2);
+}
+
+Bitmap_stream& Bitmap_stream::PrewittOperator(bool Diagonal)
+{
+    return Apply([=](Bitmap_cpp& band) { band.PrewittOperator(Diagonal); }, 1);
+}
+
+Bitmap_stream& Bitmap_stream::SobelOperator(bool Diagonal)
+{
+    return Apply([=](Bitmap_cpp& band) { band.SobelOperator(Diagonal); }, 1);
+}
+
+Bitmap_stream& Bitmap_stream::LaplacianOperator(bool Enhanced)
+{
+    return Apply([=](Bitmap_cpp& band) { band.LaplacianOperator(Enhanced); }, 1);
+}
+
+void Bitmap_stream::SaveBmp(string file_path)
+{
+    ifstream input(input_path, ios::binary);
+    if (!input.is_open())
+        throw runtime_error("Error: file not found");
+
+    Bitmap_cpp band;
+    input.read(reinterpret_cast<char*>(&band.header), sizeof(bmp_header));
+    if (band.header.signature[0] != 'B' || band.header.signature[1] != 'M')
+        throw runtime_error("Error: file is not a Bitmap file");
+
+    input.read(reinterpret_cast<char*>(&band.info_header), sizeof(bmp_info_header));
+    bitmap_detail::bmp_format format;
+    Bitmap_cpp::ReadBmpFormat(input, band.info_header, format);
+    if (format.top_down || format.compression == bmp_compression::rle8 || format.compression == bmp_compression::rle4)
+        throw runtime_error("Error: only uncompressed bottom-up Bitmap files can be streamed");
+    input.seekg(band.header.data_offset, ios::beg);
+
+    // Depths below 24 bits are written as 24-bit files
+    const int width = format.width, height = format.height;
+    const int bit_count = format.bit_count == 32 ? 32 : 24;
+    int halo = 0;
+    for (auto& op : operations)
+        halo += op.halo;
+
+    // Chained filters need the sum of their halos, rows closer than that to a band edge are not exact yet
+    pixel_buffer window(min(height, band_rows + 2 * halo), width);
+    int window_start = 0, window_rows = 0;
+
+    bmp_header out_header = band.header;
+    bmp_info_header out_info_header = band.info_header;
+    const int row_bytes = bit_count == 24 ? (width * 3 + 3) / 4 * 4 : width * 4;
+    out_header.data_offset = sizeof(bmp_header) + sizeof(bmp_info_header);
+    out_info_header.size = sizeof(bmp_info_header);
+    out_info_header.bit_count = static_cast<uint16_t>(bit_count);
+    out_info_header.compression = 0;
+    out_info_header.colors_used = 0;
+    out_info_header.colors_important = 0;
+    out_info_header.size_image = row_bytes * height;
+    out_header.file_size = out_header.data_offset + out_info_header.size_image;
+
+    if (file_path.find(".bmp") == string::npos)
+        file_path += ".bmp";
+    ofstream output;
+    vector<unsigned char> encoded;
+
+    for (int band_start = 0; band_start < height; band_start += band_rows)
+    {
+        const int band_end = min(height, band_start + band_rows);
+        const int need_start = max(0, band_start - halo);
+        const int need_end = min(height, band_end + halo);
+
+        int kept_rows = max(0, window_start + window_rows - need_start);
+        for (int x = 0; x < kept_rows; x++)
+            memmove(window.row(x), window.row(need_start - window_start + x), width * sizeof(pixel));
+        Bitmap_cpp::ReadPixelRows(input, format, window, kept_rows, need_end - need_start - kept_rows);
+        if (!input)
+            throw runtime_error("Error: unexpected end of Bitmap file");
+        window_start = need_start;
+        window_rows = need_end - need_start;
+
+        band.data.resize(window_rows, width);
+        for (int x = 0; x < window_rows; x++)
+            memcpy(band.data.row(x), window.row(x), width * sizeof(pixel));
+        band.info_header.height = window_rows;
+
+        for (auto& op : operations)
+            op.apply(band);
+        if (band.info_header.width != width || band.info_header.height != window_rows)
+            throw runtime_error("Error: streamed operations must keep the image size");
+
+        // The file is only created once the first band went through, so argument errors leave nothing behind
+        if (!output.is_open())
+        {
+            output.open(file_path, ios::binary);
+            if (!output.is_open())
+                throw runtime_error("Error: Cannot create file");
+            output.write(reinterpret_cast<char*>(&out_header), sizeof(bmp_header));
+            output.write(reinterpret_cast<char*>(&out_info_header), sizeof(bmp_info_header));
+        }
+        encoded.resize(static_cast<size_t>(row_bytes) * (band_end - band_start));
+        Bitmap_cpp::EncodePixelRows(encoded.data(), bit_count, band.data, band_start - window_start, band_end - band_start);
+        output.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        if (!output.good())
+            throw runtime_error("Error: failed to write Bitmap band");
+    }
+    output.close();
+    if (!output.good())
+        throw runtime_error("Error: file write error");
+    else
+        bitmap_detail::log_saved(file_path);
+}
+
+// Records a chain of operations on a Bitmap_cpp and runs it only when the result is requested.
+// Consecutive point-wise operations are fused into one pass over each row, and point-wise
+// operations that follow a neighbourhood filter run on every filter row as soon as it is produced,
+// so a chain like toGray -> InvertColor -> Multiply -> mix_with reads and writes the image once.
+class Bitmap_pipeline
+{
+public:
+    // The source image (and every image passed to a binary operation) must outlive Result()
+    Bitmap_pipeline(const Bitmap_cpp& source);
+    Bitmap_pipeline(string file_path);
+
+    // Point-wise operations, fused with their neighbours
+    Bitmap_pipeline& toGray();
+    Bitmap_pipeline& InvertColor();
+    Bitmap_pipeline& mix_with(const Bitmap_cpp& other, const float ratio = 0.5f);
+    Bitmap_pipeline& Add(const Bitmap_cpp& other);
+    Bitmap_pipeline& Subtract(const Bitmap_cpp& other);
+    Bitmap_pipeline& Multiply(const int scaler);
+    Bitmap_pipeline& Divide(const int scaler);
+    Bitmap_pipeline& and_with(const Bitmap_cpp& other);
+    Bitmap_pipeline& or_with(const Bitmap_cpp& other);
+    Bitmap_pipeline& xor_with(const Bitmap_cpp& other);
+
+    // Smoothing filters, the point-wise operations after them run on their output rows
+    Bitmap_pipeline& SpatialLowPassFilter(const int filter_size = 3);
+    Bitmap_pipeline& MedianFilter(const int filter_size = 3);
+    Bitmap_pipeline& AlphaTrimmedMeanFilter(const int filter_size = 3, const int removed_elements = 1);
+    Bitmap_pipeline& PercentileFilter(const int filter_size = 3, const float percentile = 50.0f);
+    Bitmap_pipeline& MinFilter(const int filter_size = 3);
+    Bitmap_pipeline& MaxFilter(const int filter_size = 3);
+
+    // Sharpening and edge detection, fused the same way
+    Bitmap_pipeline& SpatialHighPassFilter(const int filter_size = 3);
+    Bitmap_pipeline& PrewittOperator(bool Diagonal = false);
+    Bitmap_pipeline& SobelOperator(bool Diagonal = false);
+    Bitmap_pipeline& LaplacianOperator(bool Enhanced = false);
+
+    // Any other Bitmap_cpp call, runs on the whole image and ends the fused pass
+    Bitmap_pipeline& Apply(function<void(Bitmap_cpp&)> operation);
+
+    Bitmap_cpp Result() const;
+    void SaveBmp(string file_path, const bool atomic_replace = false) const;
+
+private:
+    typedef function<void(const bitmap_detail::pointwise_kernels&, pixel*, int, int)> row_operation;
+    typedef function<void(const pixel_buffer&, pixel_buffer&, int, int, const function<void(int)>&)> row_filter;
+
+    struct point_operation
+    {
+        row_operation apply;
+        const Bitmap_cpp* other;
+    };
+
+    // One pass over the image: a filter or an opaque operation (or neither) and the point-wise operations after it
+    struct stage
+    {
+        row_filter filter;
+        function<void(Bitmap_cpp&)> operation;
+        vector<point_operation> points;
+    };
+
+    Bitmap_pipeline& Point(row_operation apply, const Bitmap_cpp* other = nullptr);
+    Bitmap_pipeline& Filter(row_filter filter);
+    template <typename Query>
+    Bitmap_pipeline& RankFilter(const int filter_size, Query query);
+    static void ApplyPoints(const stage& current, const bitmap_detail::pointwise_kernels& kernels, pixel* row, const int x, const int width);
+
+    const Bitmap_cpp* source;
+    string input_path;
+    vector<stage> stages;
+};
+
+Bitmap_pipeline::Bitmap_pipeline(const Bitmap_cpp& source) : source(&source)
+{
+}
+
+Bitmap_pipeline::Bitmap_pipeline(string file_path) : source(nullptr), input_path(file_path)
+{
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Point(row_operation apply, const Bitmap_cpp* other)
+{
+    if (stages.empty())
+        stages.push_back(stage());
+    stages.back().points.push_back({apply, other});
+    return *this;
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Filter(row_filter filter)
+{
+    stages.push_back(stage());
+    stages.back().filter = filter;
+    return *this;
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Apply(function<void(Bitmap_cpp&)> operation)
+{
+    stages.push_back(stage());
+    stages.back().operation = operation;
+    return *this;
+}
+
+Bitmap_pipeline& Bitmap_pipeline::toGray()
+{
+    return Point([](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int, int width) { kernels.gray(row, width); });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::InvertColor()
+{
+    return Point([](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int, int width) { kernels.invert(row, width); });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::mix_with(const Bitmap_cpp& other, const float ratio)
+{
+    if (ratio < 0.0f || ratio > 1.0f)
+        throw invalid_argument("Error: ratio must be between 0 and 1");
+
+    const int weight = static_cast<int>(ratio * 256 + 0.5f);
+    return Point([&other, weight](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int x, int width)
+    {
+        kernels.blend(row, other.data.row(x), width, weight);
+    }, &other);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Add(const Bitmap_cpp& other)
+{
+    return Point([&other](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int x, int width) { kernels.add(row, other.data.row(x), width); }, &other);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Subtract(const Bitmap_cpp& other)
+{
+    return Point([&other](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int x, int width) { kernels.subtract(row, other.data.row(x), width); }, &other);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Multiply(const int scaler)
+{
+    if (scaler <= 0)
+        throw invalid_argument("Error: scaler must be greater than 0");
+    return Point([scaler](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int, int width) { kernels.multiply(row, width, scaler); });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::Divide(const int scaler)
+{
+    if (scaler == 0)
+        throw invalid_argument("Error: division by zero");
+    return Point([scaler](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int, int width) { kernels.divide(row, width, scaler); });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::and_with(const Bitmap_cpp& other)
+{
+    return Point([&other](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int x, int width) { kernels.bitwise_and(row, other.data.row(x), width); }, &other);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::or_with(const Bitmap_cpp& other)
+{
+    return Point([&other](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int x, int width) { kernels.bitwise_or(row, other.data.row(x), width); }, &other);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::xor_with(const Bitmap_cpp& other)
+{
+    return Point([&other](const bitmap_detail::pointwise_kernels& kernels, pixel* row, int x, int width) { kernels.bitwise_xor(row, other.data.row(x), width); }, &other);
+}
+
+
+Bitmap_pipeline& Bitmap_pipeline::SpatialLowPassFilter(const int filter_size)
+{
+    bitmap_detail::check_filter_size(filter_size);
+    return Filter([filter_size](const pixel_buffer& src, pixel_buffer& dst, int first_row, int last_row, const function<void(int)>& row_done)
+    {
+        Bitmap_cpp::LowPassRows(src, dst, filter_size, first_row, last_row, row_done);
+    });
+}
+
+template <typename Query>
+Bitmap_pipeline& Bitmap_pipeline::RankFilter(const int filter_size, Query query)
+{
+    // The histograms stay with the stage, so running the pipeline again reuses them
+    shared_ptr<bitmap_detail::rank_storage> storage = make_shared<bitmap_detail::rank_storage>();
+    return Filter([filter_size, query, storage](const pixel_buffer& src, pixel_buffer& dst, int first_row, int last_row, const function<void(int)>& row_done)
+    {
+        Bitmap_cpp::RankRows(src, dst, filter_size, first_row, last_row, query, row_done, *storage);
+    });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::MedianFilter(const int filter_size)
+{
+    bitmap_detail::check_filter_size(filter_size);
+    return RankFilter(filter_size, [](bitmap_detail::rank_window& window) { return window.Kth(window.Size() / 2); });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::AlphaTrimmedMeanFilter(const int filter_size, const int removed_elements)
+{
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_removed_elements(filter_size, removed_elements);
+    const int filter_pixels = filter_size * filter_size;
+
+    const bitmap_detail::exact_divider divide(filter_pixels - removed_elements * 2);
+    return RankFilter(filter_size, [=](bitmap_detail::rank_window& window)
+    {
+        return divide(window.TotalSum() - window.LowestSum(removed_elements) - window.HighestSum(removed_elements));
+    });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::PercentileFilter(const int filter_size, const float percentile)
+{
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_percentile(percentile);
+
+    const int rank = static_cast<int>(percentile / 100.0f * (filter_size * filter_size - 1) + 0.5f);
+    return RankFilter(filter_size, [=](bitmap_detail::rank_window& window) { return window.Kth(rank); });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::MinFilter(const int filter_size)
+{
+    return PercentileFilter(filter_size, 0.0f);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::MaxFilter(const int filter_size)
+{
+    return PercentileFilter(filter_size, 100.0f);
+}
+
+Bitmap_pipeline& Bitmap_pipeline::SpatialHighPassFilter(const int filter_size)
+{
+    bitmap_detail::check_filter_size(filter_size);
+    return Filter([filter_size](const pixel_buffer& src, pixel_buffer& dst, int first_row, int last_row, const function<void(int)>& row_done)
+    {
+        Bitmap_cpp::HighPassRows(src, dst, filter_size, first_row, last_row, row_done);
+    });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::PrewittOperator(bool Diagonal)
+{
+    return Filter([Diagonal](const pixel_buffer& src, pixel_buffer& dst, int first_row, int last_row, const function<void(int)>& row_done)
+    {
+        Bitmap_cpp::PrewittRows(src, dst, Diagonal, first_row, last_row, row_done);
+    });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::SobelOperator(bool Diagonal)
+{
+    return Filter([Diagonal](const pixel_buffer& src, pixel_buffer& dst, int first_row, int last_row, const function<void(int)>& row_done)
+    {
+        Bitmap_cpp::SobelRows(src, dst, Diagonal, first_row, last_row, row_done);
+    });
+}
+
+Bitmap_pipeline& Bitmap_pipeline::LaplacianOperator(bool Enhanced)
+{
+    return Filter([Enhanced](const pixel_buffer& src, pixel_buffer& dst, int first_row, int last_row, const function<void(int)>& row_done)
+    {
+        Bitmap_cpp::LaplacianRows(src, dst, Enhanced, first_row, last_row, row_done);
+    });
+}
+
+void Bitmap_pipeline::ApplyPoints(const stage& current, const bitmap_detail::pointwise_kernels& kernels, pixel* row, const int x, const int width)
+{
+    for (auto& point : current.points)
+        point.apply(kernels, row, x, width);
+}
+
+Bitmap_cpp Bitmap_pipeline::Result() const
+{
+    Bitmap_cpp image;
+    if (source == nullptr)
+        image.LoadBmp(input_path);
+    else
+    {
+        source->CheckValid();
+        image.SetMemoryResource(source->GetMemoryResource());
+        image.header = source->header;
+        image.info_header = source->info_header;
+        image.format_requested = source->format_requested;
+    }
+
+    // Until the first pass writes its own buffer the rows are read straight from the source
+    const pixel_buffer* input = source == nullptr ? &image.data : &source->data;
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    for (auto& current : stages)
+    {
+        if (current.operation)
+        {
+            if (input != &image.data)
+                image.data = *input;
+            input = &image.data;
+            current.operation(image);
+            image.CheckValid();
+        }
+
+        const int width = image.info_header.width, height = image.info_header.height;
+        for (auto& point : current.points)
+            if (point.other != nullptr && (point.other->info_header.width != width || point.other->info_header.height != height))
+                throw runtime_error("Error: image size error, " + to_string(width) + "x" + to_string(height) + "(origin) vs " + to_string(point.other->info_header.width) + "x" + to_string(point.other->info_header.height) + "(other)");
+
+        if (current.filter)
+        {
+            pixel_buffer& new_data = image.scratch;
+            new_data.resize_for_overwrite(height, width);
+            bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+            {
+                current.filter(*input, new_data, first_row, last_row, [&](int x) { ApplyPoints(current, kernels, new_data.row(x), x, width); });
+            });
+            image.data.swap(new_data);
+        }
+        else if (input != &image.data)
+        {
+            // The copy out of the source is the first operation's read
+            image.data.resize_for_overwrite(height, width);
+            bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+            {
+                for (int x = first_row; x < last_row; x++)
+                {
+                    copy(input->row(x), input->row(x) + width, image.data.row(x));
+                    ApplyPoints(current, kernels, image.data.row(x), x, width);
+                }
+            });
+        }
+        else if (!current.points.empty())
+        {
+            image.data.make_writable();
+            bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+            {
+                for (int x = first_row; x < last_row; x++)
+                    ApplyPoints(current, kernels, image.data.row(x), x, width);
+            });
+        }
+        input = &image.data;
+    }
+
+    if (input != &image.data)
+        image.data = *input;
+    return image;
+}
+
+void Bitmap_pipeline::SaveBmp(string file_path, const bool atomic_replace) const
+{
+    Result().SaveBmp(file_path, atomic_replace);
+}
+
+Bitmap_pipeline Bitmap_cpp::Lazy() const
+{
+    return Bitmap_pipeline(*this);
+}
+
+void Bitmap_cpp::SetMemoryResource(bitmap_memory_resource* resource)
+{
+    shared_ptr<pixel_memory> memory = make_shared<pixel_memory>();
+    memory->resource = resource;
+    data.use_memory(memory);
+    scratch.use_memory(memory);
+    pass_scratch.use_memory(memory);
+    rank_scratch.Reset(memory);
+}
+
+bitmap_memory_resource* Bitmap_cpp::GetMemoryResource() const
+{
+    return data.memory_source() != nullptr ? data.memory_source()->resource : nullptr;
+}
+
+bitmap_memory_stats Bitmap_cpp::MemoryStats() const
+{
+    return bitmap_detail::memory_stats(data.memory_source().get());
+}
+
+void Bitmap_cpp::ReleaseScratch()
+{
+    pixel_buffer released, released_pass;
+    released.use_memory(scratch.memory_source());
+    released_pass.use_memory(scratch.memory_source());
+    scratch.swap(released);
+    pass_scratch.swap(released_pass);
+    rank_scratch.Reset(scratch.memory_source());
+}
+
+// Planar copy of an image for filter-heavy work. b, g, r and a live in separate aligned planes, so the
+// neighbourhood filters and the DCT read one byte per sample and never touch alpha. Convert once, run any
+// number of filters and convert back with ToBitmap or SaveBmp; every filter gives the Bitmap_cpp result.
+class Bitmap_planar
+{
+public:
+    // Copies allocate from the same memory resource as the original, a Bitmap_cpp passes on its own
+    Bitmap_planar();
+    explicit Bitmap_planar(const Bitmap_cpp& image);
+    Bitmap_planar(string file_path);
+    Bitmap_planar(const Bitmap_planar& other);
+    Bitmap_planar(Bitmap_planar&& other) = default;
+    Bitmap_planar& operator=(const Bitmap_planar& other);
+    Bitmap_planar& operator=(Bitmap_planar&& other) = default;
+
+    // Conversions, both reuse the destination's storage when the size allows
+    void Assign(const Bitmap_cpp& image);
+    void ToBitmap(Bitmap_cpp& dst) const;
+    Bitmap_cpp ToBitmap() const;
+    void SaveBmp(string file_path, const bool atomic_replace = false) const;
+
+    bool empty() const { return planes[0].empty(); }
+    int Width() const { return planes[0].width(); }
+    int Height() const { return planes[0].height(); }
+    // Planes in pixel order b, g, r, a. After a filter that makes every pixel opaque the alpha plane is stale.
+    const channel_plane& Plane(const int channel) const { return planes[channel]; }
+    bool Opaque() const { return opaque; }
+
+    // Smoothing filters
+    Bitmap_planar& SpatialLowPassFilter(const int filter_size = 3);
+    Bitmap_planar& MedianFilter(const int filter_size = 3);
+    Bitmap_planar& AlphaTrimmedMeanFilter(const int filter_size = 3, const int removed_elements = 1);
+    Bitmap_planar& PercentileFilter(const int filter_size = 3, const float percentile = 50.0f);
+    Bitmap_planar& MinFilter(const int filter_size = 3);
+    Bitmap_planar& MaxFilter(const int filter_size = 3);
+
+    // Sharpening filters
+    Bitmap_planar& SpatialHighPassFilter(const int filter_size = 3);
+    Bitmap_planar& SpatialHighBoostFilter(const int filter_size = 3, const float boost_ratio = 1.5f);
+
+    // Edge detection
+    Bitmap_planar& PrewittOperator(bool Diagonal = false);
+    Bitmap_planar& SobelOperator(bool Diagonal = false);
+    Bitmap_planar& LaplacianOperator(bool Enhanced = false);
+
+    // DCT, the same format and results as the Bitmap_cpp versions
+    Bitmap_planar& DCT_Compress(const dct_precision precision = dct_precision::floating_point);
+    vector<unsigned char> DCT_Encode(const int quality = 75) const;
+    void DCT_Decode(const vector<unsigned char>& bytes, const int first_row = 0, const int row_count = -1);
+    void SaveDCT(string file_path, const int quality = 75, const bool atomic_replace = false) const;
+    void LoadDCT(string file_path, const int first_row = 0, const int row_count = -1);
+
+    // Memory of the planes and filter buffers, the same as Bitmap_cpp::SetMemoryResource
+    void SetMemoryResource(bitmap_memory_resource* resource);
+    bitmap_memory_resource* GetMemoryResource() const;
+    bitmap_memory_stats MemoryStats() const;
+
+private:
+    void CheckValid() const;
+    template <typename Rows>
+    Bitmap_planar& FilterPlanes(Rows rows, const bool makes_opaque);
+    template <typename Query>
+    Bitmap_planar& RankFilter(const int filter_size, Query query);
+    static bitmap_detail::rgb_view<unsigned char> Samples(channel_plane* bgr);
+    static bitmap_detail::rgb_view<const unsigned char> Samples(const channel_plane* bgr);
+
+    bmp_header header;
+    bmp_info_header info_header;
+    channel_plane planes[4];
+    // Filters write into `scratch` and trade it with the color planes
+    channel_plane scratch[3];
+    bitmap_detail::rank_storage rank_scratch;
+    bool opaque;
+};
+
+Bitmap_planar::Bitmap_planar() : opaque(false)
+{
+    SetMemoryResource(nullptr);
+}
+
+Bitmap_planar::Bitmap_planar(const Bitmap_cpp& image) : opaque(false)
+{
+    SetMemoryResource(image.GetMemoryResource());
+    Assign(image);
+}
+
+Bitmap_planar::Bitmap_planar(string file_path) : Bitmap_planar()
+{
+    Assign(Bitmap_cpp(file_path));
+}
+
+Bitmap_planar::Bitmap_planar(const Bitmap_planar& other) : header(other.header), info_header(other.info_header), opaque(other.opaque)
+{
+    SetMemoryResource(other.GetMemoryResource());
+    for (int c = 0; c < 4; c++)
+        planes[c] = other.planes[c];
+}
+
+Bitmap_planar& Bitmap_planar::operator=(const Bitmap_planar& other)
+{
+    // Copies into the existing planes, same-sized images do not allocate
+    header = other.header;
+    info_header = other.info_header;
+    for (int c = 0; c < 4; c++)
+        planes[c] = other.planes[c];
+    opaque = other.opaque;
+    return *this;
+}
+
+void Bitmap_planar::Assign(const Bitmap_cpp& image)
+{
+    image.CheckValid();
+    const int height = image.info_header.height, width = image.info_header.width;
+    for (int c = 0; c < 4; c++)
+        planes[c].resize_for_overwrite(height, width);
+
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
     {
-        if (x % scale == 0)
-            continue;
-        for (int y = 0; y < (info_header.width * scale); y++)
-            new_data[x][y] = new_data[x - 1][y];
-    }
-    data = new_data;
-    info_header.width *= scale;
-    info_header.height *= scale;
+        for (int x = first_row; x < last_row; x++)
+            kernels.deinterleave(image.data.row(x), planes[0].row(x), planes[1].row(x), planes[2].row(x), planes[3].row(x), width);
+    });
+    header = image.header;
+    info_header = image.info_header;
+    opaque = false;
 }
 
-void Bitmap_cpp::ZoomIn_Bilinear(const int scale)
+void Bitmap_planar::ToBitmap(Bitmap_cpp& dst) const
 {
     CheckValid();
-    vector<vector<pixel>> new_data(info_header.height * scale, vector<pixel>(info_header.width * scale));
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            new_data[x * scale][y * scale] = data[x][y];
-    
-    for (int x = 0; x < (info_header.height * scale); x++)
+    const int height = Height(), width = Width();
+    dst.data.resize_for_overwrite(height, width);
+
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
     {
-        for (int y = 0; y < (info_header.width * scale); y++)
-        {
-            if (x % scale == 0 && y % scale == 0)
-                continue;
-            if (x >= (info_header.height * scale) - (scale - 1))
-            {
-                new_data[x][y] = new_data[x - 1][y];
-                continue;
-            }
-            if (y >= (info_header.width * scale) - (scale - 1))
-            {
-                new_data[x][y] = new_data[x][y - 1];
-                continue;
-            }
+        for (int x = first_row; x < last_row; x++)
+            kernels.interleave(dst.data.row(x), planes[0].row(x), planes[1].row(x), planes[2].row(x), opaque ? nullptr : planes[3].row(x), width);
+    });
+    dst.header = header;
+    dst.info_header = info_header;
+}
 
-            int x0 = (x / scale) * scale;
-            int x1 = min(x0 + scale, info_header.height * scale - 1);
-            int x_ratio0 = x - x0;
-            int x_ratio1 = x1 - x;
-            int x_ratio = x_ratio0 + x_ratio1;
+Bitmap_cpp Bitmap_planar::ToBitmap() const
+{
+    Bitmap_cpp image;
+    image.SetMemoryResource(GetMemoryResource());
+    ToBitmap(image);
+    return image;
+}
 
-            int y0 = (y / scale) * scale;
-            int y1 = min(y0 + scale, info_header.width * scale - 1);
-            int y_ratio0 = y - y0;
-            int y_ratio1 = y1 - y;
-            int y_ratio = y_ratio0 + y_ratio1;
+void Bitmap_planar::SaveBmp(string file_path, const bool atomic_replace) const
+{
+    ToBitmap().SaveBmp(file_path, atomic_replace);
+}
 
-            float r0 = (y_ratio1 * new_data[x0][y0].r + y_ratio0 * new_data[x0][y1].r) / y_ratio;
-            float r1 = (y_ratio1 * new_data[x1][y0].r + y_ratio0 * new_data[x1][y1].r) / y_ratio;
+void Bitmap_planar::SetMemoryResource(bitmap_memory_resource* resource)
+{
+    shared_ptr<pixel_memory> memory = make_shared<pixel_memory>();
+    memory->resource = resource;
+    for (auto& plane : planes)
+        plane.use_memory(memory);
+    for (auto& plane : scratch)
+        plane.use_memory(memory);
+    rank_scratch.Reset(memory);
+}
 
-            float g0 = (y_ratio1 * new_data[x0][y0].g + y_ratio0 * new_data[x0][y1].g) / y_ratio;
-            float g1 = (y_ratio1 * new_data[x1][y0].g + y_ratio0 * new_data[x1][y1].g) / y_ratio;
+bitmap_memory_resource* Bitmap_planar::GetMemoryResource() const
+{
+    return planes[0].memory_source() != nullptr ? planes[0].memory_source()->resource : nullptr;
+}
 
-            float b0 = (y_ratio1 * new_data[x0][y0].b + y_ratio0 * new_data[x0][y1].b) / y_ratio;
-            float b1 = (y_ratio1 * new_data[x1][y0].b + y_ratio0 * new_data[x1][y1].b) / y_ratio;
+bitmap_memory_stats Bitmap_planar::MemoryStats() const
+{
+    return bitmap_detail::memory_stats(planes[0].memory_source().get());
+}
 
-            new_data[x][y] = pixel(
-                (x_ratio1 * r0 + x_ratio0 * r1) / x_ratio,
-                (x_ratio1 * g0 + x_ratio0 * g1) / x_ratio,
-                (x_ratio1 * b0 + x_ratio0 * b1) / x_ratio);
-        }
-    }
-    data = new_data;
-    info_header.width *= scale;
-    info_header.height *= scale;
+void Bitmap_planar::CheckValid() const
+{
+    if (empty())
+        throw runtime_error("Error: image data is empty");
 }
 
-void Bitmap_cpp::ZoomOut(const int scale)
+
+template <typename Rows>
+Bitmap_planar& Bitmap_planar::FilterPlanes(Rows rows, const bool makes_opaque)
 {
-    CheckValid();
-    vector<vector<pixel>> new_data(info_header.height / scale, vector<pixel>(info_header.width / scale));
-    for (int x = 0; x < info_header.height / scale; x++)
+    // rows(src, out, first_row, last_row) filters one color plane, a band runs all three before the next band
+    const int height = Height(), width = Width();
+    for (int c = 0; c < 3; c++)
+        scratch[c].resize_for_overwrite(height, width);
+    bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
     {
-        for (int y = 0; y < info_header.width / scale; y++)
-        {
-            int sum_r = 0, sum_g = 0, sum_b = 0;
-            for (int i = 0; i < scale; i++)
-            {
-                for (int j = 0; j < scale; j++)
-                {
-                    int pos_x = x * scale + i;
-                    int pos_y = y * scale + j;
-                    sum_r += data[pos_x][pos_y].r;
-                    sum_g += data[pos_x][pos_y].g;
-                    sum_b += data[pos_x][pos_y].b;
-                }
-            }
-            int scale_2 = scale * scale;
-            new_data[x][y].r = sum_r / scale_2;
-            new_data[x][y].g = sum_g / scale_2;
-            new_data[x][y].b = sum_b / scale_2;
-        }
-    }
-    data = new_data;
-    info_header.width /= scale;
-    info_header.height /= scale;
+        for (int c = 0; c < 3; c++)
+            rows(planes[c], scratch[c], first_row, last_row);
+    });
+    for (int c = 0; c < 3; c++)
+        planes[c].swap(scratch[c]);
+    opaque = opaque || makes_opaque;
+    return *this;
 }
 
-void Bitmap_cpp::HistogramEqualization_Global()
+Bitmap_planar& Bitmap_planar::SpatialLowPassFilter(const int filter_size)
 {
     CheckValid();
-    if (data[0][0].r != data[0][0].g || data[0][0].r != data[0][0].b)
-        throw runtime_error("Error: image is not a gray image");
-
-    int histogram[256] = {0};
-    for (auto& row : data)
-        for (auto& p : row)
-            histogram[p.r]++;
-
-    int cdf[256] = {0};
-    cdf[0] = histogram[0];
-    for (int i = 1; i < 256; i++)
-        cdf[i] = cdf[i - 1] + histogram[i];
-    
-    int min_cdf = cdf[0];
-    for (int i = 0; i < 256; i++)
+    bitmap_detail::check_filter_size(filter_size);
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
     {
-        if (histogram[i] > 0)
-        {
-            min_cdf = cdf[i];
-            break;
-        }
-    }
-
-    int totel_pixel = info_header.width * info_header.height;
-    if (totel_pixel == min_cdf)
-        return;
+        Bitmap_cpp::LowPassRows(src, out, filter_size, first_row, last_row, bitmap_detail::no_row_callback());
+    }, false);
+}
 
-    for (auto& row : data)
+template <typename Query>
+Bitmap_planar& Bitmap_planar::RankFilter(const int filter_size, Query query)
+{
+    bitmap_detail::rank_storage* storage = &rank_scratch;
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
     {
-        for (auto& p : row)
-        {
-            int new_value = (cdf[p.r] - min_cdf) * 255 / (totel_pixel - min_cdf);
-            p.r = p.g = p.b = new_value;
-        }
-    }
+        Bitmap_cpp::RankRows(src, out, filter_size, first_row, last_row, query, bitmap_detail::no_row_callback(), *storage);
+    }, true);
 }
 
-void Bitmap_cpp::HistogramEqualization_Local(const int block_size)
+Bitmap_planar& Bitmap_planar::MedianFilter(const int filter_size)
 {
     CheckValid();
-    if (data[0][0].r != data[0][0].g || data[0][0].r != data[0][0].b)
-        throw runtime_error("Error: image is not a gray image");
-    if (block_size <= 0)
-        throw invalid_argument("Error: block size must be greater than 0");
+    bitmap_detail::check_filter_size(filter_size);
+    return RankFilter(filter_size, [](bitmap_detail::rank_window& window) { return window.Kth(window.Size() / 2); });
+}
 
-    int padding = block_size / 2 + block_size % 2 - 1;
-    int block_adjustment = 1 - block_size % 2;
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    for (int x = padding; x < info_header.height - padding - block_adjustment; x++)
+Bitmap_planar& Bitmap_planar::AlphaTrimmedMeanFilter(const int filter_size, const int removed_elements)
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_removed_elements(filter_size, removed_elements);
+    const int filter_pixels = filter_size * filter_size;
+
+    const bitmap_detail::exact_divider divide(filter_pixels - removed_elements * 2);
+    return RankFilter(filter_size, [=](bitmap_detail::rank_window& window)
     {
-        int histogram[256] = {0};
-        for (int i = -padding; i <= padding + block_adjustment; i++)
-            for (int j = -padding; j <= padding + block_adjustment; j++)
-                histogram[data[x + i][padding + j].r]++;
+        return divide(window.TotalSum() - window.LowestSum(removed_elements) - window.HighestSum(removed_elements));
+    });
+}
 
-        for (int y = padding; y < info_header.width - padding - block_adjustment; y++)
-        {
-            if (y > padding)
-            {
-                for (int i = -padding; i <= padding + block_adjustment; i++)
-                {
-                    histogram[data[x + i][y - padding - 1].r]--;
-                    histogram[data[x + i][y + padding + block_adjustment].r]++;
-                }
-            }
+Bitmap_planar& Bitmap_planar::PercentileFilter(const int filter_size, const float percentile)
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_percentile(percentile);
 
-            int cdf[256] = {0};
-            cdf[0] = histogram[0];
-            for (int i = 1; i < 256; i++)
-                cdf[i] = cdf[i - 1] + histogram[i];
-            
-            int min_cdf = cdf[0];
-            for (int i = 0; i < 256; i++)
-            {
-                if (histogram[i] > 0)
-                {
-                    min_cdf = cdf[i];
-                    break;
-                }
-            }
+    const int rank = static_cast<int>(percentile / 100.0f * (filter_size * filter_size - 1) + 0.5f);
+    return RankFilter(filter_size, [=](bitmap_detail::rank_window& window) { return window.Kth(rank); });
+}
 
-            int totel_pixel = (block_size + block_adjustment) * (block_size + block_adjustment);
-            if (totel_pixel == min_cdf)
-                continue;
+Bitmap_planar& Bitmap_planar::MinFilter(const int filter_size)
+{
+    return PercentileFilter(filter_size, 0.0f);
+}
 
-            int new_value = (cdf[data[x][y].r] - min_cdf) * 255 / (totel_pixel - min_cdf);
-            new_data[x][y].r = new_data[x][y].g = new_data[x][y].b = new_value;
-        }
-    }
-    data = new_data;
+Bitmap_planar& Bitmap_planar::MaxFilter(const int filter_size)
+{
+    return PercentileFilter(filter_size, 100.0f);
 }
 
-void Bitmap_cpp::SpatialLowPassFilter(const int filter_size)
+Bitmap_planar& Bitmap_planar::SpatialHighPassFilter(const int filter_size)
 {
     CheckValid();
-    if (filter_size <= 0)
-        throw invalid_argument("Error: filter size must be greater than 0");
-    if (filter_size % 2 == 0)
-        throw invalid_argument("Error: filter size must be an odd number");
+    bitmap_detail::check_filter_size(filter_size);
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::HighPassRows(src, out, filter_size, first_row, last_row, bitmap_detail::no_row_callback());
+    }, true);
+}
+
+Bitmap_planar& Bitmap_planar::SpatialHighBoostFilter(const int filter_size, const float boost_ratio)
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    if (boost_ratio < 1.0f)
+        throw invalid_argument("Error: boost ratio must be greater than 1.0");
 
-    vector<vector<pixel>> new_data = data;
-    const int padding = filter_size / 2;
-    for (int x = padding; x < info_header.height - padding; x++)
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
     {
-        int sum_r = 0, sum_g = 0, sum_b = 0;
-        for (int i = -padding; i <= padding; i++)
+        Bitmap_cpp::HighPassRows(src, out, filter_size, first_row, last_row, [&](int x)
         {
-            for (int j = -padding; j <= padding; j++)
-            {
-                sum_r += data[x + i][padding + j].r;
-                sum_g += data[x + i][padding + j].g;
-                sum_b += data[x + i][padding + j].b;
-            }
-        }
+            const unsigned char* original = src.row(x);
+            unsigned char* highpass = out.row(x);
+            for (int y = 0; y < src.width(); y++)
+                highpass[y] = static_cast<unsigned char>(min(255, max(0, static_cast<int>((boost_ratio - 1) * original[y] + highpass[y]))));
+        });
+    }, true);
+}
 
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                for (int i = -padding; i <= padding; i++)
-                {
-                    sum_r -= data[x + i][y - padding - 1].r;
-                    sum_r += data[x + i][y + padding].r;
-                    sum_g -= data[x + i][y - padding - 1].g;
-                    sum_g += data[x + i][y + padding].g;
-                    sum_b -= data[x + i][y - padding - 1].b;
-                    sum_b += data[x + i][y + padding].b;
-                }
-            }
+Bitmap_planar& Bitmap_planar::PrewittOperator(bool Diagonal)
+{
+    CheckValid();
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::PrewittRows(src, out, Diagonal, first_row, last_row, bitmap_detail::no_row_callback());
+    }, true);
+}
 
-            const int filter_size_2 = filter_size * filter_size;
-            new_data[x][y].r = sum_r / filter_size_2;
-            new_data[x][y].g = sum_g / filter_size_2;
-            new_data[x][y].b = sum_b / filter_size_2;
-        }
-    }
-    data = new_data;
+Bitmap_planar& Bitmap_planar::SobelOperator(bool Diagonal)
+{
+    CheckValid();
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::SobelRows(src, out, Diagonal, first_row, last_row, bitmap_detail::no_row_callback());
+    }, true);
 }
 
-void Bitmap_cpp::MedianFilter(const int filter_size)
+Bitmap_planar& Bitmap_planar::LaplacianOperator(bool Enhanced)
 {
     CheckValid();
-    if (filter_size <= 0)
-        throw invalid_argument("Error: filter size must be greater than 0");
-    if (filter_size % 2 == 0)
-        throw invalid_argument("Error: filter size must be an odd number");
-    
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    const int padding = filter_size / 2;
-    const int filter_pixels = filter_size * filter_size;
-    for (int x = padding; x < info_header.height - padding; x++)
+    return FilterPlanes([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
     {
-        vector<int> r_values(filter_pixels), g_values(filter_pixels), b_values(filter_pixels);
-        for (int i = -padding; i <= padding; i++)
-        {
-            const int offset = i + padding;
-            for (int j = -padding; j <= padding; j++)
-            {
-                const int index = (j + padding) * filter_size + offset;
-                r_values[index] = data[x + i][padding + j].r;
-                g_values[index] = data[x + i][padding + j].g;
-                b_values[index] = data[x + i][padding + j].b;
-            }
-        }
+        Bitmap_cpp::LaplacianRows(src, out, Enhanced, first_row, last_row, bitmap_detail::no_row_callback());
+    }, true);
+}
 
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                const int row_offset = (y - padding - 1) * filter_size % filter_pixels;
-                for (int i = -padding; i <= padding; i++)
-                {
-                    const int index = row_offset + (i + padding);
-                    r_values[index] = data[x + i][y + padding].r;
-                    g_values[index] = data[x + i][y + padding].g;
-                    b_values[index] = data[x + i][y + padding].b;
-                }
-            }
+bitmap_detail::rgb_view<unsigned char> Bitmap_planar::Samples(channel_plane* bgr)
+{
+    const bitmap_detail::rgb_view<unsigned char> view = {bgr[2].row(0), bgr[1].row(0), bgr[0].row(0), bgr[0].stride(), 1, bgr[0].width(), bgr[0].height()};
+    return view;
+}
 
-            auto KthElement = [](vector<int> vec, const int k) 
-            {
-                nth_element(vec.begin(), vec.begin() + k, vec.end());
-                return vec[k];
-            };
-            new_data[x][y].r = KthElement(r_values, filter_pixels / 2);
-            new_data[x][y].g = KthElement(g_values, filter_pixels / 2);
-            new_data[x][y].b = KthElement(b_values, filter_pixels / 2);
-        }
-    }
-    data = new_data;
+bitmap_detail::rgb_view<const unsigned char> Bitmap_planar::Samples(const channel_plane* bgr)
+{
+    const bitmap_detail::rgb_view<const unsigned char> view = {bgr[2].row(0), bgr[1].row(0), bgr[0].row(0), bgr[0].stride(), 1, bgr[0].width(), bgr[0].height()};
+    return view;
 }
 
-void Bitmap_cpp::AlphaTrimmedMeanFilter(const int filter_size, const int removed_elements)
+Bitmap_planar& Bitmap_planar::DCT_Compress(const dct_precision precision)
 {
     CheckValid();
-    if (filter_size <= 0)
-        throw invalid_argument("Error: filter size must be greater than 0");
-    if (filter_size % 2 == 0)
-        throw invalid_argument("Error: filter size must be an odd number");
-    const int filter_pixels = filter_size * filter_size;
-    if (filter_pixels <= removed_elements * 2)
-        throw invalid_argument("Error: removed_elements must be less than half of the filter size");
-    
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    const int padding = filter_size / 2;
-    for (int x = padding; x < info_header.height - padding; x++)
-    {
-        vector<int> r_values(filter_pixels), g_values(filter_pixels), b_values(filter_pixels);
-        for (int i = -padding; i <= padding; i++)
-        {
-            const int offset = i + padding;
-            for (int j = -padding; j <= padding; j++)
-            {
-                const int index = (j + padding) * filter_size + offset;
-                r_values[index] = data[x + i][padding + j].r;
-                g_values[index] = data[x + i][padding + j].g;
-                b_values[index] = data[x + i][padding + j].b;
-            }
-        }
+    Bitmap_cpp::CompressDCTBlocks(Samples(planes), precision);
+    return *this;
+}
 
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                const int row_offset = (y - padding - 1) * filter_size % filter_pixels;
-                for (int i = -padding; i <= padding; i++)
-                {
-                    const int index = row_offset + (i + padding);
-                    r_values[index] = data[x + i][y + padding].r;
-                    g_values[index] = data[x + i][y + padding].g;
-                    b_values[index] = data[x + i][y + padding].b;
-                }
-            }
+vector<unsigned char> Bitmap_planar::DCT_Encode(const int quality) const
+{
+    CheckValid();
+    return Bitmap_cpp::EncodeDCT(Samples(planes), quality);
+}
 
-            nth_element(r_values.begin(), r_values.begin() + removed_elements, r_values.end());
-            nth_element(r_values.begin() + removed_elements, r_values.end() - removed_elements, r_values.end());
-            nth_element(g_values.begin(), g_values.begin() + removed_elements, g_values.end());
-            nth_element(g_values.begin() + removed_elements, g_values.end() - removed_elements, g_values.end());
-            nth_element(b_values.begin(), b_values.begin() + removed_elements, b_values.end());
-            nth_element(b_values.begin() + removed_elements, b_values.end() - removed_elements, b_values.end());
+void Bitmap_planar::DCT_Decode(const vector<unsigned char>& bytes, const int first_row, const int row_count)
+{
+    dct_file_header file_header;
+    bitmap_detail::dct_tables tables;
+    vector<uint32_t> row_offsets;
+    Bitmap_cpp::ReadDCTHeader(bytes.data(), bytes.size(), file_header, tables, row_offsets);
+    if (static_cast<size_t>(file_header.data_offset) + file_header.data_size > bytes.size())
+        throw runtime_error("Error: DCT data exceeds buffer size");
+    const int last_row = row_count < 0 ? file_header.height : first_row + row_count;
+    if (first_row < 0 || last_row > file_header.height || first_row >= last_row)
+        throw invalid_argument("Error: row band is out of range");
+
+    // Decoded into the scratch planes, a corrupt stream leaves the image as it was
+    for (int c = 0; c < 3; c++)
+        scratch[c].resize_for_overwrite(last_row - first_row, file_header.width);
+    Bitmap_cpp::DecodeDCTRows(file_header, tables, row_offsets, bytes.data() + file_header.data_offset, 0, first_row, Samples(scratch));
+    for (int c = 0; c < 3; c++)
+        planes[c].swap(scratch[c]);
+    Bitmap_cpp::MakeHeaders(file_header.width, last_row - first_row, header, info_header);
+    opaque = true;
+}
 
-            int sum_r = 0, sum_g = 0, sum_b = 0;
-            for (int i = removed_elements; i < filter_pixels - removed_elements; i++) 
-            {
-                sum_r += r_values[i];
-                sum_g += g_values[i];
-                sum_b += b_values[i];
-            }
+void Bitmap_planar::SaveDCT(string file_path, const int quality, const bool atomic_replace) const
+{
+    bitmap_detail::write_dct_file(file_path, DCT_Encode(quality), atomic_replace);
+}
 
-            const int remaining_elements = filter_pixels - removed_elements * 2;
-            new_data[x][y].r = sum_r / remaining_elements;
-            new_data[x][y].g = sum_g / remaining_elements;
-            new_data[x][y].b = sum_b / remaining_elements;
-        }
-    }
-    data = new_data;
+void Bitmap_planar::LoadDCT(string file_path, const int first_row, const int row_count)
+{
+    ifstream file(file_path, ios::binary | ios::ate);
+    if (!file.is_open())
+        throw runtime_error("Error: file not found");
+    vector<unsigned char> bytes(static_cast<size_t>(file.tellg()));
+    file.seekg(0, ios::beg);
+    if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size()))
+        throw runtime_error("Error: file read error");
+    DCT_Decode(bytes, first_row, row_count);
 }
 
-void Bitmap_cpp::SpatialHighPassFilter(const int filter_size)
+// Single-channel 8-bit image. Gray inputs run the filters, the equalizations and the DCT on one plane
+// instead of three interleaved channels, and the result matches Bitmap_cpp on the same gray image.
+// Loads any supported Bitmap file ((r + g + b) / 3 for color ones) and saves 8-bit palettized files.
+class Bitmap_gray
 {
-    CheckValid();
-    if (filter_size <= 0)
-        throw invalid_argument("Error: filter size must be greater than 0");
-    if (filter_size % 2 == 0)
-        throw invalid_argument("Error: filter size must be an odd number");
-    
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    const int padding = filter_size / 2, filter_pixels = filter_size * filter_size;
-    vector<int> kernel(filter_pixels, -1);
-    kernel[padding * filter_size + padding] = filter_pixels - 1;
-    /* kernel example, filter_size = 3
-    -1 -1 -1
-    -1  8 -1
-    -1 -1 -1
-    */
+public:
+    // Copies allocate from the same memory resource as the original, a Bitmap_cpp passes on its own
+    Bitmap_gray();
+    explicit Bitmap_gray(const Bitmap_cpp& image);
+    Bitmap_gray(string file_path);
+    Bitmap_gray(const Bitmap_gray& other);
+    Bitmap_gray(Bitmap_gray&& other) = default;
+    Bitmap_gray& operator=(const Bitmap_gray& other);
+    Bitmap_gray& operator=(Bitmap_gray&& other) = default;
 
-    for (int x = padding; x < info_header.height - padding; x++)
-    {
-        vector<int> kernel_r(filter_pixels), kernel_g(filter_pixels), kernel_b(filter_pixels);
-        for (int i = -padding; i <= padding; i++)
-        {
-            const int offset = i + padding;
-            for (int j = -padding; j <= padding; j++)
-            {
-                const int index = (j + padding) * filter_size + offset;
-                kernel_r[index] = data[x + i][padding + j].r;
-                kernel_g[index] = data[x + i][padding + j].g;
-                kernel_b[index] = data[x + i][padding + j].b;
-            }
-        }
-        
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                const int row_offset = (y - padding - 1) * filter_size % filter_pixels;
-                for (int i = -padding; i <= padding; i++)
-                {
-                    const int index = row_offset + (i + padding);
-                    kernel_r[index] = data[x + i][y + padding].r;
-                    kernel_g[index] = data[x + i][y + padding].g;
-                    kernel_b[index] = data[x + i][y + padding].b;
-                }
-            }
+    void LoadBmp(string file_path);
+    void SaveBmp(string file_path, const bool atomic_replace = false) const;
+
+    // Assign keeps (r + g + b) / 3 of every pixel, ToBitmap writes the gray value to r, g and b
+    void Assign(const Bitmap_cpp& image);
+    void ToBitmap(Bitmap_cpp& dst) const;
+    Bitmap_cpp ToBitmap() const;
+
+    bool empty() const { return data.empty(); }
+    int Width() const { return data.width(); }
+    int Height() const { return data.height(); }
+    const channel_plane& Plane() const { return data; }
+
+    // Histogram equalization
+    Bitmap_gray& HistogramEqualization_Global();
+    Bitmap_gray& HistogramEqualization_Local(const int block_size = 7, const equalization_mode mode = equalization_mode::exact, const float clip_limit = 4.0f);
+
+    // Smoothing filters
+    Bitmap_gray& SpatialLowPassFilter(const int filter_size = 3);
+    Bitmap_gray& MedianFilter(const int filter_size = 3);
+    Bitmap_gray& AlphaTrimmedMeanFilter(const int filter_size = 3, const int removed_elements = 1);
+    Bitmap_gray& PercentileFilter(const int filter_size = 3, const float percentile = 50.0f);
+    Bitmap_gray& MinFilter(const int filter_size = 3);
+    Bitmap_gray& MaxFilter(const int filter_size = 3);
+
+    // Sharpening filters
+    Bitmap_gray& SpatialHighPassFilter(const int filter_size = 3);
+    Bitmap_gray& SpatialHighBoostFilter(const int filter_size = 3, const float boost_ratio = 1.5f);
+
+    // Edge detection
+    Bitmap_gray& PrewittOperator(bool Diagonal = false);
+    Bitmap_gray& SobelOperator(bool Diagonal = false);
+    Bitmap_gray& LaplacianOperator(bool Enhanced = false);
+
+    // DCT, the same .bdct format as Bitmap_cpp. The container always holds three components, so
+    // decoding goes through a color image and converts back.
+    Bitmap_gray& DCT_Compress(const dct_precision precision = dct_precision::floating_point);
+    vector<unsigned char> DCT_Encode(const int quality = 75) const;
+    void DCT_Decode(const vector<unsigned char>& bytes, const int first_row = 0, const int row_count = -1);
+    void SaveDCT(string file_path, const int quality = 75, const bool atomic_replace = false) const;
+    void LoadDCT(string file_path, const int first_row = 0, const int row_count = -1);
+
+    // Memory of the plane and filter buffers, the same as Bitmap_cpp::SetMemoryResource
+    void SetMemoryResource(bitmap_memory_resource* resource);
+    bitmap_memory_resource* GetMemoryResource() const;
+    bitmap_memory_stats MemoryStats() const;
+
+    bmp_header header;
+    bmp_info_header info_header;
+    channel_plane data;
+
+private:
+    void CheckValid() const;
+    void SetHeaders();
+    template <typename Rows>
+    Bitmap_gray& Filter(Rows rows);
+    template <typename Query>
+    Bitmap_gray& RankFilter(const int filter_size, Query query);
+    bitmap_detail::rgb_view<unsigned char> Samples();
+    bitmap_detail::rgb_view<const unsigned char> Samples() const;
+
+    // Filters write into `scratch` and trade it with `data`
+    channel_plane scratch;
+    bitmap_detail::rank_storage rank_scratch;
+};
+
+Bitmap_gray::Bitmap_gray() : header(), info_header()
+{
+    SetMemoryResource(nullptr);
+}
+
+Bitmap_gray::Bitmap_gray(const Bitmap_cpp& image) : header(), info_header()
+{
+    SetMemoryResource(image.GetMemoryResource());
+    Assign(image);
+}
+
+Bitmap_gray::Bitmap_gray(string file_path) : Bitmap_gray()
+{
+    LoadBmp(file_path);
+}
 
-            int sum_r = 0, sum_g = 0, sum_b = 0;
-            for (int i = 0; i < filter_pixels; i++)
-            {
-                sum_r += kernel_r[i] * kernel[i];
-                sum_g += kernel_g[i] * kernel[i];
-                sum_b += kernel_b[i] * kernel[i];
-            }
+Bitmap_gray::Bitmap_gray(const Bitmap_gray& other) : header(other.header), info_header(other.info_header)
+{
+    SetMemoryResource(other.GetMemoryResource());
+    data = other.data;
+}
 
-            new_data[x][y].r = max(0, min(255, sum_r / filter_pixels));
-            new_data[x][y].g = max(0, min(255, sum_g / filter_pixels));
-            new_data[x][y].b = max(0, min(255, sum_b / filter_pixels));
-        }
-    }
-    data = new_data;
+Bitmap_gray& Bitmap_gray::operator=(const Bitmap_gray& other)
+{
+    // Copies into the existing plane, same-sized images do not allocate
+    header = other.header;
+    info_header = other.info_header;
+    data = other.data;
+    return *this;
 }
 
-void Bitmap_cpp::SpatialHighBoostFilter(const int filter_size, const float boost_ratio)
+void Bitmap_gray::LoadBmp(string file_path)
 {
-    CheckValid();
-    if (filter_size <= 0)
-        throw invalid_argument("Error: filter size must be greater than 0");
-    if (filter_size % 2 == 0)
-        throw invalid_argument("Error: filter size must be an odd number");
-    if (boost_ratio < 1.0f)
-        throw invalid_argument("Error: boost ratio must be greater than 1.0");
+    ifstream file(file_path, ios::binary);
+    if (!file.is_open())
+        throw runtime_error("Error: file not found");
+
+    bmp_header file_header;
+    bmp_info_header file_info_header;
+    file.read(reinterpret_cast<char*>(&file_header), sizeof(bmp_header));
+    file.read(reinterpret_cast<char*>(&file_info_header), sizeof(bmp_info_header));
+    if (!file || file_header.signature[0] != 'B' || file_header.signature[1] != 'M')
+        throw runtime_error("Error: file is not a Bitmap file");
+    if (file_info_header.bit_count != 8 || file_info_header.compression != 0)
+    {
+        file.close();
+        Assign(Bitmap_cpp(file_path));
+        return;
+    }
 
-    vector<vector<pixel>> original = data;
-    this->SpatialHighPassFilter(filter_size);
-    vector<vector<pixel>> highpass = data;
+    // Colored palettes are mapped like Assign maps colored pixels
+    bitmap_detail::bmp_format format;
+    Bitmap_cpp::ReadBmpFormat(file, file_info_header, format);
+    unsigned char gray[256];
+    for (int i = 0; i < 256; i++)
+        gray[i] = static_cast<unsigned char>((format.palette[i].b + format.palette[i].g + format.palette[i].r) / 3);
 
-    for (int x = 0; x < info_header.height; x++)
+    if (bitmap_detail::logging_enabled())
+        bitmap_detail::log_message(bitmap_detail::file_name_of(file_path) + " is an 8-bit Bitmap file");
+
+    const int height = format.height, width = format.width;
+    data.resize_for_overwrite(height, width);
+    vector<unsigned char> row_data(format.RowBytes());
+    file.seekg(file_header.data_offset, ios::beg);
+    for (int x = 0; x < height; x++)
     {
-        for (int y = 0; y < info_header.width; y++)
-        {
-            data[x][y].r = min(255, max(0, static_cast<int>((boost_ratio - 1) * original[x][y].r + highpass[x][y].r)));
-            data[x][y].g = min(255, max(0, static_cast<int>((boost_ratio - 1) * original[x][y].g + highpass[x][y].g)));
-            data[x][y].b = min(255, max(0, static_cast<int>((boost_ratio - 1) * original[x][y].b + highpass[x][y].b)));
-        }
+        if (!file.read(reinterpret_cast<char*>(row_data.data()), row_data.size()))
+            throw runtime_error("Error: unexpected end of Bitmap file");
+        unsigned char* row = data.row(format.top_down ? height - 1 - x : x);
+        for (int y = 0; y < width; y++)
+            row[y] = gray[row_data[y]];
     }
+    header = file_header;
+    info_header = file_info_header;
+    SetHeaders();
 }
 
-void Bitmap_cpp::PrewittOperator(bool Diagonal)
+void Bitmap_gray::SaveBmp(string file_path, const bool atomic_replace) const
 {
     CheckValid();
+    if (file_path.find(".bmp") == string::npos)
+        file_path += ".bmp";
 
-    const vector<vector<int>> kernel_x = !Diagonal ?
-        vector<vector<int>>{
-            {-1, 0, 1},
-            {-1, 0, 1},
-            {-1, 0, 1}
-        } :
-        vector<vector<int>>{
-            {-1, -1, 0},
-            {-1,  0, 1},
-            { 0,  1, 1}
-        };
-    const vector<vector<int>> kernel_y = !Diagonal ?
-        vector<vector<int>>{
-            {-1, -1, -1},
-            { 0,  0,  0},
-            { 1,  1,  1}
-        } :
-        vector<vector<int>>{
-            { 0,  1,  1},
-            {-1,  0,  1},
-            {-1, -1,  0}
-        };
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    const int padding = 1, filter_size = 3, filter_pixels = filter_size * filter_size;
-
-    for (int x = padding; x < info_header.height - padding; x++)
+    unsigned char palette[256][4];
+    for (int i = 0; i < 256; i++)
     {
-        vector<int> kernel_r(filter_pixels), kernel_g(filter_pixels), kernel_b(filter_pixels);
-        for (int i = -padding; i <= padding; i++)
-        {
-            const int offset = i + padding;
-            for (int j = -padding; j <= padding; j++)
-            {
-                const int index = (j + padding) * filter_size + offset;
-                kernel_r[index] = data[x + i][padding + j].r;
-                kernel_g[index] = data[x + i][padding + j].g;
-                kernel_b[index] = data[x + i][padding + j].b;
-            }
-        }
-        
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                const int row_offset = (y - padding - 1) * filter_size % filter_pixels;
-                for (int i = -padding; i <= padding; i++)
-                {
-                    const int index = row_offset + (i + padding);
-                    kernel_r[index] = data[x + i][y + padding].r;
-                    kernel_g[index] = data[x + i][y + padding].g;
-                    kernel_b[index] = data[x + i][y + padding].b;
-                }
-            }
-
-            int sum_r_x = 0, sum_g_x = 0, sum_b_x = 0, sum_r_y = 0, sum_g_y = 0, sum_b_y = 0;
-            for (int i = 0; i < filter_pixels; i++)
-            {
-                sum_r_x += kernel_r[i] * kernel_x[i / filter_size][i % filter_size];
-                sum_g_x += kernel_g[i] * kernel_x[i / filter_size][i % filter_size];
-                sum_b_x += kernel_b[i] * kernel_x[i / filter_size][i % filter_size];
-                sum_r_y += kernel_r[i] * kernel_y[i / filter_size][i % filter_size];
-                sum_g_y += kernel_g[i] * kernel_y[i / filter_size][i % filter_size];
-                sum_b_y += kernel_b[i] * kernel_y[i / filter_size][i % filter_size];
-            }
-
-            new_data[x][y].r = min(255, max(0, abs(sum_r_x) + abs(sum_r_y)));
-            new_data[x][y].g = min(255, max(0, abs(sum_g_x) + abs(sum_g_y)));
-            new_data[x][y].b = min(255, max(0, abs(sum_b_x) + abs(sum_b_y)));
-        }
+        palette[i][0] = palette[i][1] = palette[i][2] = static_cast<unsigned char>(i);
+        palette[i][3] = 0;
     }
-    data = new_data;
+
+    const int width = Width();
+    const size_t row_bytes = (width + 3) / 4 * 4;
+    vector<unsigned char> pixels(row_bytes * Height(), 0);
+    for (int x = 0; x < Height(); x++)
+        memcpy(&pixels[row_bytes * x], data.row(x), width);
+    bitmap_detail::write_file(file_path, {{&header, sizeof(bmp_header)}, {&info_header, sizeof(bmp_info_header)}, {palette, sizeof(palette)}, {pixels.data(), pixels.size()}}, atomic_replace);
+    bitmap_detail::log_saved(file_path);
 }
 
-void Bitmap_cpp::SobelOperator(bool Diagonal)
+// 8-bit headers with a full gray palette for the current size, the resolution fields are kept
+void Bitmap_gray::SetHeaders()
 {
-    CheckValid();
+    const int row_bytes = (Width() + 3) / 4 * 4;
+    const int32_t x_resolution = info_header.x_pixels_per_meter, y_resolution = info_header.y_pixels_per_meter;
+    memcpy(header.signature, "BM", 2);
+    header.reserved = 0;
+    header.data_offset = sizeof(bmp_header) + sizeof(bmp_info_header) + 256 * 4;
+    info_header = bmp_info_header();
+    info_header.size = sizeof(bmp_info_header);
+    info_header.width = Width();
+    info_header.height = Height();
+    info_header.planes = 1;
+    info_header.bit_count = 8;
+    info_header.size_image = row_bytes * Height();
+    info_header.x_pixels_per_meter = x_resolution;
+    info_header.y_pixels_per_meter = y_resolution;
+    info_header.colors_used = 256;
+    header.file_size = header.data_offset + info_header.size_image;
+}
 
-    const vector<vector<int>> kernel_x = !Diagonal ?
-        vector<vector<int>>{
-            {-1, 0, 1},
-            {-2, 0, 2},
-            {-1, 0, 1}
-        } :
-        vector<vector<int>>{
-            {-2, -1, 0},
-            {-1,  0, 1},
-            { 0,  1, 2}
-        };
-    const vector<vector<int>> kernel_y = !Diagonal ?
-        vector<vector<int>>{
-            {-1, -2, -1},
-            { 0,  0,  0},
-            { 1,  2,  1}
-        } :
-        vector<vector<int>>{
-            { 0,  1,  2},
-            {-1,  0,  1},
-            {-2, -1,  0}
-        };
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    const int padding = 1, filter_size = 3, filter_pixels = filter_size * filter_size;
+void Bitmap_gray::Assign(const Bitmap_cpp& image)
+{
+    image.CheckValid();
+    const int height = image.info_header.height, width = image.info_header.width;
+    data.resize_for_overwrite(height, width);
 
-    for (int x = padding; x < info_header.height - padding; x++)
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
     {
-        vector<int> kernel_r(filter_pixels), kernel_g(filter_pixels), kernel_b(filter_pixels);
-        for (int i = -padding; i <= padding; i++)
-        {
-            const int offset = i + padding;
-            for (int j = -padding; j <= padding; j++)
-            {
-                const int index = (j + padding) * filter_size + offset;
-                kernel_r[index] = data[x + i][padding + j].r;
-                kernel_g[index] = data[x + i][padding + j].g;
-                kernel_b[index] = data[x + i][padding + j].b;
-            }
-        }
-        
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                const int row_offset = (y - padding - 1) * filter_size % filter_pixels;
-                for (int i = -padding; i <= padding; i++)
-                {
-                    const int index = row_offset + (i + padding);
-                    kernel_r[index] = data[x + i][y + padding].r;
-                    kernel_g[index] = data[x + i][y + padding].g;
-                    kernel_b[index] = data[x + i][y + padding].b;
-                }
-            }
+        for (int x = first_row; x < last_row; x++)
+            kernels.extract_gray(image.data.row(x), data.row(x), width);
+    });
+    header = image.header;
+    info_header = image.info_header;
+    SetHeaders();
+}
 
-            int sum_r_x = 0, sum_g_x = 0, sum_b_x = 0, sum_r_y = 0, sum_g_y = 0, sum_b_y = 0;
-            for (int i = 0; i < filter_pixels; i++)
-            {
-                sum_r_x += kernel_r[i] * kernel_x[i / filter_size][i % filter_size];
-                sum_g_x += kernel_g[i] * kernel_x[i / filter_size][i % filter_size];
-                sum_b_x += kernel_b[i] * kernel_x[i / filter_size][i % filter_size];
-                sum_r_y += kernel_r[i] * kernel_y[i / filter_size][i % filter_size];
-                sum_g_y += kernel_g[i] * kernel_y[i / filter_size][i % filter_size];
-                sum_b_y += kernel_b[i] * kernel_y[i / filter_size][i % filter_size];
-            }
+void Bitmap_gray::ToBitmap(Bitmap_cpp& dst) const
+{
+    CheckValid();
+    const int height = Height(), width = Width();
+    dst.data.resize_for_overwrite(height, width);
 
-            new_data[x][y].r = min(255, max(0, abs(sum_r_x) + abs(sum_r_y)));
-            new_data[x][y].g = min(255, max(0, abs(sum_g_x) + abs(sum_g_y)));
-            new_data[x][y].b = min(255, max(0, abs(sum_b_x) + abs(sum_b_y)));
-        }
-    }
-    data = new_data;
+    const bitmap_detail::pointwise_kernels& kernels = bitmap_detail::pointwise();
+    bitmap_detail::parallel_for(0, height, [&](int first_row, int last_row)
+    {
+        for (int x = first_row; x < last_row; x++)
+            kernels.interleave(dst.data.row(x), data.row(x), data.row(x), data.row(x), nullptr, width);
+    });
+    Bitmap_cpp::MakeHeaders(width, height, dst.header, dst.info_header);
+    dst.info_header.x_pixels_per_meter = info_header.x_pixels_per_meter;
+    dst.info_header.y_pixels_per_meter = info_header.y_pixels_per_meter;
 }
 
-void Bitmap_cpp::LaplacianOperator(bool Enhanced)
+Bitmap_cpp Bitmap_gray::ToBitmap() const
 {
-    CheckValid();
+    Bitmap_cpp image;
+    image.SetMemoryResource(GetMemoryResource());
+    ToBitmap(image);
+    return image;
+}
 
-    const vector<vector<int>> kernel = !Enhanced ?
-        vector<vector<int>>{
-            { 0,  1,  0},
-            { 1, -4,  1},
-            { 0,  1,  0}
-        } :
-        vector<vector<int>>{
-            { 1,  1,  1},
-            { 1, -8,  1},
-            { 1,  1,  1}
-        };
-    vector<vector<pixel>> new_data(info_header.height, vector<pixel>(info_header.width));
-    const int padding = 1, filter_size = 3, filter_pixels = filter_size * filter_size;
+void Bitmap_gray::SetMemoryResource(bitmap_memory_resource* resource)
+{
+    shared_ptr<pixel_memory> memory = make_shared<pixel_memory>();
+    memory->resource = resource;
+    data.use_memory(memory);
+    scratch.use_memory(memory);
+    rank_scratch.Reset(memory);
+}
 
-    for (int x = padding; x < info_header.height - padding; x++)
-    {
-        vector<int> kernel_r(filter_pixels), kernel_g(filter_pixels), kernel_b(filter_pixels);
-        for (int i = -padding; i <= padding; i++)
-        {
-            const int offset = i + padding;
-            for (int j = -padding; j <= padding; j++)
-            {
-                const int index = (j + padding) * filter_size + offset;
-                kernel_r[index] = data[x + i][padding + j].r;
-                kernel_g[index] = data[x + i][padding + j].g;
-                kernel_b[index] = data[x + i][padding + j].b;
-            }
-        }
-        
-        for (int y = padding; y < info_header.width - padding; y++)
-        {
-            if (y > padding)
-            {
-                const int row_offset = (y - padding - 1) * filter_size % filter_pixels;
-                for (int i = -padding; i <= padding; i++)
-                {
-                    const int index = row_offset + (i + padding);
-                    kernel_r[index] = data[x + i][y + padding].r;
-                    kernel_g[index] = data[x + i][y + padding].g;
-                    kernel_b[index] = data[x + i][y + padding].b;
-                }
-            }
+bitmap_memory_resource* Bitmap_gray::GetMemoryResource() const
+{
+    return data.memory_source() != nullptr ? data.memory_source()->resource : nullptr;
+}
 
-            int sum_r = 0, sum_g = 0, sum_b = 0;
-            for (int i = 0; i < filter_pixels; i++)
-            {
-                sum_r += kernel_r[i] * kernel[i / filter_size][i % filter_size];
-                sum_g += kernel_g[i] * kernel[i / filter_size][i % filter_size];
-                sum_b += kernel_b[i] * kernel[i / filter_size][i % filter_size];
-            }
+bitmap_memory_stats Bitmap_gray::MemoryStats() const
+{
+    return bitmap_detail::memory_stats(data.memory_source().get());
+}
 
-            new_data[x][y].r = min(255, max(0, sum_r));
-            new_data[x][y].g = min(255, max(0, sum_g));
-            new_data[x][y].b = min(255, max(0, sum_b));
-        }
-    }
-    data = new_data;
+void Bitmap_gray::CheckValid() const
+{
+    if (empty())
+        throw runtime_error("Error: image data is empty");
 }
 
-vector<int> Bitmap_cpp::DCT_Transform(const vector<pixel> data, const float u, const float v, const int N)
+Bitmap_gray& Bitmap_gray::HistogramEqualization_Global()
 {
-    const float PI = 3.1415926;
-    const float alpha_u = u == 0 ? 1 / sqrt(N) : sqrt(2.0 / N), alpha_v = v == 0 ? 1 / sqrt(N) : sqrt(2.0 / N);
-    const float alpha_coefficient = alpha_u * alpha_v;
+    CheckValid();
+    Bitmap_cpp::EqualizeGlobal(data);
+    return *this;
+}
 
-    float sum_r = 0, sum_g = 0, sum_b = 0;
-    for (int x = 0; x < N; x++)
+Bitmap_gray& Bitmap_gray::HistogramEqualization_Local(const int block_size, const equalization_mode mode, const float clip_limit)
+{
+    CheckValid();
+    if (block_size <= 0)
+        throw invalid_argument("Error: block size must be greater than 0");
+    if (mode == equalization_mode::clahe)
     {
-        const float cos_u = cos((2 * x + 1) * u * PI / (2.0 * N));
-        for (int y = 0; y < N; y++)
-        {
-            const float cos_v = cos((2 * y + 1) * v * PI / (2.0 * N));
-            const float coefficient = cos_u * cos_v;
-            sum_r += (data[x * N + y].r - 128) * coefficient;
-            sum_g += (data[x * N + y].g - 128) * coefficient;
-            sum_b += (data[x * N + y].b - 128) * coefficient;
-        }
+        if (clip_limit <= 0.0f)
+            throw invalid_argument("Error: clip limit must be greater than 0");
+        Bitmap_cpp::EqualizeCLAHE(data, block_size, clip_limit);
+        return *this;
     }
-    return vector<int>{
-        static_cast<int>(alpha_coefficient * sum_r),
-        static_cast<int>(alpha_coefficient * sum_g),
-        static_cast<int>(alpha_coefficient * sum_b)
-    };
+
+    Bitmap_cpp::EqualizeLocal(data, scratch, block_size);
+    data.swap(scratch);
+    return *this;
 }
 
-pixel Bitmap_cpp::IDCT_Transform(const vector<vector<int>> data, const float x, const float y, const int N)
-{
-    const float PI = 3.1415926;
 
-    float sum_r = 0, sum_g = 0, sum_b = 0;
-    for (int u = 0; u < N; u++)
+template <typename Rows>
+Bitmap_gray& Bitmap_gray::Filter(Rows rows)
+{
+    scratch.resize_for_overwrite(Height(), Width());
+    bitmap_detail::parallel_for(0, Height(), [&](int first_row, int last_row)
     {
-        const float alpha_u = u == 0 ? 1 / sqrt(N) : sqrt(2.0 / N);
-        const float cos_u = cos((2 * x + 1) * u * PI / (2.0 * N));
-        for (int v = 0; v < N; v++)
-        {
-            const float alpha_v = v == 0 ? 1 / sqrt(N) : sqrt(2.0 / N);
-            const float cos_v = cos((2 * y + 1) * v * PI / (2.0 * N));
-            const float coefficient = alpha_u * alpha_v * cos_u * cos_v;
-            sum_r += data[0][u * N + v] * coefficient;
-            sum_g += data[1][u * N + v] * coefficient;
-            sum_b += data[2][u * N + v] * coefficient;
-        }
-    }
-    return pixel{
-        static_cast<unsigned char>(sum_r + 128),
-        static_cast<unsigned char>(sum_g + 128),
-        static_cast<unsigned char>(sum_b + 128)
-    };
+        rows(data, scratch, first_row, last_row);
+    });
+    data.swap(scratch);
+    return *this;
 }
 
-void Bitmap_cpp::DCT_Compress()
+Bitmap_gray& Bitmap_gray::SpatialLowPassFilter(const int filter_size)
 {
     CheckValid();
-    if (info_header.height < 512 || info_header.width < 512)
-        throw runtime_error("Error: image size must be greater than 512x512");
-    if (info_header.height > 512 || info_header.width > 512)
-        this->Resize(512, 512);
-
-    const int N = 8;
-    for (int x = 0; x < info_header.height; x += N)
+    bitmap_detail::check_filter_size(filter_size);
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
     {
-        for (int y = 0; y < info_header.width; y += N)
-        {
-            vector<pixel> block(N * N);
-            for (int i = 0; i < N; i++)
-                for (int j = 0; j < N; j++)
-                    block[i * N + j] = data[x + i][y + j];
+        Bitmap_cpp::LowPassRows(src, out, filter_size, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
 
-            vector<int> dct_block_r(N * N), dct_block_g(N * N), dct_block_b(N * N);
-            for (int u = 0; u < N; u++)
-            {
-                for (int v = 0; v < N; v++)
-                {
-                    vector<int> temp = DCT_Transform(block, u, v, N);
-                    dct_block_r[u * N + v] = temp[0];
-                    dct_block_g[u * N + v] = temp[1];
-                    dct_block_b[u * N + v] = temp[2];
-                }
-            }
+template <typename Query>
+Bitmap_gray& Bitmap_gray::RankFilter(const int filter_size, Query query)
+{
+    bitmap_detail::rank_storage* storage = &rank_scratch;
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::RankRows(src, out, filter_size, first_row, last_row, query, bitmap_detail::no_row_callback(), *storage);
+    });
+}
 
-            for (int i = 0; i < N; i++)
-            {
-                for (int j = 0; j < N; j++)
-                {
-                    if (i + j >= 4)
-                    {
-                        dct_block_r[i * N + j] = 0;
-                        dct_block_g[i * N + j] = 0;
-                        dct_block_b[i * N + j] = 0;
-                    }
-                }
-            }
+Bitmap_gray& Bitmap_gray::MedianFilter(const int filter_size)
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    return RankFilter(filter_size, [](bitmap_detail::rank_window& window) { return window.Kth(window.Size() / 2); });
+}
 
-            vector<pixel> idct_block(N * N);
-            for (int u = 0; u < N; u++)
-                for (int v = 0; v < N; v++)
-                    idct_block[u * N + v] = IDCT_Transform(vector<vector<int>>{dct_block_r, dct_block_g, dct_block_b}, u, v, N);
+Bitmap_gray& Bitmap_gray::AlphaTrimmedMeanFilter(const int filter_size, const int removed_elements)
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_removed_elements(filter_size, removed_elements);
+    const int filter_pixels = filter_size * filter_size;
 
-            for (int i = 0; i < N; i++)
-                for (int j = 0; j < N; j++)
-                    data[x + i][y + j] = idct_block[i * N + j];
-        }
-    }
+    const bitmap_detail::exact_divider divide(filter_pixels - removed_elements * 2);
+    return RankFilter(filter_size, [=](bitmap_detail::rank_window& window)
+    {
+        return divide(window.TotalSum() - window.LowestSum(removed_elements) - window.HighestSum(removed_elements));
+    });
 }
 
-Bitmap_cpp Bitmap_cpp::operator+(const Bitmap_cpp& other)
+Bitmap_gray& Bitmap_gray::PercentileFilter(const int filter_size, const float percentile)
 {
     CheckValid();
-    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
-        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+    bitmap_detail::check_filter_size(filter_size);
+    bitmap_detail::check_percentile(percentile);
 
-    Bitmap_cpp result = *this;
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            result.data[x][y] = data[x][y] + other.data[x][y];
+    const int rank = static_cast<int>(percentile / 100.0f * (filter_size * filter_size - 1) + 0.5f);
+    return RankFilter(filter_size, [=](bitmap_detail::rank_window& window) { return window.Kth(rank); });
+}
 
-    return result;
+Bitmap_gray& Bitmap_gray::MinFilter(const int filter_size)
+{
+    return PercentileFilter(filter_size, 0.0f);
+}
+
+Bitmap_gray& Bitmap_gray::MaxFilter(const int filter_size)
+{
+    return PercentileFilter(filter_size, 100.0f);
 }
 
-Bitmap_cpp Bitmap_cpp::operator-(const Bitmap_cpp& other)
+Bitmap_gray& Bitmap_gray::SpatialHighPassFilter(const int filter_size)
 {
     CheckValid();
-    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
-        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+    bitmap_detail::check_filter_size(filter_size);
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::HighPassRows(src, out, filter_size, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
 
-    Bitmap_cpp result = *this;
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            result.data[x][y] = data[x][y] - other.data[x][y];
+Bitmap_gray& Bitmap_gray::SpatialHighBoostFilter(const int filter_size, const float boost_ratio)
+{
+    CheckValid();
+    bitmap_detail::check_filter_size(filter_size);
+    if (boost_ratio < 1.0f)
+        throw invalid_argument("Error: boost ratio must be greater than 1.0");
 
-    return result;
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::HighPassRows(src, out, filter_size, first_row, last_row, [&](int x)
+        {
+            const unsigned char* original = src.row(x);
+            unsigned char* highpass = out.row(x);
+            for (int y = 0; y < src.width(); y++)
+                highpass[y] = static_cast<unsigned char>(min(255, max(0, static_cast<int>((boost_ratio - 1) * original[y] + highpass[y]))));
+        });
+    });
 }
 
-Bitmap_cpp Bitmap_cpp::operator*(const int& scaler)
+Bitmap_gray& Bitmap_gray::PrewittOperator(bool Diagonal)
 {
     CheckValid();
-    if (scaler <= 0)
-        throw invalid_argument("Error: scaler must be greater than 0");
-
-    Bitmap_cpp result = *this;
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            result.data[x][y] = data[x][y] * scaler;
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::PrewittRows(src, out, Diagonal, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
 
-    return result;
+Bitmap_gray& Bitmap_gray::SobelOperator(bool Diagonal)
+{
+    CheckValid();
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::SobelRows(src, out, Diagonal, first_row, last_row, bitmap_detail::no_row_callback());
+    });
 }
 
-Bitmap_cpp Bitmap_cpp::operator/(const int& scaler)
+Bitmap_gray& Bitmap_gray::LaplacianOperator(bool Enhanced)
 {
     CheckValid();
-    if (scaler == 0)
-        throw invalid_argument("Error: division by zero");
+    return Filter([=](const channel_plane& src, channel_plane& out, int first_row, int last_row)
+    {
+        Bitmap_cpp::LaplacianRows(src, out, Enhanced, first_row, last_row, bitmap_detail::no_row_callback());
+    });
+}
 
-    Bitmap_cpp result = *this;
-    for (int x = 0; x < info_header.height; x++)
-        for (int y = 0; y < info_header.width; y++)
-            result.data[x][y] = data[x][y] / scaler;
+// The plane stands in for all three color channels
+bitmap_detail::rgb_view<unsigned char> Bitmap_gray::Samples()
+{
+    const bitmap_detail::rgb_view<unsigned char> view = {data.row(0), data.row(0), data.row(0), data.stride(), 1, Width(), Height()};
+    return view;
+}
 
-    return result;
+bitmap_detail::rgb_view<const unsigned char> Bitmap_gray::Samples() const
+{
+    const bitmap_detail::rgb_view<const unsigned char> view = {data.row(0), data.row(0), data.row(0), data.stride(), 1, Width(), Height()};
+    return view;
 }
 
-void Bitmap_cpp::and_with(const Bitmap_cpp& other)
+Bitmap_gray& Bitmap_gray::DCT_Compress(const dct_precision precision)
 {
     CheckValid();
-    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
-        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
-
-    for (int x = 0; x < info_header.height; x++)
-    {
-        for (int y = 0; y < info_header.width; y++)
-        {
-            data[x][y].r &= other.data[x][y].r;
-            data[x][y].g &= other.data[x][y].g;
-            data[x][y].b &= other.data[x][y].b;
-        }
-    }
+    Bitmap_cpp::CompressDCTBlocks(Samples(), precision);
+    return *this;
 }
 
-void Bitmap_cpp::or_with(const Bitmap_cpp& other)
+vector<unsigned char> Bitmap_gray::DCT_Encode(const int quality) const
 {
     CheckValid();
-    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
-        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+    return Bitmap_cpp::EncodeDCT(Samples(), quality);
+}
 
-    for (int x = 0; x < info_header.height; x++)
-    {
-        for (int y = 0; y < info_header.width; y++)
-        {
-            data[x][y].r |= other.data[x][y].r;
-            data[x][y].g |= other.data[x][y].g;
-            data[x][y].b |= other.data[x][y].b;
-        }
-    }
+void Bitmap_gray::DCT_Decode(const vector<unsigned char>& bytes, const int first_row, const int row_count)
+{
+    Bitmap_cpp image;
+    image.DCT_Decode(bytes, first_row, row_count);
+    Assign(image);
 }
 
-void Bitmap_cpp::xor_with(const Bitmap_cpp& other)
+void Bitmap_gray::SaveDCT(string file_path, const int quality, const bool atomic_replace) const
 {
-    CheckValid();
-    if (info_header.width != other.info_header.width || info_header.height != other.info_header.height)
-        throw runtime_error("Error: image size error, " + to_string(info_header.width) + "x" + to_string(info_header.height) + "(origin) vs " + to_string(other.info_header.width) + "x" + to_string(other.info_header.height) + "(other)");
+    bitmap_detail::write_dct_file(file_path, DCT_Encode(quality), atomic_replace);
+}
 
-    for (int x = 0; x < info_header.height; x++)
-    {
-        for (int y = 0; y < info_header.width; y++)
-        {
-            data[x][y].r ^= other.data[x][y].r;
-            data[x][y].g ^= other.data[x][y].g;
-            data[x][y].b ^= other.data[x][y].b;
-        }
-    }
+void Bitmap_gray::LoadDCT(string file_path, const int first_row, const int row_count)
+{
+    Bitmap_cpp image;
+    image.LoadDCT(file_path, first_row, row_count);
+    Assign(image);
 }
 
 #ifdef __cplusplus_cli
@@ -1429,7 +8011,7 @@ void Bitmap_cpp::LoadBmp(System::String^ file_path)
     LoadBmp(file_path_std);
 }
 
-Bitmap_cpp::Bitmap_cpp(System::String^ file_path)
+Bitmap_cpp::Bitmap_cpp(System::String^ file_path) : Bitmap_cpp()
 {
     LoadBmp(file_path);
 }
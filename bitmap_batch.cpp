@@ -0,0 +1,542 @@
+// Batch driver: runs one operation chain over many Bitmap files.
+//
+//   bitmap_batch [options] <pipeline> <input>...
+//
+// <pipeline> names Bitmap_cpp methods separated by commas, arguments follow the name after colons:
+//   toGray,MedianFilter:5,SobelOperator      Resample:317:178:2      Resize:640:480      SetBmpFormat:8:1
+// <input> is a Bitmap file, a directory (its .bmp files) or @list (one path per line).
+//
+// Reading, processing and writing run on separate threads connected by bounded queues, so the disk
+// and the CPU stay busy together. Build: g++ -std=c++11 -O2 -pthread bitmap_batch.cpp -o bitmap_batch
+#include "Bitmap_cpp.hpp"
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+namespace
+{
+    typedef function<void(Bitmap_pipeline&, const vector<double>&)> operation_body;
+
+    struct operation_info
+    {
+        const char* name;
+        int min_args;
+        int max_args;
+        operation_body run;
+    };
+
+    double arg(const vector<double>& args, const size_t index, const double fallback)
+    {
+        return index < args.size() ? args[index] : fallback;
+    }
+
+    int int_arg(const vector<double>& args, const size_t index, const int fallback)
+    {
+        return static_cast<int>(arg(args, index, fallback));
+    }
+
+    // The few arguments read with arg() instead of int_arg(), every other one has to be an int
+    bool real_arg(const string& name, const size_t index)
+    {
+        return (name == "PercentileFilter" && index == 1) || (name == "SpatialHighBoostFilter" && index == 1) ||
+            (name == "HistogramEqualization_Local" && index == 2);
+    }
+
+    // Every operation the spec can name, point-wise ones and filters go through the fused pipeline
+    const vector<operation_info>& operations()
+    {
+        static const vector<operation_info> table = {
+            {"toGray", 0, 0, [](Bitmap_pipeline& p, const vector<double>&) { p.toGray(); }},
+            {"InvertColor", 0, 0, [](Bitmap_pipeline& p, const vector<double>&) { p.InvertColor(); }},
+            {"Multiply", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.Multiply(int_arg(a, 0, 2)); }},
+            {"Divide", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.Divide(int_arg(a, 0, 2)); }},
+            {"SpatialLowPassFilter", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.SpatialLowPassFilter(int_arg(a, 0, 3)); }},
+            {"MedianFilter", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.MedianFilter(int_arg(a, 0, 3)); }},
+            {"AlphaTrimmedMeanFilter", 0, 2, [](Bitmap_pipeline& p, const vector<double>& a) { p.AlphaTrimmedMeanFilter(int_arg(a, 0, 3), int_arg(a, 1, 1)); }},
+            {"PercentileFilter", 0, 2, [](Bitmap_pipeline& p, const vector<double>& a) { p.PercentileFilter(int_arg(a, 0, 3), static_cast<float>(arg(a, 1, 50.0))); }},
+            {"MinFilter", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.MinFilter(int_arg(a, 0, 3)); }},
+            {"MaxFilter", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.MaxFilter(int_arg(a, 0, 3)); }},
+            {"SpatialHighPassFilter", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.SpatialHighPassFilter(int_arg(a, 0, 3)); }},
+            {"PrewittOperator", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.PrewittOperator(int_arg(a, 0, 0) != 0); }},
+            {"SobelOperator", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.SobelOperator(int_arg(a, 0, 0) != 0); }},
+            {"LaplacianOperator", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { p.LaplacianOperator(int_arg(a, 0, 0) != 0); }},
+            {"SpatialHighBoostFilter", 0, 2, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int size = int_arg(a, 0, 3);
+                const float ratio = static_cast<float>(arg(a, 1, 1.5));
+                p.Apply([=](Bitmap_cpp& image) { image.SpatialHighBoostFilter(size, ratio); });
+            }},
+            {"AddImpluseNoise", 0, 2, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int salt = int_arg(a, 0, 5), pepper = int_arg(a, 1, 5);
+                p.Apply([=](Bitmap_cpp& image) { image.AddImpluseNoise(salt, pepper); });
+            }},
+            {"AddGaussianNoise", 0, 2, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int mean = int_arg(a, 0, 0), variance = int_arg(a, 1, 10);
+                p.Apply([=](Bitmap_cpp& image) { image.AddGaussianNoise(mean, variance); });
+            }},
+            {"ZoomIn_ZeroOrder", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { const int s = int_arg(a, 0, 2); p.Apply([=](Bitmap_cpp& image) { image.ZoomIn_ZeroOrder(s); }); }},
+            {"ZoomIn_FirstOrder", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { const int s = int_arg(a, 0, 2); p.Apply([=](Bitmap_cpp& image) { image.ZoomIn_FirstOrder(s); }); }},
+            {"ZoomIn_Compare", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { const int s = int_arg(a, 0, 2); p.Apply([=](Bitmap_cpp& image) { image.ZoomIn_Compare(s); }); }},
+            {"ZoomIn_Bilinear", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { const int s = int_arg(a, 0, 2); p.Apply([=](Bitmap_cpp& image) { image.ZoomIn_Bilinear(s); }); }},
+            {"ZoomOut", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a) { const int s = int_arg(a, 0, 2); p.Apply([=](Bitmap_cpp& image) { image.ZoomOut(s); }); }},
+            {"Resample", 2, 3, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int width = int_arg(a, 0, 0), height = int_arg(a, 1, 0);
+                const resample_filter filter = static_cast<resample_filter>(min(max(int_arg(a, 2, 0), 0), 2));
+                p.Apply([=](Bitmap_cpp& image) { image.Resample(width, height, filter); });
+            }},
+            {"Resize", 2, 4, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int width = int_arg(a, 0, 0), height = int_arg(a, 1, 0), start_x = int_arg(a, 2, 0), start_y = int_arg(a, 3, 0);
+                p.Apply([=](Bitmap_cpp& image) { image.Resize(width, height, start_x, start_y); });
+            }},
+            {"HistogramEqualization_Global", 0, 0, [](Bitmap_pipeline& p, const vector<double>&) { p.Apply([](Bitmap_cpp& image) { image.HistogramEqualization_Global(); }); }},
+            {"HistogramEqualization_Local", 0, 3, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int block = int_arg(a, 0, 7);
+                const equalization_mode mode = int_arg(a, 1, 0) != 0 ? equalization_mode::clahe : equalization_mode::exact;
+                const float clip = static_cast<float>(arg(a, 2, 4.0));
+                p.Apply([=](Bitmap_cpp& image) { image.HistogramEqualization_Local(block, mode, clip); });
+            }},
+            {"DCT_Compress", 0, 1, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const dct_precision precision = int_arg(a, 0, 0) != 0 ? dct_precision::fixed_point : dct_precision::floating_point;
+                p.Apply([=](Bitmap_cpp& image) { image.DCT_Compress(precision); });
+            }},
+            {"SetBmpFormat", 0, 2, [](Bitmap_pipeline& p, const vector<double>& a)
+            {
+                const int bit_count = int_arg(a, 0, 24);
+                const bmp_compression compression = static_cast<bmp_compression>(int_arg(a, 1, 0));
+                p.Apply([=](Bitmap_cpp& image) { image.SetBmpFormat(bit_count, compression); });
+            }},
+        };
+        return table;
+    }
+
+    typedef function<void(Bitmap_pipeline&)> bound_operation;
+
+    // "Name:arg:arg,Name" to bound operations, unknown names and malformed arguments fail before any file is read
+    vector<bound_operation> parse_pipeline(const string& spec)
+    {
+        vector<bound_operation> chain;
+        stringstream steps(spec);
+        string step;
+        while (getline(steps, step, ','))
+        {
+            stringstream fields(step);
+            string name, field;
+            getline(fields, name, ':');
+            vector<double> args;
+            while (getline(fields, field, ':'))
+            {
+                char* end = nullptr;
+                args.push_back(strtod(field.c_str(), &end));
+                if (field.empty() || *end != '\0')
+                    throw invalid_argument("Error: bad argument '" + field + "' for " + name);
+            }
+
+            const operation_info* found = nullptr;
+            for (auto& info : operations())
+                if (name == info.name)
+                    found = &info;
+            if (found == nullptr)
+                throw invalid_argument("Error: unknown operation '" + name + "'");
+            if (static_cast<int>(args.size()) < found->min_args || static_cast<int>(args.size()) > found->max_args)
+                throw invalid_argument("Error: wrong number of arguments for " + name);
+            // int_arg casts, so a fraction or a value past int would be truncated or undefined there
+            for (size_t i = 0; i < args.size(); ++i)
+                if (!real_arg(name, i) && !(args[i] == floor(args[i]) && args[i] >= INT_MIN && args[i] <= INT_MAX))
+                    throw invalid_argument("Error: argument " + to_string(i + 1) + " of " + name + " must be an integer");
+
+            const operation_body run = found->run;
+            chain.push_back([=](Bitmap_pipeline& p) { run(p, args); });
+        }
+        if (chain.empty())
+            throw invalid_argument("Error: empty pipeline");
+        return chain;
+    }
+
+    bool ends_with_bmp(const string& name)
+    {
+        if (name.size() < 4)
+            return false;
+        string extension = name.substr(name.size() - 4);
+        transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+        return extension == ".bmp";
+    }
+
+    // .bmp files directly inside `directory`, sorted so runs are repeatable
+    vector<string> list_directory(const string& directory)
+    {
+        vector<string> files;
+        #ifdef _WIN32
+        WIN32_FIND_DATAA entry;
+        HANDLE search = FindFirstFileA((directory + "\\*").c_str(), &entry);
+        if (search == INVALID_HANDLE_VALUE)
+            return files;
+        do
+        {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && ends_with_bmp(entry.cFileName))
+                files.push_back(directory + "\\" + entry.cFileName);
+        } while (FindNextFileA(search, &entry));
+        FindClose(search);
+        #else
+        DIR* dir = opendir(directory.c_str());
+        if (dir == nullptr)
+            return files;
+        while (dirent* entry = readdir(dir))
+        {
+            const string path = directory + "/" + entry->d_name;
+            struct stat info;
+            if (ends_with_bmp(entry->d_name) && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+                files.push_back(path);
+        }
+        closedir(dir);
+        #endif
+        sort(files.begin(), files.end());
+        return files;
+    }
+
+    bool is_directory(const string& path)
+    {
+        #ifdef _WIN32
+        const DWORD attributes = GetFileAttributesA(path.c_str());
+        return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+        #else
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+        #endif
+    }
+
+    void make_directory(const string& path)
+    {
+        if (is_directory(path))
+            return;
+        #ifdef _WIN32
+        const bool made = CreateDirectoryA(path.c_str(), nullptr) != 0;
+        #else
+        const bool made = mkdir(path.c_str(), 0777) == 0;
+        #endif
+        if (!made)
+            throw runtime_error("Error: cannot create output directory " + path);
+    }
+
+    uint64_t file_size(const string& path)
+    {
+        ifstream file(path, ios::binary | ios::ate);
+        return file.is_open() ? static_cast<uint64_t>(file.tellg()) : 0;
+    }
+
+    string file_name(const string& path)
+    {
+        return path.substr(path.find_last_of("/\\") + 1);
+    }
+
+    // Outputs keep only the input's file name, SaveBmp only recognises a lowercase extension
+    string output_path(const string& output_directory, const string& input)
+    {
+        const string name = file_name(input);
+        return output_directory + "/" + (ends_with_bmp(name) ? name.substr(0, name.size() - 4) : name) + ".bmp";
+    }
+
+    // Inputs from different directories can share a file name; rather than let one output overwrite
+    // another, the whole run is refused. Names are compared without case, as some file systems do.
+    void check_output_collisions(const vector<string>& inputs, const vector<string>& outputs)
+    {
+        map<string, size_t> first_input;
+        for (size_t i = 0; i < outputs.size(); i++)
+        {
+            string key = outputs[i];
+            transform(key.begin(), key.end(), key.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+            auto inserted = first_input.insert(make_pair(key, i));
+            if (!inserted.second)
+                throw runtime_error("Error: " + inputs[inserted.first->second] + " and " + inputs[i] + " would both be written to " + outputs[i]);
+        }
+    }
+
+    // Blocking queue with a fixed capacity, Close wakes every waiter once the producers are done
+    template <typename T>
+    class bounded_queue
+    {
+    public:
+        explicit bounded_queue(const size_t capacity) : capacity(capacity), closed(false) {}
+
+        void Push(T item)
+        {
+            unique_lock<mutex> lock(guard);
+            not_full.wait(lock, [&] { return items.size() < capacity; });
+            items.push_back(move(item));
+            not_empty.notify_one();
+        }
+
+        bool Pop(T& item)
+        {
+            unique_lock<mutex> lock(guard);
+            not_empty.wait(lock, [&] { return !items.empty() || closed; });
+            if (items.empty())
+                return false;
+            item = move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        void Close()
+        {
+            lock_guard<mutex> lock(guard);
+            closed = true;
+            not_empty.notify_all();
+        }
+
+    private:
+        const size_t capacity;
+        bool closed;
+        deque<T> items;
+        mutex guard;
+        condition_variable not_empty, not_full;
+    };
+
+    struct job
+    {
+        string input;
+        string output;
+        Bitmap_cpp image;
+    };
+
+    struct settings
+    {
+        string output_directory = "output";
+        int workers = 0;
+        int readers = 1;
+        int writers = 1;
+        int queue_size = 4;
+        bool verbose = false;
+    };
+
+    void usage()
+    {
+        fprintf(stderr,
+            "usage: bitmap_batch [options] <pipeline> <input>...\n"
+            "  <pipeline>  Name[:arg...][,Name[:arg...]]..., e.g. toGray,MedianFilter:5,SobelOperator\n"
+            "  <input>     Bitmap file, directory of .bmp files or @file with one path per line\n"
+            "options:\n"
+            "  -o <dir>    output directory (default: output)\n"
+            "  -j <n>      processing workers (default: hardware threads)\n"
+            "  -r <n>      reader threads (default: 1)\n"
+            "  -w <n>      writer threads (default: 1)\n"
+            "  -q <n>      images each queue holds (default: 4)\n"
+            "  -v          print the per-file messages of LoadBmp / SaveBmp\n"
+            "  --list      print the operation names\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    settings options;
+    vector<string> arguments;
+    for (int i = 1; i < argc; i++)
+    {
+        const string current = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (current == "--list")
+        {
+            for (auto& info : operations())
+                printf("%s (%d to %d arguments)\n", info.name, info.min_args, info.max_args);
+            return 0;
+        }
+        else if (current == "-v")
+            options.verbose = true;
+        else if (current == "-o" && has_value)
+            options.output_directory = argv[++i];
+        else if (current == "-j" && has_value)
+            options.workers = atoi(argv[++i]);
+        else if (current == "-r" && has_value)
+            options.readers = atoi(argv[++i]);
+        else if (current == "-w" && has_value)
+            options.writers = atoi(argv[++i]);
+        else if (current == "-q" && has_value)
+            options.queue_size = atoi(argv[++i]);
+        else if (current.size() > 1 && current[0] == '-')
+        {
+            usage();
+            return 2;
+        }
+        else
+            arguments.push_back(current);
+    }
+    if (arguments.size() < 2 || options.workers < 0 || options.readers < 1 || options.writers < 1 || options.queue_size < 1)
+    {
+        usage();
+        return 2;
+    }
+
+    vector<bound_operation> chain;
+    vector<string> inputs, outputs;
+    try
+    {
+        chain = parse_pipeline(arguments[0]);
+        for (size_t i = 1; i < arguments.size(); i++)
+        {
+            if (arguments[i][0] == '@')
+            {
+                ifstream list(arguments[i].substr(1));
+                if (!list.is_open())
+                    throw runtime_error("Error: cannot open list " + arguments[i].substr(1));
+                string line;
+                while (getline(list, line))
+                {
+                    if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    if (!line.empty())
+                        inputs.push_back(line);
+                }
+            }
+            else if (is_directory(arguments[i]))
+            {
+                const vector<string> files = list_directory(arguments[i]);
+                inputs.insert(inputs.end(), files.begin(), files.end());
+            }
+            else
+                inputs.push_back(arguments[i]);
+        }
+        for (auto& input : inputs)
+            outputs.push_back(output_path(options.output_directory, input));
+        check_output_collisions(inputs, outputs);
+        make_directory(options.output_directory);
+    }
+    catch (const exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    // Each worker filters with its share of the library's threads instead of all of them
+    const int hardware = max(1, static_cast<int>(thread::hardware_concurrency()));
+    const int workers = options.workers > 0 ? options.workers : hardware;
+    const int threads_per_worker = max(1, hardware / workers);
+
+    // The per-file messages of LoadBmp and SaveBmp are only shown with --verbose
+    if (options.verbose)
+        Bitmap_cpp::SetLogger([](const string& message) { printf("%s\n", message.c_str()); });
+
+    bounded_queue<job> loaded(options.queue_size), processed(options.queue_size);
+    atomic<size_t> next_input(0), finished(0), failed(0);
+    atomic<uint64_t> bytes_read(0), bytes_written(0);
+    atomic<int64_t> read_time(0), process_time(0), write_time(0);
+    mutex report;
+    const auto fail = [&](const string& path, const exception& e)
+    {
+        lock_guard<mutex> lock(report);
+        fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+        failed++;
+    };
+    const auto elapsed_since = [](chrono::steady_clock::time_point start)
+    {
+        return static_cast<int64_t>(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+    };
+
+    const auto start = chrono::steady_clock::now();
+    vector<thread> readers, workers_threads, writers;
+    for (int i = 0; i < options.readers; i++)
+    {
+        readers.emplace_back([&]
+        {
+            bitmap_thread_scope scope(threads_per_worker);
+            for (size_t index = next_input++; index < inputs.size(); index = next_input++)
+            {
+                job item;
+                item.input = inputs[index];
+                item.output = outputs[index];
+                try
+                {
+                    const auto begin = chrono::steady_clock::now();
+                    item.image.LoadBmp(item.input);
+                    read_time += elapsed_since(begin);
+                    bytes_read += file_size(item.input);
+                }
+                catch (const exception& e)
+                {
+                    fail(item.input, e);
+                    continue;
+                }
+                loaded.Push(move(item));
+            }
+        });
+    }
+    for (int i = 0; i < workers; i++)
+    {
+        workers_threads.emplace_back([&]
+        {
+            bitmap_thread_scope scope(threads_per_worker);
+            job item;
+            while (loaded.Pop(item))
+            {
+                try
+                {
+                    const auto begin = chrono::steady_clock::now();
+                    Bitmap_pipeline pipeline(item.image);
+                    for (auto& operation : chain)
+                        operation(pipeline);
+                    item.image = pipeline.Result();
+                    process_time += elapsed_since(begin);
+                }
+                catch (const exception& e)
+                {
+                    fail(item.input, e);
+                    continue;
+                }
+                processed.Push(move(item));
+            }
+        });
+    }
+    for (int i = 0; i < options.writers; i++)
+    {
+        writers.emplace_back([&]
+        {
+            bitmap_thread_scope scope(threads_per_worker);
+            job item;
+            while (processed.Pop(item))
+            {
+                try
+                {
+                    const auto begin = chrono::steady_clock::now();
+                    item.image.SaveBmp(item.output);
+                    write_time += elapsed_since(begin);
+                    bytes_written += file_size(item.output);
+                    finished++;
+                }
+                catch (const exception& e)
+                {
+                    fail(item.input, e);
+                }
+            }
+        });
+    }
+
+    for (auto& reader : readers)
+        reader.join();
+    loaded.Close();
+    for (auto& worker : workers_threads)
+        worker.join();
+    processed.Close();
+    for (auto& writer : writers)
+        writer.join();
+
+    const double seconds = max(1e-9, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    const double megabytes_read = bytes_read / 1048576.0, megabytes_written = bytes_written / 1048576.0;
+    printf("%zu images processed, %zu failed in %.3f s\n", static_cast<size_t>(finished), static_cast<size_t>(failed), seconds);
+    printf("throughput: %.2f images/s, read %.2f MB (%.2f MB/s), written %.2f MB (%.2f MB/s)\n",
+        finished / seconds, megabytes_read, megabytes_read / seconds, megabytes_written, megabytes_written / seconds);
+    printf("busy time: read %.3f s, process %.3f s, write %.3f s (summed over %d + %d + %d threads)\n",
+        read_time / 1e6, process_time / 1e6, write_time / 1e6, options.readers, workers, options.writers);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,594 @@
+// Benchmark of the Bitmap_cpp operations on deterministic synthetic images.
+//
+//   bitmap_bench [options]                       run, JSON to stdout (or -o file)
+//   bitmap_bench --baseline old.json [options]   run and flag regressions against old.json
+//   bitmap_bench --compare old.json new.json     compare two saved runs
+//
+// Every case reports the median and 95th percentile latency, megapixels/s and the bytes allocated per
+// call (heap allocations plus pixel buffers). Build: g++ -std=c++11 -O2 -pthread bitmap_bench.cpp -o bitmap_bench
+#include "Bitmap_cpp.hpp"
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <sstream>
+
+// Every heap allocation of the process is counted, pixel buffers and channel planes through MemoryStats
+static atomic<uint64_t> heap_bytes(0);
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC pairs the inlined malloc/free of the replaced operators with the caller's new/delete
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t bytes)
+{
+    heap_bytes += bytes;
+    if (void* ptr = malloc(bytes == 0 ? 1 : bytes))
+        return ptr;
+    throw bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+namespace
+{
+    struct bench_images
+    {
+        Bitmap_cpp source;
+        Bitmap_cpp other;
+        Bitmap_cpp gray;
+        string bmp_path;
+        string dct_path;
+        string palette_path;
+        vector<unsigned char> dct_bytes;
+        vector<unsigned char> bmp_bytes;
+        vector<unsigned char> bmp_buffer;
+        // Kept across calls like the scratch buffers, so their cases time the steady state
+        Bitmap_cpp into;
+        Bitmap_planar planar;
+        Bitmap_gray gray_plane;
+    };
+
+    // run(work, images) times one call on `work`, a fresh copy of the source (or of the gray source).
+    // It returns the pixel bytes of images it creates itself, the ones of `work` are counted outside.
+    struct bench_case
+    {
+        const char* name;
+        bool gray;
+        double output_scale; // output pixels per input pixel, large outputs are skipped at big sizes
+        function<size_t(Bitmap_cpp&, bench_images&)> run;
+    };
+
+    size_t pixel_bytes(const Bitmap_cpp& image)
+    {
+        return image.MemoryStats().allocated_bytes;
+    }
+
+    // Runs an Into filter on the shared destination and returns the pixel bytes it allocated there
+    template <typename Filter>
+    size_t run_into(Bitmap_cpp& work, bench_images& in, Filter filter)
+    {
+        const size_t before = pixel_bytes(in.into);
+        filter(work, in.into);
+        return pixel_bytes(in.into) - before;
+    }
+
+    // Runs an operation on a kept Bitmap_planar or Bitmap_gray and returns the plane bytes it allocated there
+    template <typename Image, typename Operation>
+    size_t run_kept(Image& image, Operation operation)
+    {
+        const size_t before = image.MemoryStats().allocated_bytes;
+        operation(image);
+        return image.MemoryStats().allocated_bytes - before;
+    }
+
+    // Every image operation and file call of Bitmap_cpp and bitmap_prefetch_queue has a case. Configuration
+    // setters and the per-coefficient DCT_Transform / IDCT_Transform are left out, and Bitmap_stream,
+    // Bitmap_pipeline, Bitmap_planar and Bitmap_gray are sampled with a few common calls. New functions add
+    // their cases here.
+
+    const vector<bench_case>& cases()
+    {
+        static const vector<bench_case> table = {
+            {"LoadBmp", false, 1, [](Bitmap_cpp&, bench_images& in) { Bitmap_cpp image; image.LoadBmp(in.bmp_path); return pixel_bytes(image); }},
+            {"MapBmp", false, 1, [](Bitmap_cpp&, bench_images& in) { Bitmap_cpp image; image.MapBmp(in.bmp_path); return pixel_bytes(image); }},
+            {"MapBmp_copy_on_write", false, 1, [](Bitmap_cpp&, bench_images& in) { Bitmap_cpp image; image.MapBmp(in.bmp_path, bmp_map_mode::copy_on_write); return pixel_bytes(image); }},
+            {"LoadBmpAsync", false, 1, [](Bitmap_cpp&, bench_images& in) { Bitmap_cpp image = Bitmap_cpp::LoadBmpAsync(in.bmp_path).get(); return pixel_bytes(image); }},
+            {"bitmap_prefetch_queue_Next", false, 1, [](Bitmap_cpp&, bench_images& in) { bitmap_prefetch_queue queue(1); queue.Prefetch(in.bmp_path); return pixel_bytes(queue.Next()); }},
+            {"bitmap_prefetch_queue_Take", false, 1, [](Bitmap_cpp&, bench_images& in) { bitmap_prefetch_queue queue(1); queue.Prefetch(vector<string>{in.bmp_path}); return pixel_bytes(queue.Take(in.bmp_path)); }},
+            {"LoadBmpFromMemory", false, 1, [](Bitmap_cpp&, bench_images& in) { Bitmap_cpp image; image.LoadBmpFromMemory(in.bmp_bytes.data(), in.bmp_bytes.size()); return pixel_bytes(image); }},
+            {"LoadBmpFromMemory_oversized_RLE", true, 1, [](Bitmap_cpp& work, bench_images&)
+                {
+                    // An end-of-bitmap stream of two bytes under a header claiming 20000 x 20000 pixels has to be
+                    // refused before the 1.6 GB image is allocated
+                    work.Resize(1, 1);
+                    work.SetBmpFormat(8, bmp_compression::rle8);
+                    vector<unsigned char> bytes = work.EncodeBmp();
+                    uint32_t data_offset;
+                    memcpy(&data_offset, bytes.data() + 10, 4);
+                    const int32_t side = 20000;
+                    const uint32_t stream_size = 2;
+                    bytes.resize(data_offset + stream_size);
+                    bytes[data_offset] = 0;
+                    bytes[data_offset + 1] = 1;
+                    memcpy(bytes.data() + 18, &side, 4);
+                    memcpy(bytes.data() + 22, &side, 4);
+                    memcpy(bytes.data() + 34, &stream_size, 4);
+
+                    Bitmap_cpp image;
+                    try
+                    {
+                        image.LoadBmpFromMemory(bytes.data(), bytes.size());
+                    }
+                    catch (const runtime_error&)
+                    {
+                        if (pixel_bytes(image) != 0)
+                            throw runtime_error("Error: an oversized RLE header allocated " + to_string(pixel_bytes(image)) + " bytes before failing");
+                        return size_t(0);
+                    }
+                    throw runtime_error("Error: an RLE stream too short for its header was accepted");
+                }},
+            {"SaveBmp", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"SaveBmpAsync", false, 1, [](Bitmap_cpp& work, bench_images& in)
+                {
+                    // What the const overload does, spelled out so the copy's pixel bytes can be counted before it moves
+                    Bitmap_cpp copy(work);
+                    const size_t bytes = pixel_bytes(copy);
+                    move(copy).SaveBmpAsync(in.bmp_path + ".out.bmp").get();
+                    return bytes;
+                }},
+            {"SaveBmp_8bit", true, 1, [](Bitmap_cpp& work, bench_images& in) { work.SetBmpFormat(8); work.SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"SaveBmp_8bit_RLE", true, 1, [](Bitmap_cpp& work, bench_images& in) { work.SetBmpFormat(8, bmp_compression::rle8); work.SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"SaveBmp_16bit", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.SetBmpFormat(16); work.SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"LoadBmp_4bit_filter_SaveBmp", false, 1, [](Bitmap_cpp&, bench_images& in)
+                {
+                    // Smoothing adds colors the inherited 4-bit palette cannot hold, the save has to fall back to 24 bits
+                    Bitmap_cpp image(in.palette_path);
+                    image.SpatialLowPassFilter(3);
+                    image.SaveBmp(in.bmp_path + ".out.bmp");
+                    if (image.info_header.bit_count != 24)
+                        throw runtime_error("Error: a filtered 4-bit image was saved at " + to_string(image.info_header.bit_count) + " bits");
+                    return pixel_bytes(image);
+                }},
+            {"SaveBmp_16bit_565", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.SetBmpFormat(16, bmp_compression::bitfields); work.SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"EncodeBmp", false, 1, [](Bitmap_cpp& work, bench_images&) { vector<unsigned char> bytes = work.EncodeBmp(); return size_t(0); }},
+            {"EncodeBmp_buffer", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.EncodeBmp(in.bmp_buffer.data(), in.bmp_buffer.size()); return size_t(0); }},
+            {"Bitmap_stream", false, 1, [](Bitmap_cpp&, bench_images& in) { Bitmap_stream(in.bmp_path).MedianFilter(3).InvertColor().SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"toGray", false, 1, [](Bitmap_cpp& work, bench_images&) { work.toGray(); return size_t(0); }},
+            {"InvertColor", false, 1, [](Bitmap_cpp& work, bench_images&) { work.InvertColor(); return size_t(0); }},
+            {"AddImpluseNoise", false, 1, [](Bitmap_cpp& work, bench_images&) { work.AddImpluseNoise(); return size_t(0); }},
+            {"AddGaussianNoise", false, 1, [](Bitmap_cpp& work, bench_images&) { work.AddGaussianNoise(); return size_t(0); }},
+            {"mix_with", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.mix_with(in.other, 0.25f); return size_t(0); }},
+            {"ZoomIn_ZeroOrder", false, 4, [](Bitmap_cpp& work, bench_images&) { work.ZoomIn_ZeroOrder(2); return size_t(0); }},
+            {"ZoomIn_FirstOrder", false, 4, [](Bitmap_cpp& work, bench_images&) { work.ZoomIn_FirstOrder(2); return size_t(0); }},
+            {"ZoomIn_Compare", false, 4, [](Bitmap_cpp& work, bench_images&) { work.ZoomIn_Compare(2); return size_t(0); }},
+            {"ZoomIn_Bilinear", false, 4, [](Bitmap_cpp& work, bench_images&) { work.ZoomIn_Bilinear(2); return size_t(0); }},
+            {"ZoomOut", false, 1, [](Bitmap_cpp& work, bench_images&) { work.ZoomOut(2); return size_t(0); }},
+            {"Resample_Bilinear", false, 1, [](Bitmap_cpp& work, bench_images&) { work.Resample(work.info_header.width * 317 / 1920, work.info_header.height * 317 / 1920); return size_t(0); }},
+            {"Resample_Lanczos", false, 1, [](Bitmap_cpp& work, bench_images&) { work.Resample(work.info_header.width * 317 / 1920, work.info_header.height * 317 / 1920, resample_filter::lanczos); return size_t(0); }},
+            {"Resize", false, 1, [](Bitmap_cpp& work, bench_images&) { work.Resize(work.info_header.width / 2, work.info_header.height / 2, 16, 16); return size_t(0); }},
+            {"HistogramEqualization_Global", true, 1, [](Bitmap_cpp& work, bench_images&) { work.HistogramEqualization_Global(); return size_t(0); }},
+            {"HistogramEqualization_Local", true, 1, [](Bitmap_cpp& work, bench_images&) { work.HistogramEqualization_Local(7); return size_t(0); }},
+            {"HistogramEqualization_CLAHE", true, 1, [](Bitmap_cpp& work, bench_images&) { work.HistogramEqualization_Local(64, equalization_mode::clahe); return size_t(0); }},
+            {"SpatialLowPassFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.SpatialLowPassFilter(3); return size_t(0); }},
+            {"SpatialLowPassFilter_15", false, 1, [](Bitmap_cpp& work, bench_images&) { work.SpatialLowPassFilter(15); return size_t(0); }},
+            {"MedianFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.MedianFilter(3); return size_t(0); }},
+            {"MedianFilter_7", false, 1, [](Bitmap_cpp& work, bench_images&) { work.MedianFilter(7); return size_t(0); }},
+            {"AlphaTrimmedMeanFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.AlphaTrimmedMeanFilter(5, 3); return size_t(0); }},
+            {"PercentileFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.PercentileFilter(5, 25.0f); return size_t(0); }},
+            {"MinFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.MinFilter(3); return size_t(0); }},
+            {"MaxFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.MaxFilter(3); return size_t(0); }},
+            {"SpatialHighPassFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.SpatialHighPassFilter(3); return size_t(0); }},
+            {"SpatialHighBoostFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { work.SpatialHighBoostFilter(3, 1.5f); return size_t(0); }},
+            {"PrewittOperator", false, 1, [](Bitmap_cpp& work, bench_images&) { work.PrewittOperator(); return size_t(0); }},
+            {"SobelOperator", false, 1, [](Bitmap_cpp& work, bench_images&) { work.SobelOperator(); return size_t(0); }},
+            {"LaplacianOperator", false, 1, [](Bitmap_cpp& work, bench_images&) { work.LaplacianOperator(); return size_t(0); }},
+            {"SpatialLowPassFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.SpatialLowPassFilterInto(dst, 3); }); }},
+            {"MedianFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.MedianFilterInto(dst, 3); }); }},
+            {"AlphaTrimmedMeanFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.AlphaTrimmedMeanFilterInto(dst, 5, 3); }); }},
+            {"PercentileFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.PercentileFilterInto(dst, 5, 25.0f); }); }},
+            {"MinFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.MinFilterInto(dst, 3); }); }},
+            {"MaxFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.MaxFilterInto(dst, 3); }); }},
+            {"SpatialHighPassFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.SpatialHighPassFilterInto(dst, 3); }); }},
+            {"SpatialHighBoostFilterInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.SpatialHighBoostFilterInto(dst, 3, 1.5f); }); }},
+            {"PrewittOperatorInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.PrewittOperatorInto(dst); }); }},
+            {"SobelOperatorInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.SobelOperatorInto(dst); }); }},
+            {"LaplacianOperatorInto", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_into(work, in, [](Bitmap_cpp& src, Bitmap_cpp& dst) { src.LaplacianOperatorInto(dst); }); }},
+            {"Region_MedianFilter", false, 1, [](Bitmap_cpp& work, bench_images&) { Bitmap_cpp region = work.Region(work.info_header.width - 2, work.info_header.height - 2, 1, 1); region.MedianFilter(3); return pixel_bytes(region); }},
+            {"Region_operator+=", false, 1, [](Bitmap_cpp& work, bench_images& in) { Bitmap_cpp region = work.Region(work.info_header.width - 2, work.info_header.height - 2, 1, 1); region += in.other.Region(work.info_header.width - 2, work.info_header.height - 2); return pixel_bytes(region); }},
+            {"Lazy_MedianFilter_InvertColor", false, 1, [](Bitmap_cpp& work, bench_images&) { Bitmap_cpp result = work.Lazy().MedianFilter(3).InvertColor().Result(); return pixel_bytes(result); }},
+            {"Lazy_Add_Multiply_Sobel", false, 1, [](Bitmap_cpp& work, bench_images& in) { Bitmap_cpp result = work.Lazy().Add(in.other).Multiply(2).SobelOperator().Result(); return pixel_bytes(result); }},
+            {"Bitmap_planar_Assign", false, 1, [](Bitmap_cpp& work, bench_images& in) { return run_kept(in.planar, [&](Bitmap_planar& planar) { planar.Assign(work); }); }},
+            {"Bitmap_planar_ToBitmap", false, 1, [](Bitmap_cpp& work, bench_images& in) { in.planar.ToBitmap(work); return size_t(0); }},
+            {"Bitmap_planar_SpatialLowPassFilter", false, 1, [](Bitmap_cpp&, bench_images& in) { return run_kept(in.planar, [](Bitmap_planar& planar) { planar.SpatialLowPassFilter(3); }); }},
+            {"Bitmap_planar_MedianFilter", false, 1, [](Bitmap_cpp&, bench_images& in) { return run_kept(in.planar, [](Bitmap_planar& planar) { planar.MedianFilter(3); }); }},
+            {"Bitmap_planar_SobelOperator", false, 1, [](Bitmap_cpp&, bench_images& in) { return run_kept(in.planar, [](Bitmap_planar& planar) { planar.SobelOperator(); }); }},
+            {"Bitmap_planar_DCT_Encode", false, 1, [](Bitmap_cpp&, bench_images& in) { vector<unsigned char> bytes = in.planar.DCT_Encode(75); return size_t(0); }},
+            {"Bitmap_gray_Assign", true, 1, [](Bitmap_cpp& work, bench_images& in) { return run_kept(in.gray_plane, [&](Bitmap_gray& gray) { gray.Assign(work); }); }},
+            {"Bitmap_gray_HistogramEqualization_Local", true, 1, [](Bitmap_cpp&, bench_images& in) { return run_kept(in.gray_plane, [](Bitmap_gray& gray) { gray.HistogramEqualization_Local(7); }); }},
+            {"Bitmap_gray_MedianFilter", true, 1, [](Bitmap_cpp&, bench_images& in) { return run_kept(in.gray_plane, [](Bitmap_gray& gray) { gray.MedianFilter(3); }); }},
+            {"Bitmap_gray_SobelOperator", true, 1, [](Bitmap_cpp&, bench_images& in) { return run_kept(in.gray_plane, [](Bitmap_gray& gray) { gray.SobelOperator(); }); }},
+            {"Bitmap_gray_SaveBmp", true, 1, [](Bitmap_cpp&, bench_images& in) { in.gray_plane.SaveBmp(in.bmp_path + ".out.bmp"); return size_t(0); }},
+            {"DCT_Compress", false, 1, [](Bitmap_cpp& work, bench_images&) { work.DCT_Compress(); return size_t(0); }},
+            {"DCT_Compress_fixed", false, 1, [](Bitmap_cpp& work, bench_images&) { work.DCT_Compress(dct_precision::fixed_point); return size_t(0); }},
+            {"DCT_Encode", false, 1, [](Bitmap_cpp& work, bench_images&) { vector<unsigned char> bytes = work.DCT_Encode(75); return size_t(0); }},
+            {"DCT_Decode", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.DCT_Decode(in.dct_bytes); return size_t(0); }},
+            {"DCT_Decode_corrupt_header", false, 1, [](Bitmap_cpp&, bench_images& in)
+                {
+                    // Headers claiming more than the data holds have to fail before anything is sized from them:
+                    // a 2^31 pixel wide image, 16 bytes of entropy data, tables reaching 4 GB into the file
+                    const string path = in.dct_path + ".corrupt.bdct";
+                    const pair<size_t, uint32_t> patches[] = {{8, 0x7FFFFFF0u}, {20, 16u}, {16, 0xFFFFFF00u}};
+                    for (auto& patch : patches)
+                    {
+                        uint32_t kept;
+                        memcpy(&kept, in.dct_bytes.data() + patch.first, 4);
+                        memcpy(in.dct_bytes.data() + patch.first, &patch.second, 4);
+                        ofstream(path, ios::binary).write(reinterpret_cast<const char*>(in.dct_bytes.data()), in.dct_bytes.size());
+                        for (int from_file = 0; from_file < 2; from_file++)
+                        {
+                            Bitmap_cpp image;
+                            const uint64_t heap_before = heap_bytes;
+                            bool refused = false;
+                            try
+                            {
+                                if (from_file)
+                                    image.LoadDCT(path);
+                                else
+                                    image.DCT_Decode(in.dct_bytes);
+                            }
+                            catch (const runtime_error&)
+                            {
+                                refused = true;
+                            }
+                            if (!refused)
+                                throw runtime_error("Error: a corrupt DCT header was accepted");
+                            if (pixel_bytes(image) != 0 || heap_bytes - heap_before > (1 << 20))
+                                throw runtime_error("Error: a corrupt DCT header allocated memory before failing");
+                        }
+                        memcpy(in.dct_bytes.data() + patch.first, &kept, 4);
+                    }
+                    return size_t(0);
+                }},
+            {"SaveDCT", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.SaveDCT(in.dct_path, 75); return size_t(0); }},
+            {"LoadDCT", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.LoadDCT(in.dct_path); return size_t(0); }},
+            {"operator+", false, 1, [](Bitmap_cpp& work, bench_images& in) { Bitmap_cpp result = work + in.other; return pixel_bytes(result); }},
+            {"operator-", false, 1, [](Bitmap_cpp& work, bench_images& in) { Bitmap_cpp result = work - in.other; return pixel_bytes(result); }},
+            {"operator*", false, 1, [](Bitmap_cpp& work, bench_images&) { Bitmap_cpp result = work * 3; return pixel_bytes(result); }},
+            {"operator/", false, 1, [](Bitmap_cpp& work, bench_images&) { Bitmap_cpp result = work / 3; return pixel_bytes(result); }},
+            {"operator+=", false, 1, [](Bitmap_cpp& work, bench_images& in) { work += in.other; return size_t(0); }},
+            {"operator-=", false, 1, [](Bitmap_cpp& work, bench_images& in) { work -= in.other; return size_t(0); }},
+            {"operator*=", false, 1, [](Bitmap_cpp& work, bench_images&) { work *= 3; return size_t(0); }},
+            {"operator/=", false, 1, [](Bitmap_cpp& work, bench_images&) { work /= 3; return size_t(0); }},
+            {"Expr", false, 1, [](Bitmap_cpp& work, bench_images& in) { Bitmap_cpp result = (work.Expr() + in.other - in.other) * 2; return pixel_bytes(result); }},
+            {"and_with", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.and_with(in.other); return size_t(0); }},
+            {"or_with", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.or_with(in.other); return size_t(0); }},
+            {"xor_with", false, 1, [](Bitmap_cpp& work, bench_images& in) { work.xor_with(in.other); return size_t(0); }},
+        };
+        return table;
+    }
+
+    // Gradients plus LCG noise, the same seed gives the same image on every machine
+    Bitmap_cpp synthetic_image(const int width, const int height, const int bit_count, unsigned seed)
+    {
+        Bitmap_cpp image;
+        image.data.resize_for_overwrite(height, width);
+        for (int x = 0; x < height; x++)
+        {
+            pixel* row = image.data.row(x);
+            for (int y = 0; y < width; y++)
+            {
+                seed = seed * 1103515245 + 12345;
+                const int noise = (seed >> 16) & 63;
+                row[y].b = static_cast<unsigned char>(x * 255 / height + noise / 2);
+                row[y].g = static_cast<unsigned char>(y * 255 / width + noise / 4);
+                row[y].r = static_cast<unsigned char>((x + y) * 3 + noise);
+                row[y].a = static_cast<unsigned char>(bit_count == 32 ? 192 + (noise & 31) : 255);
+            }
+        }
+        image.SetBmpFormat(bit_count);
+        return image;
+    }
+
+    struct result
+    {
+        string name;
+        int width;
+        int height;
+        int bits;
+        int iterations;
+        double median_ms;
+        double p95_ms;
+        double mpix_per_s;
+        uint64_t bytes_allocated;
+
+        string Key() const
+        {
+            return name + " " + to_string(width) + "x" + to_string(height) + " " + to_string(bits) + "-bit";
+        }
+    };
+
+    // Nearest-rank percentile of sorted samples
+    double percentile(const vector<double>& sorted, const double p)
+    {
+        const size_t rank = static_cast<size_t>(ceil(p / 100.0 * sorted.size()));
+        return sorted[min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+    }
+
+    void write_json(FILE* out, const vector<result>& results, const int iterations)
+    {
+        static const char* const simd_names[] = {"scalar", "sse2", "avx2", "avx512"};
+        fprintf(out, "{\n  \"benchmark\": \"bitmap_bench\",\n  \"hardware_threads\": %u,\n  \"simd\": \"%s\",\n  \"iterations\": %d,\n  \"results\": [\n",
+            thread::hardware_concurrency(), simd_names[static_cast<int>(Bitmap_cpp::GetSimdLevel())], iterations);
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const result& r = results[i];
+            fprintf(out, "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"bits\": %d, \"iterations\": %d, \"median_ms\": %.4f, \"p95_ms\": %.4f, \"mpix_per_s\": %.3f, \"bytes_allocated\": %llu}%s\n",
+                r.name.c_str(), r.width, r.height, r.bits, r.iterations, r.median_ms, r.p95_ms, r.mpix_per_s,
+                static_cast<unsigned long long>(r.bytes_allocated), i + 1 < results.size() ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+
+    // Reads the files write_json produces, one result object per line
+    vector<result> read_json(const string& path)
+    {
+        ifstream file(path);
+        if (!file.is_open())
+            throw runtime_error("Error: cannot open " + path);
+        const auto field = [](const string& line, const string& key) -> string
+        {
+            const size_t at = line.find("\"" + key + "\": ");
+            if (at == string::npos)
+                throw runtime_error("Error: missing field " + key);
+            size_t begin = at + key.size() + 4;
+            if (line[begin] == '"')
+                return line.substr(begin + 1, line.find('"', begin + 1) - begin - 1);
+            return line.substr(begin, line.find_first_of(",}", begin) - begin);
+        };
+
+        vector<result> results;
+        string line;
+        while (getline(file, line))
+        {
+            if (line.find("{\"name\"") == string::npos)
+                continue;
+            result r;
+            r.name = field(line, "name");
+            r.width = stoi(field(line, "width"));
+            r.height = stoi(field(line, "height"));
+            r.bits = stoi(field(line, "bits"));
+            r.iterations = stoi(field(line, "iterations"));
+            r.median_ms = stod(field(line, "median_ms"));
+            r.p95_ms = stod(field(line, "p95_ms"));
+            r.mpix_per_s = stod(field(line, "mpix_per_s"));
+            r.bytes_allocated = stoull(field(line, "bytes_allocated"));
+            results.push_back(r);
+        }
+        return results;
+    }
+
+    // A case regresses when its median is `threshold` percent slower or it allocates that much more
+    int compare(const vector<result>& baseline, const vector<result>& current, const double threshold)
+    {
+        map<string, const result*> previous;
+        for (auto& r : baseline)
+            previous[r.Key()] = &r;
+
+        int regressions = 0;
+        fprintf(stderr, "%-48s %12s %12s %8s\n", "case", "base ms", "new ms", "change");
+        for (auto& r : current)
+        {
+            auto found = previous.find(r.Key());
+            if (found == previous.end())
+                continue;
+            const result& old = *found->second;
+            const double change = old.median_ms > 0 ? (r.median_ms / old.median_ms - 1) * 100 : 0;
+            const bool slower = change > threshold;
+            const bool heavier = r.bytes_allocated > old.bytes_allocated * (1 + threshold / 100) + 4096;
+            fprintf(stderr, "%-48s %12.3f %12.3f %+7.1f%%%s%s\n", r.Key().c_str(), old.median_ms, r.median_ms, change,
+                slower ? "  REGRESSION" : "", heavier ? "  MORE MEMORY" : "");
+            regressions += slower || heavier;
+        }
+        fprintf(stderr, "%d regression(s) at a %.1f%% threshold\n", regressions, threshold);
+        return regressions;
+    }
+
+    vector<int> parse_list(const string& text)
+    {
+        vector<int> values;
+        stringstream items(text);
+        string item;
+        while (getline(items, item, ','))
+            values.push_back(stoi(item));
+        return values;
+    }
+
+    void usage()
+    {
+        fprintf(stderr,
+            "usage: bitmap_bench [options]\n"
+            "       bitmap_bench --compare <baseline.json> <current.json> [--threshold <percent>]\n"
+            "options:\n"
+            "  --sizes <list>       square image sizes (default: 512,1024,2048,4096,8192)\n"
+            "  --bits <list>        bit depths (default: 24,32)\n"
+            "  --iterations <n>     timed calls per case after one warm-up call (default: 5)\n"
+            "  --filter <text>      only cases whose name contains <text>\n"
+            "  --threads <n>        library threads, 0 = all (default: 0)\n"
+            "  --max-pixels <n>     skip cases whose output is larger (default: 67108864)\n"
+            "  --dir <path>         directory for the temporary files (default: .)\n"
+            "  -o <file>            write the JSON there instead of stdout\n"
+            "  --baseline <file>    compare this run against a saved one\n"
+            "  --threshold <pct>    regression threshold (default: 10)\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    vector<int> sizes = {512, 1024, 2048, 4096, 8192};
+    vector<int> depths = {24, 32};
+    int iterations = 5;
+    int threads = 0;
+    double threshold = 10;
+    double max_pixels = 8192.0 * 8192.0;
+    string filter, output_path, baseline_path, directory = ".";
+    vector<string> compare_paths;
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const string option = argv[i];
+            const bool has_value = i + 1 < argc;
+            if (option == "--sizes" && has_value)
+                sizes = parse_list(argv[++i]);
+            else if (option == "--bits" && has_value)
+                depths = parse_list(argv[++i]);
+            else if (option == "--iterations" && has_value)
+                iterations = max(1, atoi(argv[++i]));
+            else if (option == "--filter" && has_value)
+                filter = argv[++i];
+            else if (option == "--threads" && has_value)
+                threads = atoi(argv[++i]);
+            else if (option == "--max-pixels" && has_value)
+                max_pixels = atof(argv[++i]);
+            else if (option == "--dir" && has_value)
+                directory = argv[++i];
+            else if (option == "-o" && has_value)
+                output_path = argv[++i];
+            else if (option == "--baseline" && has_value)
+                baseline_path = argv[++i];
+            else if (option == "--threshold" && has_value)
+                threshold = atof(argv[++i]);
+            else if (option == "--compare" && i + 2 < argc)
+            {
+                compare_paths.push_back(argv[++i]);
+                compare_paths.push_back(argv[++i]);
+            }
+            else
+            {
+                usage();
+                return 2;
+            }
+        }
+        for (int bits : depths)
+            if (bits != 24 && bits != 32)
+                throw invalid_argument("Error: bit depths must be 24 or 32");
+
+        if (!compare_paths.empty())
+            return compare(read_json(compare_paths[0]), read_json(compare_paths[1]), threshold) == 0 ? 0 : 1;
+    }
+    catch (const exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    Bitmap_cpp::SetThreadCount(threads);
+
+    vector<result> results;
+    for (int size : sizes)
+    {
+        for (int bits : depths)
+        {
+            bench_images images;
+            images.source = synthetic_image(size, size, bits, 1);
+            images.other = synthetic_image(size, size, bits, 7);
+            images.gray = images.source;
+            images.gray.toGray();
+            images.bmp_path = directory + "/bitmap_bench_" + to_string(size) + "_" + to_string(bits) + ".bmp";
+            images.dct_path = directory + "/bitmap_bench_" + to_string(size) + "_" + to_string(bits) + ".bdct";
+            images.palette_path = directory + "/bitmap_bench_" + to_string(size) + "_" + to_string(bits) + "_4bit.bmp";
+            images.source.SaveBmp(images.bmp_path);
+            // 16 gray levels, the most a 4-bit palette holds
+            Bitmap_cpp posterized = images.gray / 17 * 17;
+            posterized.SetBmpFormat(4);
+            posterized.SaveBmp(images.palette_path);
+            images.source.SaveDCT(images.dct_path);
+            images.dct_bytes = images.source.DCT_Encode(75);
+            images.bmp_bytes = images.source.EncodeBmp();
+            images.bmp_buffer.resize(images.bmp_bytes.size());
+            images.planar.Assign(images.source);
+            images.gray_plane.Assign(images.gray);
+
+            Bitmap_cpp work;
+            for (auto& bench : cases())
+            {
+                if (!filter.empty() && string(bench.name).find(filter) == string::npos)
+                    continue;
+                if (static_cast<double>(size) * size * bench.output_scale > max_pixels)
+                {
+                    fprintf(stderr, "skip %s %dx%d %d-bit (output larger than --max-pixels)\n", bench.name, size, size, bits);
+                    continue;
+                }
+
+                vector<double> samples;
+                uint64_t allocated = 0;
+                for (int i = 0; i <= iterations; i++)
+                {
+                    work = bench.gray ? images.gray : images.source;
+                    const size_t work_before = pixel_bytes(work);
+                    const uint64_t heap_before = heap_bytes;
+                    const auto start = chrono::steady_clock::now();
+                    const size_t created = bench.run(work, images);
+                    const double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                    // The first call warms caches, the thread pool and the scratch buffers
+                    if (i == 0)
+                        continue;
+                    samples.push_back(elapsed);
+                    allocated += heap_bytes - heap_before + created + (pixel_bytes(work) - work_before);
+                }
+
+                sort(samples.begin(), samples.end());
+                result r;
+                r.name = bench.name;
+                r.width = size;
+                r.height = size;
+                r.bits = bits;
+                r.iterations = iterations;
+                r.median_ms = percentile(samples, 50);
+                r.p95_ms = percentile(samples, 95);
+                r.mpix_per_s = static_cast<double>(size) * size / 1e6 / max(1e-9, r.median_ms / 1000);
+                r.bytes_allocated = allocated / iterations;
+                results.push_back(r);
+                fprintf(stderr, "%-48s median %10.3f ms  p95 %10.3f ms  %9.2f MP/s  %12llu B\n", r.Key().c_str(), r.median_ms, r.p95_ms, r.mpix_per_s,
+                    static_cast<unsigned long long>(r.bytes_allocated));
+            }
+            remove(images.bmp_path.c_str());
+            remove((images.bmp_path + ".out.bmp").c_str());
+            remove(images.dct_path.c_str());
+            remove(images.palette_path.c_str());
+        }
+    }
+
+    FILE* out = output_path.empty() ? stdout : fopen(output_path.c_str(), "w");
+    if (out == nullptr)
+    {
+        fprintf(stderr, "Error: cannot create %s\n", output_path.c_str());
+        return 2;
+    }
+    write_json(out, results, iterations);
+    if (out != stdout)
+        fclose(out);
+
+    if (!baseline_path.empty())
+    {
+        try
+        {
+            return compare(read_json(baseline_path), results, threshold) == 0 ? 0 : 1;
+        }
+        catch (const exception& e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            return 2;
+        }
+    }
+    return 0;
+}